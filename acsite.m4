@@ -2121,7 +2121,7 @@ dnl #endif
 			inet_pton inet_aton inet_addr inet_ntoa inet_ntop \
 			accept bind connect listen poll select shutdown socket \
 			getpeereid getpeername getsockname getsockopt setsockopt \
-			recv recvfrom recvmsg send sendmsg sendto \
+			recv recvfrom recvmsg recvmmsg send sendmsg sendmmsg sendto \
 			htonl htons ntohl ntohs \
 		])
 
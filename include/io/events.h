@@ -38,6 +38,7 @@ struct event {
 	FreeFn free;
 	int enabled;
 	Events *loop;
+	long timeout_ms;
 
 	/* Public */
 	int fd;
@@ -60,6 +61,17 @@ typedef struct event Event;
 typedef struct events Events;
 typedef void (*EventHook)(Events *loop, Event *event, int _reserved_);
 
+#if HAVE_INTTYPES_H
+# include <inttypes.h>
+#else
+# if HAVE_STDINT_H
+#  include <stdint.h>
+# endif
+#endif
+
+/* Monotonic clock milliseconds. */
+typedef int64_t EventTime;
+
 #if defined(HAVE_KQUEUE)
 # include <sys/types.h>
 # include <sys/event.h>
@@ -87,6 +99,7 @@ typedef void (*EventHook)(Events *loop, Event *event, int _reserved_);
 #define EVENT_READ		0x1
 #define EVENT_WRITE		0x2
 #define EVENT_TIMER		0x4	/* not implemented yet */
+#define EVENT_EDGE		0x8	/* edge-triggered; kqueue & epoll only */
 
 typedef union {
 #if defined(HAVE_KQUEUE)
@@ -105,6 +118,20 @@ typedef union {
 #endif
 
 #include <com/snert/lib/type/list.h>
+#include <com/snert/lib/sys/pthread.h>
+#include <com/snert/lib/io/socketAddress.h>
+
+typedef void (*EventsPostFn)(Events *loop, void *data);
+
+typedef struct events_post EventsPost;
+
+typedef struct {
+	unsigned long waits;		/* backend waits */
+	unsigned long io;		/* IO hooks called */
+	unsigned long timeouts;		/* timeout hooks called */
+	unsigned long posts;		/* posted functions called */
+	unsigned long events;		/* events in the loop */
+} EventsStats;
 
 typedef struct {
 	EventHook io;			/* input ready or output buffer available */
@@ -114,16 +141,21 @@ typedef struct {
 struct event {
 	/* Private */
 	FreeFn free;
-	time_t expire;
+	EventTime expire;
+	unsigned timer;			/* 1-based loop->timers index */
+	long timeout_ms;
 	int io_type;
+	int os_type;			/* io_type registered with kernel */
 	int enabled;
+	int changed;			/* queued in loop->changes */
+	Events *loop;
 	ListItem node;
 
 	/* Public */
 	int fd;				/* ro */
 	void *data;			/* rw */
 	EventOn on;			/* rw */
-	long timeout;			/* rw */
+	long timeout;			/* ro seconds, see eventSetTimeout */
 };
 
 struct events {
@@ -132,6 +164,22 @@ struct events {
 	List events;
 	os_event *set;
 	unsigned set_size;
+	unsigned set_ready;		/* ready events being dispatched */
+	Event **changes;		/* events to sync with kernel */
+	unsigned changes_length;
+	unsigned changes_size;
+	int changes_lost;		/* resync all events */
+	const struct events_wait *wait;	/* backend bound on first wait */
+	int os_fd;			/* persistent kqueue or epoll fd */
+	Event **timers;			/* min-heap ordered by expire */
+	unsigned timers_length;
+	unsigned timers_size;
+	pthread_mutex_t post_mutex;
+	EventsPost *post_head;		/* functions posted by other threads */
+	EventsPost *post_tail;
+	Event *post_event;		/* reads post_fd[0] */
+	int post_fd[2];
+	EventsStats stats;
 
 	/* Public */
 	JMP_BUF on_error;		/* ro */
@@ -141,6 +189,31 @@ struct events {
 #define eventDoIo(fn, l, e, f)		(*fn)(l, e, f)
 #define eventDoTimeout(fn, l, e, f)	(*fn)(l, e, f)
 
+/*
+ * Cross thread wakeup. eventsPostInit() must be called by the thread
+ * that owns the loop, before any other thread calls eventsPost(). The
+ * posted function is called by the loop's own thread.
+ */
+extern int eventsPostInit(Events *loop);
+extern int eventsPost(Events *loop, EventsPostFn fn, void *data);
+extern void eventsGetStats(Events *loop, EventsStats *stats);
+
+/*
+ * Multiple reactors, one Events loop per thread. Each loop has its
+ * own SO_REUSEPORT listening socket, so the kernel spreads incoming
+ * connections across the loops, and posting enabled for handoff.
+ */
+typedef struct events_group EventsGroup;
+
+extern EventsGroup *eventsGroupNew(unsigned loops);
+extern void eventsGroupFree(EventsGroup *group);
+extern unsigned eventsGroupLength(EventsGroup *group);
+extern Events *eventsGroupGet(EventsGroup *group, unsigned index);
+extern Events *eventsGroupNext(EventsGroup *group);
+extern int eventsGroupListen(EventsGroup *group, SocketAddress *addr, int queue_size, EventHook accept_io, void *data);
+extern int eventsGroupRun(EventsGroup *group);
+extern void eventsGroupStop(EventsGroup *group);
+
 #endif /* SNERT_EVENTS */
 
 extern void eventFree(void *_event);
@@ -148,6 +221,8 @@ extern Event *eventNew(int fd, int type);
 extern void eventInit(Event *event, int fd, int type);
 extern void eventSetTimeout(Event *event, long seconds);
 extern long eventGetTimeout(Event *event);
+extern void eventSetTimeoutMs(Event *event, long ms);
+extern long eventGetTimeoutMs(Event *event);
 extern void eventResetTimeout(Event *event);
 extern void eventSetEnabled(Event *event, int flag);
 extern  int eventGetEnabled(Event *event);
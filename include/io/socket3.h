@@ -528,6 +528,25 @@ extern SOCKET socket3_connect(const char *host, unsigned port, long timeout);
  */
 extern SOCKET socket3_server(SocketAddress *addr, int is_stream, int queue_size);
 
+/**
+ * @param addr
+ *	A SocketAddress pointer of a local interface and port.
+ *
+ * @param isStream
+ *	If true, then a connection oriented TCP socket is created,
+ *	otherwise its a connectionless UDP socket.
+ *
+ * @param queue_size
+ *	The connection queue size.
+ *
+ * @return
+ *	A server SOCKET or SOCKET_ERROR. Same as socket3_server(), but
+ *	SO_REUSEADDR and SO_REUSEPORT (where supported) are set before
+ *	binding, so that several sockets, one per thread or process, can
+ *	share the port and the kernel spreads connections across them.
+ */
+extern SOCKET socket3_server_reuse(SocketAddress *addr, int is_stream, int queue_size);
+
 /**
  * Wait for TCP client connections on this server socket.
  *
@@ -0,0 +1,91 @@
+/*
+ * digest.h
+ *
+ * Single pass MIME part digests.
+ *
+ * Copyright 2026 by Anthony Howe. All rights reserved.
+ */
+
+#ifndef __com_snert_lib_mail_digest_h__
+#define __com_snert_lib_mail_digest_h__	1
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <com/snert/lib/mail/mime.h>
+
+/***********************************************************************
+ ***
+ ***********************************************************************/
+
+#define DIGEST_MD5_ENCODED	0x0001	/* MD5 of the encoded part body. */
+#define DIGEST_MD5_DECODED	0x0002	/* MD5 of the decoded part body. */
+#define DIGEST_IXHASH		0x0004	/* ixhash 1, 2, 3 of the decoded part body. */
+#define DIGEST_DKIM_SIMPLE	0x0008	/* RFC 6376 simple body canonicalisation. */
+#define DIGEST_DKIM_RELAXED	0x0010	/* RFC 6376 relaxed body canonicalisation. */
+#define DIGEST_ALL		0x001F
+
+/* Hex digest of up to SHA-256 plus NUL. */
+#define DIGEST_DKIM_STRING_SIZE	65
+
+/* The DKIM body hash: "sha256", "sha1", or "md5". */
+extern const char digestDkimHash[];
+
+typedef struct {
+	unsigned part;				/* MIME part number. */
+	unsigned long length;			/* Encoded body length. */
+	unsigned long decoded_length;		/* Decoded body length. */
+	int ixhash;				/* Hash 1, 2, or 3 to use; 0 none. */
+	char md5_encoded[33];
+	char md5_decoded[33];
+	char ixhash1[33];
+	char ixhash2[33];
+	char ixhash3[33];
+	char dkim_simple[DIGEST_DKIM_STRING_SIZE];	/* digestDkimHash of the canonical body. */
+	char dkim_relaxed[DIGEST_DKIM_STRING_SIZE];	/* digestDkimHash of the canonical body. */
+} DigestPart;
+
+typedef void (*DigestMimeHook)(Mime *, DigestPart *, void *);
+typedef struct digest_mime DigestMime;
+
+/**
+ * @param flags
+ *	A bit mask of DIGEST_ flags selecting the digests to compute.
+ *	The digests not selected are empty strings.
+ *
+ * @param part_cb
+ *	A call-back function at the end of each MIME part body, passed
+ *	the digests of the part.
+ *
+ * @param data
+ *	Application data to be passed to the call-back.
+ *
+ * @return
+ *	A pointer to a DigestMime structure suitable for passing to
+ *	mimeHooksAdd(). The DigestMime * will have to cast to MimeHooks *.
+ *	This structure and data are freed by mimeFree().
+ *
+ * All the selected digests are computed from one traversal of the
+ * source and decode buffers as they are flushed by the MIME parser,
+ * instead of each digest walking the message itself. No octet hooks
+ * are used, so mimeNextBuf() can decode in bulk.
+ *
+ * The DKIM digests are of the encoded part body, which for a message
+ * without MIME parts is the message body. They are hashed with SHA-256
+ * when <sha2.h> is available, else SHA-1 with <sha1.h>, else MD5; see
+ * digestDkimHash. For a message without MIME parts, a SHA-256 or SHA-1
+ * digest is the DKIM "bh=" value without a body length limit, in hex
+ * instead of base64.
+ */
+extern DigestMime *digestMimeInit(unsigned flags, DigestMimeHook part_cb, void *data);
+
+/***********************************************************************
+ ***
+ ***********************************************************************/
+
+#ifdef  __cplusplus
+}
+#endif
+
+#endif /* __com_snert_lib_mail_digest_h__ */
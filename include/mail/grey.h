@@ -30,7 +30,7 @@ typedef struct {
 #endif
 	const char *key_prefix;		/* cache name space prefix */
 #if defined(HAVE_PTHREAD_CREATE)
-	pthread_mutex_t	*mutex;		/* mutex to control cache access */
+	pthread_mutex_t	*mutex;		/* mutex to control cache access, NULL for a "sharded" cache */
 #endif
 } GreyList;
 
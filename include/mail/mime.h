@@ -56,6 +56,7 @@ typedef struct {
 	B64 b64;
 	int is_multipart;
 	int decode_state_cr;
+	int decode_eof;				/* Body decoding ended with EOF. */
 	int has_content_type;
 	int is_message_rfc822;			/* HACK for uri.c */
 	MimeEncoding encoding;
@@ -150,6 +151,25 @@ extern void mimeMsgFinish(Mime *m);
  */
 extern MimeErrorCode mimeNextCh(Mime *, int);
 
+/**
+ * @param m
+ *	Pointer to a Mime context structure.
+ *
+ * @param buf
+ *	A buffer of input octets to parse.
+ *
+ * @param length
+ *	The number of octets in the buffer.
+ *
+ * @return
+ *	Zero to continue, otherwise non-zero on error.
+ *
+ * @note
+ *	Same result as mimeNextCh() for each octet, but faster for
+ *	long runs of body octets. Call mimeNextCh(m, EOF) to finish.
+ */
+extern MimeErrorCode mimeNextBuf(Mime *, const unsigned char *, size_t);
+
 /**
  * @param m
  *	Pointer to a Mime context structure.
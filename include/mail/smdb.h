@@ -102,9 +102,13 @@ extern Option smdbOptDebug;
 extern Option smdbOptUseStat;
 extern Option smdbOptKeyHasNul;
 extern Option smdbOptRelayOk;
+extern Option smdbOptCacheSize;
+extern Option smdbOptCacheTtl;
 extern Option *smdbOptTable[];
 
 #define SMDB_OPTIONS_TABLE \
+	&smdbOptCacheSize,\
+	&smdbOptCacheTtl,\
 	&smdbOptDebug,\
 	&smdbOptKeyHasNul,\
 	&smdbOptRelayOk,\
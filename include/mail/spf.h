@@ -15,6 +15,7 @@ extern "C" {
 #include <com/snert/lib/mail/spf.h>
 #include <com/snert/lib/util/option.h>
 
+extern Option spfPrefetch;
 extern Option spfTempErrorDns;
 
 extern const char spfErrorOk[];
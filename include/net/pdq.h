@@ -128,6 +128,7 @@ typedef enum {
 	PDQ_TYPE_AAAA			= 28,	/* RFC 1886, 3596 */
 	PDQ_TYPE_A6			= 38,	/* RFC 2874, not supported */
 	PDQ_TYPE_DNAME			= 39,	/* RFC 2672 */
+	PDQ_TYPE_OPT			= 41,	/* RFC 6891, EDNS0 pseudo-RR */
 	PDQ_TYPE_SPF			= 99,	/* RFC 4408 */
 	PDQ_TYPE_ANY			= 255,	/* RFC 1035 all (behaves like ``any'') */
 	PDQ_TYPE_5A			= 256,	/* special API type for pdqListFindName */
@@ -217,7 +218,7 @@ typedef struct pdq_rr {
 } PDQ_rr;
 
 typedef struct {
-	PDQ_rr rr;
+	PDQ_rr rr;			/* NXDOMAIN: rr.ttl is the RFC 2308 negative TTL. */
 	time_t created;			/* When this record was created. */
 	uint16_t flags;			/* header flags */
 	PDQ_rcode rcode;
@@ -322,6 +323,26 @@ extern void pdqSetDebug(int level);
  */
 extern void pdqIgnoreTCP(int flag);
 
+/**
+ * @param size
+ *	EDNS0 UDP payload size advertised with each query, RFC 6891.
+ *	Zero disables EDNS0; otherwise the size is bounded between
+ *	512 and PDQ_EDNS_MAX_SIZE (4096). The default is 1232, which
+ *	avoids IP fragmentation on most paths. A server that rejects
+ *	EDNS0 with FORMERR is asked again without it.
+ */
+extern void pdqSetEdnsSize(unsigned size);
+
+/**
+ * @param size
+ *	Maximum number of packets sent or received by one system
+ *	call, when sendmmsg() and recvmmsg() are available; default
+ *	16, maximum 64. One disables batching. pdqGetDnsList() and
+ *	the related A/AAAA lookups of pdqGet() send their queries
+ *	together, and replies are read a batch at a time.
+ */
+extern void pdqSetBatchSize(unsigned size);
+
 /*
  * @param flag
  *	Set true to query NS servers, per pdqQuery, in round robin order
@@ -355,6 +376,76 @@ extern int pdqInit(void);
  */
 extern void pdqFini(void);
 
+typedef struct {
+	unsigned long hits;		/* Answers served from the cache. */
+	unsigned long misses;		/* Lookups that went to the network. */
+	unsigned long inserts;		/* Answers added to the cache. */
+	unsigned long evictions;	/* Least recently used answers discarded. */
+	unsigned long expired;		/* Answers discarded once their TTL ran out. */
+	unsigned long entries;		/* Answers currently held. */
+} PDQ_cache_stats;
+
+/**
+ * @param entries
+ *	Maximum number of answers held by the process wide answer
+ *	cache shared by all PDQ instances. Zero disables and flushes
+ *	the cache. Lowering the size discards the least recently
+ *	used answers.
+ *
+ * @note
+ *	Positive answers are kept for the smallest TTL of the records
+ *	returned. NXDOMAIN and NODATA answers are kept according to
+ *	RFC 2308, ie. the SOA minimum when present. Only queries sent
+ *	to the system configured name servers are cached; those
+ *	directed at a specific name server always go to the network.
+ */
+extern void pdqCacheSetSize(unsigned long entries);
+
+/**
+ * Discard all the answers held by the answer cache.
+ */
+extern void pdqCacheFlush(void);
+
+/**
+ * @param stats
+ *	A pointer to a PDQ_cache_stats structure to fill with
+ *	the answer cache counters.
+ */
+extern void pdqCacheGetStats(PDQ_cache_stats *stats);
+
+typedef struct {
+	unsigned long queries;		/* Questions sent upstream. */
+	unsigned long coalesced;	/* Questions that joined one in flight. */
+	unsigned long answers;		/* Upstream queries answered. */
+	unsigned long timeouts;		/* Upstream queries that timed out. */
+} PDQ_engine_stats;
+
+/**
+ * @param sockets
+ *	Number of UDP sockets, up to 8, of a process wide resolver
+ *	engine shared by all threads. Zero, the default, leaves each
+ *	PDQ instance with its own socket.
+ *
+ * @note
+ *	The engine starts with the next pdqOpen(), so that it can be
+ *	configured before a daemon forks, and stops with pdqFini().
+ *	A dedicated thread sends the queries, matches the replies by
+ *	query ID, and handles retransmits and timeouts; each PDQ
+ *	instance is then a light weight client without a socket of
+ *	its own. Concurrent queries for the same class, type, and
+ *	name to the system name servers share one upstream query,
+ *	each client receiving its own copy of the answer. Queries
+ *	time out after pdqMaxTimeout() seconds.
+ */
+extern void pdqSetEngine(unsigned sockets);
+
+/**
+ * @param stats
+ *	A pointer to a PDQ_engine_stats structure to fill with the
+ *	resolver engine counters, all zero when it is not running.
+ */
+extern void pdqEngineGetStats(PDQ_engine_stats *stats);
+
 /**
  * @param name_servers
  *	A list of pointers to C strings, each specifying a
@@ -534,6 +625,18 @@ extern int pdqSetLinearQuery(PDQ *pdq, int flag);
 extern int pdqQueryIsPending(PDQ *pdq);
 extern SOCKET pdqGetFd(PDQ *pdq);
 
+/**
+ * @param pdq
+ *	A PDQ structure pointer for handling queries.
+ *
+ * @return
+ *	True if pdqPoll() can return an answer without waiting. An
+ *	answer found in the DNS cache by pdqQuery() does not make
+ *	the pdqGetFd() socket of a PDQ without the shared engine
+ *	readable, so check this before waiting on it.
+ */
+extern int pdqAnswerIsReady(PDQ *pdq);
+
 /**
  * @param pdq
  *	A PDQ structure pointer for handling queries.
@@ -1345,17 +1448,26 @@ extern PDQ_valid_soa pdqTestSOA(PDQ *pdq, PDQ_class class, const char *name, PDQ
 
 #include <com/snert/lib/util/option.h>
 
+extern Option optDnsCacheSize;
+extern Option optDnsEdnsSize;
+extern Option optDnsEngine;
 extern Option optDnsIgnoreTCP;
 extern Option optDnsMaxTimeout;
 extern Option optDnsRoundRobin;
 
 #define PDQ_OPTIONS_TABLE \
+	&optDnsCacheSize, \
+	&optDnsEdnsSize, \
+	&optDnsEngine, \
 	&optDnsIgnoreTCP, \
 	&optDnsMaxTimeout, \
 	&optDnsRoundRobin
 
 #define PDQ_OPTIONS_SETTING(debug) \
 	pdqSetDebug(debug); \
+	pdqCacheSetSize(optDnsCacheSize.value); \
+	pdqSetEdnsSize(optDnsEdnsSize.value); \
+	pdqSetEngine(optDnsEngine.value); \
 	pdqIgnoreTCP(optDnsIgnoreTCP.value); \
 	pdqMaxTimeout(optDnsMaxTimeout.value); \
 	pdqSetRoundRobin(optDnsRoundRobin.value)
@@ -55,6 +55,7 @@ extern "C" {
 #include <com/snert/lib/type/queue.h>
 #include <com/snert/lib/type/Vector.h>
 #include <com/snert/lib/util/time62.h>
+#include <com/snert/lib/util/timer.h>
 
 /***********************************************************************
  ***
@@ -107,6 +108,24 @@ extern "C" {
 #define SERVER_STOP_TIMEOUT		10
 #endif
 
+#ifndef SERVER_GROW_BATCH
+#define SERVER_GROW_BATCH		4
+#endif
+
+#ifndef SERVER_SHRINK_DELAY
+#define SERVER_SHRINK_DELAY		30000
+#endif
+
+#ifndef SERVER_WAIT_TARGET
+#define SERVER_WAIT_TARGET		20
+#endif
+
+#ifndef SERVER_STATS_INTERVAL
+#define SERVER_STATS_INTERVAL		10000
+#endif
+
+#define SERVER_HISTOGRAM_SIZE		24	/* log2 microsecond buckets, ~16s */
+
 #define SERVER_FILE_LINENO		__FILE__, __LINE__
 
 #if defined(__MINGW32__)
@@ -132,6 +151,23 @@ typedef int (*ServerHook)(Server *server);
 typedef int (*ServerWorkerHook)(ServerWorker *worker);
 typedef int (*ServerSessionHook)(ServerSession *session);
 
+typedef struct {
+	unsigned long sessions;		/* sessions completed */
+	unsigned long started;		/* worker threads started by the pool */
+	unsigned long retired;		/* worker threads retired by the pool */
+	unsigned threads;		/* current worker threads */
+	unsigned active;		/* workers processing a session */
+	unsigned queued;		/* sessions waiting for a worker */
+	unsigned long wait_p50;		/* accept to process, microseconds, last interval */
+	unsigned long wait_p99;
+	unsigned long service_p50;	/* session process, microseconds, last interval */
+	unsigned long service_p99;
+	unsigned long wait_hist[SERVER_HISTOGRAM_SIZE];	/* current interval */
+	unsigned long service_hist[SERVER_HISTOGRAM_SIZE];
+} ServerStats;
+
+typedef int (*ServerStatsHook)(Server *server, ServerStats *stats);
+
 struct server_worker {
 	/* Private */
 	unsigned id;
@@ -161,6 +197,10 @@ typedef struct {
 	unsigned accept_to;			/* accept timeout */
 	unsigned read_to;			/* read timeout */
 	unsigned port;				/* default port, if not specified in interfaces */
+	unsigned grow_batch;			/* min. worker threads started or retired at once */
+	unsigned shrink_delay;			/* ms spare threads must be in surplus before retiring */
+	unsigned wait_target;			/* ms p99 accept to process wait before growing */
+	unsigned stats_interval;		/* ms between percentiles and server_stats */
 } ServerOptions;
 
 typedef struct {
@@ -173,6 +213,7 @@ typedef struct {
 	ServerSessionHook session_accept;	/* serverAccept > sessionAccept	*/
 	ServerSessionHook session_process;	/* serverWorker			*/
 	ServerSessionHook session_free;		/* serverWorker > sessionFree	*/
+	ServerStatsHook server_stats;		/* serverWorker > serverPoolAdjust, every stats_interval */
 } ServerHooks;
 
 typedef struct {
@@ -185,6 +226,7 @@ struct server_session {
 	ListItem node;
 	pthread_t thread;
 	ServerInterface *iface;
+	CLOCK accepted;
 #if defined(__WIN32__) || defined(__CYGWIN__)
 	HANDLE kill_event;
 #endif
@@ -211,6 +253,10 @@ struct server {
 
 	Queue workers;			/* All worker threads. */
 	unsigned workers_active;	/* workers.mutex used to control access. */
+	unsigned workers_retire;	/* workers.mutex; workers yet to exit. */
+	ServerStats stats;		/* workers.mutex */
+	CLOCK stats_mark;		/* workers.mutex; start of stats interval. */
+	CLOCK surplus_mark;		/* workers.mutex; spare surplus began, or zero. */
 
 	Queue sessions_queued;		/* Client sessions queued by accept thread. */
 	pthread_t accept_thread;
@@ -235,6 +281,7 @@ extern int serverStart(Server *server);
 extern int serverWorkerIsTerminated(ServerWorker *worker);
 extern int serverSessionIsTerminated(ServerSession *session);
 extern void serverStop(Server *server, int slow_quit);
+extern void serverGetStats(Server *server, ServerStats *stats);
 
 /**
  * Defined by the application and is called by Windows via ServiceMain()
@@ -199,7 +199,7 @@ extern int pthread_cond_destroy(pthread_cond_t *);
  * sure to cleanup the current locked mutex too.
  */
 # define PTHREAD_MUTEX_LOCK(m)		if (!pthread_mutex_lock(m)) { \
-						pthread_cleanup_push((void (*)(void*)) pthread_mutex_unlock, (m));
+						pthread_cleanup_push(pthreadMutexUnlock, (m));
 
 # define PTHREAD_MUTEX_UNLOCK(m)		; \
 						pthread_cleanup_pop(1); \
@@ -223,6 +223,7 @@ extern void pthread_yield(void);
 
 /* Non-POSIX using pthread functions. */
 extern int pthreadMutexDestroy(pthread_mutex_t *);
+extern void pthreadMutexUnlock(void *mutexp);
 extern int pthreadSleep(unsigned seconds, unsigned nanoseconds);
 
 /***********************************************************************
@@ -48,6 +48,13 @@ typedef struct kvm {
 	const char *(*filepath)(struct kvm *self);
 	int (*fetch)(struct kvm *self, kvm_data *key, kvm_data *value);
 	int (*get)(struct kvm *self, kvm_data *key, kvm_data *value);
+	/* Pass the value found for key by reference to function, without
+	 * copying it, while the backend's lock is held. The value need not
+	 * be NUL terminated and must not be kept or modified after function
+	 * returns, nor may function call back into the same kvm. Returns
+	 * KVM_OK when function was called, KVM_NOT_FOUND, or KVM_ERROR.
+	 */
+	int (*lookup)(struct kvm *self, kvm_data *key, void (*function)(kvm_data *value, void *data), void *data);
 	int (*put)(struct kvm *self, kvm_data *key, kvm_data *value);
 	int (*remove)(struct kvm *self, kvm_data *key);
 	int (*truncate)(struct kvm *self);
@@ -60,6 +67,18 @@ typedef struct kvm {
 	int (*next)(struct kvm *self, kvm_data *key, kvm_data *value);
 #else
 	int (*walk)(struct kvm *self, int (*function)(kvm_data *, kvm_data *, void *), void *data);
+	/* Like walk, but stop once ms milliseconds have passed, taking
+	 * the backend's lock for only a few buckets at a time, so that
+	 * a periodic sweep, such as expiring entries, never stalls other
+	 * threads for long. Set *cursor to zero to begin; it is updated
+	 * for the next call and returns to zero once the whole map has
+	 * been visited or function returns 0. Entries added or removed
+	 * between calls may or may not be seen. Every other entry is seen
+	 * at least once, but twice if a backend that grows, like stripe,
+	 * moved it. Backends that cannot be walked in slices do a complete
+	 * walk.
+	 */
+	int (*walk_slice)(struct kvm *self, unsigned long *cursor, unsigned ms, int (*function)(kvm_data *, kvm_data *, void *), void *data);
 #endif
 	void (*sync)(struct kvm *self);
 #ifdef HAVE_PTHREAD_MUTEX_T
@@ -80,10 +99,12 @@ typedef struct kvm {
  *
  *		NULL				(assumes hash!)
  *		hash!
+ *		stripe!				(striped hash for many threads)
  *		file!/path/map.txt
  *		/path/map.db			(historical)
  *		db!/path/map.db
  *		db!btree!/path/map.db
+ *		cdb!/path/map.cdb		(read-only, see kvmCdbMake)
  *		multicast!group,port!map
  *		socketmap!host,port
  *		socketmap!/path/local/socket
@@ -101,6 +122,46 @@ extern kvm *kvmOpen(const char *table_name, const char *map_name, int mode);
 
 extern void kvmDebug(int flag);
 
+/**
+ * @param map
+ *	A key-value map to copy.
+ *
+ * @param path
+ *	The file path of a cdb file to create or replace. The new file is
+ *	first written to path.tmp and then renamed, so that any cdb! map
+ *	already open on path will swap to it.
+ *
+ * @return
+ *	KVM_OK on success, otherwise KVM_ERROR.
+ */
+extern int kvmCdbMake(kvm *map, const char *path);
+
+/**
+ * @param map
+ *	An open key-value map to put a lookup cache in front of.
+ *
+ * @param entries
+ *	The maximum number of keys, found or not, to remember.
+ *
+ * @param ttl
+ *	The number of seconds to remember a lookup.
+ *
+ * @return
+ *	A pointer to a kvm structure on success, which owns map and
+ *	closes it when closed. Otherwise NULL and map remains the
+ *	caller's.
+ */
+extern kvm *kvmCacheOpen(kvm *map, unsigned long entries, unsigned long ttl);
+
+/**
+ * @param self
+ *	A key-value map.
+ *
+ * @return
+ *	The map behind a lookup cache, otherwise self.
+ */
+extern kvm *kvmCacheMap(kvm *self);
+
 #ifdef NOT_FINISHED
 /* Object locking becomes an issue with first/next. */
 extern int kvmLock(kvm *self);
@@ -22,14 +22,16 @@ extern "C" {
 #include <com/snert/lib/net/network.h>
 #include <com/snert/lib/sys/pthread.h>
 #include <com/snert/lib/type/Vector.h>
+#include <com/snert/lib/util/siphash.h>
 #include <com/snert/lib/util/sqlite3.h>
 
 #ifndef MCC_STACK_SIZE
 # define MCC_STACK_SIZE		(64 * 1024)
-# ifndef __sun__
+# if !defined(__sun__) && !defined(__USE_DYNAMIC_STACK_SIZE)
 /* SunOS has to be the most annoying implementation of SUS ever conceived,
  * in this case they defined a limits.h macro as a function call to _sysconf
- * which can't be used in #if expressions; bloody wankers.
+ * which can't be used in #if expressions; bloody wankers. So does glibc
+ * 2.34 and later when _GNU_SOURCE is defined.
  */
 #  if MCC_STACK_SIZE < PTHREAD_STACK_MIN
 #   undef MCC_STACK_SIZE
@@ -76,6 +78,21 @@ typedef enum {
 #define MCC_HEAD_SIZE		24
 #define MCC_PACKET_LENGTH(p)	(MCC_HEAD_SIZE + MCC_GET_K_SIZE(p) + MCC_GET_V_SIZE(p))
 
+/*
+ * A batch packet, see mccStartBatch(), has the same 24 byte head as
+ * a row packet, with the command MCC_CMD_BATCH and the v_size field
+ * holding the number of rows. The digest is a SipHash-2-4 MAC, in the
+ * first 8 bytes, of the rows followed by bytes 16..23 of the head.
+ * Each row is then a row packet without the digest: ttl, k_size,
+ * v_size, key, and value.
+ *
+ * The default fits in an Ethernet frame for both IPv4 and IPv6.
+ */
+#ifndef MCC_BATCH_SIZE
+#define MCC_BATCH_SIZE		1400
+#endif
+#define MCC_BATCH_ROW_HEAD	(MCC_HEAD_SIZE - 16)
+
 /*
  * A multicast cache packet cannot be more than 512 bytes.
  */
@@ -140,6 +157,9 @@ typedef struct {
 #define MCC_SQL_SELECT_ONE	\
 "SELECT * FROM mcc WHERE k=?1;"
 
+#define MCC_SQL_SELECT_ALL	\
+"SELECT k,v,e,c FROM mcc;"
+
 #define MCC_SQL_TABLE_EXISTS	\
 "SELECT name FROM sqlite_master WHERE type='table' AND name='mcc';"
 
@@ -149,8 +169,9 @@ typedef struct {
 #define MCC_SQL_CREATE_INDEX	\
 "CREATE INDEX mcc_expire ON mcc(e);"
 
+/* Expire at most ?2 rows per step, see mccSetExpireSlice(). */
 #define MCC_SQL_EXPIRE		\
-"DELETE FROM mcc WHERE e<=?1;"
+"DELETE FROM mcc WHERE rowid IN (SELECT rowid FROM mcc WHERE e<=?1 LIMIT ?2);"
 
 #define MCC_SQL_DELETE		\
 "DELETE FROM mcc WHERE k=?1;"
@@ -236,6 +257,61 @@ extern void mccFini(void);
 extern void mccStopGc(void);
 extern int mccStartGc(unsigned seconds);
 
+/**
+ * @param ms
+ *	Expired rows are deleted a few at a time, each step its own
+ *	short write. For up to ms milliseconds the steps follow one
+ *	another, then mccExpireRows() pauses as long again so that other
+ *	writers can take the database lock. Zero removes the pause.
+ *	Default MCC_EXPIRE_SLICE_MS.
+ */
+extern void mccSetExpireSlice(unsigned ms);
+
+/**
+ * @param seconds
+ *	Interval between flushes of changed rows to the SQLite database.
+ *
+ * @return
+ *	MCC_OK or MCC_ERROR.
+ *
+ * Load the rows of the SQLite database into a sharded
+ * in-memory hash table, which becomes the authoritative store: row
+ * lookups and updates no longer touch SQLite. A background thread
+ * writes the changed rows back in one transaction every interval.
+ * Call after mccInit() and before other threads use the cache.
+ */
+extern int mccStartWriteBehind(unsigned seconds);
+
+/**
+ * Flush any outstanding changes and return to using the SQLite
+ * database directly. Threads still using the cache switch to SQLite
+ * as well; the emptied store is kept until mccFini().
+ */
+extern void mccStopWriteBehind(void);
+
+/**
+ * @param ms
+ *	Maximum time in milliseconds that a row change is held back
+ *	waiting for others to share its packet.
+ *
+ * @return
+ *	MCC_OK or MCC_ERROR.
+ *
+ * Have mccSend() coalesce row changes into MCC_CMD_BATCH packets of
+ * up to MCC_BATCH_SIZE bytes, sent when full or after the delay, and
+ * authenticated with SipHash-2-4 instead of MD5. The listener always
+ * accepts both batch and single row packets, so enable batching only
+ * once every peer understands them.
+ */
+extern int mccStartBatch(unsigned ms);
+
+/**
+ * Send any pending batch and return to one packet per row change.
+ * Threads still changing rows switch to single row packets as well;
+ * the batch is kept until mccFini().
+ */
+extern void mccStopBatch(void);
+
 typedef struct {
 	char *path;
 	char *secret;
@@ -253,6 +329,19 @@ typedef struct {
 	time_t gc_next;
 	unsigned gc_period;
 	pthread_t gc_thread;
+	unsigned expire_slice_ms;	/* mccSetExpireSlice */
+
+	struct mcc_store *store;	/* mccStartWriteBehind */
+	struct mcc_batch *batch;	/* mccStartBatch */
+	struct mcc_store *stores_stopped;	/* freed by mccFini */
+	struct mcc_batch *batches_stopped;	/* freed by mccFini */
+	uint8_t secret_key[SIPHASH_KEY_SIZE];
+
+	unsigned apply_count;		/* mccSetApplyThreads */
+	struct mcc_apply **apply;
+	unsigned long received;		/* rows queued by the listener */
+	unsigned long dropped;		/* rows discarded, apply queue full */
+	unsigned long rejected;		/* packets failing digest or format */
 
 	pthread_mutex_t active_mutex;
 	mcc_active_host active[MCC_HASH_TABLE_SIZE];
@@ -277,6 +366,29 @@ extern int mccStartListener(const char **ip_array, int port);
  */
 extern void mccStopListener(void);
 
+/**
+ * @param count
+ *	Number of threads that apply the rows received by the listener,
+ *	default 1. Rows are assigned to a thread by key, so changes to a
+ *	key are applied in the order received. Takes effect with the
+ *	next mccStartListener().
+ */
+extern void mccSetApplyThreads(unsigned count);
+
+typedef struct {
+	unsigned long received;		/* rows queued for the apply threads */
+	unsigned long dropped;		/* rows discarded, apply queue full */
+	unsigned long rejected;		/* packets failing digest or format */
+	unsigned long queued;		/* rows waiting to be applied */
+} mcc_listener_stats;
+
+/**
+ * @param stats
+ *	Filled in with the listener counters since mccStartListener()
+ *	and the current apply queue depth.
+ */
+extern void mccGetListenerStats(mcc_listener_stats *stats);
+
 extern Vector mccGetActive(void);
 extern mcc_active_host *mccFindActive(const char *ip);
 extern void mccUpdateActive(const char *ip, uint32_t *touched);
@@ -327,6 +439,7 @@ extern int mccSetSync(mcc_handle *mcc, int level);
 #define MCC_CMD_PUT		'p'
 #define MCC_CMD_REMOVE		'r'
 #define MCC_CMD_OTHER		'?'
+#define MCC_CMD_BATCH		'b'
 
 extern int mccSend(mcc_handle *mcc, mcc_row *row, uint8_t command);
 
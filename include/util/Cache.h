@@ -139,6 +139,30 @@ typedef struct cache {
 
 	void (*setDebug)(int flag);
 
+	/**
+	 * Lookup up a key and pass its value to a function without
+	 * copying it. For the "sharded" handler, the function is called
+	 * while the entry is locked; it must not keep or modify the value
+	 * after it returns, nor call back into the same Cache. Handlers
+	 * that cannot pass by reference pass a copy.
+	 *
+	 * @param self
+	 *	This cache object.
+	 *
+	 * @param key
+	 *	The key object to lookup.
+	 *
+	 * @param function
+	 *	A call-back function given the value found and data.
+	 *
+	 * @param data
+	 *	Passed through to function.
+	 *
+	 * @return
+	 *	Zero if function was called, otherwise -1 if no mapping found.
+	 */
+	int (*lookup)(struct cache *self, Data key, void (*function)(Data value, void *data), void *data);
+
 	/*
 	 * Private
 	 */
@@ -152,13 +176,26 @@ typedef struct cache {
 
 extern void CacheSetDebug(int flag);
 
+/**
+ * @param entries
+ *	The maximum number of entries held by "sharded" Caches created
+ *	after this call; default 65536. Zero restores the default.
+ */
+extern void CacheSetShardedSize(unsigned long entries);
+
 /**
  * Create a new Cache.
  *
  * @param handler
- *	Currently supported handlers are "hash" and "bdb". If a null pointer
- *	is given, then the default handler is choosen. The "hash" type is
- *	always available, but not persistent across application restarts.
+ *	Currently supported handlers are "hash", "sharded", "flatfile",
+ *	and "bdb". If a null pointer is given, then the default handler
+ *	is choosen. The "hash" type is always available, but not persistent
+ *	across application restarts.
+ *
+ *	The "sharded" type is also memory only. Unlike the others, it is
+ *	safe for concurrent use by several threads without any external
+ *	lock, and holds at most CacheSetShardedSize() entries, evicting
+ *	those least recently used (CLOCK) once full.
  *
  * @param name
  *	If the underlying handler is a database, then self is the database
@@ -72,6 +72,75 @@ extern int b64Decode(B64 *b64, int x);
  */
 extern int b64DecodeBuffer(B64 *b64, const char *input, size_t in_size, unsigned char *output, size_t out_size, size_t *out_length);
 
+/**
+ * @param input
+ *	The Base64 input to decode.
+ *
+ * @param in_length
+ *	The length of the input.
+ *
+ * @param output
+ *	A pointer to an output buffer to receive the decoded octets.
+ *
+ * @param out_size
+ *	The size of the output buffer.
+ *
+ * @return
+ *	The number of input characters decoded, always a multiple of 4.
+ *	The output length is 3 octets per 4 input characters. Decoding
+ *	stops before the first quantum with a character outside the
+ *	Base64 alphabet, like white space or padding, or that does not
+ *	fit in the output buffer. Uses SSE2 or AVX2 when available.
+ */
+extern size_t b64DecodeQuanta(const unsigned char *input, size_t in_length, unsigned char *output, size_t out_size);
+
+/**
+ * @param b64
+ *	A pointer to B64 state structure.
+ *
+ * @param input
+ *	The Base64 input to decode.
+ *
+ * @param in_length
+ *	The length of the input.
+ *
+ * @param output
+ *	A pointer to an output buffer to receive the decoded octets.
+ *
+ * @param out_size
+ *	The size of the output buffer.
+ *
+ * @return
+ *	The number of input characters decoded, as b64DecodeQuanta().
+ *	Zero if the B64 state is not at the start of a quantum, in
+ *	which case continue with b64Decode().
+ */
+extern size_t b64DecodeBlock(B64 *b64, const unsigned char *input, size_t in_length, unsigned char *output, size_t out_size);
+
+/**
+ * @param input
+ *	The quoted-printable input to decode.
+ *
+ * @param in_length
+ *	The length of the input.
+ *
+ * @param output
+ *	A pointer to an output buffer to receive the decoded octets.
+ *
+ * @param out_size
+ *	The size of the output buffer.
+ *
+ * @param out_length
+ *	The length of the decoded output is passed back.
+ *
+ * @return
+ *	The number of input octets decoded. Literal octets are copied
+ *	and =XX hexadecimal sequences, either case, are decoded. Stops
+ *	at a CR, LF, soft line break, invalid or incomplete =XX, or when
+ *	the output buffer is full; continue from there octet by octet.
+ */
+extern size_t qpDecodeBlock(const unsigned char *input, size_t in_length, unsigned char *output, size_t out_size, size_t *out_length);
+
 /**
  * @param inlength
  *	The input length.
@@ -64,6 +64,62 @@ extern void ixhash_hash1(md5_state_t *md5, const unsigned char *body, size_t siz
 extern void ixhash_hash2(md5_state_t *md5, const unsigned char *body, size_t size);
 extern void ixhash_hash3(md5_state_t *md5, const unsigned char *body, size_t size);
 
+/***********************************************************************
+ *** All three hashes in one pass
+ ***********************************************************************/
+
+#ifndef IXHASH_BUFFER_SIZE
+#define IXHASH_BUFFER_SIZE	256
+#endif
+
+typedef struct {
+	md5_state_t md5[3];
+	size_t length;				/* Octets seen. */
+	size_t lf;				/* See ixhash_count_lf() */
+	size_t space_tab;			/* See ixhash_count_space_tab() */
+	size_t delims;				/* See ixhash_count_delims_or_abs_url() */
+	int prev[3];
+	int last;
+	int cr;
+	size_t out_length[3];
+	unsigned char out[3][IXHASH_BUFFER_SIZE];
+} ixhash_state;
+
+/**
+ * @param ix
+ *	A pointer to an ixhash state object to initialise.
+ */
+extern void ixhash_init(ixhash_state *ix);
+
+/**
+ * @param ix
+ *	A pointer to an ixhash state object.
+ *
+ * @param body
+ *	A pointer to a mail message body chunk.
+ *
+ * @param size
+ *	The length of the mail message body chunk.
+ *
+ * Update all three hashes and the counts used by the hash conditions
+ * in a single pass. Successive chunks are hashed as though they were
+ * one, unlike successive ixhash_hash1() calls.
+ */
+extern void ixhash_append(ixhash_state *ix, const unsigned char *body, size_t size);
+
+/**
+ * @param ix
+ *	A pointer to an ixhash state object.
+ *
+ * @param digest
+ *	An array of three MD5 digests, for hash1, hash2, and hash3.
+ *
+ * @return
+ *	The hash, 1, 2, or 3, whose condition the whole body meets, tested
+ *	in that order; otherwise 0 when the body is too short to hash.
+ */
+extern int ixhash_finish(ixhash_state *ix, md5_byte_t digest[3][16]);
+
 /***********************************************************************
  ***
  ***********************************************************************/
@@ -87,6 +87,18 @@ extern void md5_append(md5_state_t *pms, const md5_byte_t *data, int nbytes);
 /* Finish the message and return the digest. */
 extern void md5_finish(md5_state_t *pms, md5_byte_t digest[16]);
 
+/* Number of streams md5_append_multi() hashes in parallel. */
+#define MD5_LANES	8
+
+/*
+ * Append data[i] of nbytes[i] to the distinct state pms[i] for each of
+ * n independent streams, same as calling md5_append() for each one.
+ * The full blocks of up to MD5_LANES streams are hashed at once in
+ * vector lanes, so this pays when there are several streams of a few
+ * blocks or more, eg. a batch of MIME parts or mcc packets.
+ */
+extern void md5_append_multi(md5_state_t *pms[], const md5_byte_t *data[], const int nbytes[], int n);
+
 #ifdef __cplusplus
 }  /* end extern "C" */
 #endif
@@ -0,0 +1,70 @@
+/*
+ * siphash.h
+ *
+ * SipHash-2-4, a fast keyed hash suitable as a short message MAC.
+ * See Aumasson & Bernstein, "SipHash: a fast short-input PRF", 2012.
+ *
+ * Copyright 2026 by Anthony Howe. All rights reserved.
+ */
+
+#ifndef __com_snert_lib_util_siphash_h__
+#define __com_snert_lib_util_siphash_h__	1
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#if HAVE_INTTYPES_H
+# include <inttypes.h>
+#else
+# if HAVE_STDINT_H
+# include <stdint.h>
+# endif
+#endif
+
+#define SIPHASH_KEY_SIZE	16
+#define SIPHASH_DIGEST_SIZE	8
+
+typedef struct {
+	uint64_t v[4];
+	uint64_t length;	/* total bytes appended */
+	uint8_t buffer[8];	/* partial input word */
+} siphash_state_t;
+
+/**
+ * @param state
+ *	Hash state to initialise.
+ *
+ * @param key
+ *	A 128-bit secret key.
+ */
+extern void siphash_init(siphash_state_t *state, const uint8_t key[SIPHASH_KEY_SIZE]);
+
+/**
+ * @param state
+ *	Hash state.
+ *
+ * @param buffer
+ *	Data to add to the hash. Can be called repeatedly, so that a
+ *	digest is built incrementally as a message is assembled.
+ *
+ * @param length
+ *	Length of the buffer in bytes.
+ */
+extern void siphash_append(siphash_state_t *state, const uint8_t *buffer, unsigned length);
+
+/**
+ * @param state
+ *	Hash state.
+ *
+ * @param digest
+ *	The 64-bit result in little endian byte order, as per the
+ *	reference implementation's test vectors.
+ */
+extern void siphash_finish(siphash_state_t *state, uint8_t digest[SIPHASH_DIGEST_SIZE]);
+
+#ifdef  __cplusplus
+}
+#endif
+
+#endif /* __com_snert_lib_util_siphash_h__ */
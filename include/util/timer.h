@@ -216,6 +216,14 @@ extern Timer *timerCreate(TimerTask task, void *data, CLOCK *delay, CLOCK *perio
  */
 extern void timerFree(void *_timer);
 
+/**
+ * @return
+ *	Milliseconds from a monotonic clock, when available, so that
+ *	intervals measured with it are immune to wall clock adjustments.
+ *	Only differences between two values are meaningful.
+ */
+extern unsigned long timerMonotonicMs(void);
+
 /***********************************************************************
  ***
  ***********************************************************************/
@@ -17,6 +17,7 @@
 #include <com/snert/lib/version.h>
 
 #include <errno.h>
+#include <limits.h>
 #include <stdlib.h>
 #include <string.h>
 
@@ -26,6 +27,9 @@
 #ifdef HAVE_UNISTD_H
 # include <unistd.h>
 #endif
+#ifdef HAVE_FCNTL_H
+# include <fcntl.h>
+#endif
 
 #if HAVE_INTTYPES_H
 # include <inttypes.h>
@@ -36,6 +40,8 @@
 #endif
 
 #include <com/snert/lib/io/events.h>
+#include <com/snert/lib/io/file.h>
+#include <com/snert/lib/io/socket3.h>
 #include <com/snert/lib/util/timer.h>
 #include <com/snert/lib/util/Text.h>
 
@@ -60,6 +66,125 @@
  *** Individual Event Functions
  ***********************************************************************/
 
+#ifndef USE_LIBEV
+/*
+ * Queue an event whose enabled state or IO type changed, so that the
+ * kernel copy of the interest set (kqueue or epoll) can be updated
+ * before the next wait. Repeated changes within one iteration of the
+ * loop are coalesced into a single update.
+ */
+static void
+eventChanged(Event *event)
+{
+	Event **table;
+	Events *loop = event->loop;
+
+	if (loop == NULL || event->changed)
+		return;
+
+	if (loop->changes_size <= loop->changes_length) {
+		table = realloc(loop->changes, (loop->changes_size + EVENT_GROWTH) * sizeof (*table));
+		if (table == NULL) {
+			/* Fall back on a full resync before the next wait. */
+			loop->changes_lost = 1;
+			return;
+		}
+		loop->changes = table;
+		loop->changes_size += EVENT_GROWTH;
+	}
+
+	loop->changes[loop->changes_length++] = event;
+	event->changed = 1;
+}
+
+/*
+ * Timers are kept in a binary min-heap ordered by expire time, so
+ * finding the next deadline is O(1) and insert, reset, and removal
+ * are O(log n). Each event records its 1-based heap position, with
+ * zero meaning not queued.
+ */
+#define TIMER_AT(loop, i)	(loop)->timers[(i)-1]
+
+static void
+events_timer_put(Events *loop, unsigned i, Event *event)
+{
+	TIMER_AT(loop, i) = event;
+	event->timer = i;
+}
+
+static void
+events_timer_up(Events *loop, unsigned i)
+{
+	Event *event = TIMER_AT(loop, i);
+
+	while (1 < i && event->expire < TIMER_AT(loop, i / 2)->expire) {
+		events_timer_put(loop, i, TIMER_AT(loop, i / 2));
+		i /= 2;
+	}
+	events_timer_put(loop, i, event);
+}
+
+static void
+events_timer_down(Events *loop, unsigned i)
+{
+	unsigned child;
+	Event *event = TIMER_AT(loop, i);
+
+	while ((child = i * 2) <= loop->timers_length) {
+		if (child < loop->timers_length && TIMER_AT(loop, child + 1)->expire < TIMER_AT(loop, child)->expire)
+			child++;
+		if (event->expire <= TIMER_AT(loop, child)->expire)
+			break;
+		events_timer_put(loop, i, TIMER_AT(loop, child));
+		i = child;
+	}
+	events_timer_put(loop, i, event);
+}
+
+static void
+events_timer_remove(Events *loop, Event *event)
+{
+	unsigned i;
+	Event *last;
+
+	if ((i = event->timer) == 0)
+		return;
+
+	event->timer = 0;
+	last = TIMER_AT(loop, loop->timers_length);
+	if (i < loop->timers_length--) {
+		events_timer_put(loop, i, last);
+		events_timer_up(loop, i);
+		events_timer_down(loop, last->timer);
+	}
+}
+
+/*
+ * Queue, requeue, or dequeue an event's timer according to its
+ * current state. eventAdd() sizes the heap to hold every event in
+ * the loop, so insertion cannot fail.
+ */
+static void
+eventTimerUpdate(Event *event)
+{
+	Events *loop = event->loop;
+
+	if (loop == NULL)
+		return;
+
+	if (!event->enabled || event->timeout_ms < 0) {
+		events_timer_remove(loop, event);
+	} else if (event->timer == 0) {
+		loop->timers_length++;
+		events_timer_put(loop, loop->timers_length, event);
+		events_timer_up(loop, loop->timers_length);
+	} else {
+		events_timer_up(loop, event->timer);
+		events_timer_down(loop, event->timer);
+	}
+}
+#endif
+
 int
 eventGetEnabled(Event *event)
 {
@@ -83,6 +208,9 @@ eventSetEnabled(Event *event, int flag)
 		if (ev_cb(&event->on.io) != NULL)
 			ev_io_stop(event->loop, &event->on.io);
 	}
+#else
+	eventChanged(event);
+	eventTimerUpdate(event);
 #endif
 }
 
@@ -107,6 +235,7 @@ eventSetType(Event *event, int type)
 	}
 #else
 	event->io_type = type;
+	eventChanged(event);
 #endif
 }
 
@@ -116,11 +245,19 @@ eventGetTimeout(Event *event)
 	return event->timeout;
 }
 
+long
+eventGetTimeoutMs(Event *event)
+{
+	return event->timeout_ms;
+}
+
 #ifndef USE_LIBEV
 static void
-eventResetExpire(Event *event, const time_t *now)
+eventResetExpire(Event *event, EventTime now)
 {
-	event->expire = *now + (event->timeout < 0 ? LONG_MAX/UNIT_MILLI : event->timeout);
+	if (0 <= event->timeout_ms)
+		event->expire = now + event->timeout_ms;
+	eventTimerUpdate(event);
 }
 #endif
 
@@ -142,24 +279,43 @@ eventResetExpire(Event *event, const time_t *now)
 void
 eventResetTimeout(Event *event)
 {
-	if (0 < event->timeout) {
 #ifdef USE_LIBEV
-		if (ev_cb(&event->on.timeout) != NULL) {
-			event->on.timeout.repeat = (ev_tstamp) event->timeout;
-			ev_timer_again(event->loop, &event->on.timeout);
-		}
+	if (0 < event->timeout_ms && ev_cb(&event->on.timeout) != NULL) {
+		event->on.timeout.repeat = (ev_tstamp) event->timeout_ms / UNIT_MILLI;
+		ev_timer_again(event->loop, &event->on.timeout);
+	}
 #else
-		time_t now;
-		(void) time(&now);
-		eventResetExpire(event, &now);
+	eventResetExpire(event, timerMonotonicMs());
 #endif
-	}
 }
 
+/**
+ * @param event
+ *	A pointer to Event structure.
+ *
+ * @param seconds
+ *	Timeout in seconds; -1 for no timeout.
+ */
 void
 eventSetTimeout(Event *event, long seconds)
 {
 	event->timeout = seconds;
+	event->timeout_ms = seconds < 0 ? -1 : seconds * UNIT_MILLI;
+	eventResetTimeout(event);
+}
+
+/**
+ * @param event
+ *	A pointer to Event structure.
+ *
+ * @param ms
+ *	Timeout in milliseconds; -1 for no timeout.
+ */
+void
+eventSetTimeoutMs(Event *event, long ms)
+{
+	event->timeout = ms < 0 ? -1 : (ms + UNIT_MILLI - 1) / UNIT_MILLI;
+	event->timeout_ms = ms;
 	eventResetTimeout(event);
 }
 
@@ -169,6 +325,7 @@ eventInit(Event *event, int fd, int io_type)
 	if (event != NULL) {
 		memset(event, 0, sizeof (*event));
 		event->timeout = -1;
+		event->timeout_ms = -1;
 		event->enabled = 1;
 		event->fd = fd;
 #ifdef USE_LIBEV
@@ -214,24 +371,36 @@ eventAdd(Events *loop, Event *event)
 	eventSetEnabled(event, 1);
 #else
 {
-	long length;
-
-	listInsertAfter(&loop->events, loop->events.tail, &event->node);
+	Event **table;
 
-	length = loop->events.length;
-	if (loop->set_size < length) {
-		free(loop->set);
-		if ((loop->set = malloc((length + EVENT_GROWTH) * sizeof (*loop->set))) == NULL)
+	if (loop->timers_size <= loop->events.length) {
+		table = realloc(loop->timers, (loop->timers_size + EVENT_GROWTH) * sizeof (*table));
+		if (table == NULL)
 			return -1;
-		loop->set_size = length + EVENT_GROWTH;
+		loop->timers = table;
+		loop->timers_size += EVENT_GROWTH;
 	}
 
+	event->loop = loop;
+	event->timer = 0;
+	event->os_type = 0;
+	event->changed = 0;
+	listInsertAfter(&loop->events, loop->events.tail, &event->node);
+	eventChanged(event);
 	eventResetTimeout(event);
 }
 #endif
 	return 0;
 }
 
+#ifndef USE_LIBEV
+static void eventsForget(Events *loop, Event *event);
+#endif
+
+/*
+ * Remove an event before closing its fd, otherwise the kernel
+ * interest set might drop a reused fd belonging to a newer event.
+ */
 void
 eventRemove(Events *loop, Event *event)
 {
@@ -242,7 +411,10 @@ eventRemove(Events *loop, Event *event)
 		 */
 		eventSetEnabled(event, 0);
 #else
+		eventsForget(loop, event);
+		events_timer_remove(loop, event);
 		listDelete(&loop->events, &event->node);
+		event->loop = NULL;
 #endif
 		eventFree(event);
 	}
@@ -329,56 +501,139 @@ eventsWaitFnSet(const char *name)
 
 #else /* SNERT_EVENTS */
 
-#if defined(HAVE_KQUEUE)
+struct events_wait {
+	const char *name;
+	int (*open_fn)(Events *loop);
+	void (*update_fn)(Events *loop, Event *event);
+	void (*forget_fn)(Events *loop, Event *event);
+	int (*wait_fn)(Events *loop, long ms);
+};
+
+struct events_post {
+	EventsPost *next;
+	EventsPostFn fn;
+	void *data;
+};
+
+/*
+ * The IO type wanted from the kernel given an event's current state.
+ */
 static int
-events_wait_kqueue(Events *loop, long ms)
+event_os_type(Event *event)
 {
-	time_t now;
-	Event *event;
-	ListItem *node;
-	struct timespec ts;
-	struct kevent *k_ev;
-	int i, fd_length, fd_active, fd_ready;
-	int kq, saved_errno, io_want, io_seen;
+	if (!event->enabled || (event->io_type & (EVENT_READ|EVENT_WRITE)) == 0)
+		return 0;
 
-	fd_length = loop->events.length;
-	if (fd_length <= 0)
-		return EINVAL;
+	return event->io_type & (EVENT_READ|EVENT_WRITE|EVENT_EDGE);
+}
+
+#if defined(HAVE_KQUEUE) || defined(HAVE_EPOLL_CREATE)
+static void
+events_set_cloexec(int fd)
+{
+#if defined(HAVE_FCNTL_H) && defined(FD_CLOEXEC)
+	(void) fcntl(fd, F_SETFD, FD_CLOEXEC);
+#endif
+}
+#endif
 
-	if ((kq = kqueue()) < 0)
+#if defined(HAVE_KQUEUE)
+static int
+events_open_kqueue(Events *loop)
+{
+	if ((loop->os_fd = kqueue()) < 0)
 		return errno;
+	events_set_cloexec(loop->os_fd);
 
-	/* Create file descriptors list. */
-	fd_active = 0;
-	for (node = loop->events.head; node != NULL; node = node->next) {
-		event = node->data;
-		if (event->enabled) {
-			io_want = (event->io_type & EVENT_READ) ? EVFILT_READ : EVFILT_WRITE;
-			EV_SET(
-				&((struct kevent *)loop->set)[fd_active], event->fd,
-				io_want, EV_ADD|EV_ENABLE, 0, 0, event
-			);
-			fd_active++;
-		}
+	return 0;
+}
+
+/*
+ * kqueue has a filter per IO direction, so add the filters now
+ * wanted and delete those no longer wanted. Changes are applied
+ * one event at a time, since an error in the change list would
+ * otherwise be reported against an arbitrary event.
+ */
+static void
+events_set_kqueue(Events *loop, Event *event, int want)
+{
+	int n, flags;
+	struct kevent change[2];
+
+	if (want == event->os_type)
+		return;
+
+	n = 0;
+	flags = EV_ADD|EV_ENABLE|((want & EVENT_EDGE) ? EV_CLEAR : 0);
+
+	if (want & EVENT_READ)
+		EV_SET(&change[n++], event->fd, EVFILT_READ, flags, 0, 0, event);
+	if (want & EVENT_WRITE)
+		EV_SET(&change[n++], event->fd, EVFILT_WRITE, flags, 0, 0, event);
+	if (0 < n && kevent(loop->os_fd, change, n, NULL, 0, NULL) == -1) {
+		/* Leave unregistered; the fd might be closed. */
+		want = 0;
+	}
+
+	n = 0;
+	if ((event->os_type & EVENT_READ) && !(want & EVENT_READ))
+		EV_SET(&change[n++], event->fd, EVFILT_READ, EV_DELETE, 0, 0, event);
+	if ((event->os_type & EVENT_WRITE) && !(want & EVENT_WRITE))
+		EV_SET(&change[n++], event->fd, EVFILT_WRITE, EV_DELETE, 0, 0, event);
+	if (0 < n)
+		(void) kevent(loop->os_fd, change, n, NULL, 0, NULL);
+
+	event->os_type = want;
+}
+
+static void
+events_update_kqueue(Events *loop, Event *event)
+{
+	events_set_kqueue(loop, event, event_os_type(event));
+}
+
+static void
+events_forget_kqueue(Events *loop, Event *event)
+{
+	unsigned i;
+	struct kevent *k_ev;
+
+	events_set_kqueue(loop, event, 0);
+
+	k_ev = (struct kevent *) loop->set;
+	for (i = 0; i < loop->set_ready; i++) {
+		if (k_ev[i].udata == (void *) event)
+			k_ev[i].udata = NULL;
 	}
+}
+
+static int
+events_wait_kqueue(Events *loop, long ms)
+{
+	EventTime now;
+	Event *event;
+	struct timespec ts;
+	struct kevent *k_ev;
+	int i, fd_ready, saved_errno, io_want, io_seen;
 
 	TIMER_SET_MS(&ts, ms);
 
 	errno = 0;
 
 	/* Wait for some I/O or timeout. */
-	switch (fd_ready = kevent(kq, (struct kevent *)loop->set, fd_active, (struct kevent *)loop->set, fd_active, ms < 0 ? NULL : &ts)) {
+	switch (fd_ready = kevent(loop->os_fd, NULL, 0, (struct kevent *)loop->set, loop->set_size, ms < 0 ? NULL : &ts)) {
 	case 0:
 		if (errno != EINTR)
 			errno = ETIMEDOUT;
 		/*@fallthrough@*/
 	case -1:
-		goto error1;
+		return errno;
 	}
 
 	saved_errno = errno;
+	loop->set_ready = fd_ready;
 
-	(void) time(&now);
+	now = timerMonotonicMs();
 	for (i = 0; i < fd_ready; i++) {
 		if (SIGSETJMP(loop->on_error, 1) != 0)
 			continue;
@@ -408,83 +663,128 @@ events_wait_kqueue(Events *loop, long ms)
 			errno = saved_errno;
 		}
 
-		if (saved_errno == 0 || event->timeout < 0)
-			eventResetExpire(event, &now);
+		if (saved_errno == 0 || event->timeout_ms < 0)
+			eventResetExpire(event, now);
 
 		if (errno != 0 || (io_want & io_seen)) {
 			/* NOTE the event might remove itself from the loop
 			 * and destroy itself, so we cannot reference it
 			 * after the caller the handler.
 			 */
-			if (event->on.io != NULL)
+			if (event->on.io != NULL) {
+				loop->stats.io++;
 				(*event->on.io)(loop, event, 0);
+			}
 		}
 	}
-error1:
-	saved_errno = errno;
-	(void) close(kq);
 
-	return saved_errno;
+	loop->set_ready = 0;
+
+	return errno;
 }
 #endif
 #if defined(HAVE_EPOLL_CREATE)
-#include <com/snert/lib/io/socket3.h>
+static int
+events_open_epoll(Events *loop)
+{
+	if ((loop->os_fd = epoll_create(EVENT_GROWTH)) < 0)
+		return errno;
+	events_set_cloexec(loop->os_fd);
+
+	return 0;
+}
+
+static void
+events_set_epoll(Events *loop, Event *event, int want)
+{
+	int op;
+	struct epoll_event e_ev;
+
+	if (want == event->os_type)
+		return;
+
+	memset(&e_ev, 0, sizeof (e_ev));
+	e_ev.data.ptr = event;
+
+	if (want == 0) {
+		/* Fails with EBADF when the fd has already been closed,
+		 * in which case the kernel has already dropped it.
+		 */
+		(void) epoll_ctl(loop->os_fd, EPOLL_CTL_DEL, event->fd, &e_ev);
+		event->os_type = 0;
+		return;
+	}
+
+	if (want & EVENT_READ)
+		e_ev.events |= EPOLL_READ;
+	if (want & EVENT_WRITE)
+		e_ev.events |= EPOLL_WRITE;
+	if (want & EVENT_EDGE)
+		e_ev.events |= EPOLLET;
+
+	op = event->os_type == 0 ? EPOLL_CTL_ADD : EPOLL_CTL_MOD;
+	if (epoll_ctl(loop->os_fd, op, event->fd, &e_ev)) {
+		/* A closed fd was implicitly dropped by the kernel and
+		 * the number reused, or the reverse; try the other op.
+		 */
+		op = errno == EEXIST ? EPOLL_CTL_MOD : EPOLL_CTL_ADD;
+		if ((errno != EEXIST && errno != ENOENT)
+		|| epoll_ctl(loop->os_fd, op, event->fd, &e_ev))
+			want = 0;
+	}
+
+	event->os_type = want;
+}
+
+static void
+events_update_epoll(Events *loop, Event *event)
+{
+	events_set_epoll(loop, event, event_os_type(event));
+}
+
+static void
+events_forget_epoll(Events *loop, Event *event)
+{
+	unsigned i;
+	struct epoll_event *e_ev;
+
+	events_set_epoll(loop, event, 0);
+
+	e_ev = (struct epoll_event *) loop->set;
+	for (i = 0; i < loop->set_ready; i++) {
+		if (e_ev[i].data.ptr == event)
+			e_ev[i].data.ptr = NULL;
+	}
+}
 
 static int
 events_wait_epoll(Events *loop, long ms)
 {
-	time_t now;
+	EventTime now;
 	int io_want;
 	Event *event;
-	ListItem *node;
 	struct epoll_event *e_ev;
-	int i, fd_length, fd_active, fd_ready, saved_errno;
-
-	int ev_fd;
-
-	fd_length = loop->events.length;
-	if (fd_length <= 0)
-		return EINVAL;
-
-	if ((ev_fd = epoll_create(fd_length)) < 0)
-		return errno;
+	int i, fd_ready, saved_errno;
 
 	if (ms < 0)
 		ms = INFTIM;
 
-	fd_active = 0;
-	for (node = loop->events.head; node != NULL; node = node->next) {
-		event = node->data;
-		if (event->enabled) {
-			io_want = 0;
-			if (event->io_type & EVENT_READ)
-				io_want |= EPOLL_READ;
-			if (event->io_type & EVENT_WRITE)
-				io_want |= EPOLL_WRITE;
-			e_ev = &((struct epoll_event *) loop->set)[fd_active];
-			e_ev->data.ptr = event;
-			e_ev->events = io_want;
-			if (epoll_ctl(ev_fd, EPOLL_CTL_ADD, event->fd, e_ev))
-				goto error1;
-			fd_active++;
-		}
-	}
-
 	errno = 0;
 
 	/* Wait for some I/O or timeout. */
-	switch (fd_ready = epoll_wait(ev_fd, (struct epoll_event *)loop->set, fd_active, ms)) {
+	switch (fd_ready = epoll_wait(loop->os_fd, (struct epoll_event *)loop->set, loop->set_size, ms)) {
 	case 0:
 		if (errno != EINTR)
 			errno = ETIMEDOUT;
 		/*@fallthrough@*/
 	case -1:
-		goto error1;
+		return errno;
 	}
 
 	saved_errno = errno;
+	loop->set_ready = fd_ready;
 
-	(void) time(&now);
+	now = timerMonotonicMs();
 	for (i = 0; i < fd_ready; i++) {
 		if (SIGSETJMP(loop->on_error, 1) != 0)
 			continue;
@@ -499,6 +799,8 @@ events_wait_epoll(Events *loop, long ms)
 			errno = socket3_get_error(event->fd);
 		else if (!(e_ev->events & (EPOLLIN|EPOLLOUT)))
 			errno = saved_errno;
+		else
+			errno = 0;
 
 		io_want = 0;
 		if (event->io_type & EVENT_READ)
@@ -507,24 +809,46 @@ events_wait_epoll(Events *loop, long ms)
 			io_want |= EPOLL_WRITE;
 
 		if (errno != 0 || (e_ev->events & io_want)) {
-			if (saved_errno == 0 || event->timeout < 0)
-				eventResetExpire(event, &now);
-			if (event->on.io != NULL)
+			if (saved_errno == 0 || event->timeout_ms < 0)
+				eventResetExpire(event, now);
+			if (event->on.io != NULL) {
+				loop->stats.io++;
 				(*event->on.io)(loop, event, 0);
+			}
 		}
 	}
-error1:
-	saved_errno = errno;
-	(void) close(ev_fd);
 
-	return saved_errno;
+	loop->set_ready = 0;
+
+	return errno;
 }
 #endif
 #if defined(HAVE_POLL)
+/*
+ * poll() has no kernel side state; the set is rebuilt each wait.
+ */
+static int
+events_open_poll(Events *loop)
+{
+	return 0;
+}
+
+static void
+events_update_poll(Events *loop, Event *event)
+{
+	/* Do nothing. */
+}
+
+static void
+events_forget_poll(Events *loop, Event *event)
+{
+	/* Do nothing. */
+}
+
 static int
 events_wait_poll(Events *loop, long ms)
 {
-	time_t now;
+	EventTime now;
 	int io_want;
 	Event *event;
 	ListItem *node;
@@ -571,7 +895,7 @@ events_wait_poll(Events *loop, long ms)
 	saved_errno = errno;
 
 	fd_active = 0;
-	(void) time(&now);
+	now = timerMonotonicMs();
 	for (node = loop->events.head; node != NULL; node = node->next) {
 		if (SIGSETJMP(loop->on_error, 1) != 0)
 			continue;
@@ -589,6 +913,8 @@ events_wait_poll(Events *loop, long ms)
 				errno = EIO;
 			else if (!(p_ev->revents & (POLLIN|POLLOUT)))
 				errno = saved_errno;
+			else
+				errno = 0;
 
 			io_want = 0;
 			if (event->io_type & EVENT_READ)
@@ -597,10 +923,12 @@ events_wait_poll(Events *loop, long ms)
 				io_want |= POLL_WRITE;
 
 			if (errno != 0 || (p_ev->revents & io_want)) {
-				if (saved_errno == 0 || event->timeout < 0)
-					eventResetExpire(event, &now);
-				if (event->on.io != NULL)
+				if (saved_errno == 0 || event->timeout_ms < 0)
+					eventResetExpire(event, now);
+				if (event->on.io != NULL) {
+					loop->stats.io++;
 					(*event->on.io)(loop, event, 0);
+				}
 			}
 		}
 	}
@@ -609,37 +937,24 @@ error0:
 }
 #endif
 
-static int (*events_wait_fn)(Events *loop, long ms);
-
-static int
-eventsWait(Events *loop, long ms)
-{
-	if (events_wait_fn == NULL) {
-		errno = EIO;
-		return 0;
-	}
-
-	return (*events_wait_fn)(loop, ms);
-}
-
-typedef struct {
-	const char *name;
-	int (*wait_fn)(Events *loop, long ms);
-} eventsWaitMapping;
+typedef struct events_wait eventsWaitMapping;
 
 static eventsWaitMapping wait_mapping[] = {
 #if defined(HAVE_KQUEUE)
-	{ "kqueue", events_wait_kqueue },
+	{ "kqueue", events_open_kqueue, events_update_kqueue, events_forget_kqueue, events_wait_kqueue },
 #endif
 #if defined(HAVE_EPOLL_CREATE)
-	{ "epoll", events_wait_epoll },
+	{ "epoll", events_open_epoll, events_update_epoll, events_forget_epoll, events_wait_epoll },
 #endif
 #if defined(HAVE_POLL)
-	{ "poll", events_wait_poll },
+	{ "poll", events_open_poll, events_update_poll, events_forget_poll, events_wait_poll },
 #endif
-	{ NULL, NULL }
+	{ NULL, NULL, NULL, NULL, NULL }
 };
 
+/* Default backend, bound to a loop on its first wait. */
+static const eventsWaitMapping *events_wait;
+
 void
 eventsWaitFnSet(const char *name)
 {
@@ -647,64 +962,143 @@ eventsWaitFnSet(const char *name)
 
 	for (mapping = wait_mapping; mapping->name != NULL; mapping++) {
 		if (TextInsensitiveCompare(mapping->name, name) == 0) {
-			events_wait_fn = mapping->wait_fn;
+			events_wait = mapping;
 			break;
 		}
 	}
 }
 
-/**
- * @param loop
- *	A pointer to a Events loop.
- *
- * @param start
- *	A pointer to a time_t start time.
- *
- * @return
- *	The minimum timeout in seconds or -1 for infinite.
+/*
+ * Called by eventRemove() before the event is unlinked and possibly
+ * freed, so that no reference to it remains in the kernel interest
+ * set, the pending change list, or the ready set being dispatched.
  */
-static long
-eventsTimeout(Events *loop, const time_t *start)
+static void
+eventsForget(Events *loop, Event *event)
 {
-	long seconds;
+	unsigned i;
+
+	if (event->changed) {
+		for (i = 0; i < loop->changes_length; i++) {
+			if (loop->changes[i] == event)
+				loop->changes[i] = NULL;
+		}
+		event->changed = 0;
+	}
+
+	if (loop->wait != NULL)
+		(*loop->wait->forget_fn)(loop, event);
+}
+
+static int
+eventsSync(Events *loop)
+{
+	unsigned i;
 	Event *event;
 	ListItem *node;
-	time_t now, expire;
+	unsigned length;
+	os_event *table;
 
-	if (loop == NULL || start == NULL)
-		return -1;
+	length = loop->events.length;
+	if (loop->set_size < length) {
+		if ((table = malloc((length + EVENT_GROWTH) * sizeof (*table))) == NULL)
+			return errno;
+		free(loop->set);
+		loop->set = table;
+		loop->set_size = length + EVENT_GROWTH;
+	}
+
+	if (loop->changes_lost) {
+		for (node = loop->events.head; node != NULL; node = node->next) {
+			event = node->data;
+			event->changed = 0;
+			(*loop->wait->update_fn)(loop, event);
+		}
+		loop->changes_lost = 0;
+	} else {
+		for (i = 0; i < loop->changes_length; i++) {
+			if ((event = loop->changes[i]) != NULL) {
+				event->changed = 0;
+				(*loop->wait->update_fn)(loop, event);
+			}
+		}
+	}
+	loop->changes_length = 0;
 
-	now = *start;
-	seconds = LONG_MAX / UNIT_MILLI - 1;
-	expire = now + seconds;
+	return 0;
+}
 
-	for (node = loop->events.head; node != NULL; node = node->next) {
-		event = node->data;
-		if (event->enabled && now <= event->expire && event->expire < expire) {
-			expire = event->expire;
-			seconds = expire - now;
+static int
+eventsWait(Events *loop, long ms)
+{
+	int rc;
+
+	if (loop->wait == NULL) {
+		if (events_wait == NULL) {
+			errno = EIO;
+			return 0;
 		}
+		if ((rc = (*events_wait->open_fn)(loop)) != 0)
+			return rc;
+		loop->wait = events_wait;
+		loop->changes_lost = 1;
 	}
 
-	return seconds;
+	if ((rc = eventsSync(loop)) != 0)
+		return rc;
+
+	loop->stats.waits++;
+
+	return (*loop->wait->wait_fn)(loop, ms);
 }
 
+/**
+ * @param loop
+ *	A pointer to a Events loop.
+ *
+ * @param now
+ *	The current monotonic time in milliseconds.
+ *
+ * @return
+ *	The milliseconds until the next timer expires or -1 for infinite.
+ */
+static long
+eventsTimeout(Events *loop, EventTime now)
+{
+	EventTime ms;
+
+	if (loop == NULL || loop->timers_length == 0)
+		return -1;
+
+	ms = TIMER_AT(loop, 1)->expire - now;
+
+	return ms < 0 ? 0 : INT_MAX < ms ? INT_MAX : (long) ms;
+}
+
+/*
+ * Fire the timeout hook of every event due by now. An expired event
+ * is dequeued before its hook is called, so a hook that neither resets
+ * the timeout nor removes the event is not called again until the
+ * timeout is reset, either explicitly or by further IO.
+ */
 static void
-eventsExpire(Events *loop, const time_t *expire)
+eventsExpire(Events *loop, EventTime now)
 {
-	time_t when;
 	Event *event;
-	ListItem *node, *next;
+	unsigned limit;
 
-	when = *expire;
+	/* Bound the work should hooks requeue with a zero timeout. */
+	for (limit = loop->timers_length; 0 < limit && 0 < loop->timers_length; limit--) {
+		event = TIMER_AT(loop, 1);
+		if (now < event->expire)
+			break;
 
-	for (node = loop->events.head; node != NULL; node = next) {
-		next = node->next;
-		event = node->data;
-		if (event->enabled && event->expire <= when) {
-			errno = ETIMEDOUT;
-			if (event->on.timeout != NULL)
-				(*event->on.timeout)(loop, event, 0);
+		events_timer_remove(loop, event);
+
+		errno = ETIMEDOUT;
+		if (event->on.timeout != NULL) {
+			loop->stats.timeouts++;
+			(*event->on.timeout)(loop, event, 0);
 		}
 	}
 }
@@ -717,30 +1111,45 @@ eventsNew(void)
 	if ((loop = calloc(1, sizeof (*loop))) == NULL)
 		return NULL;
 
+	loop->os_fd = -1;
+	loop->post_fd[0] = loop->post_fd[1] = -1;
 	loop->set_size = EVENT_GROWTH;
 	if ((loop->set = calloc(loop->set_size, sizeof (*loop->set))) == NULL) {
 		free(loop);
 		return NULL;
 	}
-
-	if (events_wait_fn == NULL) {
-#if defined(HAVE_KQUEUE)
-		events_wait_fn = events_wait_kqueue;
-#elif defined(HAVE_EPOLL_CREATE)
-		events_wait_fn = events_wait_epoll;
-#elif defined(HAVE_POLL)
-		events_wait_fn = events_wait_poll;
-#endif
+	if (pthread_mutex_init(&loop->post_mutex, NULL)) {
+		free(loop->set);
+		free(loop);
+		return NULL;
 	}
 
+	if (events_wait == NULL)
+		events_wait = wait_mapping;
+
 	return loop;
 }
 
 void
 eventsFree(Events *loop)
 {
+	EventsPost *post, *next;
+
 	if (loop != NULL) {
 		listFini(&loop->events);
+		for (post = loop->post_head; post != NULL; post = next) {
+			next = post->next;
+			free(post);
+		}
+		if (0 <= loop->post_fd[0]) {
+			(void) close(loop->post_fd[0]);
+			(void) close(loop->post_fd[1]);
+		}
+		(void) pthread_mutex_destroy(&loop->post_mutex);
+		if (0 <= loop->os_fd)
+			(void) close(loop->os_fd);
+		free(loop->changes);
+		free(loop->timers);
 		free(loop->set);
 		free(loop);
 	}
@@ -749,19 +1158,17 @@ eventsFree(Events *loop)
 void
 eventsRun(Events *loop)
 {
-	long seconds;
-	time_t now, expire;
-
 	if (loop == NULL || loop->events.length == 0)
 		return;
 
 	for (loop->running = 1; loop->running; ) {
-		(void) time(&now);
-		seconds = eventsTimeout(loop, &now);
-		if (eventsWait(loop, seconds * UNIT_MILLI) == ETIMEDOUT && 0 <= seconds) {
-			expire = now + seconds;
-			eventsExpire(loop, &expire);
-		}
+		(void) eventsWait(loop, eventsTimeout(loop, timerMonotonicMs()));
+
+		/* Expire timers even when IO is ready, otherwise a
+		 * steady stream of IO on some events could starve the
+		 * timeouts of others.
+		 */
+		eventsExpire(loop, timerMonotonicMs());
 	}
 }
 
@@ -771,8 +1178,557 @@ eventsStop(Events *loop)
 	loop->running = 0;
 }
 
+/***********************************************************************
+ *** Cross Thread Posting
+ ***********************************************************************/
+
+static void
+events_post_io(Events *loop, Event *event, int _reserved_)
+{
+	char buffer[64];
+	EventsPost *post, *next;
+
+	/* Drain the wakeup bytes before taking the queue, so that a
+	 * post made after the queue is taken leaves a byte behind.
+	 */
+	while (0 < read(event->fd, buffer, sizeof (buffer)))
+		;
+
+	PTHREAD_MUTEX_LOCK(&loop->post_mutex);
+	post = loop->post_head;
+	loop->post_head = loop->post_tail = NULL;
+	PTHREAD_MUTEX_UNLOCK(&loop->post_mutex);
+
+	for ( ; post != NULL; post = next) {
+		next = post->next;
+		loop->stats.posts++;
+		(*post->fn)(loop, post->data);
+		free(post);
+	}
+}
+
+/**
+ * @param loop
+ *	A pointer to a Events loop.
+ *
+ * @return
+ *	Zero on success, otherwise -1 on error. Create the wakeup
+ *	pipe used by eventsPost(). Must be called by the thread that
+ *	owns the loop, before the loop is shared with other threads.
+ */
+int
+eventsPostInit(Events *loop)
+{
+	Event *event;
+
+	if (loop == NULL)
+		return -1;
+	if (0 <= loop->post_fd[0])
+		return 0;
+	if (pipe(loop->post_fd))
+		goto error0;
+
+	(void) fileSetCloseOnExec(loop->post_fd[0], 1);
+	(void) fileSetCloseOnExec(loop->post_fd[1], 1);
+	(void) socket3_set_nonblocking(loop->post_fd[0], 1);
+	(void) socket3_set_nonblocking(loop->post_fd[1], 1);
+
+	if ((event = eventNew(loop->post_fd[0], EVENT_READ)) == NULL)
+		goto error1;
+	eventSetCbIo(event, events_post_io);
+	if (eventAdd(loop, event)) {
+		free(event);
+		goto error1;
+	}
+	loop->post_event = event;
+
+	return 0;
+error1:
+	(void) close(loop->post_fd[0]);
+	(void) close(loop->post_fd[1]);
+	loop->post_fd[0] = loop->post_fd[1] = -1;
+error0:
+	return -1;
+}
+
+/**
+ * @param loop
+ *	A pointer to a Events loop, for which eventsPostInit() was called.
+ *
+ * @param fn
+ *	A function to be called by the loop's thread.
+ *
+ * @param data
+ *	Application data passed to fn.
+ *
+ * @return
+ *	Zero on success, otherwise -1 on error. Thread safe.
+ */
+int
+eventsPost(Events *loop, EventsPostFn fn, void *data)
+{
+	int was_empty;
+	EventsPost *post;
+
+	if (loop == NULL || fn == NULL || loop->post_fd[1] < 0) {
+		errno = EINVAL;
+		return -1;
+	}
+	if ((post = malloc(sizeof (*post))) == NULL)
+		return -1;
+
+	post->fn = fn;
+	post->data = data;
+	post->next = NULL;
+	was_empty = 0;
+
+	PTHREAD_MUTEX_LOCK(&loop->post_mutex);
+	if ((was_empty = (loop->post_tail == NULL)))
+		loop->post_head = post;
+	else
+		loop->post_tail->next = post;
+	loop->post_tail = post;
+	PTHREAD_MUTEX_UNLOCK(&loop->post_mutex);
+
+	/* A non-empty queue already has a wakeup pending. */
+	if (was_empty)
+		(void) write(loop->post_fd[1], "", 1);
+
+	return 0;
+}
+
+/**
+ * @param loop
+ *	A pointer to a Events loop.
+ *
+ * @param stats
+ *	A pointer to a EventsStats structure to fill in. Counters are
+ *	updated by the loop's thread without locking, so a copy taken
+ *	by another thread is approximate.
+ */
+void
+eventsGetStats(Events *loop, EventsStats *stats)
+{
+	if (loop != NULL && stats != NULL) {
+		*stats = loop->stats;
+		stats->events = loop->events.length;
+	}
+}
+
+/***********************************************************************
+ *** Multiple Reactors
+ ***********************************************************************/
+
+struct events_group {
+	unsigned length;
+	unsigned next;
+	Events **loops;
+	pthread_t *threads;
+};
+
+/**
+ * @param loops
+ *	The number of event loops, typically one per CPU core. Zero
+ *	for the number of online processors.
+ *
+ * @return
+ *	A pointer to a EventsGroup or NULL on error.
+ */
+EventsGroup *
+eventsGroupNew(unsigned loops)
+{
+	EventsGroup *group;
+
+	if (loops == 0) {
+#ifdef _SC_NPROCESSORS_ONLN
+		long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+		loops = cpus <= 0 ? 1 : (unsigned) cpus;
+#else
+		loops = 1;
+#endif
+	}
+
+	if ((group = calloc(1, sizeof (*group))) == NULL)
+		goto error0;
+	if ((group->loops = calloc(loops, sizeof (*group->loops))) == NULL)
+		goto error1;
+	if ((group->threads = calloc(loops, sizeof (*group->threads))) == NULL)
+		goto error1;
+
+	for (group->length = 0; group->length < loops; group->length++) {
+		if ((group->loops[group->length] = eventsNew()) == NULL)
+			goto error1;
+		if (eventsPostInit(group->loops[group->length])) {
+			eventsFree(group->loops[group->length]);
+			goto error1;
+		}
+	}
+
+	return group;
+error1:
+	eventsGroupFree(group);
+error0:
+	return NULL;
+}
+
+void
+eventsGroupFree(EventsGroup *group)
+{
+	unsigned i;
+
+	if (group != NULL) {
+		if (group->loops != NULL) {
+			for (i = 0; i < group->length; i++)
+				eventsFree(group->loops[i]);
+			free(group->loops);
+		}
+		free(group->threads);
+		free(group);
+	}
+}
+
+unsigned
+eventsGroupLength(EventsGroup *group)
+{
+	return group == NULL ? 0 : group->length;
+}
+
+Events *
+eventsGroupGet(EventsGroup *group, unsigned index)
+{
+	if (group == NULL || group->length <= index)
+		return NULL;
+
+	return group->loops[index];
+}
+
+/**
+ * @param group
+ *	A pointer to a EventsGroup.
+ *
+ * @return
+ *	The next loop in round robin order, suitable for handing off
+ *	work with eventsPost(). The counter is not synchronised; a lost
+ *	update merely picks the same loop twice.
+ */
+Events *
+eventsGroupNext(EventsGroup *group)
+{
+	if (group == NULL || group->length == 0)
+		return NULL;
+
+	return group->loops[group->next++ % group->length];
+}
+
+static void
+events_listener_free(void *_event)
+{
+	Event *event = _event;
+
+	if (event != NULL) {
+		socket3_close(event->fd);
+		free(event);
+	}
+}
+
+/**
+ * @param group
+ *	A pointer to a EventsGroup.
+ *
+ * @param addr
+ *	A SocketAddress pointer of a local interface and port.
+ *
+ * @param queue_size
+ *	The connection queue size of each listening socket.
+ *
+ * @param accept_io
+ *	The IO hook called by a loop when its listening socket is ready.
+ *	The Event's fd is the listening socket to accept from.
+ *
+ * @param data
+ *	Application data assigned to each listening Event.
+ *
+ * @return
+ *	Zero on success, otherwise -1 on error. Must be called before
+ *	eventsGroupRun(). Where SO_REUSEPORT is not supported, the loops
+ *	share duplicates of one listening socket instead.
+ */
+int
+eventsGroupListen(EventsGroup *group, SocketAddress *addr, int queue_size, EventHook accept_io, void *data)
+{
+	unsigned i;
+	Event *event;
+	SOCKET fd, shared;
+
+	if (group == NULL || addr == NULL) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	shared = SOCKET_ERROR;
+	for (i = 0; i < group->length; i++) {
+#ifdef SO_REUSEPORT
+		fd = socket3_server_reuse(addr, 1, queue_size);
+#else
+		if (shared == SOCKET_ERROR && (shared = socket3_server(addr, 1, queue_size)) == SOCKET_ERROR)
+			return -1;
+		fd = dup(shared);
+#endif
+		if (fd == SOCKET_ERROR)
+			goto error0;
+
+		(void) fileSetCloseOnExec(fd, 1);
+		(void) socket3_set_nonblocking(fd, 1);
+
+		if ((event = eventNew(fd, EVENT_READ)) == NULL) {
+			socket3_close(fd);
+			goto error0;
+		}
+		event->free = events_listener_free;
+		event->data = data;
+		eventSetCbIo(event, accept_io);
+
+		if (eventAdd(group->loops[i], event)) {
+			events_listener_free(event);
+			goto error0;
+		}
+	}
+
+	if (shared != SOCKET_ERROR)
+		socket3_close(shared);
+
+	return 0;
+error0:
+	if (shared != SOCKET_ERROR)
+		socket3_close(shared);
+
+	return -1;
+}
+
+static void *
+events_group_thread(void *data)
+{
+	eventsRun((Events *) data);
+
+	return NULL;
+}
+
+/**
+ * @param group
+ *	A pointer to a EventsGroup.
+ *
+ * @return
+ *	Zero on success, otherwise -1 on error. Start a thread for each
+ *	loop after the first, run the first loop in the calling thread,
+ *	and wait for the other threads once it stops.
+ */
+int
+eventsGroupRun(EventsGroup *group)
+{
+	unsigned i, started;
+
+	if (group == NULL || group->length == 0) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	for (started = 1; started < group->length; started++) {
+		if (pthread_create(&group->threads[started], NULL, events_group_thread, group->loops[started]))
+			break;
+	}
+
+	if (started == group->length)
+		eventsRun(group->loops[0]);
+	else
+		eventsGroupStop(group);
+
+	for (i = 1; i < started; i++)
+		(void) pthread_join(group->threads[i], NULL);
+
+	return started == group->length ? 0 : -1;
+}
+
+static void
+events_group_stop(Events *loop, void *data)
+{
+	eventsStop(loop);
+}
+
+/**
+ * @param group
+ *	A pointer to a EventsGroup.
+ *
+ * Ask every loop to stop. Thread safe, but not async signal safe.
+ */
+void
+eventsGroupStop(EventsGroup *group)
+{
+	unsigned i;
+
+	if (group != NULL) {
+		for (i = 0; i < group->length; i++)
+			(void) eventsPost(group->loops[i], events_group_stop, NULL);
+	}
+}
+
 #endif /* SNERT_EVENTS */
 
+#if defined(TEST) && !defined(USE_LIBEV)
+/***********************************************************************
+ *** Wakeup cost benchmark
+ ***********************************************************************/
+
+#include <stdio.h>
+#ifdef HAVE_SYS_RESOURCE_H
+# include <sys/resource.h>
+#endif
+#include <com/snert/lib/util/getopt.h>
+
+static const char usage[] =
+"usage: events [-w kqueue|epoll|poll][-i iterations][-t ms] [idle ...]\n"
+"\n"
+"-i n\t\tnumber of wakeups to time per run; default 10000\n"
+"-t ms\t\tidle and ready event timeout; default -1 for none\n"
+"-w name\t\tevent wait backend\n"
+"idle\t\tnumber of idle file descriptors; default 100 1000 10000 50000\n"
+"\n"
+"Time one ready pipe waking the loop while other idle pipes are\n"
+"registered. The cost per wakeup should remain flat as idle grows\n"
+"for kqueue and epoll, but not poll.\n"
+;
+
+static long wakeups;
+static long timeout_ms = -1;
+static long iterations = 10000;
+
+static void
+ping_io(Events *loop, Event *event, int _reserved_)
+{
+	char ch;
+
+	if (read(event->fd, &ch, 1) == 1) {
+		if (iterations <= ++wakeups)
+			eventsStop(loop);
+		(void) write(*(int *) event->data, &ch, 1);
+	}
+}
+
+static int
+bench(long idle)
+{
+	Event *event;
+	Events *loop;
+	int i, rc, ping[2], *fds;
+	TIMER_DECLARE(mark);
+
+	rc = EXIT_FAILURE;
+	if ((fds = calloc(idle * 2, sizeof (*fds))) == NULL)
+		goto error0;
+	if ((loop = eventsNew()) == NULL)
+		goto error1;
+	if (pipe(ping))
+		goto error2;
+
+	for (i = 0; i < idle; i++) {
+		if (pipe(&fds[i * 2])) {
+			fprintf(stderr, "pipe #%d: %s\n", i, strerror(errno));
+			idle = i;
+			goto error3;
+		}
+		if ((event = eventNew(fds[i * 2], EVENT_READ)) == NULL)
+			goto error3;
+		eventSetTimeoutMs(event, timeout_ms);
+		(void) eventAdd(loop, event);
+	}
+
+	if ((event = eventNew(ping[0], EVENT_READ)) == NULL)
+		goto error3;
+	eventSetCbIo(event, ping_io);
+	eventSetTimeoutMs(event, timeout_ms);
+	event->data = &ping[1];
+	(void) eventAdd(loop, event);
+
+	/* First wait binds the backend and registers everything. */
+	(void) write(ping[1], "!", 1);
+	(void) eventsWait(loop, -1);
+
+	wakeups = 0;
+	TIMER_START(mark);
+	eventsRun(loop);
+	TIMER_DIFF(mark);
+
+	printf(
+		"%s idle=%ld wakeups=%ld elapsed=" TIMER_FORMAT " usec/wakeup=%.3f\n",
+		loop->wait->name, idle, wakeups, TIMER_FORMAT_ARG(diff_mark),
+		CLOCK_TO_DOUBLE(&diff_mark) * 1e6 / wakeups
+	);
+
+	rc = EXIT_SUCCESS;
+error3:
+	for (i = 0; i < idle * 2; i++)
+		(void) close(fds[i]);
+	(void) close(ping[0]);
+	(void) close(ping[1]);
+error2:
+	eventsFree(loop);
+error1:
+	free(fds);
+error0:
+	return rc;
+}
+
+int
+main(int argc, char **argv)
+{
+	int ch, rc;
+	long idle, max_idle;
+	static long sizes[] = { 100, 1000, 10000, 50000, 0 };
+#ifdef RLIMIT_NOFILE
+	struct rlimit limit;
+#endif
+
+	while ((ch = getopt(argc, argv, "i:t:w:")) != -1) {
+		switch (ch) {
+		case 'i':
+			iterations = strtol(optarg, NULL, 10);
+			break;
+		case 't':
+			timeout_ms = strtol(optarg, NULL, 10);
+			break;
+		case 'w':
+			eventsWaitFnSet(optarg);
+			break;
+		default:
+			(void) fputs(usage, stderr);
+			return EXIT_FAILURE;
+		}
+	}
+
+	max_idle = 500;
+#ifdef RLIMIT_NOFILE
+	if (getrlimit(RLIMIT_NOFILE, &limit) == 0) {
+		limit.rlim_cur = limit.rlim_max;
+		(void) setrlimit(RLIMIT_NOFILE, &limit);
+		if (getrlimit(RLIMIT_NOFILE, &limit) == 0)
+			max_idle = (limit.rlim_cur - 16) / 2;
+	}
+#endif
+
+	rc = EXIT_SUCCESS;
+	if (optind < argc) {
+		for ( ; optind < argc && rc == EXIT_SUCCESS; optind++) {
+			idle = strtol(argv[optind], NULL, 10);
+			rc = bench(max_idle < idle ? max_idle : idle);
+		}
+	} else {
+		for (ch = 0; sizes[ch] != 0 && rc == EXIT_SUCCESS; ch++)
+			rc = bench(max_idle < sizes[ch] ? max_idle : sizes[ch]);
+	}
+
+	return rc;
+}
+#endif /* TEST */
+
 /***********************************************************************
  *** -end-
  ***********************************************************************/
@@ -133,6 +133,7 @@
 #include <com/snert/lib/mail/tlds.h>
 #include <com/snert/lib/mail/smtp2.h>
 #include <com/snert/lib/mail/parsePath.h>
+#include <com/snert/lib/mail/digest.h>
 #include <com/snert/lib/net/network.h>
 #include <com/snert/lib/net/pdq.h>
 #include <com/snert/lib/net/http.h>
@@ -221,8 +222,6 @@ typedef struct {
 } Lua;
 
 typedef struct {
-	md5_state_t source;
-	md5_state_t decode;
 	char *content_type;
 	char *content_encoding;
 } MD5Mime;
@@ -630,6 +629,16 @@ static const char usage_smtp_default_at_dot[] =
 ;
 Option opt_smtp_default_at_dot	= { "smtp-default-at-dot",	QUOTE(451),	usage_smtp_default_at_dot };
 
+static const char usage_mime_digests[] =
+  "Bit mask of the digests computed for each MIME part and passed to\n"
+"# the Lua script in mime.parts[i]: 0x01 MD5 of the encoded body,\n"
+"# 0x02 MD5 of the decoded body, 0x04 ixhash, 0x08 DKIM simple body\n"
+"# hash, 0x10 DKIM relaxed body hash. The digests not selected are\n"
+"# empty strings.\n"
+"#"
+;
+Option opt_mime_digests		= { "mime-digests",		"0x07",		usage_mime_digests };
+
 static const char usage_rfc2920_pipelining[] =
   "Enables support for RFC 2920 SMTP command pipelining when the client\n"
 "# sends EHLO.\n"
@@ -742,6 +751,8 @@ Option *opt_table[] = {
 
 	PDQ_OPTIONS_TABLE,
 
+	&opt_mime_digests,
+
 	&opt_rate_global,
 	&opt_rate_client,
 
@@ -2890,6 +2901,17 @@ dns_wait(SmtpCtx *ctx, int wait_all)
 	return errno;
 }
 
+/*
+ * Collect the answers already at hand, such as those from the DNS
+ * cache, which never make the pdq event fire. Return true if there
+ * is no need to wait on the event.
+ */
+static int
+dns_ready(SmtpCtx *ctx, int wait_all)
+{
+	return pdqAnswerIsReady(ctx->pdq.pdq) && dns_wait(ctx, wait_all) != EAGAIN;
+}
+
 void
 dns_reset(SmtpCtx *ctx)
 {
@@ -3383,6 +3405,8 @@ lua_dns_wait(lua_State *L)
 	if ((ctx = lua_smtp_ctx(L)) != NULL) {
 		eventSetEnabled(&ctx->pdq.event, 1);
 		ctx->pdq.wait_all = luaL_optint(L, 1, 1);
+		if (dns_ready(ctx, ctx->pdq.wait_all))
+			return lua_dns_getresult(L, ctx->pdq.answer);
 		ctx->lua.yield_until = lua_dns_waituntil;
 		ctx->lua.yield_after = lua_dns_yieldafter;
 	}
@@ -5177,23 +5201,10 @@ md5_header(Mime *m, void *data)
 }
 
 void
-md5_body_start(Mime *m, void *data)
-{
-	SmtpCtx *ctx = data;
-
-	if (ctx != NULL) {
-		md5_init(&ctx->md5.source);
-		md5_init(&ctx->md5.decode);
-	}
-}
-
-void
-md5_body_finish(Mime *m, void *data)
+md5_digest_part(Mime *m, DigestPart *part, void *data)
 {
 	lua_State *L;
 	SmtpCtx *ctx = data;
-	md5_byte_t digest[16];
-	char digest_string[33];
 
 	if (ctx == NULL)
 		return;
@@ -5203,21 +5214,21 @@ md5_body_finish(Mime *m, void *data)
 	lua_getfield(L, -1, "parts");		/* mime parts */
 	lua_newtable(L);			/* mime parts part */
 
-	md5_finish(&ctx->md5.source, digest);
-	md5_digest_to_string(digest, digest_string);
-	lua_table_set_string(L, -1, "md5_encoded", digest_string);
-
-	if (verb_mime.value)
-		syslog(LOG_DEBUG, LOG_FMT "md5_encoded=%s", LOG_ID(ctx), digest_string);
-
-	md5_finish(&ctx->md5.decode, digest);
-	md5_digest_to_string(digest, digest_string);
-	lua_table_set_string(L, -1, "md5_decoded", digest_string);
-
-	if (verb_mime.value)
-		syslog(LOG_DEBUG, LOG_FMT "md5_decoded=%s", LOG_ID(ctx), digest_string);
+	lua_table_set_string(L, -1, "md5_encoded", part->md5_encoded);
+	lua_table_set_string(L, -1, "md5_decoded", part->md5_decoded);
+	lua_table_set_integer(L, -1, "ixhash", part->ixhash);
+	lua_table_set_string(L, -1, "ixhash1", part->ixhash1);
+	lua_table_set_string(L, -1, "ixhash2", part->ixhash2);
+	lua_table_set_string(L, -1, "ixhash3", part->ixhash3);
+	lua_table_set_string(L, -1, "dkim_hash", digestDkimHash);
+	lua_table_set_string(L, -1, "dkim_simple", part->dkim_simple);
+	lua_table_set_string(L, -1, "dkim_relaxed", part->dkim_relaxed);
 
 	if (verb_mime.value) {
+		syslog(
+			LOG_DEBUG, LOG_FMT "md5_encoded=%s md5_decoded=%s ixhash=%d",
+			LOG_ID(ctx), part->md5_encoded, part->md5_decoded, part->ixhash
+		);
 		syslog(
 			LOG_DEBUG,
 			LOG_FMT "part_length=%ld body_length=%ld content_type=%s content_transfer_encoding=%s",
@@ -5240,41 +5251,16 @@ md5_body_finish(Mime *m, void *data)
 	lua_pop(L, 2);				/* -- */
 }
 
-void
-md5_source_flush(Mime *m, void *data)
-{
-	SmtpCtx *ctx = data;
-
-	md5_append(&ctx->md5.source, m->source.buffer, m->source.length);
-}
-
-void
-md5_decode_flush(Mime *m, void *data)
-{
-	SmtpCtx *ctx = data;
-
-	md5_append(&ctx->md5.decode, m->decode.buffer, m->decode.length);
-}
-
-static MimeHooks md5_hook = {
-	NULL,
-	md5_mime_free,
-	md5_header,
-	md5_body_start,
-	md5_body_finish,
-	md5_source_flush,
-	md5_decode_flush
-};
-
 MimeHooks *
 md5_mime_init(SmtpCtx *ctx)
 {
 	lua_State *L;
 	MimeHooks *hook;
 
-	if ((hook = malloc(sizeof (*hook))) != NULL) {
-		*hook = md5_hook;
+	if ((hook = calloc(1, sizeof (*hook))) != NULL) {
 		hook->data = ctx;
+		hook->free_hook = md5_mime_free;
+		hook->header = md5_header;
 
 		L = ctx->script;
 		lua_newtable(L);		/* mime */
@@ -5690,7 +5676,8 @@ SMTP_DEF(accept)
 	}
 
 	eventSetEnabled(&ctx->pdq.event, 1);
-	PT_YIELD_UNTIL(&ctx->pt, dns_wait(ctx, 1) != EAGAIN);
+	if (!dns_ready(ctx, 1))
+		PT_YIELD_UNTIL(&ctx->pt, dns_wait(ctx, 1) != EAGAIN);
 
 	for (rr = ctx->pdq.answer; rr != NULL; rr = rr->next) {
 		if (rr->section == PDQ_SECTION_QUERY)
@@ -5972,6 +5959,13 @@ SMTP_DEF(mail)
 	}
 	mimeHooksAdd(ctx->mime, hook);
 
+	/* One pass over the flushed buffers for all the part digests. */
+	if ((hook = (MimeHooks *) digestMimeInit((unsigned) opt_mime_digests.value & DIGEST_ALL, md5_digest_part, ctx)) == NULL) {
+		syslog(LOG_ERR, log_oom, LOG_INT(ctx));
+		SIGLONGJMP(ctx->on_error, JMP_INTERNAL);
+	}
+	mimeHooksAdd(ctx->mime, hook);
+
 	next_transaction(ctx);
 	ctx->state = SMTP_NAME(mail);
 	LUA_PT_CALL(mail);
@@ -6195,7 +6189,7 @@ error1:
 
 SMTP_DEF(content)
 {
-	const char *fmt, *nl;
+	const char *fmt, *nl, *start;
 	SmtpCtx *ctx = event->data;
 
 	TRACE_CTX(ctx, 000);
@@ -6214,24 +6208,31 @@ SMTP_DEF(content)
 		ctx->is_dot = STRLEN(DOT_CRLF);
 		ctx->input.length = 0;
 	} else {
-		/* Feed the input to the MIME parser. */
-		for ( ; *nl != '\0'; nl++) {
+		/* Feed the input to the MIME parser upto each
+		 * newline followed by a dot.
+		 */
+		for (start = nl; (nl = strchr(nl, '\n')) != NULL; nl++) {
+			if (nl[1] != '.')
+				continue;
+
+			/* Input before the newline. */
+			(void) mimeNextBuf(ctx->mime, (unsigned char *) start, nl - start);
+			start = nl + 1;
+
 			/* Check for end-of-message. */
-			if (nl[0] == '\n' && nl[1] == '.') {
-				if (nl[2] == '\n')
-					ctx->is_dot = STRLEN(DOT_LF);
-				else if (nl[2] == '\r' && nl[3] == '\n')
-					ctx->is_dot = STRLEN(DOT_CRLF);
-				else
-					continue;
-
-				/* Shorten the input length. */
-				ctx->input.length = nl - ctx->input.data + 1;
-				break;
-			}
+			if (nl[2] == '\n')
+				ctx->is_dot = STRLEN(DOT_LF);
+			else if (nl[2] == '\r' && nl[3] == '\n')
+				ctx->is_dot = STRLEN(DOT_CRLF);
+			else
+				continue;
 
-			mimeNextCh(ctx->mime, *nl);
+			/* Shorten the input length. */
+			ctx->input.length = nl - ctx->input.data + 1;
+			break;
 		}
+		if (nl == NULL)
+			(void) mimeNextBuf(ctx->mime, (unsigned char *) start, strlen(start));
 	}
 
 	/* Update the input size for pipeline handling. */
@@ -610,6 +610,27 @@ socket3_server(SocketAddress *addr, int is_stream, int queue_size)
 	return fd;
 }
 
+SOCKET
+socket3_server_reuse(SocketAddress *addr, int is_stream, int queue_size)
+{
+	SOCKET fd;
+	int on = 1;
+
+	if ((fd = socket3_open(addr, is_stream)) != SOCKET_ERROR) {
+		if (socket3_set_reuse(fd, 1)
+#if defined(SO_REUSEPORT) && defined(SO_REUSEADDR)
+		|| setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, (char *) &on, sizeof (on))
+#endif
+		|| socket3_bind(fd, addr) == SOCKET_ERROR
+		|| (is_stream && listen(fd, queue_size) < 0)) {
+			socket3_close(fd);
+			fd = SOCKET_ERROR;
+		}
+	}
+
+	return fd;
+}
+
 /**
  * Wait for TCP client connections on this server socket.
  *
@@ -168,6 +168,7 @@ error1:
 }
 #elif defined(HAVE_EPOLL_CREATE)
 {
+	int j, n = 0;
 	SOCKET ev_fd;
 	struct epoll_event *set, pre_assigned_set[PRE_ASSIGNED_SET_SIZE];
 
@@ -184,10 +185,14 @@ error1:
 	is_input = is_input ? EPOLLIN : EPOLLOUT;
 
 	for (i = 0; i < fd_length; i++) {
-		set[i].data.fd = fd_table[i];
+		/* epoll_wait() returns only the ready events packed at
+		 * the front of the set, so remember the table index.
+		 */
+		set[i].data.u32 = i;
 		set[i].events = is_input | EPOLLERR | EPOLLHUP;
 		if (epoll_ctl(ev_fd, EPOLL_CTL_ADD, fd_table[i], &set[i]))
 			goto error2;
+		fd_ready[i] = INVALID_SOCKET;
 	}
 
 	if (timeout < 0)
@@ -198,9 +203,9 @@ error1:
 		pthread_testcancel();
 
 		/* Wait for some I/O or timeout. */
-		if (0 < (i = epoll_wait(ev_fd, set, fd_length, timeout))) {
+		if (0 < (n = epoll_wait(ev_fd, set, fd_length, timeout))) {
 			errno = 0;
-		} else if (i == 0) {
+		} else if (n == 0) {
 			errno = ETIMEDOUT;
 		} else if (errno == EINTR && timeout != INFTIM) {
 			/* Adjust the timeout in the event of I/O interrupt. */
@@ -214,21 +219,19 @@ error1:
 		}
 	} while (errno == EINTR);
 
-	for (i = 0; i < fd_length; i++) {
-		if (set[i].events & (EPOLLIN|EPOLLOUT)) {
+	for (j = 0; j < n; j++) {
+		i = set[j].data.u32;
+		if (set[j].events & (EPOLLIN|EPOLLOUT)) {
 			/* Report which sockets are ready. */
 			fd_ready[i] = fd_table[i];
-		} else if ((set[i].events & ~(EPOLLIN|EPOLLOUT)) == 0) {
-			/* Report which sockets are NOT ready. */
-			fd_ready[i] = INVALID_SOCKET;
 		} else {
 			fd_ready[i] = ERROR_SOCKET;
 
 			if (errno == 0) {
 				/* Did something else happen? */
-				if (set[i].events & EPOLLHUP)
+				if (set[j].events & EPOLLHUP)
 					errno = EPIPE;
-				else if (set[i].events & EPOLLERR)
+				else if (set[j].events & EPOLLERR)
 					errno = EIO;
 			}
 		}
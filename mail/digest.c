@@ -0,0 +1,444 @@
+/*
+ * digest.c
+ *
+ * Single pass MIME part digests.
+ *
+ * Copyright 2026 by Anthony Howe. All rights reserved.
+ */
+
+#ifndef DIGEST_BUFFER_SIZE
+#define DIGEST_BUFFER_SIZE	256
+#endif
+
+/***********************************************************************
+ *** No configuration below this point.
+ ***********************************************************************/
+
+#include <com/snert/lib/version.h>
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <com/snert/lib/mail/mime.h>
+#include <com/snert/lib/mail/digest.h>
+#include <com/snert/lib/util/ixhash.h>
+#include <com/snert/lib/util/md5.h>
+
+#if defined(HAVE_SHA2_H)
+# include <sha2.h>
+#elif defined(HAVE_SHA1_H)
+# include <sha1.h>
+#endif
+
+/***********************************************************************
+ *** DKIM body canonicalisation
+ ***********************************************************************/
+
+/*
+ * The strongest DKIM body hash available, same as dkim-hash.c.
+ */
+#if defined(HAVE_SHA2_H)
+const char digestDkimHash[] = "sha256";
+# define DKIM_CTX			SHA256_CTX
+# define DKIM_DIGEST_LENGTH		SHA256_DIGEST_LENGTH
+# define DKIM_INIT(ctx)			SHA256_Init(ctx)
+# define DKIM_UPDATE(ctx, s, n)		SHA256_Update(ctx, s, n)
+# define DKIM_FINAL(ctx, digest)	SHA256_Final(digest, ctx)
+#elif defined(HAVE_SHA1_H)
+const char digestDkimHash[] = "sha1";
+# define DKIM_CTX			SHA1_CTX
+# define DKIM_DIGEST_LENGTH		SHA1_DIGEST_LENGTH
+# define DKIM_INIT(ctx)			SHA1Init(ctx)
+# define DKIM_UPDATE(ctx, s, n)		SHA1Update(ctx, s, n)
+# define DKIM_FINAL(ctx, digest)	SHA1Final(digest, ctx)
+#else
+const char digestDkimHash[] = "md5";
+# define DKIM_CTX			md5_state_t
+# define DKIM_DIGEST_LENGTH		16
+# define DKIM_INIT(ctx)			md5_init(ctx)
+# define DKIM_UPDATE(ctx, s, n)		md5_append(ctx, s, (int) (n))
+# define DKIM_FINAL(ctx, digest)	md5_finish(ctx, digest)
+#endif
+
+/*
+ * Rather than save and restore the hash context at each line, as
+ * dkim-hash.c does, count the pending CRLF and hold white space
+ * until the next octet shows whether they are part of the body.
+ */
+typedef struct {
+	DKIM_CTX ctx;
+	unsigned long crlf;			/* Pending empty lines. */
+	int cr;					/* Pending CR, maybe a CRLF. */
+	int wsp;				/* Pending white space, relaxed. */
+	int is_relaxed;
+	int is_empty;				/* No text yet, only empty lines. */
+	size_t length;
+	unsigned char buffer[DIGEST_BUFFER_SIZE];
+} DigestDkim;
+
+static void
+dkim_init(DigestDkim *dk, int is_relaxed)
+{
+	DKIM_INIT(&dk->ctx);
+	dk->crlf = 0;
+	dk->cr = 0;
+	dk->wsp = 0;
+	dk->length = 0;
+	dk->is_empty = 1;
+	dk->is_relaxed = is_relaxed;
+}
+
+static void
+dkim_out(DigestDkim *dk, int octet)
+{
+	dk->buffer[dk->length++] = octet;
+	if (sizeof (dk->buffer) <= dk->length) {
+		DKIM_UPDATE(&dk->ctx, dk->buffer, dk->length);
+		dk->length = 0;
+	}
+}
+
+/*
+ * Output the pending lines and white space before an octet of text.
+ */
+static void
+dkim_pending(DigestDkim *dk)
+{
+	dk->is_empty = 0;
+	for ( ; 0 < dk->crlf; dk->crlf--) {
+		dkim_out(dk, ASCII_CR);
+		dkim_out(dk, ASCII_LF);
+	}
+	if (dk->wsp) {
+		dkim_out(dk, ASCII_SPACE);
+		dk->wsp = 0;
+	}
+	if (dk->cr) {
+		dkim_out(dk, ASCII_CR);
+		dk->cr = 0;
+	}
+}
+
+/*
+ * https://tools.ietf.org/html/rfc6376#section-3.4.3
+ * https://tools.ietf.org/html/rfc6376#section-3.4.4
+ */
+static void
+dkim_append(DigestDkim *dk, const unsigned char *s, size_t length)
+{
+	const unsigned char *stop;
+
+	for (stop = s + length; s < stop; s++) {
+		if (dk->cr && *s == ASCII_LF) {
+			/* Relaxed ignores white space at the end of a line. */
+			dk->cr = 0;
+			dk->wsp = 0;
+			dk->crlf++;
+			continue;
+		}
+		if (dk->cr) {
+			/* A lone CR is text. */
+			dkim_pending(dk);
+		}
+		if (*s == ASCII_CR) {
+			dk->cr = 1;
+			continue;
+		}
+		if (dk->is_relaxed && (*s == ASCII_SPACE || *s == ASCII_TAB)) {
+			/* Reduce a run of white space to a single space. */
+			dk->wsp = 1;
+			continue;
+		}
+		dkim_pending(dk);
+		dkim_out(dk, *s);
+	}
+}
+
+static void
+dkim_finish(DigestDkim *dk, char digest_string[DIGEST_DKIM_STRING_SIZE])
+{
+	size_t i;
+	unsigned char digest[DKIM_DIGEST_LENGTH];
+	static const char hex_digit[] = "0123456789abcdef";
+
+	/* Trailing empty lines become a single CRLF. A simple empty
+	 * body is a single CRLF, while a relaxed body that is empty
+	 * once trailing empty lines are ignored stays empty.
+	 */
+	if (dk->cr) {
+		dkim_pending(dk);
+	}
+	if (!dk->is_relaxed || !dk->is_empty) {
+		dkim_out(dk, ASCII_CR);
+		dkim_out(dk, ASCII_LF);
+	}
+
+	DKIM_UPDATE(&dk->ctx, dk->buffer, dk->length);
+	DKIM_FINAL(&dk->ctx, digest);
+
+	for (i = 0; i < DKIM_DIGEST_LENGTH; i++) {
+		*digest_string++ = hex_digit[(digest[i] >> 4) & 0x0F];
+		*digest_string++ = hex_digit[digest[i] & 0x0F];
+	}
+	*digest_string = '\0';
+}
+
+/***********************************************************************
+ *** MIME hooks
+ ***********************************************************************/
+
+struct digest_mime {
+	/* Must be first in structure for MIME API */
+	MimeHooks hook;
+
+	unsigned flags;
+	int is_body;
+	DigestMimeHook part_cb;
+	void *data;
+	DigestPart part;
+	md5_state_t md5_encoded;
+	md5_state_t md5_decoded;
+	DigestDkim dkim_simple;
+	DigestDkim dkim_relaxed;
+	ixhash_state ixhash;
+};
+
+static void
+digest_mime_free(Mime *m, void *_data)
+{
+	free(_data);
+}
+
+static void
+digest_mime_body_start(Mime *m, void *_data)
+{
+	DigestMime *dm = _data;
+
+	if (dm->flags & DIGEST_MD5_ENCODED)
+		md5_init(&dm->md5_encoded);
+	if (dm->flags & DIGEST_MD5_DECODED)
+		md5_init(&dm->md5_decoded);
+	if (dm->flags & DIGEST_IXHASH)
+		ixhash_init(&dm->ixhash);
+	if (dm->flags & DIGEST_DKIM_SIMPLE)
+		dkim_init(&dm->dkim_simple, 0);
+	if (dm->flags & DIGEST_DKIM_RELAXED)
+		dkim_init(&dm->dkim_relaxed, 1);
+
+	memset(&dm->part, 0, sizeof (dm->part));
+	dm->is_body = 1;
+}
+
+static void
+digest_mime_body_finish(Mime *m, void *_data)
+{
+	int i;
+	DigestMime *dm = _data;
+	md5_byte_t digest[3][16];
+	char *ixhash_string[3];
+
+	/* Once per body_start. */
+	if (!dm->is_body)
+		return;
+	dm->is_body = 0;
+
+	dm->part.part = m->mime_part_number;
+	dm->part.length = m->mime_body_length;
+	dm->part.decoded_length = m->mime_body_decoded_length;
+
+	if (dm->flags & DIGEST_MD5_ENCODED) {
+		md5_finish(&dm->md5_encoded, digest[0]);
+		md5_digest_to_string(digest[0], dm->part.md5_encoded);
+	}
+	if (dm->flags & DIGEST_MD5_DECODED) {
+		md5_finish(&dm->md5_decoded, digest[0]);
+		md5_digest_to_string(digest[0], dm->part.md5_decoded);
+	}
+	if (dm->flags & DIGEST_IXHASH) {
+		ixhash_string[0] = dm->part.ixhash1;
+		ixhash_string[1] = dm->part.ixhash2;
+		ixhash_string[2] = dm->part.ixhash3;
+		dm->part.ixhash = ixhash_finish(&dm->ixhash, digest);
+		for (i = 0; i < 3; i++)
+			md5_digest_to_string(digest[i], ixhash_string[i]);
+	}
+	if (dm->flags & DIGEST_DKIM_SIMPLE)
+		dkim_finish(&dm->dkim_simple, dm->part.dkim_simple);
+	if (dm->flags & DIGEST_DKIM_RELAXED)
+		dkim_finish(&dm->dkim_relaxed, dm->part.dkim_relaxed);
+
+	if (dm->part_cb != NULL)
+		(*dm->part_cb)(m, &dm->part, dm->data);
+}
+
+static void
+digest_mime_source_flush(Mime *m, void *_data)
+{
+	DigestMime *dm = _data;
+
+	/* Header lines are flushed too. */
+	if (!dm->is_body)
+		return;
+
+	if (dm->flags & DIGEST_MD5_ENCODED)
+		md5_append(&dm->md5_encoded, m->source.buffer, m->source.length);
+	if (dm->flags & DIGEST_DKIM_SIMPLE)
+		dkim_append(&dm->dkim_simple, m->source.buffer, m->source.length);
+	if (dm->flags & DIGEST_DKIM_RELAXED)
+		dkim_append(&dm->dkim_relaxed, m->source.buffer, m->source.length);
+}
+
+static void
+digest_mime_decode_flush(Mime *m, void *_data)
+{
+	DigestMime *dm = _data;
+
+	if (!dm->is_body)
+		return;
+
+	if (dm->flags & DIGEST_MD5_DECODED)
+		md5_append(&dm->md5_decoded, m->decode.buffer, m->decode.length);
+	if (dm->flags & DIGEST_IXHASH)
+		ixhash_append(&dm->ixhash, m->decode.buffer, m->decode.length);
+}
+
+/**
+ * @param flags
+ *	A bit mask of DIGEST_ flags selecting the digests to compute.
+ *	The digests not selected are empty strings.
+ *
+ * @param part_cb
+ *	A call-back function at the end of each MIME part body, passed
+ *	the digests of the part.
+ *
+ * @param data
+ *	Application data to be passed to the call-back.
+ *
+ * @return
+ *	A pointer to a DigestMime structure suitable for passing to
+ *	mimeHooksAdd(). The DigestMime * will have to cast to MimeHooks *.
+ *	This structure and data are freed by mimeFree().
+ */
+DigestMime *
+digestMimeInit(unsigned flags, DigestMimeHook part_cb, void *data)
+{
+	DigestMime *dm;
+
+	if ((dm = calloc(1, sizeof (*dm))) != NULL) {
+		dm->data = data;
+		dm->flags = flags;
+		dm->part_cb = part_cb;
+
+		dm->hook.data = dm;
+		dm->hook.free_hook = digest_mime_free;
+		dm->hook.body_start = digest_mime_body_start;
+		dm->hook.body_finish = digest_mime_body_finish;
+		dm->hook.source_flush = digest_mime_source_flush;
+		dm->hook.decode_flush = digest_mime_decode_flush;
+	}
+
+	return dm;
+}
+
+/***********************************************************************
+ *** CLI
+ ***********************************************************************/
+
+#ifdef TEST
+#include <stdio.h>
+#include <com/snert/lib/sys/sysexits.h>
+#include <com/snert/lib/util/getopt.h>
+
+static const char usage[] =
+"usage: digest [-f flags] file ...\n"
+"\n"
+"-f flags\tbit mask of digests; default 0x1F\n"
+"\t\t0x01 MD5 of encoded part, 0x02 MD5 of decoded part,\n"
+"\t\t0x04 ixhash, 0x08 DKIM simple, 0x10 DKIM relaxed\n"
+"\n"
+"Print the digests of each MIME part body. The DKIM body hashes are\n"
+"SHA-256 when available, else SHA-1, else MD5, in hex. A file argument\n"
+"can be hyphen (-) to indicate reading from standard input.\n"
+"\n"
+LIBSNERT_COPYRIGHT "\n"
+;
+
+static void
+print_part(Mime *m, DigestPart *part, void *data)
+{
+	(void) printf("%s part=%u length=%lu decoded=%lu", (char *) data, part->part, part->length, part->decoded_length);
+
+	if (part->md5_encoded[0] != '\0')
+		(void) printf(" md5-encoded=%s", part->md5_encoded);
+	if (part->md5_decoded[0] != '\0')
+		(void) printf(" md5-decoded=%s", part->md5_decoded);
+	if (part->ixhash1[0] != '\0')
+		(void) printf(
+			" ixhash=%d ixhash1=%s ixhash2=%s ixhash3=%s",
+			part->ixhash, part->ixhash1, part->ixhash2, part->ixhash3
+		);
+	if (part->dkim_simple[0] != '\0')
+		(void) printf(" dkim-simple=%s:%s", digestDkimHash, part->dkim_simple);
+	if (part->dkim_relaxed[0] != '\0')
+		(void) printf(" dkim-relaxed=%s:%s", digestDkimHash, part->dkim_relaxed);
+
+	(void) fputc('\n', stdout);
+}
+
+int
+main(int argc, char **argv)
+{
+	FILE *fp;
+	size_t n;
+	Mime *mime;
+	DigestMime *dm;
+	int ch, argi, ex;
+	unsigned flags = DIGEST_ALL;
+	unsigned char buffer[4096];
+
+	while ((ch = getopt(argc, argv, "f:")) != -1) {
+		switch (ch) {
+		case 'f':
+			flags = (unsigned) strtoul(optarg, NULL, 0);
+			break;
+		default:
+			(void) fputs(usage, stderr);
+			return EX_USAGE;
+		}
+	}
+
+	if (argc <= optind) {
+		(void) fputs(usage, stderr);
+		return EX_USAGE;
+	}
+
+	ex = EX_OK;
+	for (argi = optind; argi < argc; argi++) {
+		if (argv[argi][0] == '-' && argv[argi][1] == '\0') {
+			fp = stdin;
+		} else if ((fp = fopen(argv[argi], "rb")) == NULL) {
+			(void) fprintf(stderr, "%s: %s (%d)\n", argv[argi], strerror(errno), errno);
+			ex = EX_NOINPUT;
+			continue;
+		}
+
+		if ((mime = mimeCreate()) == NULL
+		|| (dm = digestMimeInit(flags, print_part, argv[argi])) == NULL) {
+			(void) fprintf(stderr, "%s (%d)\n", strerror(errno), errno);
+			return EX_OSERR;
+		}
+		mimeHooksAdd(mime, (MimeHooks *) dm);
+
+		while (0 < (n = fread(buffer, 1, sizeof (buffer), fp)))
+			(void) mimeNextBuf(mime, buffer, n);
+		(void) mimeNextCh(mime, EOF);
+
+		mimeFree(mime);
+		if (fp != stdin)
+			(void) fclose(fp);
+	}
+
+	return ex;
+}
+#endif /* TEST */
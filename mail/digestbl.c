@@ -23,10 +23,10 @@
 #include <com/snert/lib/io/Log.h>
 #include <com/snert/lib/io/socket2.h>
 #include <com/snert/lib/net/pdq.h>
+#include <com/snert/lib/mail/digest.h>
 #include <com/snert/lib/mail/mime.h>
 #include <com/snert/lib/mail/tlds.h>
 #include <com/snert/lib/type/Vector.h>
-#include <com/snert/lib/util/md5.h>
 #include <com/snert/lib/util/getopt.h>
 #include <com/snert/lib/util/Text.h>
 
@@ -37,9 +37,7 @@
 typedef struct {
 	MimeHooks hook;
 	Mime *mime;
-	md5_state_t md5;
 	char content_type[80];
-	char digest_string[33];
 	const char *digest_found;
 } Digest;
 
@@ -201,45 +199,24 @@ digestHeaders(Mime *m, void *data)
 }
 
 static void
-digestMimePartStart(Mime *m, void *data)
+digestMimePart(Mime *m, DigestPart *part, void *data)
 {
 	Digest *ctx = data;
 
-	md5_init(&ctx->md5);
-	digestHeaders(m, data);
-}
-
-static void
-digestMimePartFinish(Mime *m, void *data)
-{
-	Digest *ctx = data;
-	unsigned char digest[16];
-
-	md5_finish(&ctx->md5, (md5_byte_t *) digest);
-	md5_digest_to_string(digest, ctx->digest_string);
+	printf("part=%u type=%s digest=%s ", part->part, ctx->content_type, part->md5_decoded);
 
-	printf("part=%u type=%s digest=%s ", m->mime_part_number, ctx->content_type, ctx->digest_string);
-
-	if ((ctx->digest_found = dnsListLookup(dns_bl_list, ctx->digest_string)) != NULL) {
+	if ((ctx->digest_found = dnsListLookup(dns_bl_list, part->md5_decoded)) != NULL) {
 		printf("list=%s\n", ctx->digest_found);
 	} else {
 		printf("\n");
 	}
 }
 
-static void
-digestMimeDecodedOctet(Mime *m, int octet, void *data)
-{
-	Digest *ctx = data;
-	unsigned char byte = octet;
-
-	md5_append(&ctx->md5, (md5_byte_t *) &byte, 1);
-}
-
 int
 main(int argc, char **argv)
 {
 	int ch;
+	DigestMime *dm;
 
 	while ((ch = getopt(argc, argv, "d:v")) != -1) {
 		switch (ch) {
@@ -266,13 +243,16 @@ main(int argc, char **argv)
 		exit(1);
 	}
 
+	if ((dm = digestMimeInit(DIGEST_MD5_DECODED, digestMimePart, &digest)) == NULL) {
+		fprintf(stderr, "digestMimeInit error: %s (%d)\n", strerror(errno), errno);
+		exit(1);
+	}
+
 	digest.hook.data = &digest;
 	digest.hook.header = digestHeaders;
-	digest.hook.body_start = digestMimePartStart;
-	digest.hook.body_finish = digestMimePartFinish;
-	digest.hook.decoded_octet = digestMimeDecodedOctet;
 
 	mimeHooksAdd(digest.mime, (MimeHooks *)&digest.hook);
+	mimeHooksAdd(digest.mime, (MimeHooks *) dm);
 	mimeReset(digest.mime);
 
 	while ((ch = fgetc(stdin)) != EOF) {
@@ -280,7 +260,7 @@ main(int argc, char **argv)
 			break;
 	}
 
-	digestMimePartFinish(digest.mime, &digest);
+	(void) mimeNextCh(digest.mime, EOF);
 	mimeFree(digest.mime);
 
 	return 0;
@@ -45,11 +45,17 @@ greyListSetDebug(long flags)
 	debug = flags;
 }
 
+static void
+greyListCacheCopy(Data value, void *data)
+{
+	if (value->length(value) == sizeof (GreyListEntry))
+		*(GreyListEntry *) data = *(GreyListEntry *)(value->base(value));
+}
+
 int
 greyListCacheGet(GreyList *grey, char *name, GreyListEntry *entry)
 {
 	int rc;
-	Data value;
 	struct data key;
 
 	rc = -1;
@@ -57,22 +63,18 @@ greyListCacheGet(GreyList *grey, char *name, GreyListEntry *entry)
 	DataInitWithBytes(&key, (unsigned char *) name, strlen(name)+1);
 
 #if defined(HAVE_PTHREAD_CREATE)
-	if (pthread_mutex_lock(grey->mutex))
+	if (grey->mutex != NULL && pthread_mutex_lock(grey->mutex))
 		syslog(LOG_ERR, "mutex lock in greyListCacheGet() failed: %s (%d) ", strerror(errno), errno);
 #endif
-	value = grey->cache->get(grey->cache, &key);
+	/* Copy the entry straight out of the cache, without a Data copy. */
+	(void) grey->cache->lookup(grey->cache, &key, greyListCacheCopy, entry);
 
 #if defined(HAVE_PTHREAD_CREATE)
-	if (pthread_mutex_unlock(grey->mutex))
+	if (grey->mutex != NULL && pthread_mutex_unlock(grey->mutex))
 		syslog(LOG_ERR, "mutex unlock in greyListCacheGet() failed: %s (%d) ", strerror(errno), errno);
 #endif
-	if (value != NULL) {
-		if (value->length(value) == sizeof (GreyListEntry)) {
-			*entry = *(GreyListEntry *)(value->base(value));
-			rc = 0;
-		}
-		value->destroy(value);
-	}
+	if (entry->status != GREY_LIST_STATUS_UNKNOWN)
+		rc = 0;
 
 	if (debug)
 		syslog(LOG_DEBUG, "cache get key={%s} value={" GREY_PRINTF_FORMAT "} rc=%d", name, GREY_PRINTF_ARROW(entry), rc);
@@ -90,13 +92,13 @@ greyListCachePut(GreyList *grey, char *name, GreyListEntry *entry)
 	DataInitWithBytes(&value, (unsigned char *) entry, sizeof (*entry));
 
 #if defined(HAVE_PTHREAD_CREATE)
-	if (pthread_mutex_lock(grey->mutex))
+	if (grey->mutex != NULL && pthread_mutex_lock(grey->mutex))
 		syslog(LOG_ERR, "mutex lock in greyListCachePut() failed: %s (%d) ", strerror(errno), errno);
 #endif
 	rc = grey->cache->put(grey->cache, &key, &value);
 
 #if defined(HAVE_PTHREAD_CREATE)
-	if (pthread_mutex_unlock(grey->mutex))
+	if (grey->mutex != NULL && pthread_mutex_unlock(grey->mutex))
 		syslog(LOG_ERR, "mutex unlock in greyListCachePut() failed: %s (%d) ", strerror(errno), errno);
 #endif
 	if (debug)
@@ -189,6 +189,12 @@ mimeDecodeAppend(Mime *m, int ch)
 	if (ch != EOF) {
 		m->mime_body_decoded_length++;
 		m->decode.buffer[m->decode.length++] = ch;
+	} else {
+		/* Let decode_flush and body_finish hooks know that the
+		 * decoded_octet hooks saw EOF, which is not always the
+		 * case for a base64 body at the end of the message.
+		 */
+		m->state.decode_eof = 1;
 	}
 
 	/* Flush the decode buffer on a line unit or when full. */
@@ -335,6 +341,7 @@ void
 mimeBodyStart(Mime *m)
 {
 	LOGHOOK(m);
+	m->state.decode_eof = 0;
 	mimeDoHook(m, offsetof(MimeHooks, body_start));
 }
 
@@ -883,6 +890,7 @@ mimeReset(Mime *m)
 		mimeHeadersFirst(m, 1);
 		m->state.decode_state_cr = 0;
 		m->state.decode_state = mimeDecodeAdd;
+		m->state.decode_eof = 0;
 
 		mimeSourceFlush(m);
 		mimeDecodeFlush(m);
@@ -1055,6 +1063,190 @@ mimeNextCh(Mime *m, int ch)
 	return MIME_ERROR_OK;
 }
 
+static int
+mimeHasOctetHooks(Mime *m)
+{
+	MimeHooks *hook;
+
+	for (hook = m->mime_hook; hook != NULL; hook = hook->next) {
+		if (hook->source_octet != NULL || hook->decoded_octet != NULL)
+			return 1;
+	}
+
+	return 0;
+}
+
+static int
+mimeIsBlockState(Mime *m)
+{
+	return !m->state.decode_state_cr && (
+		   m->state.decode_state == mimeDecodeAdd
+		|| m->state.decode_state == mimeStateBase64
+		|| m->state.decode_state == mimeStateQpLiteral
+		|| m->state.decode_state == mimeStateQpSoftLine
+	);
+}
+
+/*
+ * Consume a run of body octets while in mimeStateBdy, which only
+ * changes state on a newline. The run stops short of the next LF
+ * and of the point where mimeNextCh() would flush the source or
+ * decode buffer, so the hooks see the same buffers and counters at
+ * each flush.
+ *
+ * @return
+ *	The number of octets consumed; zero if the next octet must
+ *	go through mimeNextCh().
+ */
+static size_t
+mimeBodyRun(Mime *m, const unsigned char *buf, size_t length, int octet_hooks)
+{
+	unsigned char *out;
+	const unsigned char *s;
+	size_t i, n, run, space, decoded;
+
+	if (sizeof (m->source.buffer)-1 <= m->source.length)
+		return 0;
+	n = sizeof (m->source.buffer)-1 - m->source.length;
+	if (length < n)
+		n = length;
+
+	/* A newline might be followed by a boundary line. */
+	if ((s = memchr(buf, ASCII_LF, n)) != NULL)
+		n = s - buf;
+	if (n == 0)
+		return 0;
+
+	/* Without per-octet hooks, decode straight into the decode
+	 * buffer: plain copy, Base64 quanta, or quoted-printable.
+	 */
+	if (!octet_hooks && mimeIsBlockState(m) && sizeof (m->decode.buffer)-1 > m->decode.length) {
+		out = m->decode.buffer + m->decode.length;
+		space = sizeof (m->decode.buffer)-1 - m->decode.length;
+
+		if (m->state.decode_state == mimeStateBase64) {
+			run = b64DecodeBlock(&m->state.b64, buf, n, out, space);
+			decoded = run / 4 * 3;
+		} else if (m->state.decode_state == mimeDecodeAdd) {
+			run = n < space ? n : space;
+			if ((s = memchr(buf, ASCII_CR, run)) != NULL)
+				run = s - buf;
+			memcpy(out, buf, run);
+			decoded = run;
+		} else {
+			run = qpDecodeBlock(buf, n, out, space, &decoded);
+		}
+
+		/* A decoded CR is held back and a decoded LF flushes, so
+		 * stop short of either and leave it to mimeDecodeAdd().
+		 */
+		space = decoded;
+		if ((s = memchr(out, ASCII_CR, space)) != NULL)
+			space = s - out;
+		if ((s = memchr(out, ASCII_LF, space)) != NULL)
+			space = s - out;
+		if (space < decoded) {
+			if (m->state.decode_state == mimeStateBase64) {
+				decoded = space / 3 * 3;
+				run = decoded / 3 * 4;
+			} else if (m->state.decode_state != mimeDecodeAdd) {
+				run = qpDecodeBlock(buf, n, out, space, &decoded);
+			}
+		}
+
+		if (0 < run) {
+			m->mime_part_length += run;
+			m->mime_body_length += run;
+			m->mime_message_length += run;
+			m->mime_body_decoded_length += decoded;
+
+			memcpy(m->source.buffer + m->source.length, buf, run);
+			m->source.length += run;
+			m->decode.length += decoded;
+			m->decode.buffer[m->decode.length] = '\0';
+
+			/* Any =XX leaves a soft line break state. */
+			if (m->state.decode_state == mimeStateQpSoftLine && decoded < run)
+				m->state.decode_state = mimeStateQpLiteral;
+
+			if (sizeof (m->decode.buffer)-1 <= m->decode.length)
+				mimeDecodeFlush(m);
+			if (sizeof (m->source.buffer)-1 <= m->source.length)
+				mimeSourceFlush(m);
+
+			return run;
+		}
+	}
+
+	/* Otherwise skip only the per-octet checks and state dispatch,
+	 * until the decoding can continue in bulk.
+	 */
+	for (i = 0; i < n; ) {
+		m->mime_part_length++;
+		m->mime_body_length++;
+		m->mime_message_length++;
+		m->source.buffer[m->source.length++] = buf[i];
+		if (octet_hooks)
+			(void) mimeDecodeState(m, buf[i++]);
+		else
+			(void) (*m->state.decode_state)(m, buf[i++]);
+
+		if (!octet_hooks && mimeIsBlockState(m))
+			break;
+	}
+
+	if (sizeof (m->source.buffer)-1 <= m->source.length)
+		mimeSourceFlush(m);
+
+	return i;
+}
+
+/**
+ * @param m
+ *	Pointer to a Mime context structure.
+ *
+ * @param buf
+ *	A buffer of input octets to parse.
+ *
+ * @param length
+ *	The number of octets in the buffer.
+ *
+ * @return
+ *	Zero on success; otherwise non-zero on error.
+ *
+ * @note
+ *	Equivalent to calling mimeNextCh() for each octet of the buffer,
+ *	but runs of body octets are scanned and copied in bulk. Call
+ *	mimeNextCh(m, EOF) to finish the message.
+ */
+MimeErrorCode
+mimeNextBuf(Mime *m, const unsigned char *buf, size_t length)
+{
+	size_t n;
+	int octet_hooks;
+	const unsigned char *stop;
+
+	LOGVOL(2, "%s(0x%lX, 0x%lX, %lu)", __func__, (long) m, (long) buf, (unsigned long) length);
+
+	if (m == NULL || (buf == NULL && 0 < length)) {
+		errno = EFAULT;
+		return MIME_ERROR_NULL;
+	}
+
+	octet_hooks = mimeHasOctetHooks(m);
+
+	for (stop = buf + length; buf < stop; buf += n) {
+		/* Keep the per-octet trace when debugging states. */
+		if (m->state.source_state != mimeStateBdy || 2 < debug
+		|| (n = mimeBodyRun(m, buf, stop - buf, octet_hooks)) == 0) {
+			(void) mimeNextCh(m, *buf);
+			n = 1;
+		}
+	}
+
+	return MIME_ERROR_OK;
+}
+
 /***********************************************************************
  *** MIME CLI
  ***********************************************************************/
@@ -1077,6 +1269,7 @@ int extract_part = -1;
 int enable_decode;
 int enable_throw;
 int generate_md5;
+int octet_input;
 int json_dump;
 int hack_json_b64_strip_newline;
 
@@ -1084,11 +1277,12 @@ Mime *mime;
 
 
 static char usage[] =
-"usage: mime [-v][-B func] -l < message\n"
-"       mime [-v][-B func] -p num [-dem] < message\n"
-"       mime [-v][-B func] -j [-eN] < message\n"
+"usage: mime [-cv][-B func] -l < message\n"
+"       mime [-cv][-B func] -p num [-dem] < message\n"
+"       mime [-cv][-B func] -j [-eN] < message\n"
 "\n"
 "-B func\t\tboundary function rule: nospace, strict, weak\n"
+"-c\t\tparse input one octet at a time with mimeNextCh\n"
 "-d\t\tdecode base64 or quoted-printable\n"
 "-e\t\treport parsing errors\n"
 "-j\t\tJSON dump\n"
@@ -1509,15 +1703,23 @@ void
 processInput(Mime *m, FILE *fp)
 {
 	int ch;
+	size_t n;
+	unsigned char buffer[4096];
 
 	LOGTRACE();
 
 	if (fp != NULL) {
 		mimeMsgStart(m);
-		do {
-			ch = fgetc(fp);
-			(void) mimeNextCh(m, ch);
-		} while (ch != EOF);
+		if (octet_input) {
+			do {
+				ch = fgetc(fp);
+				(void) mimeNextCh(m, ch);
+			} while (ch != EOF);
+		} else {
+			while (0 < (n = fread(buffer, 1, sizeof (buffer), fp)))
+				(void) mimeNextBuf(m, buffer, n);
+			(void) mimeNextCh(m, EOF);
+		}
 		(void) fflush(stdout);
 		mimeMsgFinish(m);
 	}
@@ -1557,8 +1759,11 @@ main(int argc, char **argv)
 	MimeHooks hook;
 	MimeBoundary *mb;
 
-	while ((ch = getopt(argc, argv, "B:NdejJ:lmp:v")) != -1) {
+	while ((ch = getopt(argc, argv, "B:NcdejJ:lmp:v")) != -1) {
 		switch (ch) {
+		case 'c':
+			octet_input = 1;
+			break;
 		case 'd':
 			enable_decode = 1;
 			break;
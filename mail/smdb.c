@@ -51,6 +51,8 @@ Option smdbOptDebug	= { "smdb-debug", 	"-", "Enable debugging of smdb routines."
 Option smdbOptKeyHasNul	= { "smdb-key-has-nul",	"-",  usage_smdb_key_has_nul };
 Option smdbOptUseStat	= { "smdb-use-stat",	"-", "Use stat() instead of fstat() to monitor .db file updates; experimental." };
 Option smdbOptRelayOk	= { "smdb-relay-ok",	"-", "Treat a RELAY value same as OK (white-list), else is unknown." };
+Option smdbOptCacheSize	= { "smdb-cache-size",	"4096", "Number of recent lookups, found or not, to remember per file based map; 0 to disable. Socket maps are not cached." };
+Option smdbOptCacheTtl	= { "smdb-cache-ttl",	"60", "Seconds to remember a lookup. A map file that is updated or replaced is noticed within a second." };
 
 Option *smdbOptTable[] = {
 	SMDB_OPTIONS_TABLE,
@@ -230,18 +232,57 @@ tagInvalid(const char *tag1, const char *tag2)
 	return str;
 }
 
+/*
+ * Enough of a value for smdbAccessCode() and debug logging.
+ */
+#define SMDB_HEAD_SIZE		64
+
+typedef struct {
+	char **valuep;
+	smdb_code code;
+	char head[SMDB_HEAD_SIZE];
+} smdbFound;
+
+/*
+ * Called by the kvm lookup method with the value still owned by the
+ * map. Only when the caller wants the value is a copy made.
+ */
+static void
+smdbFoundValue(kvm_data *value, void *data)
+{
+	size_t length;
+	smdbFound *found = data;
+
+	length = value->size < sizeof (found->head) ? value->size : sizeof (found->head)-1;
+	memcpy(found->head, value->data, length);
+	found->head[length] = '\0';
+	found->code = smdbAccessCode(found->head);
+
+	if (found->valuep != NULL && (*found->valuep = malloc(value->size + 1)) != NULL) {
+		memcpy(*found->valuep, value->data, value->size);
+		(*found->valuep)[value->size] = '\0';
+	}
+}
+
+/*
+ * Either valuep or codep may be NULL. When only the code is wanted,
+ * the value is inspected in place within the map and never copied.
+ */
 static smdb_result
-singleKey(smdb *sm, char **keyp, char **valuep, const char *tag1, const char *key1, int (*reduceKey)(size_t prefix, kvm_data *key))
+singleKey(smdb *sm, char **keyp, char **valuep, smdb_code *codep, const char *tag1, const char *key1, int (*reduceKey)(size_t prefix, kvm_data *key))
 {
 	char *str;
-	kvm_data k, v;
+	kvm_data k;
 	smdb_result rc;
+	smdbFound found;
 	int span, plus_sign;
 	size_t tag1_len, key1_len, str_len;
 
-	*valuep = NULL;
+	if (valuep != NULL)
+		*valuep = NULL;
 	if (keyp != NULL)
 		*keyp = NULL;
+	found.valuep = valuep;
 	rc = SMDB_ERROR;
 
 #ifndef TEST
@@ -305,24 +346,29 @@ singleKey(smdb *sm, char **keyp, char **valuep, const char *tag1, const char *ke
 		k.data[k.size] = '\0';
 #ifdef TEST
 		printf("size=%lu data=\"%s\"\n", k.size, k.data);
-#else
-		memset(&v, 0, sizeof (v));
+		if (sm == NULL)
+			continue;
+#endif
+		found.head[0] = '\0';
 
-		rc = (smdb_result) sm->fetch(sm, &k, &v);
+		rc = (smdb_result) sm->lookup(sm, &k, smdbFoundValue, &found);
 		if (1 < smdbOptDebug.value)
-			syslog(LOG_DEBUG, log_lookup, sm->_table, k.size, k.data, TextEmpty((char *) v.data));
+			syslog(LOG_DEBUG, log_lookup, sm->_table, k.size, k.data, found.head);
 		if (rc == SMDB_ERROR)
 			break;
 		if (rc == SMDB_OK) {
+			if (valuep != NULL && *valuep == NULL) {
+				rc = SMDB_ERROR;
+				break;
+			}
 			if (0 < smdbOptDebug.value)
-				syslog(LOG_DEBUG, log_found, sm->_table, k.size, k.data, TextEmpty((char *) v.data));
+				syslog(LOG_DEBUG, log_found, sm->_table, k.size, k.data, found.head);
 			if (keyp != NULL)
 				*keyp = strdup((char *) k.data);
-			*valuep = (char *) v.data;
+			if (codep != NULL)
+				*codep = found.code;
 			break;
 		}
-		free(v.data);
-#endif
 	} while ((*reduceKey)(tag1_len, &k));
 
 	free(str);
@@ -330,20 +376,24 @@ error0:
 	if (rc == SMDB_ERROR) {
 		if (keyp != NULL)
 			*keyp = tagInvalid(tag1, NULL);
-		*valuep = strdup("TEMPFAIL");
+		if (valuep != NULL)
+			*valuep = strdup("TEMPFAIL");
+		if (codep != NULL)
+			*codep = smdbAccessCode("TEMPFAIL");
 	}
 	return rc;
 }
 
 static smdb_result
-doubleKey(smdb *sm, char **keyp, char **valuep, const char *tag1, const char *key1,  int (*reduce1)(size_t, kvm_data *), const char *tag2, const char *key2,  int (*reduce2)(size_t, kvm_data *))
+doubleKey(smdb *sm, char **keyp, char **valuep, smdb_code *codep, const char *tag1, const char *key1,  int (*reduce1)(size_t, kvm_data *), const char *tag2, const char *key2,  int (*reduce2)(size_t, kvm_data *))
 {
 	char *str;
 	kvm_data k;
 	smdb_result rc;
 	size_t tag1_len, key1_len, tag2_len, str_len;
 
-	*valuep = NULL;
+	if (valuep != NULL)
+		*valuep = NULL;
 	if (keyp != NULL)
 		*keyp = NULL;
 	rc = SMDB_ERROR;
@@ -387,7 +437,7 @@ doubleKey(smdb *sm, char **keyp, char **valuep, const char *tag1, const char *ke
 		memcpy(k.data + k.size, tag2, tag2_len + 1);
 		k.size += tag2_len;
 
-		if ((rc = singleKey(sm, keyp, valuep, (char *) k.data, key2, reduce2)) != SMDB_NOT_FOUND)
+		if ((rc = singleKey(sm, keyp, valuep, codep, (char *) k.data, key2, reduce2)) != SMDB_NOT_FOUND)
 			break;
 
 		/* Remove :tag2: before reducing tag1:key1. */
@@ -396,48 +446,38 @@ doubleKey(smdb *sm, char **keyp, char **valuep, const char *tag1, const char *ke
 	} while ((*reduce1)(tag1_len, &k));
 
 	free(str);
+
+	/* singleKey() has already reported any error. */
+	return rc;
 error0:
-	if (rc == SMDB_ERROR && *valuep == NULL) {
-		if (keyp != NULL)
-			*keyp = tagInvalid(tag1, tag2);
+	if (keyp != NULL)
+		*keyp = tagInvalid(tag1, tag2);
+	if (valuep != NULL)
 		*valuep = strdup("TEMPFAIL");
-	}
+	if (codep != NULL)
+		*codep = smdbAccessCode("TEMPFAIL");
 	return rc;
 }
 
 static smdb_code
 singleKeyGetCode(smdb *sm, char **keyp, char **valuep, const char *tag1, const char *key1,  int (*reduce1)(size_t, kvm_data *))
 {
-	char *value;
 	smdb_code code;
 
-	if (singleKey(sm, keyp, &value, tag1, key1, reduce1) == SMDB_NOT_FOUND)
+	if (singleKey(sm, keyp, valuep, &code, tag1, key1, reduce1) == SMDB_NOT_FOUND)
 		return SMDB_ACCESS_NOT_FOUND;
 
-	code = smdbAccessCode(value);
-	if (valuep != NULL)
-		*valuep = value;
-	else
-		free(value);
-
 	return code;
 }
 
 static smdb_code
 doubleKeyGetCode(smdb *sm, char **keyp, char **valuep, const char *tag1, const char *key1,  int (*reduce1)(size_t, kvm_data *), const char *tag2, const char *key2,  int (*reduce2)(size_t, kvm_data *))
 {
-	char *value;
 	smdb_code code;
 
-	if (doubleKey(sm, keyp, &value, tag1, key1, reduce1, tag2, key2, reduce2) == SMDB_NOT_FOUND)
+	if (doubleKey(sm, keyp, valuep, &code, tag1, key1, reduce1, tag2, key2, reduce2) == SMDB_NOT_FOUND)
 		return SMDB_ACCESS_NOT_FOUND;
 
-	code = smdbAccessCode(value);
-	if (valuep != NULL)
-		*valuep = value;
-	else
-		free(value);
-
 	return code;
 }
 
@@ -454,7 +494,7 @@ smdbSetDebug(int level)
 void
 smdbSetKeyHasNul(smdb *sm, int flag)
 {
-	if (sm != NULL) {
+	if ((sm = kvmCacheMap(sm)) != NULL) {
 		if (flag)
 			sm->_mode |= KVM_MODE_KEY_HAS_NUL;
 		else
@@ -473,7 +513,7 @@ smdbClose(void *sm)
 smdb *
 smdbOpen(const char *dbfile, int rdonly)
 {
-	smdb *sm;
+	smdb *sm, *cached;
 	int mode = 0;
 	char *table, *delim, *file;
 
@@ -523,6 +563,14 @@ smdbOpen(const char *dbfile, int rdonly)
 	smdbSetKeyHasNul(sm, smdbOptKeyHasNul.value);
 	free(file);
 
+	/* Only a map backed by a file can tell the cache when it
+	 * changes; a socketmap server's answers could go stale.
+	 */
+	if (0 < smdbOptCacheSize.value && 0 < smdbOptCacheTtl.value
+	&& sm->filepath(sm) != NULL
+	&& (cached = kvmCacheOpen(sm, smdbOptCacheSize.value, smdbOptCacheTtl.value)) != NULL)
+		sm = cached;
+
 	return sm;
 error1:
 	free(file);
@@ -1168,6 +1216,163 @@ smdbAccessMail2(smdb *sm, const char *tag, const char *mail, char **keyp, char *
  ***********************************************************************/
 
 #ifdef TEST
+#include <signal.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#define TEST_SOCKETMAP		"/tmp/smdb-test.socket"
+
+static int
+socketmapReply(int client, const char *reply)
+{
+	int length;
+	char buffer[256];
+
+	length = snprintf(buffer, sizeof (buffer), "%lu:%s,", (unsigned long) strlen(reply), reply);
+
+	return write(client, buffer, length) != length;
+}
+
+/*
+ * A minimal sendmail socketmap server that knows one access entry
+ * and refuses anything that is not a "$length:$table $key," query,
+ * in particular the kvmd GET extension.
+ */
+static void
+socketmapClient(int client)
+{
+	ssize_t n;
+	char *field, *key, *stop;
+	char request[512];
+	unsigned long length, size, used;
+
+	length = 0;
+	while (0 < (n = read(client, request+length, sizeof (request)-1-length))) {
+		length += n;
+		request[length] = '\0';
+
+		while (0 < length) {
+			size = strtoul(request, &stop, 10);
+			if (stop == request + length)
+				break;
+			if (stop == request || *stop != ':') {
+				(void) socketmapReply(client, "PERM invalid request");
+				length = 0;
+				break;
+			}
+			field = stop + 1;
+			used = field - request + size + 1;
+			if (length < used)
+				break;
+			if (field[size] != ',') {
+				(void) socketmapReply(client, "PERM invalid request");
+				length = 0;
+				break;
+			}
+			field[size] = '\0';
+
+			if ((key = strchr(field, ' ')) == NULL) {
+				(void) socketmapReply(client, "PERM not a socketmap query");
+			} else {
+				*key++ = '\0';
+				if (strcmp(field, "access") == 0 && strcmp(key, "connect:192.0.2") == 0)
+					(void) socketmapReply(client, "OK REJECT");
+				else
+					(void) socketmapReply(client, "NOTFOUND");
+			}
+
+			length -= used;
+			memmove(request, request + used, length);
+			request[length] = '\0';
+		}
+
+		if (sizeof (request)-1 <= length)
+			break;
+	}
+}
+
+/*
+ * The kvm socketmap client spreads requests over a pool of
+ * connections, so serve each one in its own process.
+ */
+static void
+socketmapServe(int listener)
+{
+	int client;
+
+	while (0 <= (client = accept(listener, NULL, NULL))) {
+		if (fork() == 0) {
+			(void) close(listener);
+			socketmapClient(client);
+			_exit(0);
+		}
+		(void) close(client);
+	}
+}
+
+static int
+socketmapCheck(smdb *sm, const char *ip, smdb_code expect, const char *expect_key)
+{
+	smdb_code code;
+	char *key, *value;
+	int failed;
+
+	code = smdbAccessIp(sm, "connect:", ip, &key, &value);
+	failed = code != expect || (expect_key != NULL && (key == NULL || strcmp(key, expect_key) != 0));
+	printf("%s code=%c key=%s value=%s\n", failed ? "FAIL" : "OK", code, TextNull(key), TextNull(value));
+	free(value);
+	free(key);
+
+	return failed;
+}
+
+static int
+socketmapTest(void)
+{
+	smdb *sm;
+	pid_t child;
+	int listener, failed;
+	struct sockaddr_un addr;
+
+	failed = 1;
+	(void) unlink(TEST_SOCKETMAP);
+
+	memset(&addr, 0, sizeof (addr));
+	addr.sun_family = AF_UNIX;
+	TextCopy(addr.sun_path, sizeof (addr.sun_path), TEST_SOCKETMAP);
+
+	if ((listener = socket(AF_UNIX, SOCK_STREAM, 0)) < 0)
+		goto error0;
+	if (bind(listener, (struct sockaddr *) &addr, sizeof (addr)) || listen(listener, 5))
+		goto error1;
+
+	(void) fflush(stdout);
+	if ((child = fork()) < 0)
+		goto error1;
+	if (child == 0) {
+		socketmapServe(listener);
+		_exit(0);
+	}
+	(void) close(listener);
+	listener = -1;
+
+	if ((sm = smdbOpen("access" KVM_DELIM_S "socketmap" KVM_DELIM_S TEST_SOCKETMAP, 1)) != NULL) {
+		failed = socketmapCheck(sm, "192.0.2.1", SMDB_ACCESS_REJECT, "connect:192.0.2");
+		failed |= socketmapCheck(sm, "198.51.100.1", SMDB_ACCESS_NOT_FOUND, NULL);
+		smdbClose(sm);
+	}
+
+	(void) kill(child, SIGTERM);
+	(void) waitpid(child, NULL, 0);
+error1:
+	if (0 <= listener)
+		(void) close(listener);
+	(void) unlink(TEST_SOCKETMAP);
+error0:
+	return failed;
+}
+
 int
 main(int argc, char **argv)
 {
@@ -1250,60 +1455,62 @@ main(int argc, char **argv)
 
 	printf("\n---- double keys (host1:host2:) ----\n\n");
 
-	doubleKey(NULL, NULL, NULL, "host1:", "123.45.67.89", reduceIp, SMDB_COMBO_TAG_DELIM "host2:", "192.0.2.1", reduceIp);
-	doubleKey(NULL, NULL, NULL, "host1:", "123.45.67.89", reduceIp, SMDB_COMBO_TAG_DELIM "host2:", "a:b:c:d:e:f:g", reduceIp);
-	doubleKey(NULL, NULL, NULL, "host1:", "123.45.67.89", reduceIp, SMDB_COMBO_TAG_DELIM "host2:", "ipv6:a:b:c:d:e:f:g", reduceIp);
-	doubleKey(NULL, NULL, NULL, "host1:", "123.45.67.89", reduceIp, SMDB_COMBO_TAG_DELIM "host2:", "ipv6:2001:0DB8::1234:5678", reduceIp);
-	doubleKey(NULL, NULL, NULL, "host1:", "123.45.67.89", reduceIp, SMDB_COMBO_TAG_DELIM "host2:", "ipv6:2001:0DB8::FFFF:123.45.67.89", reduceIp);
-	doubleKey(NULL, NULL, NULL, "host1:", "123.45.67.89", reduceIp, SMDB_COMBO_TAG_DELIM "host2:", "[123.45.67.89]", reduceDomain);
-	doubleKey(NULL, NULL, NULL, "host1:", "123.45.67.89", reduceIp, SMDB_COMBO_TAG_DELIM "host2:", "[ipv6:a:b:c:d:e:f:g]", reduceDomain);
-	doubleKey(NULL, NULL, NULL, "host1:", "123.45.67.89", reduceIp, SMDB_COMBO_TAG_DELIM "host2:", "sub.domain.tld", reduceDomain);
-
-	doubleKey(NULL, NULL, NULL, "host1:", "a:b:c:d:e:f:g", reduceIp, SMDB_COMBO_TAG_DELIM "host2:", "192.0.2.1", reduceIp);
-	doubleKey(NULL, NULL, NULL, "host1:", "a:b:c:d:e:f:g", reduceIp, SMDB_COMBO_TAG_DELIM "host2:", "a:b:c:d:e:f:g", reduceIp);
-	doubleKey(NULL, NULL, NULL, "host1:", "a:b:c:d:e:f:g", reduceIp, SMDB_COMBO_TAG_DELIM "host2:", "ipv6:a:b:c:d:e:f:g", reduceIp);
-	doubleKey(NULL, NULL, NULL, "host1:", "a:b:c:d:e:f:g", reduceIp, SMDB_COMBO_TAG_DELIM "host2:", "ipv6:2001:0DB8::1234:5678", reduceIp);
-	doubleKey(NULL, NULL, NULL, "host1:", "a:b:c:d:e:f:g", reduceIp, SMDB_COMBO_TAG_DELIM "host2:", "ipv6:2001:0DB8::FFFF:123.45.67.89", reduceIp);
-	doubleKey(NULL, NULL, NULL, "host1:", "a:b:c:d:e:f:g", reduceIp, SMDB_COMBO_TAG_DELIM "host2:", "[123.45.67.89]", reduceDomain);
-	doubleKey(NULL, NULL, NULL, "host1:", "a:b:c:d:e:f:g", reduceIp, SMDB_COMBO_TAG_DELIM "host2:", "[ipv6:a:b:c:d:e:f:g]", reduceDomain);
-	doubleKey(NULL, NULL, NULL, "host1:", "a:b:c:d:e:f:g", reduceIp, SMDB_COMBO_TAG_DELIM "host2:", "sub.domain.tld", reduceDomain);
-
-	doubleKey(NULL, NULL, NULL, "host1:", "ipv6:a:b:c:d:e:f:g", reduceIp, SMDB_COMBO_TAG_DELIM "host2:", "192.0.2.1", reduceIp);
-	doubleKey(NULL, NULL, NULL, "host1:", "ipv6:a:b:c:d:e:f:g", reduceIp, SMDB_COMBO_TAG_DELIM "host2:", "a:b:c:d:e:f:g", reduceIp);
-	doubleKey(NULL, NULL, NULL, "host1:", "ipv6:a:b:c:d:e:f:g", reduceIp, SMDB_COMBO_TAG_DELIM "host2:", "ipv6:a:b:c:d:e:f:g", reduceIp);
-	doubleKey(NULL, NULL, NULL, "host1:", "ipv6:a:b:c:d:e:f:g", reduceIp, SMDB_COMBO_TAG_DELIM "host2:", "ipv6:2001:0DB8::1234:5678", reduceIp);
-	doubleKey(NULL, NULL, NULL, "host1:", "ipv6:a:b:c:d:e:f:g", reduceIp, SMDB_COMBO_TAG_DELIM "host2:", "ipv6:2001:0DB8::FFFF:123.45.67.89", reduceIp);
-	doubleKey(NULL, NULL, NULL, "host1:", "ipv6:a:b:c:d:e:f:g", reduceIp, SMDB_COMBO_TAG_DELIM "host2:", "[123.45.67.89]", reduceDomain);
-	doubleKey(NULL, NULL, NULL, "host1:", "ipv6:a:b:c:d:e:f:g", reduceIp, SMDB_COMBO_TAG_DELIM "host2:", "[ipv6:a:b:c:d:e:f:g]", reduceDomain);
-	doubleKey(NULL, NULL, NULL, "host1:", "ipv6:a:b:c:d:e:f:g", reduceIp, SMDB_COMBO_TAG_DELIM "host2:", "sub.domain.tld", reduceDomain);
-
-	doubleKey(NULL, NULL, NULL, "host1:", "[123.45.67.89]", reduceDomain, SMDB_COMBO_TAG_DELIM "host2:", "192.0.2.1", reduceIp);
-	doubleKey(NULL, NULL, NULL, "host1:", "[123.45.67.89]", reduceDomain, SMDB_COMBO_TAG_DELIM "host2:", "a:b:c:d:e:f:g", reduceIp);
-	doubleKey(NULL, NULL, NULL, "host1:", "[123.45.67.89]", reduceDomain, SMDB_COMBO_TAG_DELIM "host2:", "ipv6:a:b:c:d:e:f:g", reduceIp);
-	doubleKey(NULL, NULL, NULL, "host1:", "[123.45.67.89]", reduceDomain, SMDB_COMBO_TAG_DELIM "host2:", "ipv6:2001:0DB8::1234:5678", reduceIp);
-	doubleKey(NULL, NULL, NULL, "host1:", "[123.45.67.89]", reduceDomain, SMDB_COMBO_TAG_DELIM "host2:", "ipv6:2001:0DB8::FFFF:123.45.67.89", reduceIp);
-	doubleKey(NULL, NULL, NULL, "host1:", "[123.45.67.89]", reduceDomain, SMDB_COMBO_TAG_DELIM "host2:", "[123.45.67.89]", reduceDomain);
-	doubleKey(NULL, NULL, NULL, "host1:", "[123.45.67.89]", reduceDomain, SMDB_COMBO_TAG_DELIM "host2:", "[ipv6:a:b:c:d:e:f:g]", reduceDomain);
-	doubleKey(NULL, NULL, NULL, "host1:", "[123.45.67.89]", reduceDomain, SMDB_COMBO_TAG_DELIM "host2:", "sub.domain.tld", reduceDomain);
-
-	doubleKey(NULL, NULL, NULL, "host1:", "[ipv6:a:b:c:d:e:f:g]", reduceDomain, SMDB_COMBO_TAG_DELIM "host2:", "192.0.2.1", reduceIp);
-	doubleKey(NULL, NULL, NULL, "host1:", "[ipv6:a:b:c:d:e:f:g]", reduceDomain, SMDB_COMBO_TAG_DELIM "host2:", "a:b:c:d:e:f:g", reduceIp);
-	doubleKey(NULL, NULL, NULL, "host1:", "[ipv6:a:b:c:d:e:f:g]", reduceDomain, SMDB_COMBO_TAG_DELIM "host2:", "ipv6:a:b:c:d:e:f:g", reduceIp);
-	doubleKey(NULL, NULL, NULL, "host1:", "[ipv6:a:b:c:d:e:f:g]", reduceDomain, SMDB_COMBO_TAG_DELIM "host2:", "ipv6:2001:0DB8::1234:5678", reduceIp);
-	doubleKey(NULL, NULL, NULL, "host1:", "[ipv6:a:b:c:d:e:f:g]", reduceDomain, SMDB_COMBO_TAG_DELIM "host2:", "ipv6:2001:0DB8::FFFF:123.45.67.89", reduceIp);
-	doubleKey(NULL, NULL, NULL, "host1:", "[ipv6:a:b:c:d:e:f:g]", reduceDomain, SMDB_COMBO_TAG_DELIM "host2:", "[123.45.67.89]", reduceDomain);
-	doubleKey(NULL, NULL, NULL, "host1:", "[ipv6:a:b:c:d:e:f:g]", reduceDomain, SMDB_COMBO_TAG_DELIM "host2:", "[ipv6:a:b:c:d:e:f:g]", reduceDomain);
-	doubleKey(NULL, NULL, NULL, "host1:", "[ipv6:a:b:c:d:e:f:g]", reduceDomain, SMDB_COMBO_TAG_DELIM "host2:", "sub.domain.tld", reduceDomain);
-
-	doubleKey(NULL, NULL, NULL, "host1:", "sub.domain.tld", reduceDomain, SMDB_COMBO_TAG_DELIM "host2:", "192.0.2.1", reduceIp);
-	doubleKey(NULL, NULL, NULL, "host1:", "sub.domain.tld", reduceDomain, SMDB_COMBO_TAG_DELIM "host2:", "a:b:c:d:e:f:g", reduceIp);
-	doubleKey(NULL, NULL, NULL, "host1:", "sub.domain.tld", reduceDomain, SMDB_COMBO_TAG_DELIM "host2:", "ipv6:a:b:c:d:e:f:g", reduceIp);
-	doubleKey(NULL, NULL, NULL, "host1:", "sub.domain.tld", reduceDomain, SMDB_COMBO_TAG_DELIM "host2:", "ipv6:2001:0DB8::1234:5678", reduceIp);
-	doubleKey(NULL, NULL, NULL, "host1:", "sub.domain.tld", reduceDomain, SMDB_COMBO_TAG_DELIM "host2:", "ipv6:2001:0DB8::FFFF:123.45.67.89", reduceIp);
-	doubleKey(NULL, NULL, NULL, "host1:", "sub.domain.tld", reduceDomain, SMDB_COMBO_TAG_DELIM "host2:", "[123.45.67.89]", reduceDomain);
-	doubleKey(NULL, NULL, NULL, "host1:", "sub.domain.tld", reduceDomain, SMDB_COMBO_TAG_DELIM "host2:", "[ipv6:a:b:c:d:e:f:g]", reduceDomain);
-	doubleKey(NULL, NULL, NULL, "host1:", "sub.domain.tld", reduceDomain, SMDB_COMBO_TAG_DELIM "host2:", "sub.domain.tld", reduceDomain);
-
-	return 0;
+	doubleKey(NULL, NULL, NULL, NULL, "host1:", "123.45.67.89", reduceIp, SMDB_COMBO_TAG_DELIM "host2:", "192.0.2.1", reduceIp);
+	doubleKey(NULL, NULL, NULL, NULL, "host1:", "123.45.67.89", reduceIp, SMDB_COMBO_TAG_DELIM "host2:", "a:b:c:d:e:f:g", reduceIp);
+	doubleKey(NULL, NULL, NULL, NULL, "host1:", "123.45.67.89", reduceIp, SMDB_COMBO_TAG_DELIM "host2:", "ipv6:a:b:c:d:e:f:g", reduceIp);
+	doubleKey(NULL, NULL, NULL, NULL, "host1:", "123.45.67.89", reduceIp, SMDB_COMBO_TAG_DELIM "host2:", "ipv6:2001:0DB8::1234:5678", reduceIp);
+	doubleKey(NULL, NULL, NULL, NULL, "host1:", "123.45.67.89", reduceIp, SMDB_COMBO_TAG_DELIM "host2:", "ipv6:2001:0DB8::FFFF:123.45.67.89", reduceIp);
+	doubleKey(NULL, NULL, NULL, NULL, "host1:", "123.45.67.89", reduceIp, SMDB_COMBO_TAG_DELIM "host2:", "[123.45.67.89]", reduceDomain);
+	doubleKey(NULL, NULL, NULL, NULL, "host1:", "123.45.67.89", reduceIp, SMDB_COMBO_TAG_DELIM "host2:", "[ipv6:a:b:c:d:e:f:g]", reduceDomain);
+	doubleKey(NULL, NULL, NULL, NULL, "host1:", "123.45.67.89", reduceIp, SMDB_COMBO_TAG_DELIM "host2:", "sub.domain.tld", reduceDomain);
+
+	doubleKey(NULL, NULL, NULL, NULL, "host1:", "a:b:c:d:e:f:g", reduceIp, SMDB_COMBO_TAG_DELIM "host2:", "192.0.2.1", reduceIp);
+	doubleKey(NULL, NULL, NULL, NULL, "host1:", "a:b:c:d:e:f:g", reduceIp, SMDB_COMBO_TAG_DELIM "host2:", "a:b:c:d:e:f:g", reduceIp);
+	doubleKey(NULL, NULL, NULL, NULL, "host1:", "a:b:c:d:e:f:g", reduceIp, SMDB_COMBO_TAG_DELIM "host2:", "ipv6:a:b:c:d:e:f:g", reduceIp);
+	doubleKey(NULL, NULL, NULL, NULL, "host1:", "a:b:c:d:e:f:g", reduceIp, SMDB_COMBO_TAG_DELIM "host2:", "ipv6:2001:0DB8::1234:5678", reduceIp);
+	doubleKey(NULL, NULL, NULL, NULL, "host1:", "a:b:c:d:e:f:g", reduceIp, SMDB_COMBO_TAG_DELIM "host2:", "ipv6:2001:0DB8::FFFF:123.45.67.89", reduceIp);
+	doubleKey(NULL, NULL, NULL, NULL, "host1:", "a:b:c:d:e:f:g", reduceIp, SMDB_COMBO_TAG_DELIM "host2:", "[123.45.67.89]", reduceDomain);
+	doubleKey(NULL, NULL, NULL, NULL, "host1:", "a:b:c:d:e:f:g", reduceIp, SMDB_COMBO_TAG_DELIM "host2:", "[ipv6:a:b:c:d:e:f:g]", reduceDomain);
+	doubleKey(NULL, NULL, NULL, NULL, "host1:", "a:b:c:d:e:f:g", reduceIp, SMDB_COMBO_TAG_DELIM "host2:", "sub.domain.tld", reduceDomain);
+
+	doubleKey(NULL, NULL, NULL, NULL, "host1:", "ipv6:a:b:c:d:e:f:g", reduceIp, SMDB_COMBO_TAG_DELIM "host2:", "192.0.2.1", reduceIp);
+	doubleKey(NULL, NULL, NULL, NULL, "host1:", "ipv6:a:b:c:d:e:f:g", reduceIp, SMDB_COMBO_TAG_DELIM "host2:", "a:b:c:d:e:f:g", reduceIp);
+	doubleKey(NULL, NULL, NULL, NULL, "host1:", "ipv6:a:b:c:d:e:f:g", reduceIp, SMDB_COMBO_TAG_DELIM "host2:", "ipv6:a:b:c:d:e:f:g", reduceIp);
+	doubleKey(NULL, NULL, NULL, NULL, "host1:", "ipv6:a:b:c:d:e:f:g", reduceIp, SMDB_COMBO_TAG_DELIM "host2:", "ipv6:2001:0DB8::1234:5678", reduceIp);
+	doubleKey(NULL, NULL, NULL, NULL, "host1:", "ipv6:a:b:c:d:e:f:g", reduceIp, SMDB_COMBO_TAG_DELIM "host2:", "ipv6:2001:0DB8::FFFF:123.45.67.89", reduceIp);
+	doubleKey(NULL, NULL, NULL, NULL, "host1:", "ipv6:a:b:c:d:e:f:g", reduceIp, SMDB_COMBO_TAG_DELIM "host2:", "[123.45.67.89]", reduceDomain);
+	doubleKey(NULL, NULL, NULL, NULL, "host1:", "ipv6:a:b:c:d:e:f:g", reduceIp, SMDB_COMBO_TAG_DELIM "host2:", "[ipv6:a:b:c:d:e:f:g]", reduceDomain);
+	doubleKey(NULL, NULL, NULL, NULL, "host1:", "ipv6:a:b:c:d:e:f:g", reduceIp, SMDB_COMBO_TAG_DELIM "host2:", "sub.domain.tld", reduceDomain);
+
+	doubleKey(NULL, NULL, NULL, NULL, "host1:", "[123.45.67.89]", reduceDomain, SMDB_COMBO_TAG_DELIM "host2:", "192.0.2.1", reduceIp);
+	doubleKey(NULL, NULL, NULL, NULL, "host1:", "[123.45.67.89]", reduceDomain, SMDB_COMBO_TAG_DELIM "host2:", "a:b:c:d:e:f:g", reduceIp);
+	doubleKey(NULL, NULL, NULL, NULL, "host1:", "[123.45.67.89]", reduceDomain, SMDB_COMBO_TAG_DELIM "host2:", "ipv6:a:b:c:d:e:f:g", reduceIp);
+	doubleKey(NULL, NULL, NULL, NULL, "host1:", "[123.45.67.89]", reduceDomain, SMDB_COMBO_TAG_DELIM "host2:", "ipv6:2001:0DB8::1234:5678", reduceIp);
+	doubleKey(NULL, NULL, NULL, NULL, "host1:", "[123.45.67.89]", reduceDomain, SMDB_COMBO_TAG_DELIM "host2:", "ipv6:2001:0DB8::FFFF:123.45.67.89", reduceIp);
+	doubleKey(NULL, NULL, NULL, NULL, "host1:", "[123.45.67.89]", reduceDomain, SMDB_COMBO_TAG_DELIM "host2:", "[123.45.67.89]", reduceDomain);
+	doubleKey(NULL, NULL, NULL, NULL, "host1:", "[123.45.67.89]", reduceDomain, SMDB_COMBO_TAG_DELIM "host2:", "[ipv6:a:b:c:d:e:f:g]", reduceDomain);
+	doubleKey(NULL, NULL, NULL, NULL, "host1:", "[123.45.67.89]", reduceDomain, SMDB_COMBO_TAG_DELIM "host2:", "sub.domain.tld", reduceDomain);
+
+	doubleKey(NULL, NULL, NULL, NULL, "host1:", "[ipv6:a:b:c:d:e:f:g]", reduceDomain, SMDB_COMBO_TAG_DELIM "host2:", "192.0.2.1", reduceIp);
+	doubleKey(NULL, NULL, NULL, NULL, "host1:", "[ipv6:a:b:c:d:e:f:g]", reduceDomain, SMDB_COMBO_TAG_DELIM "host2:", "a:b:c:d:e:f:g", reduceIp);
+	doubleKey(NULL, NULL, NULL, NULL, "host1:", "[ipv6:a:b:c:d:e:f:g]", reduceDomain, SMDB_COMBO_TAG_DELIM "host2:", "ipv6:a:b:c:d:e:f:g", reduceIp);
+	doubleKey(NULL, NULL, NULL, NULL, "host1:", "[ipv6:a:b:c:d:e:f:g]", reduceDomain, SMDB_COMBO_TAG_DELIM "host2:", "ipv6:2001:0DB8::1234:5678", reduceIp);
+	doubleKey(NULL, NULL, NULL, NULL, "host1:", "[ipv6:a:b:c:d:e:f:g]", reduceDomain, SMDB_COMBO_TAG_DELIM "host2:", "ipv6:2001:0DB8::FFFF:123.45.67.89", reduceIp);
+	doubleKey(NULL, NULL, NULL, NULL, "host1:", "[ipv6:a:b:c:d:e:f:g]", reduceDomain, SMDB_COMBO_TAG_DELIM "host2:", "[123.45.67.89]", reduceDomain);
+	doubleKey(NULL, NULL, NULL, NULL, "host1:", "[ipv6:a:b:c:d:e:f:g]", reduceDomain, SMDB_COMBO_TAG_DELIM "host2:", "[ipv6:a:b:c:d:e:f:g]", reduceDomain);
+	doubleKey(NULL, NULL, NULL, NULL, "host1:", "[ipv6:a:b:c:d:e:f:g]", reduceDomain, SMDB_COMBO_TAG_DELIM "host2:", "sub.domain.tld", reduceDomain);
+
+	doubleKey(NULL, NULL, NULL, NULL, "host1:", "sub.domain.tld", reduceDomain, SMDB_COMBO_TAG_DELIM "host2:", "192.0.2.1", reduceIp);
+	doubleKey(NULL, NULL, NULL, NULL, "host1:", "sub.domain.tld", reduceDomain, SMDB_COMBO_TAG_DELIM "host2:", "a:b:c:d:e:f:g", reduceIp);
+	doubleKey(NULL, NULL, NULL, NULL, "host1:", "sub.domain.tld", reduceDomain, SMDB_COMBO_TAG_DELIM "host2:", "ipv6:a:b:c:d:e:f:g", reduceIp);
+	doubleKey(NULL, NULL, NULL, NULL, "host1:", "sub.domain.tld", reduceDomain, SMDB_COMBO_TAG_DELIM "host2:", "ipv6:2001:0DB8::1234:5678", reduceIp);
+	doubleKey(NULL, NULL, NULL, NULL, "host1:", "sub.domain.tld", reduceDomain, SMDB_COMBO_TAG_DELIM "host2:", "ipv6:2001:0DB8::FFFF:123.45.67.89", reduceIp);
+	doubleKey(NULL, NULL, NULL, NULL, "host1:", "sub.domain.tld", reduceDomain, SMDB_COMBO_TAG_DELIM "host2:", "[123.45.67.89]", reduceDomain);
+	doubleKey(NULL, NULL, NULL, NULL, "host1:", "sub.domain.tld", reduceDomain, SMDB_COMBO_TAG_DELIM "host2:", "[ipv6:a:b:c:d:e:f:g]", reduceDomain);
+	doubleKey(NULL, NULL, NULL, NULL, "host1:", "sub.domain.tld", reduceDomain, SMDB_COMBO_TAG_DELIM "host2:", "sub.domain.tld", reduceDomain);
+
+	printf("\n---- single keys against a sendmail socketmap ----\n\n");
+
+	return socketmapTest();
 }
 #endif
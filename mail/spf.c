@@ -50,12 +50,27 @@ static const char usage_spf_temp_error_dns[] =
 
 Option spfTempErrorDns = { "spf-temp-error-dns", "+", usage_spf_temp_error_dns };
 
+static const char usage_spf_prefetch[] =
+  "Parse each SPF record ahead of its evaluation and send the DNS lookups\n"
+"# of its a, mx, ptr, exists, include, and redirect terms concurrently.\n"
+"# The terms are still evaluated in order; disable to look up each term\n"
+"# only when it is reached.\n"
+"#"
+;
+
+Option spfPrefetch = { "spf-prefetch", "+", usage_spf_prefetch };
+
 #ifndef STRLEN
 #define STRLEN(s)			(sizeof (s)-1)
 #endif
 
 #define MAX_PTR_MACRO			10
 #define MAX_DNS_MECHANISMS		10
+#define MAX_DNS_NAMES			10	/* RFC 7208 section 4.6.4 */
+
+#ifndef SPF_PREFETCH_MAX
+#define SPF_PREFETCH_MAX		64
+#endif
 
 static int debug;
 
@@ -89,11 +104,23 @@ right_hand_parts(const char *s, const char *delims, int n)
 	return s + offset;
 }
 
+typedef struct {
+	PDQ_type type;
+	int done;			/* answer received or timed out */
+	int followed;			/* record terms or hosts prefetched */
+	PDQ_rr *answer;
+	char name[DOMAIN_SIZE];		/* without the root dot */
+} spfLookup;
+
 typedef struct {
 	int result;
 	int ptr_count;
 	int temp_error;
 	int mechanism_count;
+	int prefetch_terms;
+	int lookups_length;
+	spfLookup *lookups;
+	PDQ *ahead;
 	PDQ *pdq;
 	char *ip;
 	char *helo;
@@ -373,6 +400,367 @@ spfIsCircularReference(spfContext *ctx, const char *domain)
 	return 0;
 }
 
+/***********************************************************************
+ *** Prefetching
+ ***********************************************************************/
+
+/*
+ * The terms of an SPF record are parsed before they are evaluated and
+ * the lookups they require are sent together on a second PDQ handle.
+ * The answers are kept by type and name until spfCheck() reaches the
+ * term, which then waits only for what is still outstanding. Lookups
+ * that were not prefetched fall back to the blocking pdqGet*() calls.
+ */
+static int
+spfLookupName(PDQ_type type, const char *name, char *buffer, size_t size)
+{
+	size_t length;
+
+	if (type == PDQ_TYPE_PTR && strstr(name, ".arpa") == NULL)
+		length = reverseIp(name, buffer, size, 1);
+	else
+		length = TextCopy(buffer, size, name);
+
+	if (size <= length)
+		return -1;
+	if (0 < length && buffer[length-1] == '.')
+		buffer[length-1] = '\0';
+
+	return 0;
+}
+
+static spfLookup *
+spfLookupFind(spfContext *ctx, PDQ_type type, const char *name)
+{
+	int i;
+	char buffer[DOMAIN_SIZE];
+
+	if (ctx->lookups == NULL || spfLookupName(type, name, buffer, sizeof (buffer)))
+		return NULL;
+
+	for (i = 0; i < ctx->lookups_length; i++) {
+		if (ctx->lookups[i].type == type && TextInsensitiveCompare(ctx->lookups[i].name, buffer) == 0)
+			return &ctx->lookups[i];
+	}
+
+	return NULL;
+}
+
+static spfLookup *
+spfLookupAdd(spfContext *ctx, PDQ_type type, const char *name)
+{
+	spfLookup *entry;
+
+	if (ctx->lookups == NULL
+	&& (ctx->lookups = malloc(SPF_PREFETCH_MAX * sizeof (*ctx->lookups))) == NULL)
+		return NULL;
+
+	if (SPF_PREFETCH_MAX <= ctx->lookups_length)
+		return NULL;
+
+	entry = &ctx->lookups[ctx->lookups_length];
+	if (spfLookupName(type, name, entry->name, sizeof (entry->name)))
+		return NULL;
+
+	entry->type = type;
+	entry->done = 0;
+	entry->followed = 0;
+	entry->answer = NULL;
+	ctx->lookups_length++;
+
+	return entry;
+}
+
+static void
+spfLookupFree(spfContext *ctx)
+{
+	int i;
+
+	for (i = 0; i < ctx->lookups_length; i++)
+		pdqListFree(ctx->lookups[i].answer);
+	free(ctx->lookups);
+
+	ctx->lookups_length = 0;
+	ctx->lookups = NULL;
+}
+
+static void
+spfPrefetchQuery(spfContext *ctx, PDQ_type type, const char *name)
+{
+	spfLookup *entry;
+
+	if (ctx->ahead == NULL || spfLookupFind(ctx, type, name) != NULL)
+		return;
+
+	if ((entry = spfLookupAdd(ctx, type, name)) == NULL)
+		return;
+
+	if (1 < debug)
+		syslog(LOG_DEBUG, "prefetch %s %s", pdqTypeName(type), entry->name);
+
+	/* An entry that could not be queried is done without an
+	 * answer, so that spfCheck() performs the lookup itself.
+	 */
+	if (pdqQuery(ctx->ahead, PDQ_CLASS_IN, type, name, NULL))
+		entry->done = 1;
+}
+
+static void
+spfPrefetch5A(spfContext *ctx, const char *name)
+{
+	spfPrefetchQuery(ctx, PDQ_TYPE_A, name);
+	spfPrefetchQuery(ctx, PDQ_TYPE_AAAA, name);
+}
+
+static void
+spfPrefetchTerms(spfContext *ctx, const char *domain, const char *txt)
+{
+	long i;
+	Vector terms;
+	char *term, *target, *redirect;
+
+	if ((terms = TextSplit(txt, " ", 0)) == NULL)
+		return;
+
+	redirect = NULL;
+
+	/* Start after the version specifier; stop where evaluation would. */
+	for (i = 1; i < VectorLength(terms) && ctx->prefetch_terms < MAX_DNS_MECHANISMS; i++) {
+		if ((term = VectorGet(terms, i)) == NULL)
+			continue;
+
+		term += (*term == '+' || *term == '-' || *term == '~' || *term == '?');
+
+		if (TextInsensitiveCompareN(term , "all", STRLEN("all")) == 0) {
+			redirect = NULL;
+			break;
+		}
+
+		/* A %{p} macro is a lookup of its own; leave it to spfCheck(). */
+		if (strstr(term, "%{p") != NULL)
+			continue;
+
+		if (TextInsensitiveCompareN(term , "a", STRLEN("a")) == 0) {
+			if ((target = spfMacro(ctx, domain, term+STRLEN("a"))) != NULL)
+				spfPrefetch5A(ctx, target);
+		} else if (TextInsensitiveCompareN(term , "mx", STRLEN("mx")) == 0) {
+			if ((target = spfMacro(ctx, domain, term+STRLEN("mx"))) != NULL)
+				spfPrefetchQuery(ctx, PDQ_TYPE_MX, target);
+		} else if (TextInsensitiveCompareN(term , "ptr", STRLEN("ptr")) == 0) {
+			spfPrefetchQuery(ctx, PDQ_TYPE_PTR, ctx->ip);
+			target = NULL;
+		} else if (TextInsensitiveCompareN(term , "include:", STRLEN("include:")) == 0) {
+			if ((target = spfMacro(ctx, domain, term+STRLEN("include:"))) != NULL)
+				spfPrefetchQuery(ctx, PDQ_TYPE_TXT, target);
+		} else if (TextInsensitiveCompareN(term , "exists:", STRLEN("exists:")) == 0) {
+			if ((target = spfMacro(ctx, domain, term+STRLEN("exists:"))) != NULL)
+				spfPrefetchQuery(ctx, PDQ_TYPE_A, target);
+		} else {
+			if (TextInsensitiveCompareN(term , "redirect=", STRLEN("redirect=")) == 0)
+				redirect = term+STRLEN("redirect=");
+			continue;
+		}
+
+		ctx->prefetch_terms++;
+		free(target);
+	}
+
+	if (redirect != NULL && ctx->prefetch_terms < MAX_DNS_MECHANISMS
+	&& (target = spfMacro(ctx, domain, redirect)) != NULL) {
+		spfPrefetchQuery(ctx, PDQ_TYPE_TXT, target);
+		ctx->prefetch_terms++;
+		free(target);
+	}
+
+	VectorDestroy(terms);
+}
+
+/*
+ * Prefetch what the answer to an earlier prefetch will lead to: the
+ * terms of an included SPF record or the addresses of MX and PTR hosts.
+ */
+static void
+spfPrefetchFollow(spfContext *ctx, spfLookup *entry)
+{
+	int count;
+	PDQ_rr *rr;
+
+	entry->followed = 1;
+
+	if (entry->answer == NULL || entry->answer->section != PDQ_SECTION_QUERY
+	|| ((PDQ_QUERY *) entry->answer)->rcode != PDQ_RCODE_OK)
+		return;
+
+	count = 0;
+	for (rr = entry->answer->next; rr != NULL; rr = rr->next) {
+		if (rr->section == PDQ_SECTION_QUERY || rr->type != entry->type)
+			continue;
+
+		switch (rr->type) {
+		case PDQ_TYPE_TXT:
+			if (((PDQ_TXT *) rr)->text.value != NULL
+			&& strncmp((char *) ((PDQ_TXT *) rr)->text.value, "v=spf1 ", sizeof ("v=spf1 ")-1) == 0) {
+				spfPrefetchTerms(ctx, entry->name, (char *) ((PDQ_TXT *) rr)->text.value);
+				return;
+			}
+			break;
+		case PDQ_TYPE_MX:
+			if (strcmp(".", ((PDQ_MX *) rr)->host.string.value) == 0)
+				break;
+			/*@fallthrough@*/
+		case PDQ_TYPE_PTR:
+			if (MAX_DNS_NAMES <= count++)
+				return;
+			spfPrefetch5A(ctx, ((PDQ_PTR *) rr)->host.string.value);
+			break;
+		}
+	}
+}
+
+/*
+ * @param answers
+ *	A list returned by pdqPoll() or pdqWait(), possibly holding
+ *	the answers to several queries, each headed by a query record.
+ */
+static void
+spfPrefetchAnswer(spfContext *ctx, PDQ_rr *answers)
+{
+	spfLookup *entry;
+	PDQ_rr *head, *rr;
+
+	while ((head = answers) != NULL) {
+		/* Detach the answer to one query from the rest. */
+		for (rr = head; rr->next != NULL && rr->next->section != PDQ_SECTION_QUERY; rr = rr->next)
+			;
+		answers = rr->next;
+		rr->next = NULL;
+
+		entry = spfLookupFind(ctx, head->type, head->name.string.value);
+		if (entry == NULL || entry->done) {
+			pdqListFree(head);
+			continue;
+		}
+
+		entry->done = 1;
+		entry->answer = head;
+
+		if (entry->type == PDQ_TYPE_TXT || entry->type == PDQ_TYPE_PTR
+		|| entry->type == PDQ_TYPE_MX)
+			spfPrefetchFollow(ctx, entry);
+	}
+}
+
+/*
+ * @return
+ *	The prefetched lookup with its answer, or NULL if the lookup
+ *	was not prefetched or failed.
+ */
+static spfLookup *
+spfPrefetchWait(spfContext *ctx, PDQ_type type, const char *name)
+{
+	spfLookup *entry;
+
+	if ((entry = spfLookupFind(ctx, type, name)) == NULL)
+		return NULL;
+
+	while (!entry->done && pdqQueryIsPending(ctx->ahead))
+		spfPrefetchAnswer(ctx, pdqWait(ctx->ahead));
+
+	return entry->done && entry->answer != NULL ? entry : NULL;
+}
+
+static PDQ_rr *
+spfGet(spfContext *ctx, PDQ_type type, const char *name)
+{
+	spfLookup *entry;
+
+	if ((entry = spfPrefetchWait(ctx, type, name)) != NULL)
+		return pdqListClone(entry->answer);
+
+	return pdqGet(ctx->pdq, PDQ_CLASS_IN, type, name, NULL);
+}
+
+static PDQ_rr *
+spfGet5A(spfContext *ctx, const char *name)
+{
+	PDQ_rr *list;
+	spfLookup *a, *aaaa;
+
+	if ((a = spfPrefetchWait(ctx, PDQ_TYPE_A, name)) == NULL
+	|| (aaaa = spfPrefetchWait(ctx, PDQ_TYPE_AAAA, name)) == NULL)
+		return pdqGet5A(ctx->pdq, PDQ_CLASS_IN, name);
+
+	list = pdqListAppend(pdqListClone(a->answer), pdqListClone(aaaa->answer));
+
+	return pdqListPruneDup(list);
+}
+
+/*
+ * Equivalent of pdqGetMX() assembled from the prefetched MX answer
+ * and the A/AAAA answers of its hosts.
+ */
+static PDQ_rr *
+spfGetMX(spfContext *ctx, const char *name)
+{
+	PDQ_rr *list, *rr;
+	spfLookup *mx, *a, *aaaa;
+
+	if ((mx = spfPrefetchWait(ctx, PDQ_TYPE_MX, name)) == NULL)
+		return pdqGetMX(ctx->pdq, PDQ_CLASS_IN, name, 0);
+
+	if (mx->answer->section == PDQ_SECTION_QUERY) {
+		if (((PDQ_QUERY *) mx->answer)->rcode != PDQ_RCODE_OK)
+			return pdqListClone(mx->answer);
+
+		/* Leave the implicit MX 0 rule to pdqGet(). */
+		if (((PDQ_QUERY *) mx->answer)->ancount == 0)
+			return pdqGetMX(ctx->pdq, PDQ_CLASS_IN, name, 0);
+	}
+
+	list = pdqListClone(mx->answer);
+
+	for (rr = mx->answer; rr != NULL; rr = rr->next) {
+		if (rr->section == PDQ_SECTION_QUERY || rr->type != PDQ_TYPE_MX
+		|| strcmp(".", ((PDQ_MX *) rr)->host.string.value) == 0)
+			continue;
+
+		if ((a = spfPrefetchWait(ctx, PDQ_TYPE_A, ((PDQ_MX *) rr)->host.string.value)) == NULL
+		|| (aaaa = spfPrefetchWait(ctx, PDQ_TYPE_AAAA, ((PDQ_MX *) rr)->host.string.value)) == NULL) {
+			pdqListFree(list);
+			return pdqGetMX(ctx->pdq, PDQ_CLASS_IN, name, 0);
+		}
+
+		list = pdqListAppend(list, pdqListClone(a->answer));
+		list = pdqListAppend(list, pdqListClone(aaaa->answer));
+	}
+
+	return pdqListPrune(list, 0);
+}
+
+/*
+ * Prefetch the lookups of a record about to be evaluated, unless
+ * they were already prefetched when the record itself arrived.
+ */
+static void
+spfPrefetchRecord(spfContext *ctx, const char *domain, const char *txt)
+{
+	spfLookup *entry;
+
+	if (ctx->ahead == NULL)
+		return;
+
+	if ((entry = spfLookupFind(ctx, PDQ_TYPE_TXT, domain)) == NULL) {
+		if ((entry = spfLookupAdd(ctx, PDQ_TYPE_TXT, domain)) == NULL)
+			return;
+		entry->done = 1;
+	}
+
+	if (!entry->followed) {
+		entry->followed = 1;
+		spfPrefetchTerms(ctx, domain, txt);
+	}
+}
+
 static const char *
 spfCheck(spfContext *ctx, const char *domain, const char *alt_txt)
 {
@@ -441,8 +829,8 @@ spfCheck(spfContext *ctx, const char *domain, const char *alt_txt)
 		/* RFC 4408 states that SPF RR trump SPF TXT RR, however
 		 * the SPF in TXT is still more commonly used.
 		 */
-		if ((list = pdqGet(ctx->pdq, PDQ_CLASS_IN, PDQ_TYPE_TXT, domain, NULL)) == NULL) {
-			if ((list = pdqGet(ctx->pdq, PDQ_CLASS_IN, PDQ_TYPE_SPF, domain, NULL)) == NULL) {
+		if ((list = spfGet(ctx, PDQ_TYPE_TXT, domain)) == NULL) {
+			if ((list = spfGet(ctx, PDQ_TYPE_SPF, domain)) == NULL) {
 				if (errno != 0)
 					qualifier = SPF_TEMP_ERROR;
 				goto error1;
@@ -522,6 +910,8 @@ spfCheck(spfContext *ctx, const char *domain, const char *alt_txt)
 		goto error4;
 	}
 
+	spfPrefetchRecord(ctx, domain, txt);
+
 	redirect = target = NULL;
 
 	/* Start after the version specifier. */
@@ -583,7 +973,7 @@ spfCheck(spfContext *ctx, const char *domain, const char *alt_txt)
 				goto error5;
 			}
 
-			if ((list = pdqGet5A(ctx->pdq, PDQ_CLASS_IN, target)) == NULL) {
+			if ((list = spfGet5A(ctx, target)) == NULL) {
 				qualifier = SPF_TEMP_ERROR;
 				err = spfErrorInternal;
 				goto error5;
@@ -630,7 +1020,7 @@ spfCheck(spfContext *ctx, const char *domain, const char *alt_txt)
 				goto error5;
 			}
 
-			if ((list = pdqGetMX(ctx->pdq, PDQ_CLASS_IN, target, 0)) == NULL) {
+			if ((list = spfGetMX(ctx, target)) == NULL) {
 				if (errno == 0)
 					continue;
 				qualifier = SPF_TEMP_ERROR;
@@ -638,6 +1028,17 @@ spfCheck(spfContext *ctx, const char *domain, const char *alt_txt)
 				goto error5;
 			}
 
+			/* RFC 7208 section 4.6.4 limits the MX host lookups. */
+			for (length = 0, rr = list; rr != NULL; rr = rr->next) {
+				if (rr->section == PDQ_SECTION_ANSWER && rr->type == PDQ_TYPE_MX)
+					length++;
+			}
+			if (MAX_DNS_NAMES < length) {
+				qualifier = SPF_PERM_ERROR;
+				err = spfErrorDnsLimit;
+				goto error5;
+			}
+
 			if (list->section == PDQ_SECTION_QUERY) {
 				if (((PDQ_QUERY *)list)->rcode != PDQ_RCODE_OK) {
 					if (((PDQ_QUERY *)list)->rcode == PDQ_RCODE_UNDEFINED)
@@ -673,7 +1074,7 @@ spfCheck(spfContext *ctx, const char *domain, const char *alt_txt)
 				goto error5;
 			}
 
-			if ((list = pdqGet(ctx->pdq, PDQ_CLASS_IN, PDQ_TYPE_PTR, ctx->ip, NULL)) == NULL) {
+			if ((list = spfGet(ctx, PDQ_TYPE_PTR, ctx->ip)) == NULL) {
 				qualifier = SPF_TEMP_ERROR;
 				err = spfErrorInternal;
 				goto error5;
@@ -697,14 +1098,16 @@ spfCheck(spfContext *ctx, const char *domain, const char *alt_txt)
 
 			cidr = cidr6;
 
-			for (rr = list; rr != NULL; rr = rr->next) {
+			/* RFC 7208 section 4.6.4 ignores PTR names past the limit. */
+			for (length = 0, rr = list; rr != NULL && length < MAX_DNS_NAMES; rr = rr->next) {
 				int match;
 				PDQ_rr *alist, *ar;
 
 				if (rr->section == PDQ_SECTION_QUERY || rr->type != PDQ_TYPE_PTR)
 					continue;
+				length++;
 
-				if ((alist = pdqGet5A(ctx->pdq, PDQ_CLASS_IN, ((PDQ_PTR *) rr)->host.string.value)) == NULL)
+				if ((alist = spfGet5A(ctx, ((PDQ_PTR *) rr)->host.string.value)) == NULL)
 					break;
 
 				/* Remove trailing root dot. */
@@ -775,6 +1178,12 @@ spfCheck(spfContext *ctx, const char *domain, const char *alt_txt)
 				goto error5;
 			}
 
+			if (MAX_DNS_MECHANISMS <= ctx->mechanism_count++) {
+				qualifier = SPF_PERM_ERROR;
+				err = spfErrorDnsLimit;
+				goto error5;
+			}
+
 			err = spfCheck(ctx, target, NULL);
 			switch (ctx->result) {
 			case SPF_NONE:
@@ -810,7 +1219,7 @@ spfCheck(spfContext *ctx, const char *domain, const char *alt_txt)
 				goto error5;
 			}
 
-			if ((list = pdqGet(ctx->pdq, PDQ_CLASS_IN, PDQ_TYPE_A, target, NULL)) != NULL) {
+			if ((list = spfGet(ctx, PDQ_TYPE_A, target)) != NULL) {
 				if (list->section == PDQ_SECTION_QUERY && ((PDQ_QUERY *)list)->rcode != PDQ_RCODE_OK) {
 					if (((PDQ_QUERY *)list)->rcode == PDQ_RCODE_UNDEFINED)
 						continue;
@@ -858,6 +1267,11 @@ spfCheck(spfContext *ctx, const char *domain, const char *alt_txt)
 			err = spfErrorSyntax;
 			goto error5;
 		}
+		if (MAX_DNS_MECHANISMS <= ctx->mechanism_count++) {
+			qualifier = SPF_PERM_ERROR;
+			err = spfErrorDnsLimit;
+			goto error5;
+		}
 		err = spfCheck(ctx, target, NULL);
 		qualifier = ctx->result;
 	}
@@ -902,6 +1316,10 @@ spfCheckHeloMailTxt(const char *client_addr, const char *helo, const char *mail,
 	ctx.helo = (char *) (helo == NULL ? unknown : helo);
 	ctx.ptr_count = ctx.mechanism_count = 0;
 	ctx.temp_error = 0;
+	ctx.prefetch_terms = 0;
+	ctx.lookups_length = 0;
+	ctx.lookups = NULL;
+	ctx.ahead = NULL;
 
 	if (parseIPv6(client_addr, ctx.ipv6) == 0) {
 		error = spfErrorIpParse;
@@ -947,9 +1365,15 @@ spfCheckHeloMailTxt(const char *client_addr, const char *helo, const char *mail,
 	}
 	VectorSetDestroyEntry(ctx.circular, free);
 
+	/* Without a second handle the lookups are simply not prefetched. */
+	if (spfPrefetch.value)
+		ctx.ahead = pdqOpen();
+
 	error = spfCheck(&ctx, ctx.mail->domain.string, txt);
 	*result = ctx.result;
 
+	spfLookupFree(&ctx);
+	pdqClose(ctx.ahead);
 	VectorDestroy(ctx.circular);
 error2:
 	pdqClose(ctx.pdq);
@@ -982,10 +1406,11 @@ spfCheckDomain(const char *client_addr, const char *domain, int *result)
 #include <com/snert/lib/sys/sysexits.h>
 
 static char usage[] =
-"usage: spf [-v][-h helo]"
+"usage: spf [-pv][-h helo]"
 "[-t txt] client-ip domain|mail ...\n"
 "\n"
 "-h helo\t\tthe SMTP EHLO/HELO argument to verify\n"
+"-p\t\tprefetch the DNS lookups of each SPF record\n"
 "-t txt\t\tspecify the initial TXT record to use\n"
 "-v\t\tsend debugging information to the mail log.\n"
 "\n"
@@ -1031,6 +1456,10 @@ testMacro(const char *ip, ParsePath *mail, const char *spec, const char *expect)
 	ctx.result = SPF_PERM_ERROR;
 	ctx.ptr_count = ctx.mechanism_count = 0;
 	ctx.temp_error = 0;
+	ctx.prefetch_terms = 0;
+	ctx.lookups_length = 0;
+	ctx.lookups = NULL;
+	ctx.ahead = NULL;
 
 	if (parseIPv6(ip, ctx.ipv6) == 0) {
 		return SPF_PERM_ERROR;
@@ -1098,11 +1527,14 @@ main(int argc, char **argv)
 	int i, ch, spf;
 	const char *error, *helo = NULL, *txt = NULL;
 
-	while ((ch = getopt(argc, argv, "h:n:t:Tv")) != -1) {
+	while ((ch = getopt(argc, argv, "h:n:pt:Tv")) != -1) {
 		switch (ch) {
 		case 'h':
 			helo = optarg;
 			break;
+		case 'p':
+			spfPrefetch.value = 1;
+			break;
 		case 't':
 			txt = optarg;
 			break;
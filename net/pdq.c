@@ -24,6 +24,62 @@
 #define SOCKET3_WAIT_NEXT_PACKET_MS		50
 #endif
 
+#ifndef PDQ_CACHE_SIZE
+#define PDQ_CACHE_SIZE		10000
+#endif
+
+#ifndef PDQ_CACHE_SHARDS
+#define PDQ_CACHE_SHARDS	16
+#endif
+
+#ifndef PDQ_CACHE_BUCKETS
+#define PDQ_CACHE_BUCKETS	1021
+#endif
+
+#ifndef PDQ_CACHE_NEGATIVE_TTL
+#define PDQ_CACHE_NEGATIVE_TTL	300
+#endif
+
+#ifndef PDQ_CACHE_NEGATIVE_MAX
+#define PDQ_CACHE_NEGATIVE_MAX	10800
+#endif
+
+#ifndef PDQ_CACHE_MAX_TTL
+#define PDQ_CACHE_MAX_TTL	86400
+#endif
+
+#ifndef PDQ_EDNS_SIZE
+#define PDQ_EDNS_SIZE		1232
+#endif
+
+#ifndef PDQ_EDNS_MAX_SIZE
+#define PDQ_EDNS_MAX_SIZE	4096
+#endif
+
+#ifndef PDQ_BATCH_SIZE
+#define PDQ_BATCH_SIZE		16
+#endif
+
+#ifndef PDQ_BATCH_MAX
+#define PDQ_BATCH_MAX		64
+#endif
+
+#ifndef PDQ_ENGINE_SOCKETS_MAX
+#define PDQ_ENGINE_SOCKETS_MAX	8
+#endif
+
+#ifndef PDQ_ENGINE_BUCKETS
+#define PDQ_ENGINE_BUCKETS	4093
+#endif
+
+#ifndef PDQ_ENGINE_ID_BUCKETS
+#define PDQ_ENGINE_ID_BUCKETS	1024
+#endif
+
+#ifndef PDQ_ENGINE_TICK_MS
+#define PDQ_ENGINE_TICK_MS	1000
+#endif
+
 #ifndef ETC_HOSTS
 # ifdef __WIN32__
 #  define ETC_HOSTS		"/WINDOWS/system32/drivers/etc/hosts"
@@ -42,11 +98,18 @@
  *** No configuration below this point.
  ***********************************************************************/
 
+#ifdef __linux__
+/* Required for sendmmsg() and recvmmsg(). */
+# undef _GNU_SOURCE
+# define _GNU_SOURCE
+#endif
+
 #include <com/snert/lib/version.h>
 
 #include <ctype.h>
 #include <errno.h>
 #include <limits.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -77,6 +140,7 @@
 #include <com/snert/lib/io/file.h>
 #include <com/snert/lib/io/socket3.h>
 #include <com/snert/lib/mail/tlds.h>
+#include <com/snert/lib/sys/pthread.h>
 #include <com/snert/lib/type/Vector.h>
 #include <com/snert/lib/util/Text.h>
 #include <com/snert/lib/util/timer.h>
@@ -94,6 +158,7 @@
 #define NET_SHORT_BYTE_SIZE	2
 #define NET_LONG_BYTE_SIZE	4
 #define UDP_PACKET_SIZE		512
+#define OPT_RR_SIZE		11	/* root, type, class, ttl, rdlength */
 
 #define OP_QUERY		0x0000
 #define OP_IQUERY		0x0800
@@ -124,6 +189,11 @@ struct header {
 	uint16_t arcount;
 };
 
+/*
+ * Queries, which never exceed 512 bytes, are held in a udp_packet.
+ * Replies are received into a larger block, see pdq_ring_alloc(),
+ * and parsed through a udp_packet pointer bounded by its length.
+ */
 struct udp_packet {
 	uint16_t length;
 	struct header header;
@@ -148,12 +218,52 @@ typedef struct pdq_query {
 	SocketAddress address;
 	time_t created;
 	int next_ns;
+	unsigned edns;			/* Advertised UDP size, 0 without OPT. */
+	int unsent;			/* Waiting for pdq_query_flush(). */
+
+	/* Used only by queries of the shared engine. */
+	struct pdq_query *id_chain;	/* Socket reply ID hash chain. */
+	struct pdq_query *key_chain;	/* In-flight question hash chain. */
+	struct pdq_waiter *waiters;	/* Clients sharing this query. */
+	unsigned long hash;
+	uint16_t class;
+	uint16_t type;
+	uint64_t resend;		/* Next retransmit, monotonic ms. */
+	uint64_t expires;		/* Time out, monotonic ms. */
+	unsigned delay;			/* Current retransmit interval, ms. */
+	char key[DOMAIN_SIZE];		/* Empty when never shared. */
 } PDQ_query;
 
+typedef struct pdq_waiter {
+	struct pdq_waiter *next;
+	PDQ *pdq;
+} PDQ_waiter;
+
+typedef struct pdq_cache_entry {
+	struct pdq_cache_entry *prev;	/* LRU order, most recent first. */
+	struct pdq_cache_entry *next;
+	struct pdq_cache_entry *chain;	/* Hash bucket chain. */
+	unsigned long hash;
+	uint16_t class;
+	uint16_t type;
+	time_t created;
+	time_t expires;
+	PDQ_rr *list;
+	char name[DOMAIN_SIZE];
+} PDQ_cache_entry;
+
+typedef struct {
+	pthread_mutex_t mutex;
+	PDQ_cache_entry *head;
+	PDQ_cache_entry *tail;
+	PDQ_cache_stats stats;
+	PDQ_cache_entry *table[PDQ_CACHE_BUCKETS];
+} PDQ_cache_shard;
+
 typedef struct pdq_reply {
 	struct pdq_reply *prev;
 	struct pdq_reply *next;
-	struct udp_packet packet;
+	struct udp_packet *packet;	/* Within the ring's receive block. */
 	SocketAddress from;
 	socklen_t fromlen;
 } PDQ_reply;
@@ -174,8 +284,36 @@ struct pdq {
 	int round_robin;
 	unsigned timeout;
 	PDQ_query *pending;
+	PDQ_rr *cached;			/* Answers found by pdqQuery(). */
+	int batch;			/* Defer sends until pdq_query_flush(). */
+	int ring_size;
+	unsigned ring_packet;		/* Receive bytes per ring slot. */
+	PDQ_reply *ring;		/* Receive buffers for pdqPoll(). */
+	PDQ_query **by_id;		/* Reply ID index of an engine socket. */
+	struct pdq_engine *owner;	/* Engine of an engine socket. */
+
+	/* A client of the shared engine has no socket of its own. */
+	struct pdq_engine *engine;
+	int outstanding;		/* Engine queries not yet answered. */
+	PDQ_rr *inbox;			/* Engine answers for pdqPoll(). */
+	int notify[2];			/* pdqGetFd() readiness pipe. */
+	pthread_mutex_t mutex;
+	pthread_cond_t cv;
 };
 
+typedef struct pdq_engine {
+	pthread_mutex_t mutex;
+	pthread_t thread;
+	volatile int running;
+	int wake[2];
+	int length;
+	unsigned next;			/* Socket for the next new query. */
+	PDQ *socket[PDQ_ENGINE_SOCKETS_MAX];
+	PDQ_query *submitted;		/* New queries for the I/O thread. */
+	PDQ_engine_stats stats;
+	PDQ_query *table[PDQ_ENGINE_BUCKETS];
+} PDQ_engine;
+
 struct host {
 	char host[DOMAIN_SIZE];
 	unsigned char ip[IPV6_BYTE_SIZE];
@@ -192,7 +330,15 @@ static SocketAddress *servers;
 static int pdq_initialised = 0;
 static unsigned pdq_max_timeout = PDQ_TIMEOUT_MAX;
 static unsigned pdq_initial_timeout = PDQ_TIMEOUT_START * 1000;
+static unsigned pdq_edns_size = PDQ_EDNS_SIZE;
+static unsigned pdq_batch_size = PDQ_BATCH_SIZE;
 static PDQ_rr *root_hints;
+static int pdq_cache_ready;
+static unsigned long pdq_cache_size = PDQ_CACHE_SIZE;
+static PDQ_cache_shard pdq_cache[PDQ_CACHE_SHARDS];
+static unsigned pdq_engine_sockets;
+static PDQ_engine *pdq_engine;
+static pthread_mutex_t pdq_engine_mutex = PTHREAD_MUTEX_INITIALIZER;
 
 struct mapping {
 	int code;
@@ -223,6 +369,7 @@ static struct mapping typeMap[] = {
 	{ PDQ_TYPE_AAAA,		"AAAA"	},
 	{ PDQ_TYPE_A6,			"A6"	},
 	{ PDQ_TYPE_DNAME,		"DNAME"	},
+	{ PDQ_TYPE_OPT,			"OPT"	},
 	{ PDQ_TYPE_ANY,			"ANY"	},
 	{ 0, 				NULL	}
 };
@@ -300,6 +447,34 @@ static const char usage_dns_ignore_tcp[] =
 
 Option optDnsIgnoreTCP	= { "dns-ignore-tcp",	"-", usage_dns_ignore_tcp };
 
+static const char usage_dns_cache_size[] =
+  "Maximum number of DNS answers held in the process wide answer\n"
+"# cache. Answers are kept no longer than their TTL. Set to zero\n"
+"# to disable the cache.\n"
+"#"
+;
+
+static const char usage_dns_edns_size[] =
+  "EDNS0 UDP payload size in bytes advertised with each DNS query,\n"
+"# between 512 and " QUOTE(PDQ_EDNS_MAX_SIZE) ". Larger answers avoid a TCP retry when\n"
+"# the UDP answer is truncated. Set to zero to disable EDNS0.\n"
+"#"
+;
+
+Option optDnsEdnsSize	= { "dns-edns-size",	QUOTE(PDQ_EDNS_SIZE), usage_dns_edns_size };
+
+Option optDnsCacheSize	= { "dns-cache-size",	QUOTE(PDQ_CACHE_SIZE), usage_dns_cache_size };
+
+static const char usage_dns_engine[] =
+  "Number of UDP sockets, up to " QUOTE(PDQ_ENGINE_SOCKETS_MAX) ", of a process wide DNS resolver\n"
+"# engine shared by all threads. Concurrent queries for the same\n"
+"# question share one upstream query. Set to zero for each session\n"
+"# to use its own socket.\n"
+"#"
+;
+
+Option optDnsEngine	= { "dns-engine",	"0", usage_dns_engine };
+
 /***********************************************************************
  *** Support
  ***********************************************************************/
@@ -737,7 +912,12 @@ pdqDup(PDQ_rr *orig)
 	if (orig == NULL)
 		return NULL;
 
-	if ((size = pdqSizeOfType(orig->type)) == 0) {
+	/* A query record is always a PDQ_QUERY, but its type field
+	 * holds the type of the question.
+	 */
+	if (orig->section == PDQ_SECTION_QUERY) {
+		size = sizeof (PDQ_QUERY);
+	} else if ((size = pdqSizeOfType(orig->type)) == 0) {
 		syslog(LOG_ERR, "%s(%d) name=%s: %s (%d)", __FILE__, __LINE__, orig->name.string.value, strerror(errno), errno);
 		return NULL;
 	}
@@ -745,8 +925,10 @@ pdqDup(PDQ_rr *orig)
 	if ((copy = malloc(size)) != NULL) {
 		memcpy(copy, orig, size);
 
-		if (orig->type == PDQ_TYPE_TXT || orig->type == PDQ_TYPE_NULL) {
-			((PDQ_TXT *) copy)->text.value = malloc(((PDQ_TXT *) orig)->text.length);
+		if (orig->section != PDQ_SECTION_QUERY
+		&& (orig->type == PDQ_TYPE_TXT || orig->type == PDQ_TYPE_NULL)) {
+			/* pdq_txt_create() null terminates the text. */
+			((PDQ_TXT *) copy)->text.value = malloc(((PDQ_TXT *) orig)->text.length + 1);
 			if (((PDQ_TXT *) copy)->text.value == NULL) {
 				free(copy);
 				return NULL;
@@ -757,6 +939,7 @@ pdqDup(PDQ_rr *orig)
 				((PDQ_TXT *) orig)->text.value,
 				((PDQ_TXT *) orig)->text.length
 			);
+			((PDQ_TXT *) copy)->text.value[((PDQ_TXT *) orig)->text.length] = '\0';
 		}
 	}
 
@@ -2167,11 +2350,115 @@ pdq_query_create(void)
 		query->prev = query->next = NULL;
 		query->created = time(NULL);
 		query->next_ns = 0;
+		query->edns = 0;
+		query->unsent = 0;
+		query->id_chain = NULL;
+		query->key_chain = NULL;
+		query->waiters = NULL;
+		query->hash = 0;
+		query->class = 0;
+		query->type = 0;
+		query->resend = 0;
+		query->expires = 0;
+		query->delay = 0;
+		query->key[0] = '\0';
+	}
+
+	return query;
+}
+
+/*
+ * Pending query list maintenance. An engine socket also indexes its
+ * pending queries by ID, since it can have thousands in flight.
+ */
+static PDQ_query *
+pdq_pending_find(PDQ *pdq, uint16_t id)
+{
+	PDQ_query *query;
+
+	if (pdq->by_id != NULL) {
+		for (query = pdq->by_id[id % PDQ_ENGINE_ID_BUCKETS]; query != NULL; query = query->id_chain) {
+			if (query->packet.header.id == id)
+				break;
+		}
+		return query;
+	}
+
+	for (query = pdq->pending; query != NULL; query = query->next) {
+		if (query->packet.header.id == id)
+			break;
 	}
 
 	return query;
 }
 
+static void
+pdq_pending_add(PDQ *pdq, PDQ_query *query)
+{
+	PDQ_query **bucket;
+
+	pdq_link_add(&pdq->pending, query);
+
+	if (pdq->by_id != NULL) {
+		bucket = &pdq->by_id[query->packet.header.id % PDQ_ENGINE_ID_BUCKETS];
+		query->id_chain = *bucket;
+		*bucket = query;
+	}
+}
+
+static void
+pdq_pending_remove(PDQ *pdq, PDQ_query *query)
+{
+	PDQ_query **prev;
+
+	pdq_link_remove(&pdq->pending, query);
+
+	if (pdq->by_id != NULL) {
+		for (prev = &pdq->by_id[query->packet.header.id % PDQ_ENGINE_ID_BUCKETS]; *prev != NULL; prev = &(*prev)->id_chain) {
+			if (*prev == query) {
+				*prev = query->id_chain;
+				break;
+			}
+		}
+	}
+}
+
+/*
+ * Append or remove an EDNS0 OPT record, RFC 6891, advertising the
+ * UDP payload size we can receive. Zero removes the OPT record.
+ */
+static void
+pdq_query_edns(PDQ_query *query, unsigned size)
+{
+	unsigned char *opt;
+
+	if (query->edns != 0) {
+		query->packet.length -= OPT_RR_SIZE;
+		query->packet.header.arcount = 0;
+		query->edns = 0;
+	}
+
+	if (0 < size) {
+		opt = (unsigned char *) &query->packet.header + query->packet.length;
+
+		/* Root name, type OPT, class is the UDP payload size,
+		 * TTL is extended RCODE, version 0, and flags, no RDATA.
+		 */
+		*opt++ = 0;
+		NET_SET_SHORT(opt, PDQ_TYPE_OPT);
+		opt += NET_SHORT_BYTE_SIZE;
+		NET_SET_SHORT(opt, size);
+		opt += NET_SHORT_BYTE_SIZE;
+		NET_SET_LONG(opt, 0);
+		opt += NET_LONG_BYTE_SIZE;
+		NET_SET_SHORT(opt, 0);
+
+		query->packet.length += OPT_RR_SIZE;
+		query->packet.header.arcount = htons(1);
+		query->edns = size;
+	}
+}
+
 static int
 pdq_query_fill(PDQ *pdq, PDQ_query *query, PDQ_class class, PDQ_type type, const char *name, int use_recursion)
 {
@@ -2246,6 +2533,9 @@ pdq_query_fill(PDQ *pdq, PDQ_query *query, PDQ_class class, PDQ_type type, const
 	*label++ = 0;
 	*label   = (unsigned char) class;
 
+	if (0 < pdq_edns_size)
+		pdq_query_edns(query, pdq_edns_size);
+
 	if (0 < debug)
 		syslog(LOG_DEBUG, "> query id=%-5u %s %s %s", ntohs(q->header.id), name, pdqClassName(class), pdqTypeName(type));
 
@@ -2303,6 +2593,204 @@ pdq_query_send(PDQ *pdq, PDQ_query *query)
 	return -(error_count == servers_length);
 }
 
+/*
+ * Return the index-th destination of a query following the same
+ * rules as pdq_query_send(), or NULL when there are no more.
+ */
+static SocketAddress *
+pdq_query_dest(PDQ *pdq, PDQ_query *query, int index)
+{
+	if (query->next_ns == -1)
+		return index == 0 ? &query->address : NULL;
+
+	if (pdq->round_robin) {
+		if (0 < index)
+			return NULL;
+		if (servers_length <= query->next_ns)
+			query->next_ns = 0;
+		return &servers[query->next_ns++];
+	}
+
+	return index < servers_length ? &servers[index] : NULL;
+}
+
+#ifdef HAVE_SENDMMSG
+static int
+pdq_sendmmsg(SOCKET fd, struct mmsghdr *msgs, int length)
+{
+	int i, sent, error_count;
+
+	error_count = 0;
+	for (i = 0; i < length; ) {
+		if ((sent = sendmmsg(fd, msgs + i, length - i, 0)) < 0) {
+			if (errno == EINTR)
+				continue;
+			/* Skip the message that failed. */
+			error_count++;
+			sent = 1;
+		}
+		i += sent;
+	}
+
+	return error_count;
+}
+#endif
+
+/*
+ * Send all the queries deferred while pdq->batch was set, using as
+ * few system calls as possible.
+ *
+ * @return
+ *	The number of packets that could not be sent.
+ */
+static int
+pdq_query_flush(PDQ *pdq)
+{
+	PDQ_query *query;
+	int error_count;
+#ifdef HAVE_SENDMMSG
+	int i, length;
+	SocketAddress *ns;
+	struct iovec iov[PDQ_BATCH_MAX];
+	struct mmsghdr msgs[PDQ_BATCH_MAX];
+
+	if (1 < pdq_batch_size) {
+		length = error_count = 0;
+
+		for (query = pdq->pending; query != NULL; query = query->next) {
+			if (!query->unsent)
+				continue;
+			query->unsent = 0;
+
+			if (1 < debug)
+				pdqLogPacket(&query->packet, 1);
+
+			for (i = 0; (ns = pdq_query_dest(pdq, query, i)) != NULL; i++) {
+				iov[length].iov_base = (void *) &query->packet.header;
+				iov[length].iov_len = query->packet.length;
+				memset(&msgs[length], 0, sizeof (msgs[length]));
+				msgs[length].msg_hdr.msg_name = (void *) &ns->sa;
+				msgs[length].msg_hdr.msg_namelen = socketAddressLength(ns);
+				msgs[length].msg_hdr.msg_iov = &iov[length];
+				msgs[length].msg_hdr.msg_iovlen = 1;
+
+				if (pdq_batch_size <= ++length) {
+					error_count += pdq_sendmmsg(pdq->fd, msgs, length);
+					length = 0;
+				}
+			}
+		}
+
+		if (0 < length)
+			error_count += pdq_sendmmsg(pdq->fd, msgs, length);
+
+		return error_count;
+	}
+#endif
+	error_count = 0;
+	for (query = pdq->pending; query != NULL; query = query->next) {
+		if (query->unsent) {
+			query->unsent = 0;
+			if (pdq_query_send(pdq, query))
+				error_count++;
+		}
+	}
+
+	return error_count;
+}
+
+/*
+ * Allocate the receive ring and its packet buffers as one block, each
+ * slot large enough for the advertised EDNS0 payload size. The ring
+ * is only replaced when that size has been raised since.
+ */
+static int
+pdq_ring_alloc(PDQ *pdq)
+{
+	int i;
+	size_t stride;
+	unsigned size;
+	PDQ_reply *ring;
+	unsigned char *block;
+
+	size = pdq_edns_size < UDP_PACKET_SIZE ? UDP_PACKET_SIZE : pdq_edns_size;
+	if (pdq->ring != NULL && size <= pdq->ring_packet)
+		return 0;
+
+	stride = offsetof(struct udp_packet, header) + size;
+	stride = (stride + sizeof (long) - 1) & ~(sizeof (long) - 1);
+
+	if ((ring = malloc(pdq_batch_size * (sizeof (*ring) + stride))) == NULL)
+		return -1;
+
+	block = (unsigned char *) &ring[pdq_batch_size];
+	for (i = 0; i < pdq_batch_size; i++)
+		ring[i].packet = (struct udp_packet *) (block + i * stride);
+
+	free(pdq->ring);
+	pdq->ring = ring;
+	pdq->ring_size = pdq_batch_size;
+	pdq->ring_packet = size;
+
+	return 0;
+}
+
+/*
+ * Read as many waiting replies as will fit in the receive ring with
+ * a single system call where possible.
+ *
+ * @return
+ *	The number of replies in pdq->ring or -1 on error.
+ */
+static int
+pdq_recv_batch(PDQ *pdq)
+{
+	ssize_t nbytes;
+	PDQ_reply *reply;
+#ifdef HAVE_RECVMMSG
+	int i, length;
+	struct iovec iov[PDQ_BATCH_MAX];
+	struct mmsghdr msgs[PDQ_BATCH_MAX];
+#endif
+	if (pdq_ring_alloc(pdq))
+		return -1;
+#ifdef HAVE_RECVMMSG
+	if (1 < pdq->ring_size) {
+		for (i = 0; i < pdq->ring_size; i++) {
+			reply = &pdq->ring[i];
+			iov[i].iov_base = (void *) &reply->packet->header;
+			iov[i].iov_len = pdq->ring_packet;
+			memset(&msgs[i], 0, sizeof (msgs[i]));
+			msgs[i].msg_hdr.msg_name = (void *) &reply->from;
+			msgs[i].msg_hdr.msg_namelen = sizeof (reply->from);
+			msgs[i].msg_hdr.msg_iov = &iov[i];
+			msgs[i].msg_hdr.msg_iovlen = 1;
+		}
+
+		if ((length = recvmmsg(pdq->fd, msgs, pdq->ring_size, MSG_DONTWAIT, NULL)) < 0)
+			return -1;
+
+		for (i = 0; i < length; i++) {
+			pdq->ring[i].packet->length = msgs[i].msg_len;
+			pdq->ring[i].fromlen = msgs[i].msg_hdr.msg_namelen;
+		}
+
+		return length;
+	}
+#endif
+	reply = pdq->ring;
+	reply->fromlen = sizeof (reply->from);
+	nbytes = recvfrom(
+		pdq->fd, (void *) &reply->packet->header, pdq->ring_packet, 0,
+		(struct sockaddr *) &reply->from, &reply->fromlen
+	);
+	if (nbytes < 0)
+		return -1;
+	reply->packet->length = (uint16_t) nbytes;
+
+	return 1;
+}
+
 int
 pdq_fill_rr(PDQ_rr *rr, struct udp_packet *packet, unsigned char *ptr, unsigned char **stop)
 {
@@ -2380,7 +2868,16 @@ pdq_reply_rr(struct udp_packet *packet, unsigned char *ptr, unsigned char **stop
 		return NULL;
 	}
 
-	if ((record = pdqCreate(type)) == NULL) {
+	if (type == PDQ_TYPE_OPT) {
+		/* The EDNS0 pseudo-RR is not returned to the caller.
+		 * pdq_reply_parse() skips the remainder like any other
+		 * unknown RR type.
+		 */
+		if (1 < debug)
+			syslog(LOG_DEBUG, "id=%u OPT udp=%u ext-rcode=%u version=%u", packet->header.id, class, *ptr, ptr[1]);
+		errno = EINVAL;
+		record = NULL;
+	} else if ((record = pdqCreate(type)) == NULL) {
 		syslog(LOG_ERR, "%s(%d): %s (%d)", __FILE__, __LINE__, strerror(errno), errno);
 	} else {
 		record->class = class;
@@ -2397,6 +2894,24 @@ pdq_reply_rr(struct udp_packet *packet, unsigned char *ptr, unsigned char **stop
 	return record;
 }
 
+/*
+ * Return a record reporting the failed query.
+ */
+static PDQ_rr *
+pdq_query_timedout(PDQ_query *query)
+{
+	PDQ_rr *entry;
+
+	if ((entry = pdqCreate(PDQ_TYPE_ANY)) != NULL) {
+		pdq_fill_rr(entry, &query->packet, query->packet.data, NULL);
+		((PDQ_QUERY *)entry)->rr.section = PDQ_SECTION_QUERY;
+		((PDQ_QUERY *)entry)->rcode = PDQ_RCODE_TIMEDOUT;
+		((PDQ_QUERY *)entry)->qdcount = 1;
+	}
+
+	return entry;
+}
+
 static PDQ_rr *
 pdq_query_send_all(PDQ *pdq)
 {
@@ -2409,23 +2924,71 @@ pdq_query_send_all(PDQ *pdq)
 	for (query = pdq->pending; query != NULL; query = next) {
 		next = query->next;
 		if (now < query->created + pdq->timeout) {
-			(void) pdq_query_send(pdq, query);
-		} else if ((entry = pdqCreate(PDQ_TYPE_ANY)) != NULL) {
-			/* Return a record reporting the failed query. */
-			pdq_fill_rr(entry, &query->packet, query->packet.data, NULL);
-			((PDQ_QUERY *)entry)->rr.section = PDQ_SECTION_QUERY;
-			((PDQ_QUERY *)entry)->rcode = PDQ_RCODE_TIMEDOUT;
-			((PDQ_QUERY *)entry)->qdcount = 1;
-
+			query->unsent = 1;
+		} else if ((entry = pdq_query_timedout(query)) != NULL) {
 			timedout = pdqListAppend(timedout, entry);
-			pdq_link_remove(&pdq->pending, query);
+			pdq_pending_remove(pdq, query);
 			free(query);
 		}
 	}
 
+	(void) pdq_query_flush(pdq);
+
 	return timedout;
 }
 
+/*
+ * RFC 2308 section 5: the negative TTL of an NXDOMAIN answer is the
+ * authority SOA MINIMUM bounded by the SOA TTL. ptr is the start of
+ * the answer section. Return PDQ_CACHE_NEGATIVE_TTL when there is no
+ * SOA.
+ */
+static uint32_t
+pdq_reply_negative_ttl(struct udp_packet *packet, unsigned char *ptr)
+{
+	int i, j;
+	uint16_t type;
+	uint32_t ttl, minimum;
+	unsigned short length;
+	unsigned char *rdata, *packet_end;
+
+	packet_end = (unsigned char *) &packet->header + packet->length;
+	j = packet->header.ancount + packet->header.nscount;
+
+	for (i = 0; i < j; i++) {
+		if ((ptr = pdq_name_skip(packet, ptr)) == NULL)
+			break;
+
+		/* type, class, ttl, and rdlength */
+		if (packet_end < ptr + 10)
+			break;
+
+		type = NET_GET_SHORT(ptr);
+		ttl = NET_GET_LONG(ptr + 4);
+		length = NET_GET_SHORT(ptr + 8);
+		rdata = ptr + 10;
+		ptr = rdata + length;
+
+		if (packet_end < ptr)
+			break;
+
+		if (i < packet->header.ancount || type != PDQ_TYPE_SOA)
+			continue;
+
+		/* Skip mname and rname to serial, refresh, retry, expire, minimum. */
+		if ((rdata = pdq_name_skip(packet, rdata)) == NULL
+		|| (rdata = pdq_name_skip(packet, rdata)) == NULL
+		|| ptr < rdata + 5 * NET_LONG_BYTE_SIZE)
+			break;
+
+		minimum = NET_GET_LONG(rdata + 4 * NET_LONG_BYTE_SIZE);
+
+		return minimum < ttl ? minimum : ttl;
+	}
+
+	return PDQ_CACHE_NEGATIVE_TTL;
+}
+
 static PDQ_rcode
 pdq_reply_parse(PDQ *pdq, struct udp_packet *packet, PDQ_rr **list)
 {
@@ -2485,7 +3048,11 @@ pdq_reply_parse(PDQ *pdq, struct udp_packet *packet, PDQ_rr **list)
 	pdq_fill_rr(&query->rr, packet, ptr, &ptr);
 
 	if (rcode != PDQ_RCODE_OK) {
-		/* Report a failed query. */
+		/* Report a failed query. Only the query record is kept,
+		 * so note how long an NXDOMAIN can be cached in it.
+		 */
+		if (rcode == PDQ_RCODE_NXDOMAIN)
+			query->rr.ttl = pdq_reply_negative_ttl(packet, ptr);
 		*list = (PDQ_rr *) query;
 		return rcode;
 	}
@@ -2836,104 +3403,1057 @@ error0:
 	return rcode;
 }
 
-static int
-pdq_check_reply_address(SocketAddress *address)
+/***********************************************************************
+ *** Answer Cache
+ ***********************************************************************/
+
+/*
+ * Copy the name in lower case without leading or trailing root dots
+ * so that "Example.COM." and "example.com" share a cache entry.
+ */
+static unsigned long
+pdq_cache_key(PDQ_class class, PDQ_type type, const char *name, char *buffer, size_t size)
 {
-	int i;
+	size_t length;
 
-	for (i = 0; i < servers_length; i++) {
-		if (socketAddressEqual((SocketAddress *) &servers[i], address))
-			return 1;
-	}
+	if (*name == '.' && name[1] != '\0')
+		name++;
 
-	return 0;
+	for (length = 0; length < size-1 && name[length] != '\0'; length++)
+		buffer[length] = (char) tolower(name[length]);
+	if (1 < length && buffer[length-1] == '.')
+		length--;
+	buffer[length] = '\0';
+
+	return TextHash(((unsigned long) class << 16) | type, buffer);
 }
 
-static PDQ_rcode
-pdq_query_reply(PDQ *pdq, struct udp_packet *packet, SocketAddress *address, PDQ_rr **list)
+static void
+pdq_cache_unlink(PDQ_cache_shard *shard, PDQ_cache_entry *entry)
 {
-	PDQ_rcode rcode;
-	PDQ_query *query;
-
-	*list = NULL;
+	if (entry->prev == NULL)
+		shard->head = entry->next;
+	else
+		entry->prev->next = entry->next;
 
-	/* Find the query associated with this response. */
-	for (query = pdq->pending; query != NULL; query = query->next) {
-		if (packet->header.id == query->packet.header.id)
-			break;
-	}
+	if (entry->next == NULL)
+		shard->tail = entry->prev;
+	else
+		entry->next->prev = entry->prev;
+}
 
-	if (query == NULL) {
+static void
+pdq_cache_push(PDQ_cache_shard *shard, PDQ_cache_entry *entry)
+{
+	entry->prev = NULL;
+	entry->next = shard->head;
+	if (shard->head == NULL)
+		shard->tail = entry;
+	else
+		shard->head->prev = entry;
+	shard->head = entry;
+}
+
+/*
+ * Remove an entry from both the LRU list and its hash chain. The
+ * caller holds the shard mutex.
+ */
+static void
+pdq_cache_remove(PDQ_cache_shard *shard, PDQ_cache_entry *entry)
+{
+	PDQ_cache_entry **prev;
+
+	for (prev = &shard->table[entry->hash % PDQ_CACHE_BUCKETS]; *prev != NULL; prev = &(*prev)->chain) {
+		if (*prev == entry) {
+			*prev = entry->chain;
+			break;
+		}
+	}
+
+	pdq_cache_unlink(shard, entry);
+	shard->stats.entries--;
+	pdqListFree(entry->list);
+	free(entry);
+}
+
+/*
+ * Discard least recently used entries until the shard is within
+ * its share of the cache size. The caller holds the shard mutex.
+ */
+static void
+pdq_cache_trim(PDQ_cache_shard *shard)
+{
+	unsigned long limit;
+
+	limit = (pdq_cache_size + PDQ_CACHE_SHARDS - 1) / PDQ_CACHE_SHARDS;
+
+	while (limit < shard->stats.entries && shard->tail != NULL) {
+		pdq_cache_remove(shard, shard->tail);
+		shard->stats.evictions++;
+	}
+}
+
+/*
+ * Return a copy of a cached answer with TTLs aged by the time it
+ * has been held, or NULL if there is no unexpired answer.
+ */
+static PDQ_rr *
+pdq_cache_get(PDQ_class class, PDQ_type type, const char *name)
+{
+	time_t now;
+	time_t age;
+	PDQ_rr *rr, *list;
+	unsigned long hash;
+	PDQ_cache_shard *shard;
+	PDQ_cache_entry *entry;
+	char key[DOMAIN_SIZE];
+
+	if (!pdq_cache_ready || pdq_cache_size == 0)
+		return NULL;
+
+	list = NULL;
+	(void) time(&now);
+	hash = pdq_cache_key(class, type, name, key, sizeof (key));
+	shard = &pdq_cache[hash % PDQ_CACHE_SHARDS];
+
+	PTHREAD_MUTEX_LOCK(&shard->mutex);
+
+	for (entry = shard->table[hash % PDQ_CACHE_BUCKETS]; entry != NULL; entry = entry->chain) {
+		if (entry->hash == hash && entry->class == class
+		&& entry->type == type && strcmp(entry->name, key) == 0)
+			break;
+	}
+
+	if (entry != NULL && entry->expires <= now) {
+		pdq_cache_remove(shard, entry);
+		shard->stats.expired++;
+		entry = NULL;
+	}
+
+	if (entry == NULL) {
+		shard->stats.misses++;
+	} else if ((list = pdqListClone(entry->list)) != NULL) {
+		pdq_cache_unlink(shard, entry);
+		pdq_cache_push(shard, entry);
+		shard->stats.hits++;
+
+		age = now - entry->created;
+		for (rr = list->next; rr != NULL; rr = rr->next)
+			rr->ttl = age < rr->ttl ? rr->ttl - (uint32_t) age : 0;
+	}
+
+	PTHREAD_MUTEX_UNLOCK(&shard->mutex);
+
+	if (0 < debug && list != NULL)
+		syslog(LOG_DEBUG, "cache hit %s %s %s", key, pdqClassName(class), pdqTypeName(type));
+
+	return list;
+}
+
+/*
+ * How long in seconds an answer can be cached. Positive answers
+ * use the smallest TTL of all the records, since the answer is
+ * cached as a unit. NXDOMAIN and NODATA answers use the SOA MINIMUM
+ * bounded by the SOA TTL, RFC 2308 section 5, else a default.
+ * Return zero if the answer should not be cached.
+ */
+static unsigned long
+pdq_cache_ttl(PDQ_rr *list)
+{
+	PDQ_rr *rr;
+	int has_soa;
+	unsigned long ttl;
+	PDQ_QUERY *query = (PDQ_QUERY *) list;
+
+	if (query->rcode != PDQ_RCODE_OK && query->rcode != PDQ_RCODE_NXDOMAIN)
+		return 0;
+
+	/* A truncated answer is incomplete. */
+	if (query->flags & PDQ_BITS_TC)
+		return 0;
+
+	has_soa = 0;
+	ttl = PDQ_CACHE_MAX_TTL;
+
+	if (query->rcode == PDQ_RCODE_NXDOMAIN) {
+		/* pdq_reply_parse() keeps only the query record for
+		 * NXDOMAIN, with its negative TTL already worked out.
+		 */
+		ttl = list->ttl;
+		has_soa = 1;
+	} else {
+		for (rr = list->next; rr != NULL; rr = rr->next) {
+			if (rr->ttl < ttl)
+				ttl = rr->ttl;
+			if (rr->type == PDQ_TYPE_SOA && rr->section == PDQ_SECTION_AUTHORITY) {
+				if (((PDQ_SOA *) rr)->minimum < ttl)
+					ttl = ((PDQ_SOA *) rr)->minimum;
+				has_soa = 1;
+			}
+		}
+	}
+
+	if (query->rcode == PDQ_RCODE_NXDOMAIN || query->ancount == 0) {
+		if (!has_soa)
+			ttl = PDQ_CACHE_NEGATIVE_TTL;
+		if (PDQ_CACHE_NEGATIVE_MAX < ttl)
+			ttl = PDQ_CACHE_NEGATIVE_MAX;
+	}
+
+	return ttl;
+}
+
+static void
+pdq_cache_put(PDQ_rr *list)
+{
+	unsigned long ttl, hash;
+	PDQ_cache_shard *shard;
+	PDQ_cache_entry *entry, *old;
+
+	if (!pdq_cache_ready || pdq_cache_size == 0 || list == NULL
+	|| list->section != PDQ_SECTION_QUERY || (ttl = pdq_cache_ttl(list)) == 0)
+		return;
+
+	if ((entry = malloc(sizeof (*entry))) == NULL)
+		return;
+
+	if ((entry->list = pdqListClone(list)) == NULL) {
+		free(entry);
+		return;
+	}
+
+	entry->class = list->class;
+	entry->type = list->type;
+	entry->hash = pdq_cache_key(list->class, list->type, list->name.string.value, entry->name, sizeof (entry->name));
+	(void) time(&entry->created);
+	entry->expires = entry->created + ttl;
+
+	hash = entry->hash;
+	shard = &pdq_cache[hash % PDQ_CACHE_SHARDS];
+
+	PTHREAD_MUTEX_LOCK(&shard->mutex);
+
+	/* Concurrent lookups of the same name replace the older answer. */
+	for (old = shard->table[hash % PDQ_CACHE_BUCKETS]; old != NULL; old = old->chain) {
+		if (old->hash == hash && old->class == entry->class
+		&& old->type == entry->type && strcmp(old->name, entry->name) == 0) {
+			pdq_cache_remove(shard, old);
+			break;
+		}
+	}
+
+	entry->chain = shard->table[hash % PDQ_CACHE_BUCKETS];
+	shard->table[hash % PDQ_CACHE_BUCKETS] = entry;
+	pdq_cache_push(shard, entry);
+	shard->stats.entries++;
+	shard->stats.inserts++;
+	pdq_cache_trim(shard);
+
+	PTHREAD_MUTEX_UNLOCK(&shard->mutex);
+}
+
+static void
+pdq_cache_init(void)
+{
+	int i;
+
+	if (!pdq_cache_ready) {
+		for (i = 0; i < PDQ_CACHE_SHARDS; i++) {
+			memset(&pdq_cache[i], 0, sizeof (pdq_cache[i]));
+			(void) pthread_mutex_init(&pdq_cache[i].mutex, NULL);
+		}
+		pdq_cache_ready = 1;
+	}
+}
+
+static void
+pdq_cache_fini(void)
+{
+	int i;
+
+	if (pdq_cache_ready) {
+		pdqCacheFlush();
+		for (i = 0; i < PDQ_CACHE_SHARDS; i++)
+			(void) pthread_mutex_destroy(&pdq_cache[i].mutex);
+		pdq_cache_ready = 0;
+	}
+}
+
+/**
+ * Discard all the answers held by the answer cache.
+ */
+void
+pdqCacheFlush(void)
+{
+	int i;
+	PDQ_cache_shard *shard;
+
+	if (!pdq_cache_ready)
+		return;
+
+	for (i = 0; i < PDQ_CACHE_SHARDS; i++) {
+		shard = &pdq_cache[i];
+		PTHREAD_MUTEX_LOCK(&shard->mutex);
+		while (shard->head != NULL)
+			pdq_cache_remove(shard, shard->head);
+		PTHREAD_MUTEX_UNLOCK(&shard->mutex);
+	}
+}
+
+/**
+ * @param entries
+ *	Maximum number of answers held by the process wide answer
+ *	cache shared by all PDQ instances. Zero disables and flushes
+ *	the cache. Lowering the size discards the least recently
+ *	used answers.
+ */
+void
+pdqCacheSetSize(unsigned long entries)
+{
+	int i;
+
+	pdq_cache_size = entries;
+
+	if (!pdq_cache_ready)
+		return;
+
+	for (i = 0; i < PDQ_CACHE_SHARDS; i++) {
+		PTHREAD_MUTEX_LOCK(&pdq_cache[i].mutex);
+		pdq_cache_trim(&pdq_cache[i]);
+		PTHREAD_MUTEX_UNLOCK(&pdq_cache[i].mutex);
+	}
+}
+
+/**
+ * @param stats
+ *	A pointer to a PDQ_cache_stats structure to fill with
+ *	the answer cache counters.
+ */
+void
+pdqCacheGetStats(PDQ_cache_stats *stats)
+{
+	int i;
+	PDQ_cache_shard *shard;
+
+	memset(stats, 0, sizeof (*stats));
+
+	if (!pdq_cache_ready)
+		return;
+
+	for (i = 0; i < PDQ_CACHE_SHARDS; i++) {
+		shard = &pdq_cache[i];
+		PTHREAD_MUTEX_LOCK(&shard->mutex);
+		stats->hits += shard->stats.hits;
+		stats->misses += shard->stats.misses;
+		stats->inserts += shard->stats.inserts;
+		stats->evictions += shard->stats.evictions;
+		stats->expired += shard->stats.expired;
+		stats->entries += shard->stats.entries;
+		PTHREAD_MUTEX_UNLOCK(&shard->mutex);
+	}
+}
+
+/***********************************************************************
+ *** Shared Engine Delivery
+ ***********************************************************************/
+
+/*
+ * Hand an answer to an engine client and wake it. The caller holds
+ * the engine mutex, which keeps the client from being closed.
+ */
+static void
+pdq_client_post(PDQ *pdq, PDQ_rr *answer)
+{
+	PTHREAD_MUTEX_LOCK(&pdq->mutex);
+
+	pdq->inbox = pdqListAppend(pdq->inbox, answer);
+	if (0 < pdq->outstanding)
+		pdq->outstanding--;
+	if (0 <= pdq->notify[1])
+		(void) write(pdq->notify[1], "", 1);
+	(void) pthread_cond_signal(&pdq->cv);
+
+	PTHREAD_MUTEX_UNLOCK(&pdq->mutex);
+}
+
+static void
+pdq_engine_unlink(PDQ_engine *engine, PDQ_query *query)
+{
+	PDQ_query **prev;
+
+	for (prev = &engine->table[query->hash % PDQ_ENGINE_BUCKETS]; *prev != NULL; prev = &(*prev)->key_chain) {
+		if (*prev == query) {
+			*prev = query->key_chain;
+			break;
+		}
+	}
+}
+
+/*
+ * Give each client waiting on an engine query its own copy of the
+ * answer, then forget the query so that a new one goes upstream.
+ */
+static void
+pdq_engine_deliver(PDQ_engine *engine, PDQ_query *query, PDQ_rr *list)
+{
+	PDQ_rr *answer;
+	PDQ_waiter *waiter, *next;
+
+	PTHREAD_MUTEX_LOCK(&engine->mutex);
+
+	pdq_engine_unlink(engine, query);
+
+	if (list != NULL && list->section == PDQ_SECTION_QUERY
+	&& ((PDQ_QUERY *) list)->rcode == PDQ_RCODE_TIMEDOUT)
+		engine->stats.timeouts++;
+	else
+		engine->stats.answers++;
+
+	for (waiter = query->waiters; waiter != NULL; waiter = next) {
+		next = waiter->next;
+		if (next == NULL) {
+			answer = list;
+			list = NULL;
+		} else {
+			answer = pdqListClone(list);
+		}
+		pdq_client_post(waiter->pdq, answer);
+		free(waiter);
+	}
+	query->waiters = NULL;
+
+	PTHREAD_MUTEX_UNLOCK(&engine->mutex);
+
+	pdqListFree(list);
+}
+
+static int
+pdq_check_reply_address(SocketAddress *address)
+{
+	int i;
+
+	for (i = 0; i < servers_length; i++) {
+		if (socketAddressEqual((SocketAddress *) &servers[i], address))
+			return 1;
+	}
+
+	return 0;
+}
+
+static PDQ_rcode
+pdq_query_reply(PDQ *pdq, struct udp_packet *packet, SocketAddress *address, PDQ_rr **list)
+{
+	PDQ_rcode rcode;
+	PDQ_query *query;
+
+	*list = NULL;
+
+	/* Find the query associated with this response. */
+	if ((query = pdq_pending_find(pdq, packet->header.id)) == NULL) {
 		/* Not one of our requests or already processed. Ignore it */
 		return PDQ_RCODE_ERRNO;
 	}
 
-	/* Make sure the result came from queried server. */
-	if (query->next_ns == -1) {
-		if (!socketAddressEqual(&query->address, address))
-			return PDQ_RCODE_ERRNO;
-	} else if (!pdq_check_reply_address(address)) {
-		return PDQ_RCODE_ERRNO;
+	/* Make sure the result came from queried server. */
+	if (query->next_ns == -1) {
+		if (!socketAddressEqual(&query->address, address))
+			return PDQ_RCODE_ERRNO;
+	} else if (!pdq_check_reply_address(address)) {
+		return PDQ_RCODE_ERRNO;
+	}
+
+	/* A server that does not understand EDNS0 should reply with
+	 * FORMERR, though some answer NOTIMP. Resend without the OPT
+	 * record, RFC 6891 section 7.
+	 */
+	if (query->edns != 0) {
+		switch (packet->header.bits & PDQ_BITS_RCODE) {
+		case PDQ_RCODE_FORMAT:
+		case PDQ_RCODE_NOT_IMPLEMENTED:
+			if (0 < debug)
+				syslog(LOG_DEBUG, "id=%u EDNS0 rejected, retry without OPT", ntohs(packet->header.id));
+			pdq_query_edns(query, 0);
+			(void) pdq_query_send(pdq, query);
+			return PDQ_RCODE_ERRNO;
+		}
+	}
+
+	if (pdq_ignore_tcp || (packet->header.bits & PDQ_BITS_TC) == 0)
+		rcode = pdq_reply_parse(pdq, packet, list);
+	else
+		rcode = pdq_query_tcp(pdq, query, address, list);
+
+	switch (rcode) {
+	case PDQ_RCODE_SERVFAIL:
+	case PDQ_RCODE_REFUSED:
+		if (1 < servers_length && query->next_ns != -1)
+			break;
+		/*@fallthrough@*/
+	default:
+//	case PDQ_RCODE_OK:
+//	case PDQ_RCODE_NXDOMAIN:
+//	case PDQ_RCODE_NOT_IMPLEMENTED:
+//	case PDQ_RCODE_FORMAT:
+//	case PDQ_RCODE_ERRNO:
+//	case PDQ_RCODE_TIMEDOUT:
+//	case PDQ_RCODE_ANY:
+		if (query->next_ns != -1)
+			pdq_cache_put(*list);
+		pdq_pending_remove(pdq, query);
+		if (pdq->owner != NULL) {
+			pdq_engine_deliver(pdq->owner, query, *list);
+			*list = NULL;
+		}
+		free(query);
+	}
+
+	return rcode;
+}
+
+/*
+ * Match a received packet to its query.
+ *
+ * @return
+ *	A list of answer records or NULL.
+ */
+static PDQ_rr *
+pdq_poll_reply(PDQ *pdq, PDQ_reply *reply)
+{
+	PDQ_rr *head;
+
+	reply->packet->header.bits = ntohs(reply->packet->header.bits);
+	if (0 < debug) {
+		char ipv6[IPV6_STRING_SIZE];
+		*ipv6 = '\0';
+#ifdef HAVE_STRUCT_SOCKADDR_IN6
+		if (reply->from.sa.sa_family == AF_INET6)
+			(void) formatIP((unsigned char *) &reply->from.in6.sin6_addr, IPV6_BYTE_SIZE, 1, ipv6, sizeof (ipv6));
+		else
+#endif
+			(void) formatIP((unsigned char *) &reply->from.in.sin_addr, IPV4_BYTE_SIZE, 1, ipv6, sizeof (ipv6));
+		syslog(LOG_DEBUG, "< recv id=%u rcode=%d length=%u from=%s", ntohs(reply->packet->header.id), reply->packet->header.bits & PDQ_BITS_RCODE, reply->packet->length, ipv6);
+	}
+
+	if ((reply->packet->header.bits & PDQ_BITS_RCODE) == PDQ_RCODE_REFUSED)
+		return NULL;
+
+	(void) pdq_query_reply(pdq, reply->packet, &reply->from, &head);
+
+	return head;
+}
+
+/***********************************************************************
+ *** Public Query Interface
+ ***********************************************************************/
+
+static int
+pdq_bind_port(SOCKET fd, SocketAddress *addr, int port)
+{
+	int rc;
+	socklen_t socklen;
+
+	switch (addr->sa.sa_family) {
+	case AF_INET:
+		addr->in.sin_port = htons(port);
+		socklen = sizeof (struct sockaddr_in);
+		break;
+#ifdef HAVE_STRUCT_SOCKADDR_IN6
+	case AF_INET6:
+		addr->in6.sin6_port = htons(port);
+		socklen = sizeof (struct sockaddr_in6);
+		break;
+#endif
+	default:
+		return -1;
+	}
+
+	rc = bind(fd, /*(const struct sockaddr *) */ (void *) &addr->sa, socklen);
+	UPDATE_ERRNO;
+
+	if (0 < debug)
+		syslog(LOG_DEBUG, "pdq_bind_port(port=%d) rc=%d errno=%d (%s)", port, rc, errno, strerror(errno));
+
+	return rc;
+}
+
+static PDQ *
+pdq_alloc(void)
+{
+	PDQ *pdq;
+
+	if ((pdq = malloc(sizeof (PDQ))) != NULL) {
+		pdq->fd = INVALID_SOCKET;
+		pdq->short_query = pdq_short_query;
+		pdq->round_robin = pdq_round_robin;
+		pdq->timeout = pdq_max_timeout;
+		pdq->pending = NULL;
+		pdq->cached = NULL;
+		pdq->batch = 0;
+		pdq->ring_size = 0;
+		pdq->ring_packet = 0;
+		pdq->ring = NULL;
+		pdq->by_id = NULL;
+		pdq->owner = NULL;
+		pdq->engine = NULL;
+		pdq->outstanding = 0;
+		pdq->inbox = NULL;
+		pdq->notify[0] = pdq->notify[1] = -1;
+	}
+
+	return pdq;
+}
+
+/*
+ * A PDQ instance with its own UDP socket.
+ */
+static PDQ *
+pdq_open_socket(void)
+{
+	PDQ *pdq;
+
+	if ((pdq = pdq_alloc()) == NULL)
+		goto error0;
+
+	if ((pdq->fd = socket(servers[0].sa.sa_family, SOCK_DGRAM, 0)) == INVALID_SOCKET) {
+		pdqClose(pdq);
+		pdq = NULL;
+		goto error0;
+	}
+# ifdef __unix__
+	(void) fcntl(pdq->fd, F_SETFD, FD_CLOEXEC);
+# endif
+#ifdef SO_LINGER
+{
+	struct linger setlinger = { 0, 0 };
+	(void) setsockopt(pdq->fd, SOL_SOCKET, SO_LINGER, (char *) &setlinger, sizeof (setlinger));
+}
+#endif
+	if (pdq_source_port_randomise) {
+		int i;
+		SocketAddress local;
+		char local_name[DOMAIN_SIZE], local_ip[IPV6_STRING_SIZE];
+
+		local_ip[0] = '\0';
+		local_name[0] = '\0';
+		networkGetMyDetails(local_name, local_ip);
+
+		if (0 < debug)
+			syslog(LOG_DEBUG, "host=%s ip=%s", local_name, local_ip);
+
+		if (pdq_parse_ns(local_ip, &local) == 0) {
+			local.sa.sa_family = servers[0].sa.sa_family;
+			for (i = 0; i < MAX_SPR_ATTEMPTS; i++) {
+				if (!pdq_bind_port(pdq->fd, &local, PRIVILIGED_PORTS + RANDOM_NUMBER(65535 - PRIVILIGED_PORTS)))
+					break;
+			}
+		}
+	}
+error0:
+	return pdq;
+}
+
+/***********************************************************************
+ *** Shared Engine
+ ***********************************************************************/
+
+/*
+ * Hand the queries submitted by clients to the engine sockets,
+ * round robin, and send them together.
+ */
+static void
+pdq_engine_submit(PDQ_engine *engine, uint64_t *next)
+{
+	int i;
+	PDQ *sock;
+	uint64_t now;
+	PDQ_query *query, *submitted;
+
+	PTHREAD_MUTEX_LOCK(&engine->mutex);
+	submitted = engine->submitted;
+	engine->submitted = NULL;
+	PTHREAD_MUTEX_UNLOCK(&engine->mutex);
+
+	if (submitted == NULL)
+		return;
+
+	now = timerMonotonicMs();
+
+	for ( ; (query = submitted) != NULL; ) {
+		submitted = query->next;
+		query->prev = query->next = NULL;
+
+		sock = engine->socket[engine->next++ % engine->length];
+
+		/* The ID must be unique among the socket's queries. */
+		while (pdq_pending_find(sock, query->packet.header.id) != NULL)
+			query->packet.header.id = htons(RANDOM_NUMBER(0xFFFF));
+
+		query->created = time(NULL);
+		query->expires = now + (uint64_t) sock->timeout * UNIT_MILLI;
+		query->delay = pdq_initial_timeout;
+		query->resend = now + query->delay;
+		if (query->resend < *next)
+			*next = query->resend;
+
+		query->unsent = 1;
+		pdq_pending_add(sock, query);
+	}
+
+	for (i = 0; i < engine->length; i++)
+		(void) pdq_query_flush(engine->socket[i]);
+}
+
+/*
+ * Retransmit the queries of an engine socket that are due, doubling
+ * each query's interval, and report those that have timed out.
+ *
+ * @return
+ *	The time of the next retransmit.
+ */
+static uint64_t
+pdq_engine_resend(PDQ *sock, uint64_t now)
+{
+	uint64_t next;
+	PDQ_query *query, *following;
+
+	next = now + PDQ_ENGINE_TICK_MS;
+
+	for (query = sock->pending; query != NULL; query = following) {
+		following = query->next;
+
+		if (query->expires <= now) {
+			pdq_pending_remove(sock, query);
+			pdq_engine_deliver(sock->owner, query, pdq_query_timedout(query));
+			free(query);
+			continue;
+		}
+
+		if (query->resend <= now) {
+			query->delay += query->delay;
+			query->resend = now + query->delay;
+			query->unsent = 1;
+		}
+
+		if (query->resend < next)
+			next = query->resend;
+		if (query->expires < next)
+			next = query->expires;
+	}
+
+	(void) pdq_query_flush(sock);
+
+	return next;
+}
+
+/*
+ * Read and dispatch the replies waiting on an engine socket.
+ */
+static void
+pdq_engine_recv(PDQ *sock)
+{
+	int i, length;
+
+	do {
+		if ((length = pdq_recv_batch(sock)) < 0)
+			break;
+		for (i = 0; i < length; i++)
+			(void) pdq_poll_reply(sock, &sock->ring[i]);
+	} while (1 < sock->ring_size && length == sock->ring_size);
+}
+
+static void *
+pdq_engine_thread(void *data)
+{
+	int i;
+	char drain[64];
+	long timeout;
+	uint64_t now, next;
+	PDQ_engine *engine = data;
+	struct pollfd fds[PDQ_ENGINE_SOCKETS_MAX + 1];
+
+	fds[0].fd = engine->wake[0];
+	fds[0].events = POLLIN;
+	for (i = 0; i < engine->length; i++) {
+		fds[i+1].fd = engine->socket[i]->fd;
+		fds[i+1].events = POLLIN;
+	}
+
+	next = timerMonotonicMs() + PDQ_ENGINE_TICK_MS;
+
+	while (engine->running) {
+		now = timerMonotonicMs();
+		timeout = next <= now ? 0 : (long) (next - now);
+
+		if (poll(fds, engine->length + 1, timeout) < 0) {
+			if (errno != EINTR)
+				syslog(LOG_ERR, "pdq engine poll: %s (%d)", strerror(errno), errno);
+			continue;
+		}
+
+		if (fds[0].revents & POLLIN) {
+			while (0 < read(engine->wake[0], drain, sizeof (drain)))
+				;
+		}
+
+		pdq_engine_submit(engine, &next);
+
+		for (i = 0; i < engine->length; i++) {
+			if (fds[i+1].revents & (POLLIN|POLLERR))
+				pdq_engine_recv(engine->socket[i]);
+		}
+
+		if (next <= (now = timerMonotonicMs())) {
+			next = now + PDQ_ENGINE_TICK_MS;
+			for (i = 0; i < engine->length; i++) {
+				uint64_t when = pdq_engine_resend(engine->socket[i], now);
+				if (when < next)
+					next = when;
+			}
+		}
+	}
+
+	return NULL;
+}
+
+static void
+pdq_engine_free(PDQ_engine *engine)
+{
+	int i;
+	PDQ_query *query, *next;
+	PDQ_waiter *waiter, *following;
+
+	/* Every query, whether submitted or in flight, is in the table. */
+	for (i = 0; i < PDQ_ENGINE_BUCKETS; i++) {
+		for (query = engine->table[i]; query != NULL; query = next) {
+			next = query->key_chain;
+			for (waiter = query->waiters; waiter != NULL; waiter = following) {
+				following = waiter->next;
+				free(waiter);
+			}
+			free(query);
+		}
+	}
+
+	/* The sockets' pending lists refer to queries freed above. */
+	for (i = 0; i < engine->length; i++) {
+		engine->socket[i]->pending = NULL;
+		free(engine->socket[i]->by_id);
+		engine->socket[i]->by_id = NULL;
+		pdqClose(engine->socket[i]);
 	}
 
-	if (pdq_ignore_tcp || (packet->header.bits & PDQ_BITS_TC) == 0)
-		rcode = pdq_reply_parse(pdq, packet, list);
-	else
-		rcode = pdq_query_tcp(pdq, query, address, list);
+	if (0 <= engine->wake[0]) {
+		(void) close(engine->wake[0]);
+		(void) close(engine->wake[1]);
+	}
 
-	switch (rcode) {
-	case PDQ_RCODE_SERVFAIL:
-	case PDQ_RCODE_REFUSED:
-		if (1 < servers_length && query->next_ns != -1)
-			break;
-		/*@fallthrough@*/
-	default:
-//	case PDQ_RCODE_OK:
-//	case PDQ_RCODE_NXDOMAIN:
-//	case PDQ_RCODE_NOT_IMPLEMENTED:
-//	case PDQ_RCODE_FORMAT:
-//	case PDQ_RCODE_ERRNO:
-//	case PDQ_RCODE_TIMEDOUT:
-//	case PDQ_RCODE_ANY:
-		pdq_link_remove(&pdq->pending, query);
-		free(query);
+	(void) pthread_mutex_destroy(&engine->mutex);
+	free(engine);
+}
+
+static PDQ_engine *
+pdq_engine_start(unsigned sockets)
+{
+	unsigned i;
+	PDQ_engine *engine;
+
+	if (PDQ_ENGINE_SOCKETS_MAX < sockets)
+		sockets = PDQ_ENGINE_SOCKETS_MAX;
+
+	if ((engine = calloc(1, sizeof (*engine))) == NULL)
+		goto error0;
+
+	engine->wake[0] = engine->wake[1] = -1;
+	if (pthread_mutex_init(&engine->mutex, NULL)) {
+		free(engine);
+		goto error0;
 	}
 
-	return rcode;
+	for (i = 0; i < sockets; i++) {
+		if ((engine->socket[i] = pdq_open_socket()) == NULL)
+			goto error1;
+		engine->length++;
+		if ((engine->socket[i]->by_id = calloc(PDQ_ENGINE_ID_BUCKETS, sizeof (PDQ_query *))) == NULL)
+			goto error1;
+		engine->socket[i]->owner = engine;
+	}
+
+	if (pipe(engine->wake))
+		goto error1;
+	(void) fileSetCloseOnExec(engine->wake[0], 1);
+	(void) fileSetCloseOnExec(engine->wake[1], 1);
+	(void) socket3_set_nonblocking(engine->wake[0], 1);
+	(void) socket3_set_nonblocking(engine->wake[1], 1);
+
+	engine->running = 1;
+	if (pthread_create(&engine->thread, NULL, pdq_engine_thread, engine))
+		goto error1;
+
+	if (0 < debug)
+		syslog(LOG_DEBUG, "pdq engine started sockets=%u", sockets);
+
+	return engine;
+error1:
+	pdq_engine_free(engine);
+error0:
+	syslog(LOG_ERR, "pdq engine: %s (%d)", strerror(errno), errno);
+	return NULL;
 }
 
-/***********************************************************************
- *** Public Query Interface
- ***********************************************************************/
+static void
+pdq_engine_stop(void)
+{
+	PDQ_engine *engine;
+
+	PTHREAD_MUTEX_LOCK(&pdq_engine_mutex);
+	engine = pdq_engine;
+	pdq_engine = NULL;
+	PTHREAD_MUTEX_UNLOCK(&pdq_engine_mutex);
+
+	if (engine != NULL) {
+		PTHREAD_MUTEX_LOCK(&engine->mutex);
+		engine->running = 0;
+		PTHREAD_MUTEX_UNLOCK(&engine->mutex);
+		(void) write(engine->wake[1], "", 1);
+		(void) pthread_join(engine->thread, NULL);
+		pdq_engine_free(engine);
+	}
+}
 
+/*
+ * Post a query for the engine, or join the query already in flight
+ * for the same question. The engine takes ownership of the query.
+ */
 static int
-pdq_bind_port(SOCKET fd, SocketAddress *addr, int port)
+pdq_engine_query(PDQ *pdq, PDQ_query *query)
 {
-	int rc;
-	socklen_t socklen;
+	int wake;
+	PDQ_query *flight;
+	PDQ_waiter *waiter;
+	PDQ_engine *engine = pdq->engine;
 
-	switch (addr->sa.sa_family) {
-	case AF_INET:
-		addr->in.sin_port = htons(port);
-		socklen = sizeof (struct sockaddr_in);
-		break;
-#ifdef HAVE_STRUCT_SOCKADDR_IN6
-	case AF_INET6:
-		addr->in6.sin6_port = htons(port);
-		socklen = sizeof (struct sockaddr_in6);
-		break;
-#endif
-	default:
+	if ((waiter = malloc(sizeof (*waiter))) == NULL)
 		return -1;
+
+	waiter->pdq = pdq;
+	waiter->next = NULL;
+	wake = 0;
+
+	PTHREAD_MUTEX_LOCK(&engine->mutex);
+
+	flight = NULL;
+	if (query->key[0] != '\0') {
+		for (flight = engine->table[query->hash % PDQ_ENGINE_BUCKETS]; flight != NULL; flight = flight->key_chain) {
+			if (flight->hash == query->hash && flight->class == query->class
+			&& flight->type == query->type && strcmp(flight->key, query->key) == 0)
+				break;
+		}
 	}
 
-	rc = bind(fd, /*(const struct sockaddr *) */ (void *) &addr->sa, socklen);
-	UPDATE_ERRNO;
+	if (flight != NULL) {
+		waiter->next = flight->waiters;
+		flight->waiters = waiter;
+		engine->stats.coalesced++;
+	} else {
+		query->waiters = waiter;
+		query->key_chain = engine->table[query->hash % PDQ_ENGINE_BUCKETS];
+		engine->table[query->hash % PDQ_ENGINE_BUCKETS] = query;
 
-	if (0 < debug)
-		syslog(LOG_DEBUG, "pdq_bind_port(port=%d) rc=%d errno=%d (%s)", port, rc, errno, strerror(errno));
+		wake = engine->submitted == NULL;
+		query->prev = NULL;
+		query->next = engine->submitted;
+		engine->submitted = query;
+		engine->stats.queries++;
+		query = NULL;
+	}
 
-	return rc;
+	PTHREAD_MUTEX_LOCK(&pdq->mutex);
+	pdq->outstanding++;
+	PTHREAD_MUTEX_UNLOCK(&pdq->mutex);
+
+	PTHREAD_MUTEX_UNLOCK(&engine->mutex);
+
+	/* Joined an existing query. */
+	free(query);
+
+	if (wake)
+		(void) write(engine->wake[1], "", 1);
+
+	return 0;
+}
+
+/*
+ * Detach a client from the engine queries it is waiting on and
+ * discard any answers not yet collected.
+ */
+static void
+pdq_engine_forget(PDQ *pdq)
+{
+	int i;
+	PDQ_query *query;
+	PDQ_waiter **prev, *waiter;
+	PDQ_engine *engine = pdq->engine;
+
+	if (0 < pdq->outstanding) {
+		PTHREAD_MUTEX_LOCK(&engine->mutex);
+		for (i = 0; i < PDQ_ENGINE_BUCKETS; i++) {
+			for (query = engine->table[i]; query != NULL; query = query->key_chain) {
+				for (prev = &query->waiters; (waiter = *prev) != NULL; ) {
+					if (waiter->pdq == pdq) {
+						*prev = waiter->next;
+						free(waiter);
+					} else {
+						prev = &waiter->next;
+					}
+				}
+			}
+		}
+		PTHREAD_MUTEX_UNLOCK(&engine->mutex);
+	}
+
+	PTHREAD_MUTEX_LOCK(&pdq->mutex);
+	pdq->outstanding = 0;
+	pdqListFree(pdq->inbox);
+	pdq->inbox = NULL;
+	PTHREAD_MUTEX_UNLOCK(&pdq->mutex);
+}
+
+/*
+ * Wait for answers delivered by the engine.
+ */
+static PDQ_rr *
+pdq_engine_poll(PDQ *pdq, unsigned ms)
+{
+	char drain[64];
+	PDQ_rr *answer;
+	struct timespec abstime, delay;
+
+	delay.tv_sec = ms / UNIT_MILLI;
+	delay.tv_nsec = (ms % UNIT_MILLI) * 1000000L;
+	timespecSetAbstime(&abstime, &delay);
+
+	answer = NULL;
+
+	PTHREAD_MUTEX_LOCK(&pdq->mutex);
+
+	while (pdq->inbox == NULL && 0 < pdq->outstanding) {
+		if (pthread_cond_timedwait(&pdq->cv, &pdq->mutex, &abstime) == ETIMEDOUT)
+			break;
+	}
+
+	answer = pdq->inbox;
+	pdq->inbox = NULL;
+
+	if (0 <= pdq->notify[0]) {
+		while (0 < read(pdq->notify[0], drain, sizeof (drain)))
+			;
+	}
+
+	PTHREAD_MUTEX_UNLOCK(&pdq->mutex);
+
+	errno = answer == NULL ? ETIMEDOUT : 0;
+
+	return answer;
 }
 
 /**
@@ -2944,6 +4464,7 @@ PDQ *
 pdqOpen(void)
 {
 	PDQ *pdq = NULL;
+	PDQ_engine *engine;
 
 	if (servers == NULL) {
 		if (pdqInit())
@@ -2951,47 +4472,22 @@ pdqOpen(void)
 		(void) atexit(pdqFini);
 	}
 
-	if ((pdq = malloc(sizeof (PDQ))) == NULL)
-		goto error0;
-
-	pdq->short_query = pdq_short_query;
-	pdq->round_robin = pdq_round_robin;
-	pdq->timeout = pdq_max_timeout;
-	pdq->pending = NULL;
-
-	if ((pdq->fd = socket(servers[0].sa.sa_family, SOCK_DGRAM, 0)) == INVALID_SOCKET) {
-		pdqClose(pdq);
-		pdq = NULL;
-		goto error0;
+	engine = NULL;
+	if (0 < pdq_engine_sockets) {
+		PTHREAD_MUTEX_LOCK(&pdq_engine_mutex);
+		if (pdq_engine == NULL)
+			pdq_engine = pdq_engine_start(pdq_engine_sockets);
+		engine = pdq_engine;
+		PTHREAD_MUTEX_UNLOCK(&pdq_engine_mutex);
 	}
-# ifdef __unix__
-	(void) fcntl(pdq->fd, F_SETFD, FD_CLOEXEC);
-# endif
-#ifdef SO_LINGER
-{
-	struct linger setlinger = { 0, 0 };
-	(void) setsockopt(pdq->fd, SOL_SOCKET, SO_LINGER, (char *) &setlinger, sizeof (setlinger));
-}
-#endif
-	if (pdq_source_port_randomise) {
-		int i;
-		SocketAddress local;
-		char local_name[DOMAIN_SIZE], local_ip[IPV6_STRING_SIZE];
-
-		local_ip[0] = '\0';
-		local_name[0] = '\0';
-		networkGetMyDetails(local_name, local_ip);
-
-		if (0 < debug)
-			syslog(LOG_DEBUG, "host=%s ip=%s", local_name, local_ip);
 
-		if (pdq_parse_ns(local_ip, &local) == 0) {
-			local.sa.sa_family = servers[0].sa.sa_family;
-			for (i = 0; i < MAX_SPR_ATTEMPTS; i++) {
-				if (!pdq_bind_port(pdq->fd, &local, PRIVILIGED_PORTS + RANDOM_NUMBER(65535 - PRIVILIGED_PORTS)))
-					break;
-			}
-		}
+	if (engine == NULL) {
+		pdq = pdq_open_socket();
+	} else if ((pdq = pdq_alloc()) != NULL) {
+		/* A light weight client of the shared engine. */
+		pdq->engine = engine;
+		(void) pthread_mutex_init(&pdq->mutex, NULL);
+		(void) pthread_cond_init(&pdq->cv, NULL);
 	}
 error0:
 	if (0 < debug)
@@ -3018,6 +4514,11 @@ pdqQueryRemoveAll(PDQ *pdq)
 		}
 
 		pdq->pending = NULL;
+		pdqListFree(pdq->cached);
+		pdq->cached = NULL;
+
+		if (pdq->engine)
+			pdq_engine_forget(pdq);
 	}
 }
 
@@ -3030,7 +4531,17 @@ pdqClose(PDQ *pdq)
 {
 	if (pdq != NULL) {
 		pdqQueryRemoveAll(pdq);
-		closesocket(pdq->fd);
+		if (pdq->engine) {
+			if (0 <= pdq->notify[0]) {
+				(void) close(pdq->notify[0]);
+				(void) close(pdq->notify[1]);
+			}
+			(void) pthread_cond_destroy(&pdq->cv);
+			(void) pthread_mutex_destroy(&pdq->mutex);
+		} else if (pdq->fd != INVALID_SOCKET) {
+			closesocket(pdq->fd);
+		}
+		free(pdq->ring);
 		free(pdq);
 	}
 }
@@ -3049,9 +4560,34 @@ pdqSetTimeout(PDQ *pdq, unsigned seconds)
 	return old;
 }
 
+/**
+ * @param pdq
+ *	A PDQ structure pointer for handling queries.
+ *
+ * @return
+ *	A file descriptor that becomes readable when pdqPoll() has
+ *	answers. For a client of the shared engine this is a pipe
+ *	created on the first call.
+ */
 SOCKET
 pdqGetFd(PDQ *pdq)
 {
+	if (pdq->engine && pdq->fd == INVALID_SOCKET) {
+		PTHREAD_MUTEX_LOCK(&pdq->mutex);
+		if (pipe(pdq->notify) == 0) {
+			(void) fileSetCloseOnExec(pdq->notify[0], 1);
+			(void) fileSetCloseOnExec(pdq->notify[1], 1);
+			(void) socket3_set_nonblocking(pdq->notify[0], 1);
+			(void) socket3_set_nonblocking(pdq->notify[1], 1);
+			pdq->fd = pdq->notify[0];
+			if (pdq->inbox != NULL)
+				(void) write(pdq->notify[1], "", 1);
+		} else {
+			pdq->notify[0] = pdq->notify[1] = -1;
+		}
+		PTHREAD_MUTEX_UNLOCK(&pdq->mutex);
+	}
+
 	return pdq->fd;
 }
 
@@ -3064,7 +4600,33 @@ pdqGetTimeout(PDQ *pdq)
 int
 pdqQueryIsPending(PDQ *pdq)
 {
-	return pdq->pending != NULL;
+	int pending;
+
+	pending = pdq->pending != NULL || pdq->cached != NULL;
+
+	if (!pending && pdq->engine) {
+		PTHREAD_MUTEX_LOCK(&pdq->mutex);
+		pending = 0 < pdq->outstanding || pdq->inbox != NULL;
+		PTHREAD_MUTEX_UNLOCK(&pdq->mutex);
+	}
+
+	return pending;
+}
+
+int
+pdqAnswerIsReady(PDQ *pdq)
+{
+	int ready;
+
+	ready = pdq->cached != NULL;
+
+	if (!ready && pdq->engine) {
+		PTHREAD_MUTEX_LOCK(&pdq->mutex);
+		ready = pdq->inbox != NULL;
+		PTHREAD_MUTEX_UNLOCK(&pdq->mutex);
+	}
+
+	return ready;
 }
 
 int
@@ -3114,6 +4676,7 @@ pdqSetLinearQuery(PDQ *pdq, int flag)
 int
 pdqQuery(PDQ *pdq, PDQ_class class, PDQ_type type, const char *name, const char *ns)
 {
+	PDQ_rr *cached;
 	PDQ_query *query;
 	char *buffer = NULL;
 
@@ -3132,6 +4695,24 @@ pdqQuery(PDQ *pdq, PDQ_class class, PDQ_type type, const char *name, const char
 		name = buffer;
 	}
 
+	/* Answers from the cache are returned by the next pdqPoll().
+	 * An engine client's pdqGetFd() is woken for them like for any
+	 * other answer; a PDQ with its own socket cannot be, so see
+	 * pdqAnswerIsReady().
+	 */
+	if (ns == NULL && (cached = pdq_cache_get(class, type, name)) != NULL) {
+		pdq->cached = pdqListAppend(pdq->cached, cached);
+		if (pdq->engine) {
+			PTHREAD_MUTEX_LOCK(&pdq->mutex);
+			if (0 <= pdq->notify[1])
+				(void) write(pdq->notify[1], "", 1);
+			PTHREAD_MUTEX_UNLOCK(&pdq->mutex);
+		}
+		free(buffer);
+		free(query);
+		return 0;
+	}
+
 	/* pdq_query_fill() will build the query and append
 	 * the root domain if required.
 	 */
@@ -3144,9 +4725,27 @@ pdqQuery(PDQ *pdq, PDQ_class class, PDQ_type type, const char *name, const char
 		query->next_ns = -1;
 	}
 
+	if (pdq->engine) {
+		/* Only queries to the system name servers are shared. */
+		if (ns == NULL) {
+			query->class = class;
+			query->type = type;
+			query->hash = pdq_cache_key(class, type, name, query->key, sizeof (query->key));
+		}
+		if (pdq_engine_query(pdq, query))
+			goto error1;
+		free(buffer);
+		return 0;
+	}
+
 	pdq_link_add(&pdq->pending, query);
 	free(buffer);
 
+	if (pdq->batch) {
+		query->unsent = 1;
+		return 0;
+	}
+
 	return pdq_query_send(pdq, query);
 error1:
 	free(buffer);
@@ -3171,7 +4770,7 @@ PDQ_rr *
 pdqPoll(PDQ *pdq, unsigned ms)
 {
 	TIMER_DECLARE(mark);
-	PDQ_rr *head, *answer;
+	PDQ_rr *answer;
 
 	if (0 < debug)
 		TIMER_START(mark);
@@ -3182,6 +4781,16 @@ pdqPoll(PDQ *pdq, unsigned ms)
 	}
 
 	errno = 0;
+
+	if (pdq->cached != NULL) {
+		answer = pdq->cached;
+		pdq->cached = NULL;
+		return answer;
+	}
+
+	if (pdq->engine)
+		return pdq_engine_poll(pdq, ms);
+
 	answer = NULL;
 
 #ifdef TEST2
@@ -3195,53 +4804,25 @@ pdqPoll(PDQ *pdq, unsigned ms)
 	sleep(1);
 #endif
 	if (socket3_wait(pdq->fd, ms, SOCKET_WAIT_READ) == 0) {
-		int saved_errno = 0;
-		PDQ_reply *reply, *replies = NULL, *next;
+		int i, length, saved_errno = 0;
 
-		/* First collect all the packets on the ready socket... */
+		/* Collect and parse the packets on the ready socket,
+		 * a batch at a time, until no more arrive or there
+		 * are no more queries waiting for an answer.
+		 */
 		do {
-			if ((reply = malloc(sizeof (*reply))) == NULL)
-				break;
-			reply->prev = reply->next = NULL;
-			reply->fromlen = sizeof (reply->from);
-			reply->packet.length = recvfrom(
-				pdq->fd, (void *) &reply->packet.header, UDP_PACKET_SIZE, 0,
-				(struct sockaddr *) &reply->from, &reply->fromlen
-			);
+			length = pdq_recv_batch(pdq);
 			saved_errno = errno;
-			reply->packet.header.bits = ntohs(reply->packet.header.bits);
-			if (0 < debug) {
-				char ipv6[IPV6_STRING_SIZE];
-				*ipv6 = '\0';
-#ifdef HAVE_STRUCT_SOCKADDR_IN6
-				if (reply->from.sa.sa_family == AF_INET6)
-					(void) formatIP((unsigned char *) &reply->from.in6.sin6_addr, IPV6_BYTE_SIZE, 1, ipv6, sizeof (ipv6));
-				else
-#endif
-					(void) formatIP((unsigned char *) &reply->from.in.sin_addr, IPV4_BYTE_SIZE, 1, ipv6, sizeof (ipv6));
-				syslog(LOG_DEBUG, "< recv id=%u rcode=%d length=%u from=%s", ntohs(reply->packet.header.id), reply->packet.header.bits & PDQ_BITS_RCODE, reply->packet.length, ipv6);
-			}
 
-			if ((reply->packet.header.bits & PDQ_BITS_RCODE) == PDQ_RCODE_REFUSED)
-				free(reply);
-			else
-				pdq_link_add(&replies, reply);
-		} while (socket3_wait(pdq->fd, SOCKET3_WAIT_NEXT_PACKET_MS, SOCKET_WAIT_READ) == 0);
+			for (i = 0; i < length; i++)
+				answer = pdqListAppend(answer, pdq_poll_reply(pdq, &pdq->ring[i]));
+		} while (pdq->pending != NULL && socket3_wait(pdq->fd, SOCKET3_WAIT_NEXT_PACKET_MS, SOCKET_WAIT_READ) == 0);
 
 		/* Restore the errno related to recvfrom, since we know
 		 * that socketTimeoutIO will more than likely set errno
 		 * to ETIMEDOUT.
 		 */
 		errno = saved_errno;
-
-		/* ...then parse the replies. */
-		for (reply = replies; reply != NULL; reply = next) {
-			next = reply->next;
-			pdq_link_remove(&replies, reply);
-			(void) pdq_query_reply(pdq, &reply->packet, &reply->from, &head);
-			answer = pdqListAppend(answer, head);
-			free(reply);
-		}
 	} else if (errno == ETIMEDOUT) {
 		/* pdq_query_send_all() returns a list of timed out queries. */
 		answer = pdq_query_send_all(pdq);
@@ -3277,8 +4858,11 @@ pdq_wait(PDQ *pdq, int wait_all)
 
 	answer = NULL;
 
-	if (pdq->pending != NULL) {
-		stop = time(NULL) + pdq->timeout;
+	if (pdqQueryIsPending(pdq)) {
+		/* The engine reports its own timeouts within pdqMaxTimeout()
+		 * of sending; allow for the one second resolution of time().
+		 */
+		stop = time(NULL) + pdq->timeout + (pdq->engine != NULL);
 		delay = pdq_initial_timeout;
 
 		do {
@@ -3289,7 +4873,7 @@ pdq_wait(PDQ *pdq, int wait_all)
 			}
 
 			answer = pdqListAppend(answer, head);
-		} while (pdq->pending != NULL && time(NULL) < stop && (wait_all || answer == NULL));
+		} while (time(NULL) < stop && (wait_all || answer == NULL) && pdqQueryIsPending(pdq));
 	}
 
 	if (0 < debug) {
@@ -3527,6 +5111,7 @@ pdqGet(PDQ *pdq, PDQ_class class, PDQ_type type, const char *name, const char *n
 	&& (type == PDQ_TYPE_MX || type == PDQ_TYPE_NS || type == PDQ_TYPE_SOA)) {
 		if (debug)
 			syslog(LOG_DEBUG, "pdqGet() related A/AAAA records...");
+		pdq->batch++;
 		for (rr = answer->rr.next; (rr = pdqListFindName(rr, class, type, rr->name.string.value)) != NULL; rr = rr->next) {
 			if (rr == PDQ_CNAME_TOO_DEEP || rr == PDQ_CNAME_IS_CIRCULAR)
 				break;
@@ -3545,6 +5130,8 @@ pdqGet(PDQ *pdq, PDQ_class class, PDQ_type type, const char *name, const char *n
 					(void) pdqQuery(pdq, class, PDQ_TYPE_AAAA, ((PDQ_MX *) rr)->host.string.value, ns);
 			}
 		}
+		pdq->batch--;
+		(void) pdq_query_flush(pdq);
 
 		answer->rr.next = pdqListAppend(answer->rr.next, pdqWaitAll(pdq));
 		answer->rr.next = pdqListPruneDup(answer->rr.next);
@@ -3654,13 +5241,19 @@ pdqGetDnsList(PDQ *pdq, PDQ_class class, PDQ_type type, const char *prefix_name,
 	if (0 < length && buffer[length-1] != '.' )
 		buffer[length++] = '.';
 
+	/* Send the queries for all the lists together. */
+	pdq->batch++;
 	for (suffix = suffix_list; *suffix != NULL; suffix++) {
 		/* Copy and query if no buffer overflow. */
 		if (TextCopy(buffer+length, sizeof (buffer)-length, *suffix + (**suffix == '.')) < sizeof (buffer)-length) {
-			if (pdqQuery(pdq, class, type, buffer, NULL))
+			if (pdqQuery(pdq, class, type, buffer, NULL)) {
+				pdq->batch--;
 				goto error1;
+			}
 		}
 	}
+	pdq->batch--;
+	(void) pdq_query_flush(pdq);
 
 	do {
 		answer = (*wait_fn)(pdq);
@@ -3674,7 +5267,7 @@ pdqGetDnsList(PDQ *pdq, PDQ_class class, PDQ_type type, const char *prefix_name,
 			while (answer != NULL && answer->section == PDQ_SECTION_QUERY && ((PDQ_QUERY *)answer)->rcode != PDQ_RCODE_OK)
 				answer = pdqListPruneQuery(answer);
 		}
-	} while (answer == NULL && pdq->pending != NULL);
+	} while (answer == NULL && pdqQueryIsPending(pdq));
 
 	if (0 < debug)
 		pdqListLog(answer);
@@ -4243,6 +5836,9 @@ pdqSetServers(Vector name_servers)
 	int i;
 	char *server;
 
+	/* Answers from the previous name servers no longer apply. */
+	pdqCacheFlush();
+
 	/* Convert the list of name server addresses into IP addresses. */
 	free(servers);
 	servers_length = VectorLength(name_servers);
@@ -4282,6 +5878,7 @@ pdqInit(void)
 
 	if (!pdq_initialised) {
 		pdq_initialised++;
+		pdq_cache_init();
 
 		/* Note that socket3_init() calls pdqInit(). */
 		socket3_init();
@@ -4346,8 +5943,10 @@ pdqFini(void)
 			pdqListFree(root_hints);
 			root_hints = NULL;
 		}
+		pdq_engine_stop();
 		free(servers);
 		servers = NULL;
+		pdq_cache_fini();
 		pdq_initialised--;
 	}
 }
@@ -4425,6 +6024,75 @@ pdqSetShortQuery(int flag)
 	pdq_short_query = flag;
 }
 
+/**
+ * @param size
+ *	Maximum number of packets sent or received by one system
+ *	call, when sendmmsg() and recvmmsg() are available. One
+ *	disables batching. The receive buffers of a PDQ instance
+ *	are sized on its first pdqPoll().
+ */
+void
+pdqSetBatchSize(unsigned size)
+{
+	if (size < 1)
+		size = 1;
+	if (PDQ_BATCH_MAX < size)
+		size = PDQ_BATCH_MAX;
+	pdq_batch_size = size;
+}
+
+/**
+ * @param sockets
+ *	Number of UDP sockets of the process wide resolver engine,
+ *	up to PDQ_ENGINE_SOCKETS_MAX. The engine starts with the next
+ *	pdqOpen() and runs until pdqFini(). Zero, the default, leaves
+ *	each PDQ instance with its own socket.
+ */
+void
+pdqSetEngine(unsigned sockets)
+{
+	if (PDQ_ENGINE_SOCKETS_MAX < sockets)
+		sockets = PDQ_ENGINE_SOCKETS_MAX;
+	pdq_engine_sockets = sockets;
+}
+
+/**
+ * @param stats
+ *	A pointer to a PDQ_engine_stats structure to fill with
+ *	the resolver engine counters.
+ */
+void
+pdqEngineGetStats(PDQ_engine_stats *stats)
+{
+	PDQ_engine *engine;
+
+	memset(stats, 0, sizeof (*stats));
+
+	PTHREAD_MUTEX_LOCK(&pdq_engine_mutex);
+	if ((engine = pdq_engine) != NULL) {
+		PTHREAD_MUTEX_LOCK(&engine->mutex);
+		*stats = engine->stats;
+		PTHREAD_MUTEX_UNLOCK(&engine->mutex);
+	}
+	PTHREAD_MUTEX_UNLOCK(&pdq_engine_mutex);
+}
+
+/**
+ * @param size
+ *	EDNS0 UDP payload size advertised with each query. Zero
+ *	disables EDNS0; otherwise the size is bounded between 512
+ *	and PDQ_EDNS_MAX_SIZE.
+ */
+void
+pdqSetEdnsSize(unsigned size)
+{
+	if (0 < size && size < UDP_PACKET_SIZE)
+		size = UDP_PACKET_SIZE;
+	if (PDQ_EDNS_MAX_SIZE < size)
+		size = PDQ_EDNS_MAX_SIZE;
+	pdq_edns_size = size;
+}
+
 /**
  * @param flag
  *	Set true to enable source port randomisation.
@@ -4448,10 +6116,13 @@ pdqSetSourcePortRandomisation(int flag)
 static char *query_server;
 
 static const char usage[] =
-"usage: pdq [-LprRsSTv][-c class][-l suffixes][-t sec][-q server]\n"
-"           type name [type name ...]\n"
+"usage: pdq [-CLprRsSTv][-c class][-e size][-E sockets][-l suffixes][-t sec]\n"
+"           [-q server] type name [type name ...]\n"
 "\n"
 "-c class\tone of IN (default), CH, CS, HS, or ANY\n"
+"-C\t\treport answer cache statistics\n"
+"-e size\t\tEDNS0 UDP payload size, 0 to disable; default " QUOTE(PDQ_EDNS_SIZE) "\n"
+"-E sockets\tuse the shared resolver engine with this many sockets\n"
 "-L\t\twait for all the replies from DNS lists, see -l\n"
 "-l suffixes\tcomma separated list of DNS list suffixes\n"
 "-p\t\tprune invalid MX, NS, or SOA records\n"
@@ -4553,8 +6224,9 @@ main(int argc, char **argv)
 	PDQ_rr *list, *answers;
 	PDQ_rr *(*wait_fn)(PDQ *);
 	char buffer[DOMAIN_SIZE];
-	int ch, type, class, i, prune_list, check_soa, from_root;
+	int ch, type, class, i, prune_list, check_soa, from_root, cache_stats;
 
+	cache_stats = 0;
 	from_root = 0;
 	check_soa = 0;
 	prune_list = 0;
@@ -4562,12 +6234,24 @@ main(int argc, char **argv)
 	suffix_list = NULL;
 	class = PDQ_CLASS_IN;
 
-	while ((ch = getopt(argc, argv, "LprRsSTvc:l:t:q:")) != -1) {
+	while ((ch = getopt(argc, argv, "CLprRsSTvc:e:E:l:t:q:")) != -1) {
 		switch (ch) {
 		case 'c':
 			class = pdqClassCode(optarg);
 			break;
 
+		case 'C':
+			cache_stats = 1;
+			break;
+
+		case 'e':
+			pdqSetEdnsSize((unsigned) strtoul(optarg, NULL, 10));
+			break;
+
+		case 'E':
+			pdqSetEngine((unsigned) strtoul(optarg, NULL, 10));
+			break;
+
 		case 'L':
 			wait_fn = pdqWaitAll;
 			break;
@@ -4687,6 +6371,16 @@ main(int argc, char **argv)
 	pdqListFree(answers);
 	pdqClose(pdq);
 
+	if (cache_stats) {
+		PDQ_cache_stats stats;
+
+		pdqCacheGetStats(&stats);
+		printf(
+			"cache hits=%lu misses=%lu inserts=%lu evictions=%lu expired=%lu entries=%lu\n",
+			stats.hits, stats.misses, stats.inserts, stats.evictions, stats.expired, stats.entries
+		);
+	}
+
 	if (suffix_list != NULL)
 		VectorDestroy(suffix_list);
 
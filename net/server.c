@@ -337,6 +337,11 @@ error0:
 
 static unsigned short session_counter = 0;
 
+/* The ID counters are shared by every server's accept thread and
+ * by workers starting other workers, so guard them.
+ */
+static pthread_mutex_t counter_mutex = PTHREAD_MUTEX_INITIALIZER;
+
 int
 serverSessionIsTerminated(ServerSession *session)
 {
@@ -363,6 +368,8 @@ sessionAccept(ServerSession *session)
 		return -1;
 	}
 
+	CLOCK_GET(&session->accepted);
+
 	if (session->server->hook.session_accept != NULL
 	&& (*session->server->hook.session_accept)(session)) {
 		syslog(LOG_ERR, "%s server-id=%u session-id=%u accept hook fail", session->id_log, session->server->id, session->id);
@@ -459,8 +466,11 @@ sessionCreate(Server *server)
 #endif
 
 	/* Counter ID zero is reserved for server thread identification. */
+	PTHREAD_MUTEX_LOCK(&counter_mutex);
 	if (++session_counter == 0)
 		session_counter = 1;
+	session->id = session_counter;
+	PTHREAD_MUTEX_UNLOCK(&counter_mutex);
 
 	/* The session-id is a message-id with cc=00, is composed of
 	 *
@@ -470,13 +480,12 @@ sessionCreate(Server *server)
 	 * some systems, incorporating timestamp and process info
 	 * in the session-id should facilitate log searches.
 	 */
-	session->id = session_counter;
 	session->start = time(NULL);
 	time62Encode(session->start, session->id_log);
 	length = snprintf(
 		session->id_log+TIME62_BUFFER_SIZE,
 		sizeof (session->id_log)-TIME62_BUFFER_SIZE,
-		"%05u%05u00", getpid(), session_counter
+		"%05u%05u00", getpid(), session->id
 	);
 
 	if (sizeof (session->id_log)-TIME62_BUFFER_SIZE <= length) {
@@ -552,6 +561,7 @@ serverInit(Server *server, const char *interfaces, unsigned default_port)
 		syslog(LOG_ERR, log_init, SERVER_FILE_LINENO, strerror(errno), errno);
 		goto error1;
 	}
+
 #if defined(HAVE_PTHREAD_ATTR_INIT)
 	if (pthread_attr_init(&server->thread_attr)) {
 		syslog(LOG_ERR, log_init, SERVER_FILE_LINENO, strerror(errno), errno);
@@ -569,6 +579,15 @@ serverInit(Server *server, const char *interfaces, unsigned default_port)
 	server->option.accept_to	= SERVER_ACCEPT_TO;
 	server->option.read_to		= SERVER_READ_TO;
 	server->option.port		= default_port;
+	server->option.grow_batch	= SERVER_GROW_BATCH;
+	server->option.shrink_delay	= SERVER_SHRINK_DELAY;
+	server->option.wait_target	= SERVER_WAIT_TARGET;
+	server->option.stats_interval	= SERVER_STATS_INTERVAL;
+
+	server->workers_active = 0;
+	server->workers_retire = 0;
+	memset(&server->stats, 0, sizeof (server->stats));
+	memset(&server->surplus_mark, 0, sizeof (server->surplus_mark));
 
 	server->id = ++count;
 
@@ -743,14 +762,268 @@ serverWorkerFree(void *_worker)
 
 }
 
+/***********************************************************************
+ *** Worker Pool
+ ***********************************************************************/
+
+static int serverWorkerCreate(Server *server);
+
+static unsigned long
+clockElapsedUs(CLOCK *start, CLOCK *now)
+{
+	CLOCK diff = *now;
+
+	CLOCK_SUB(&diff, start);
+	if (diff.tv_sec < 0)
+		return 0;
+
+	return (unsigned long) (CLOCK_TO_DOUBLE(&diff) * 1000000.0);
+}
+
+static void
+serverHistogramAdd(unsigned long *hist, unsigned long us)
+{
+	unsigned i;
+
+	for (i = 0; 1 < us && i < SERVER_HISTOGRAM_SIZE-1; i++)
+		us >>= 1;
+	hist[i]++;
+}
+
+/*
+ * Return the upper bound in microseconds of the histogram bucket
+ * holding the given percentile, or zero for an empty histogram.
+ */
+static unsigned long
+serverHistogramPercentile(unsigned long *hist, unsigned percent)
+{
+	unsigned i;
+	unsigned long total, rank;
+
+	for (total = i = 0; i < SERVER_HISTOGRAM_SIZE; i++)
+		total += hist[i];
+	if (total == 0)
+		return 0;
+
+	rank = (total * percent + 99) / 100;
+	for (i = 0; i < SERVER_HISTOGRAM_SIZE-1; i++) {
+		if (rank <= hist[i])
+			break;
+		rank -= hist[i];
+	}
+
+	return 2UL << i;
+}
+
+/*
+ * Called with workers.mutex held. Decide whether the pool should grow
+ * or shrink and return the number of worker threads the caller must
+ * start once the mutex is released. Sets *report when a stats interval
+ * has ended and the server_stats hook is due.
+ *
+ * The pool grows by at least grow_batch threads when sessions wait
+ * for a worker, or when the p99 wait from accept to process exceeds
+ * wait_target with the spare threads used up. It shrinks only after
+ * idle threads have exceeded spare_threads for shrink_delay, retiring
+ * the surplus as workers finish their current session.
+ */
+static unsigned
+serverPoolAdjust(Server *server, unsigned queued, int *report)
+{
+	CLOCK now;
+	unsigned threads, idle, need, surplus, batch;
+
+	CLOCK_GET(&now);
+
+	threads = server->workers.list.length - server->workers_retire;
+	idle = threads < server->workers_active ? 0 : threads - server->workers_active;
+	batch = server->option.grow_batch < 1 ? 1 : server->option.grow_batch;
+
+	need = idle < queued ? queued - idle : 0;
+	if (need == 0 && idle < server->option.spare_threads
+	&& server->option.wait_target * 1000UL < serverHistogramPercentile(server->stats.wait_hist, 99))
+		need = server->option.spare_threads - idle;
+
+	if (0 < need) {
+		memset(&server->surplus_mark, 0, sizeof (server->surplus_mark));
+
+		/* Cancel pending retirements before starting threads. */
+		if (0 < server->workers_retire) {
+			surplus = need < server->workers_retire ? need : server->workers_retire;
+			server->workers_retire -= surplus;
+			threads += surplus;
+			need -= surplus;
+			if (need == 0)
+				goto stats;
+		}
+
+		if (need < batch)
+			need = batch;
+		if (server->option.max_threads < threads + need)
+			need = threads < server->option.max_threads ? server->option.max_threads - threads : 0;
+	} else {
+		surplus = queued + server->option.spare_threads < idle ? idle - queued - server->option.spare_threads : 0;
+		if (surplus == 0 || threads <= server->option.min_threads) {
+			memset(&server->surplus_mark, 0, sizeof (server->surplus_mark));
+		} else if (TIMER_EQ_CONST(server->surplus_mark, 0, 0)) {
+			server->surplus_mark = now;
+		} else if (server->option.shrink_delay <= clockElapsedUs(&server->surplus_mark, &now) / 1000) {
+			if (threads - server->option.min_threads < surplus)
+				surplus = threads - server->option.min_threads;
+			server->workers_retire += surplus;
+			server->surplus_mark = now;
+
+			if (0 < server->debug.level)
+				syslog(LOG_DEBUG, "server-id=%u threads=%u idle=%u retire=%u", server->id, threads, idle, surplus);
+		}
+	}
+stats:
+	if (0 < server->option.stats_interval
+	&& server->option.stats_interval <= clockElapsedUs(&server->stats_mark, &now) / 1000) {
+		server->stats.wait_p50 = serverHistogramPercentile(server->stats.wait_hist, 50);
+		server->stats.wait_p99 = serverHistogramPercentile(server->stats.wait_hist, 99);
+		server->stats.service_p50 = serverHistogramPercentile(server->stats.service_hist, 50);
+		server->stats.service_p99 = serverHistogramPercentile(server->stats.service_hist, 99);
+		memset(server->stats.wait_hist, 0, sizeof (server->stats.wait_hist));
+		memset(server->stats.service_hist, 0, sizeof (server->stats.service_hist));
+		server->stats_mark = now;
+		*report = 1;
+	}
+
+	if (0 < need && 0 < server->debug.level)
+		syslog(LOG_DEBUG, "server-id=%u threads=%u idle=%u queued=%u grow=%u", server->id, threads, idle, queued, need);
+
+	return need;
+}
+
+/*
+ * Called with workers.mutex held. Return true if the calling worker
+ * should exit to shrink the pool.
+ */
+static int
+serverPoolRetire(Server *server)
+{
+	if (0 < server->workers_retire) {
+		server->workers_retire--;
+		server->stats.retired++;
+		return 1;
+	}
+
+	return 0;
+}
+
+static void
+serverPoolApply(Server *server, unsigned grow, int report)
+{
+	ServerStats stats;
+
+	for ( ; 0 < grow; grow--) {
+		if (serverWorkerCreate(server))
+			break;
+	}
+
+	if (report && server->hook.server_stats != NULL) {
+		serverGetStats(server, &stats);
+		(void) (*server->hook.server_stats)(server, &stats);
+	}
+}
+
+/**
+ * @param server
+ *	A Server pointer.
+ *
+ * @param stats
+ *	A ServerStats structure to fill with a snapshot of the worker
+ *	pool counters. The percentiles are those of the last completed
+ *	stats_interval; when stats_interval is zero, they are computed
+ *	over all sessions so far.
+ */
+void
+serverGetStats(Server *server, ServerStats *stats)
+{
+	unsigned queued;
+
+	queued = queueLength(&server->sessions_queued);
+
+	PTHREAD_MUTEX_LOCK(&server->workers.mutex);
+	*stats = server->stats;
+	stats->threads = server->workers.list.length;
+	stats->active = server->workers_active;
+	PTHREAD_MUTEX_UNLOCK(&server->workers.mutex);
+
+	stats->queued = queued;
+
+	if (server->option.stats_interval == 0) {
+		stats->wait_p50 = serverHistogramPercentile(stats->wait_hist, 50);
+		stats->wait_p99 = serverHistogramPercentile(stats->wait_hist, 99);
+		stats->service_p50 = serverHistogramPercentile(stats->service_hist, 50);
+		stats->service_p99 = serverHistogramPercentile(stats->service_hist, 99);
+	}
+}
+
+/***********************************************************************
+ *** Server Workers
+ ***********************************************************************/
+
+/*
+ * Account for a session about to be processed and return the number
+ * of worker threads to start.
+ */
+static unsigned
+serverWorkerBegin(ServerWorker *worker, ServerSession *session, CLOCK *start, unsigned queued, int *report)
+{
+	unsigned grow = 0;
+	Server *server = worker->server;
+
+	worker->session = session;
+	session->worker = worker;
+
+	CLOCK_GET(start);
+	PTHREAD_MUTEX_LOCK(&server->workers.mutex);
+	server->workers_active++;
+	serverHistogramAdd(server->stats.wait_hist, clockElapsedUs(&session->accepted, start));
+	grow = serverPoolAdjust(server, queued, report);
+	PTHREAD_MUTEX_UNLOCK(&server->workers.mutex);
+
+	return grow;
+}
+
+/*
+ * Account for a finished session. Return true if the worker should
+ * exit, in which case *grow is zero.
+ */
+static int
+serverWorkerEnd(ServerWorker *worker, CLOCK *start, unsigned queued, unsigned *grow, int *report)
+{
+	CLOCK now;
+	int retire = 0;
+	Server *server = worker->server;
+
+	worker->session = NULL;
+
+	CLOCK_GET(&now);
+	PTHREAD_MUTEX_LOCK(&server->workers.mutex);
+	if (--server->workers_active == 0)
+		pthread_cond_broadcast(&server->workers.cv_less);
+	server->stats.sessions++;
+	serverHistogramAdd(server->stats.service_hist, clockElapsedUs(start, &now));
+	*grow = serverPoolAdjust(server, queued, report);
+	if (*grow == 0)
+		retire = serverPoolRetire(server);
+	PTHREAD_MUTEX_UNLOCK(&server->workers.mutex);
+
+	return retire;
+}
+
 static void *
 serverWorker(void *_worker)
 {
-	unsigned sess_id;
+	CLOCK start;
+	int report, retire;
+	unsigned sess_id, grow;
 	Server *server;
 	ServerSession *session;
 	ServerWorker *worker = (ServerWorker *) _worker;
-	unsigned threads, active, idle, queued;
 
 	pthread_cleanup_push(serverWorkerFree, worker);
 
@@ -772,15 +1045,11 @@ serverWorker(void *_worker)
 			syslog(LOG_DEBUG, "%s server-id=%u worker-id=%u session-id=%u dequeued", session->id_log, server->id, worker->id, sess_id);
 		VALGRIND_PRINTF("%s server-id=%u worker-id=%u session-id=%u dequeued", session->id_log, server->id, worker->id, sess_id);
 
-		/* Keep track of active worker threads. */
-		PTHREAD_MUTEX_LOCK(&server->workers.mutex);
-		server->workers_active++;
-		PTHREAD_MUTEX_UNLOCK(&server->workers.mutex);
+		report = 0;
+		grow = serverWorkerBegin(worker, session, &start, queueLength(&server->sessions_queued), &report);
+		serverPoolApply(server, grow, report);
 
-		worker->session = session;
-		session->worker = worker;
-
-		if (session != NULL && session->client != NULL) {
+		if (session->client != NULL) {
 			sessionStart(session);
 			if (server->hook.session_process != NULL)
 				(void) (*server->hook.session_process)(session);
@@ -788,31 +1057,20 @@ serverWorker(void *_worker)
 		}
 
 		sessionFree(session);
-		worker->session = NULL;
 
-		/* Do we have too many threads? */
-		active = 0;
-		PTHREAD_MUTEX_LOCK(&server->workers.mutex);
-		active = --server->workers_active;
-		if (active == 0)
-			pthread_cond_broadcast(&server->workers.cv_less);
-		PTHREAD_MUTEX_UNLOCK(&server->workers.mutex);
-		queued = queueLength(&server->sessions_queued);
-		threads = queueLength(&server->workers);
-		idle = threads - active;
+		report = 0;
+		retire = serverWorkerEnd(worker, &start, queueLength(&server->sessions_queued), &grow, &report);
+		serverPoolApply(server, grow, report);
 
-                if (0 < server->debug.level)
-                        syslog(LOG_DEBUG, "server-id=%u active=%u idle=%u queued=%u", server->id, active, idle, queued);
+		if (0 < server->debug.level)
+			syslog(LOG_DEBUG, "server-id=%u worker-id=%u session-id=%u done", server->id, worker->id, sess_id);
+		VALGRIND_PRINTF("server-id=%u worker-id=%u session-id=%u done", server->id, worker->id, sess_id);
 
-		if (server->option.min_threads < threads && queued + server->option.spare_threads < idle) {
+		if (retire) {
 			if (0 < server->debug.level)
 				syslog(LOG_DEBUG, "server-id=%u worker-id=%u exit", server->id, worker->id);
 			break;
 		}
-
-		if (0 < server->debug.level)
-			syslog(LOG_DEBUG, "server-id=%u worker-id=%u session-id=%u done", server->id, worker->id, sess_id);
-		VALGRIND_PRINTF("server-id=%u worker-id=%u session-id=%u done", server->id, worker->id, sess_id);
 	}
 
 	pthread_cleanup_pop(1);
@@ -826,9 +1084,13 @@ serverWorker(void *_worker)
 static int
 serverWorkerCreate(Server *server)
 {
-	int cleanup = -1;
+	int cleanup = -1, save_errno;
 	ServerWorker *worker;
 
+	/* Concurrent workers may each decide to grow the pool. */
+	if (server->option.max_threads <= queueLength(&server->workers))
+		return 0;
+
 	if ((worker = calloc(1, sizeof (*worker))) == NULL) {
 		syslog(LOG_ERR, log_oom, SERVER_FILE_LINENO);
 		goto error0;
@@ -837,10 +1099,12 @@ serverWorkerCreate(Server *server)
 	PTHREAD_FREE_PUSH(worker);
 
 	/* Counter ID zero is reserved for server thread identification. */
+	PTHREAD_MUTEX_LOCK(&counter_mutex);
 	if (++worker_counter == 0)
 		worker_counter = 1;
-
 	worker->id = worker_counter;
+	PTHREAD_MUTEX_UNLOCK(&counter_mutex);
+
 	worker->server = server;
 	worker->node.data = worker;
 	worker->node.free = NULL;
@@ -857,13 +1121,22 @@ serverWorkerCreate(Server *server)
 		goto error1;
 	}
 
-	if (pthread_create(&worker->thread, &server->thread_attr, serverWorker, worker)) {
+	/* Hold the workers queue while starting the thread; a short
+	 * lived worker can otherwise exit and free itself, via
+	 * serverWorkerFree() and queueRemove(), before it is enqueued.
+	 */
+	PTHREAD_MUTEX_LOCK(&server->workers.mutex);
+	if ((errno = pthread_create(&worker->thread, &server->thread_attr, serverWorker, worker))) {
+		save_errno = errno;
 		syslog(LOG_ERR, "server-id=%u worker-id=%u thread create fail: %s (%d)", server->id, worker->id, strerror(errno), errno);
-		goto error1;
+		errno = save_errno;
+	} else {
+		(void) pthread_detach(worker->thread);
+		listInsertAfter(&server->workers.list, server->workers.list.tail, &worker->node);
+		server->stats.started++;
+		cleanup = 0;
 	}
-
-	if ((cleanup = pthread_detach(worker->thread)) == 0)
-		queueEnqueue(&server->workers, &worker->node);
+	PTHREAD_MUTEX_UNLOCK(&server->workers.mutex);
 error1:
 	PTHREAD_FREE_POP(cleanup);
 error0:
@@ -876,7 +1149,8 @@ serverAccept(void *_server)
 	int i;
 	ServerSession *session;
 	Server *server = (Server *) _server;
-	unsigned threads, active, idle, queued;
+	unsigned queued, grow;
+	int report;
 
 	if (0 < server->debug.level)
 		syslog(LOG_DEBUG, "server-id=%u running", server->id);
@@ -893,28 +1167,28 @@ serverAccept(void *_server)
 							continue;
 						}
 						queueEnqueue(&server->sessions_queued, &session->node);
-
-						/* Do we have too few threads? */
-						active = 0;
-						PTHREAD_MUTEX_LOCK(&server->workers.mutex);
-						active = server->workers_active;
-						PTHREAD_MUTEX_UNLOCK(&server->workers.mutex);
 						queued = queueLength(&server->sessions_queued);
-						threads = queueLength(&server->workers);
-						idle = threads - active;
 
 						if (0 < server->debug.level)
-							syslog(LOG_DEBUG, "%s server-id=%u session-id=%u enqueued; active=%u idle=%u queued=%u", session->id_log, server->id, session->id, active, idle, queued);
+							syslog(LOG_DEBUG, "%s server-id=%u session-id=%u enqueued; queued=%u", session->id_log, server->id, session->id, queued);
 
-						if (idle < queued && threads < server->option.max_threads) {
-							pthread_testcancel();
-							if (serverWorkerCreate(server)) {
-								continue;
-							}
-						}
+						/* Do we have too few threads? */
+						report = 0;
+						PTHREAD_MUTEX_LOCK(&server->workers.mutex);
+						grow = serverPoolAdjust(server, queued, &report);
+						PTHREAD_MUTEX_UNLOCK(&server->workers.mutex);
+						pthread_testcancel();
+						serverPoolApply(server, grow, report);
 					}
 				}
 			}
+		} else {
+			/* Accept timeout; roll the stats interval when idle. */
+			report = 0;
+			PTHREAD_MUTEX_LOCK(&server->workers.mutex);
+			grow = serverPoolAdjust(server, 0, &report);
+			PTHREAD_MUTEX_UNLOCK(&server->workers.mutex);
+			serverPoolApply(server, grow, report);
 		}
 	}
 
@@ -924,6 +1198,8 @@ serverAccept(void *_server)
 int
 serverStart(Server *server)
 {
+	unsigned i;
+
 	if (server == NULL)
 		return EFAULT;
 
@@ -937,6 +1213,13 @@ serverStart(Server *server)
 	}
 
 	server->running = 1;
+	CLOCK_GET(&server->stats_mark);
+
+	/* Pre-spawn the pool rather than grow it on the first burst. */
+	for (i = 0; i < server->option.min_threads || i < 1; i++) {
+		if (serverWorkerCreate(server))
+			return errno == 0 ? EAGAIN : errno;
+	}
 
 	if (pthread_create(&server->accept_thread, &server->thread_attr, serverAccept, server)) {
 		syslog(LOG_ERR, "server-id=%u thread create fail: %s (%d)", server->id, strerror(errno), errno);
@@ -1175,6 +1458,18 @@ reportFinish(ServerSession *session)
 	return 0;
 }
 
+int
+reportStats(Server *server, ServerStats *stats)
+{
+	syslog(
+		LOG_INFO, "server-id=%u sessions=%lu threads=%u active=%u queued=%u started=%lu retired=%lu wait-p50=%luus wait-p99=%luus service-p50=%luus service-p99=%luus",
+		server->id, stats->sessions, stats->threads, stats->active, stats->queued,
+		stats->started, stats->retired, stats->wait_p50, stats->wait_p99,
+		stats->service_p50, stats->service_p99
+	);
+	return 0;
+}
+
 int
 echoProcess(ServerSession *session)
 {
@@ -1536,6 +1831,7 @@ serverMain(void)
 		service->server->option.spare_threads = spare_threads;
 		service->server->option.min_threads = min_threads;
 		service->server->option.max_threads = max_threads;
+		service->server->hook.server_stats = reportStats;
 		service->server->debug.level = debug;
 		service->server->hook.server_start = service->start;
 		service->server->hook.server_stop = service->stop;
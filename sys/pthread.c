@@ -575,3 +575,13 @@ pthreadMutexDestroy(pthread_mutex_t *mutexp)
 	(void) pthread_mutex_unlock(mutexp);
 	return pthread_mutex_destroy(mutexp);
 }
+
+/*
+ * pthread_mutex_unlock() as a pthread_cleanup_push() handler, for
+ * PTHREAD_MUTEX_LOCK(), without casting between function types.
+ */
+void
+pthreadMutexUnlock(void *mutexp)
+{
+	(void) pthread_mutex_unlock(mutexp);
+}
@@ -0,0 +1,28 @@
+/*
+ * bench.c
+ *
+ * Benchmark Tool Support
+ *
+ * Copyright 2026 by Anthony Howe.  All rights reserved.
+ */
+
+#include <com/snert/lib/version.h>
+#include "bench.h"
+
+unsigned long
+benchRandom(unsigned long *seed)
+{
+	unsigned long x = *seed;
+
+	x ^= x << 13;
+	x ^= x >> 7;
+	x ^= x << 17;
+
+	return *seed = x;
+}
+
+double
+benchSeconds(unsigned long start)
+{
+	return (timerMonotonicMs() - start) / 1000.0;
+}
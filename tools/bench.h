@@ -0,0 +1,33 @@
+/*
+ * bench.h
+ *
+ * Benchmark Tool Support
+ *
+ * Copyright 2026 by Anthony Howe.  All rights reserved.
+ */
+
+#ifndef __bench_h__
+#define __bench_h__	1
+
+#include <com/snert/lib/util/timer.h>
+
+/**
+ * @param seed
+ *	A pointer to the non-zero xorshift state, updated in place.
+ *	Threads each with their own seed share no random state.
+ *
+ * @return
+ *	The next pseudo random number.
+ */
+extern unsigned long benchRandom(unsigned long *seed);
+
+/**
+ * @param start
+ *	A timerMonotonicMs() value taken at the start of a run.
+ *
+ * @return
+ *	The seconds elapsed since start.
+ */
+extern double benchSeconds(unsigned long start);
+
+#endif /* __bench_h__ */
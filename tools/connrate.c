@@ -0,0 +1,158 @@
+/*
+ * connrate.c
+ *
+ * Connection Rate Benchmark
+ *
+ * Copyright 2026 by Anthony Howe.  All rights reserved.
+ */
+
+#define _NAME			"connrate"
+
+#ifndef CONNRATE_HOST
+#define CONNRATE_HOST		"127.0.0.1"
+#endif
+
+#ifndef CONNRATE_PORT
+#define CONNRATE_PORT		9
+#endif
+
+#ifndef SOCKET_TIMEOUT
+#define SOCKET_TIMEOUT		30000
+#endif
+
+/***********************************************************************
+ *** No configuration below this point.
+ ***********************************************************************/
+#include <com/snert/lib/version.h>
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef HAVE_UNISTD_H
+# include <unistd.h>
+#endif
+
+#include <com/snert/lib/io/socket3.h>
+#include <com/snert/lib/sys/pthread.h>
+#include <com/snert/lib/sys/sysexits.h>
+#include <com/snert/lib/util/getopt.h>
+
+#include "bench.h"
+
+static long timeout = SOCKET_TIMEOUT;
+static unsigned long connections = 10000;
+static SocketAddress *address;
+
+typedef struct {
+	pthread_t thread;
+	unsigned long count;
+	unsigned long errors;
+} Client;
+
+static const char usage_msg[] =
+"usage: " _NAME " [-c connections][-t threads][-T timeout] [host[:port]]\n"
+"\n"
+"-c connections\ttotal number of connections; default 10000\n"
+"-t threads\tnumber of concurrent client threads; default 1\n"
+"-T timeout\tconnect timeout in milliseconds; default 30000\n"
+"\n"
+"Connect to and immediately disconnect from a server, then report\n"
+"the connections per second. The default server is " CONNRATE_HOST ":9,\n"
+"the discard service of the libsnert net/server test program.\n"
+"\n"
+LIBSNERT_COPYRIGHT "\n"
+;
+
+static void *
+client(void *data)
+{
+	SOCKET fd;
+	Client *self = data;
+
+	for ( ; 0 < self->count; self->count--) {
+		if ((fd = socket3_open(address, 1)) == INVALID_SOCKET) {
+			self->errors++;
+			continue;
+		}
+		if (socket3_client(fd, address, timeout))
+			self->errors++;
+		socket3_close(fd);
+	}
+
+	return NULL;
+}
+
+int
+main(int argc, char **argv)
+{
+	double elapsed;
+	Client *clients;
+	unsigned long start;
+	int ch, i, threads = 1;
+	unsigned long errors;
+
+	while ((ch = getopt(argc, argv, "c:t:T:")) != -1) {
+		switch (ch) {
+		case 'c':
+			connections = strtoul(optarg, NULL, 10);
+			break;
+		case 't':
+			threads = (int) strtol(optarg, NULL, 10);
+			break;
+		case 'T':
+			timeout = strtol(optarg, NULL, 10);
+			break;
+		default:
+			(void) fputs(usage_msg, stderr);
+			return EX_USAGE;
+		}
+	}
+
+	if (threads < 1)
+		threads = 1;
+
+	if (socket3_init()) {
+		(void) fprintf(stderr, "socket3_init: %s (%d)\n", strerror(errno), errno);
+		return EX_OSERR;
+	}
+
+	if ((address = socketAddressNew(optind < argc ? argv[optind] : CONNRATE_HOST, CONNRATE_PORT)) == NULL) {
+		(void) fprintf(stderr, "%s: invalid address\n", optind < argc ? argv[optind] : CONNRATE_HOST);
+		return EX_USAGE;
+	}
+
+	if ((clients = calloc(threads, sizeof (*clients))) == NULL) {
+		(void) fprintf(stderr, "%s (%d)\n", strerror(errno), errno);
+		return EX_OSERR;
+	}
+
+	start = timerMonotonicMs();
+
+	for (i = 0; i < threads; i++) {
+		clients[i].count = connections / threads + ((unsigned long) i < connections % threads);
+		if (pthread_create(&clients[i].thread, NULL, client, &clients[i])) {
+			(void) fprintf(stderr, "pthread_create: %s (%d)\n", strerror(errno), errno);
+			return EX_OSERR;
+		}
+	}
+
+	for (errors = 0, i = 0; i < threads; i++) {
+		(void) pthread_join(clients[i].thread, NULL);
+		errors += clients[i].errors;
+	}
+
+	elapsed = benchSeconds(start);
+	(void) printf(
+		"connections=%lu errors=%lu threads=%d seconds=%.3f rate=%.0f/s\n",
+		connections, errors, threads, elapsed,
+		0 < elapsed ? (connections - errors) / elapsed : 0.0
+	);
+
+	free(address);
+	free(clients);
+	socket3_fini();
+
+	return errors == 0 ? EX_OK : EXIT_FAILURE;
+}
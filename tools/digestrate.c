@@ -0,0 +1,486 @@
+/*
+ * digestrate.c
+ *
+ * MIME Part Digest Throughput Benchmark
+ *
+ * Copyright 2026 by Anthony Howe.  All rights reserved.
+ */
+
+#define _NAME			"digestrate"
+
+/***********************************************************************
+ *** No configuration below this point.
+ ***********************************************************************/
+#include <com/snert/lib/version.h>
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <com/snert/lib/mail/digest.h>
+#include <com/snert/lib/mail/mime.h>
+#include <com/snert/lib/sys/sysexits.h>
+#include <com/snert/lib/util/getopt.h>
+#include <com/snert/lib/util/ixhash.h>
+#include <com/snert/lib/util/md5.h>
+
+#include "bench.h"
+
+#define BOUNDARY		"=_digestrate_boundary"
+
+static unsigned rounds = 10;
+static size_t synthetic_size = 4 * 1024 * 1024;
+
+typedef struct {
+	const char *name;
+	unsigned char *data;
+	size_t length;
+} Input;
+
+typedef struct {
+	DigestPart *parts;
+	size_t length;
+	size_t size;
+} Result;
+
+typedef struct {
+	Mime *mime;
+	unsigned flags;
+	size_t index;
+	Result *result;
+	int is_body;
+	unsigned char *body;
+	size_t body_length;
+	size_t body_size;
+} Pass;
+
+static const char usage_msg[] =
+"usage: " _NAME " [-r rounds][-s size] [message.eml ...]\n"
+"\n"
+"-r rounds\tnumber of times to digest each message; default 10\n"
+"-s size\t\tsize in KB of the synthetic attachments; default 4096,\n"
+"\t\tzero to digest only the given messages\n"
+"\n"
+"Compute the MD5 encoded, MD5 decoded, ixhash, and DKIM simple and\n"
+"relaxed digests of each MIME part, first with a separate parse for\n"
+"each digest, ixhash using the whole body functions, then all in one\n"
+"parse with digestMimeInit(), and report the throughput in MB/s.\n"
+"Both must produce the same digests.\n"
+"\n"
+LIBSNERT_COPYRIGHT "\n"
+;
+
+static const char b64_alphabet[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+static DigestPart *
+result_part(Pass *pass)
+{
+	DigestPart *parts;
+	Result *result = pass->result;
+
+	if (result->length <= pass->index) {
+		if (result->size <= pass->index) {
+			result->size = (pass->index + 1) * 2;
+			if ((parts = realloc(result->parts, result->size * sizeof (*parts))) == NULL)
+				return NULL;
+			result->parts = parts;
+		}
+		memset(&result->parts[pass->index], 0, sizeof (*parts));
+		result->length = pass->index + 1;
+	}
+
+	return &result->parts[pass->index++];
+}
+
+/*
+ * Merge the digests selected by the pass into the result, so that the
+ * separate passes build up the same table as the single pass.
+ */
+static void
+part_digest(Mime *m, DigestPart *part, void *data)
+{
+	DigestPart *out;
+	Pass *pass = data;
+
+	if ((out = result_part(pass)) == NULL)
+		return;
+
+	out->part = part->part;
+	out->length = part->length;
+	out->decoded_length = part->decoded_length;
+
+	if (pass->flags & DIGEST_MD5_ENCODED)
+		memcpy(out->md5_encoded, part->md5_encoded, sizeof (out->md5_encoded));
+	if (pass->flags & DIGEST_MD5_DECODED)
+		memcpy(out->md5_decoded, part->md5_decoded, sizeof (out->md5_decoded));
+	if (pass->flags & DIGEST_IXHASH) {
+		out->ixhash = part->ixhash;
+		memcpy(out->ixhash1, part->ixhash1, sizeof (out->ixhash1));
+		memcpy(out->ixhash2, part->ixhash2, sizeof (out->ixhash2));
+		memcpy(out->ixhash3, part->ixhash3, sizeof (out->ixhash3));
+	}
+	if (pass->flags & DIGEST_DKIM_SIMPLE)
+		memcpy(out->dkim_simple, part->dkim_simple, sizeof (out->dkim_simple));
+	if (pass->flags & DIGEST_DKIM_RELAXED)
+		memcpy(out->dkim_relaxed, part->dkim_relaxed, sizeof (out->dkim_relaxed));
+}
+
+/*
+ * The ixhash pass collects each decoded part body and then applies the
+ * whole body condition and hash functions, as smtpe scripts did.
+ */
+static void
+ixhash_body_start(Mime *m, void *data)
+{
+	Pass *pass = data;
+
+	pass->is_body = 1;
+	pass->body_length = 0;
+}
+
+static void
+ixhash_decode_flush(Mime *m, void *data)
+{
+	unsigned char *body;
+	Pass *pass = data;
+
+	if (!pass->is_body)
+		return;
+
+	if (pass->body_size < pass->body_length + m->decode.length) {
+		pass->body_size = (pass->body_length + m->decode.length) * 2;
+		if ((body = realloc(pass->body, pass->body_size)) == NULL) {
+			pass->body_size = 0;
+			return;
+		}
+		pass->body = body;
+	}
+
+	memcpy(pass->body + pass->body_length, m->decode.buffer, m->decode.length);
+	pass->body_length += m->decode.length;
+}
+
+static void
+ixhash_string(void (*ixhash_fn)(md5_state_t *, const unsigned char *, size_t), Pass *pass, char digest_string[33])
+{
+	md5_state_t md5;
+	md5_byte_t digest[16];
+
+	md5_init(&md5);
+	(*ixhash_fn)(&md5, pass->body, pass->body_length);
+	md5_finish(&md5, digest);
+	md5_digest_to_string(digest, digest_string);
+}
+
+static void
+ixhash_body_finish(Mime *m, void *data)
+{
+	DigestPart part;
+	Pass *pass = data;
+
+	if (!pass->is_body)
+		return;
+	pass->is_body = 0;
+
+	memset(&part, 0, sizeof (part));
+	part.part = m->mime_part_number;
+	part.length = m->mime_body_length;
+	part.decoded_length = m->mime_body_decoded_length;
+
+	if (ixhash_condition1(pass->body, pass->body_length))
+		part.ixhash = 1;
+	else if (ixhash_condition2(pass->body, pass->body_length))
+		part.ixhash = 2;
+	else if (ixhash_condition3(pass->body, pass->body_length))
+		part.ixhash = 3;
+
+	ixhash_string(ixhash_hash1, pass, part.ixhash1);
+	ixhash_string(ixhash_hash2, pass, part.ixhash2);
+	ixhash_string(ixhash_hash3, pass, part.ixhash3);
+
+	part_digest(m, &part, data);
+}
+
+static void
+ixhash_free(Mime *m, void *data)
+{
+	MimeHooks *hook = data;
+	Pass *pass = hook->data;
+
+	free(pass->body);
+	free(hook);
+}
+
+static int
+pass_init(Pass *pass, unsigned flags, Result *result)
+{
+	MimeHooks *hook;
+
+	memset(pass, 0, sizeof (*pass));
+	pass->flags = flags;
+	pass->result = result;
+
+	if ((pass->mime = mimeCreate()) == NULL)
+		return -1;
+
+	if (flags == DIGEST_IXHASH) {
+		if ((hook = calloc(1, sizeof (*hook))) == NULL)
+			return -1;
+		hook->data = pass;
+		hook->free_hook = ixhash_free;
+		hook->body_start = ixhash_body_start;
+		hook->body_finish = ixhash_body_finish;
+		hook->decode_flush = ixhash_decode_flush;
+	} else if ((hook = (MimeHooks *) digestMimeInit(flags, part_digest, pass)) == NULL) {
+		return -1;
+	}
+	mimeHooksAdd(pass->mime, hook);
+
+	return 0;
+}
+
+static void
+parse(Pass *pass, Input *in)
+{
+	pass->index = 0;
+	mimeMsgStart(pass->mime);
+	(void) mimeNextBuf(pass->mime, in->data, in->length);
+	(void) mimeNextCh(pass->mime, EOF);
+	mimeMsgFinish(pass->mime);
+}
+
+static int
+append(Input *in, size_t *size, const char *s, size_t length)
+{
+	unsigned char *data;
+
+	if (*size <= in->length + length) {
+		*size = (in->length + length) * 2;
+		if ((data = realloc(in->data, *size)) == NULL)
+			return -1;
+		in->data = data;
+	}
+
+	memcpy(in->data + in->length, s, length);
+	in->length += length;
+
+	return 0;
+}
+
+#define APPEND(in, size, s)	append(in, size, s, strlen(s))
+
+static const char headers[] =
+"From: sender@example.com\r\n"
+"To: recipient@example.com\r\n"
+"Subject: " _NAME "\r\n"
+"MIME-Version: 1.0\r\n"
+"Content-Type: multipart/mixed; boundary=\"" BOUNDARY "\"\r\n"
+"\r\n"
+"This is a multi-part message in MIME format.\r\n"
+"\r\n"
+;
+
+static const char lorem[] =
+"Lorem ipsum dolor sit amet, consectetur adipiscing elit, sed do eiusmod "
+"tempor incididunt ut labore et dolore magna aliqua. Ut enim ad minim veniam, "
+"quis nostrud exercitation ullamco laboris nisi ut aliquip ex ea commodo. "
+;
+
+/*
+ * A multipart message with a text part, a quoted-printable part, and
+ * a base64 attachment, each about a third of the synthetic size.
+ */
+static int
+synthetic(Input *in)
+{
+	size_t size, col, stop;
+	unsigned long seed, x;
+	char line[80], *t;
+
+	size = 0;
+	seed = 2463534242UL;
+	memset(in, 0, sizeof (*in));
+	in->name = "synthetic";
+
+	if (APPEND(in, &size, headers))
+		return -1;
+
+	if (APPEND(in, &size, "--" BOUNDARY "\r\nContent-Type: text/plain\r\n\r\n"))
+		return -1;
+	for (stop = synthetic_size / 3; in->length < stop; ) {
+		/* Wrap lorem at different points for varied line lengths. */
+		x = benchRandom(&seed) % (sizeof (lorem)-1);
+		if (append(in, &size, lorem, x) || APPEND(in, &size, " \t\r\n"))
+			return -1;
+	}
+
+	if (APPEND(in, &size, "\r\n--" BOUNDARY "\r\nContent-Type: text/plain; charset=iso-8859-1\r\nContent-Transfer-Encoding: quoted-printable\r\n\r\n"))
+		return -1;
+	for (stop = 2 * synthetic_size / 3; in->length < stop; ) {
+		if (append(in, &size, lorem, 70) || APPEND(in, &size, "=E9t=3D=\r\n"))
+			return -1;
+	}
+
+	if (APPEND(in, &size, "\r\n--" BOUNDARY "\r\nContent-Type: application/octet-stream\r\nContent-Transfer-Encoding: base64\r\n\r\n"))
+		return -1;
+	while (in->length < synthetic_size) {
+		/* 76 column lines of random binary content. */
+		for (t = line, col = 0; col < 76; col += 4) {
+			x = benchRandom(&seed);
+			*t++ = b64_alphabet[x & 63];
+			*t++ = b64_alphabet[(x >> 6) & 63];
+			*t++ = b64_alphabet[(x >> 12) & 63];
+			*t++ = b64_alphabet[(x >> 18) & 63];
+		}
+		*t++ = '\r';
+		*t++ = '\n';
+		if (append(in, &size, line, t - line))
+			return -1;
+	}
+
+	return APPEND(in, &size, "\r\n--" BOUNDARY "--\r\n");
+}
+
+static int
+load(Input *in, const char *filename)
+{
+	FILE *fp;
+	size_t n, size;
+	char buffer[8192];
+
+	size = 0;
+	memset(in, 0, sizeof (*in));
+	in->name = filename;
+
+	if ((fp = fopen(filename, "rb")) == NULL)
+		return -1;
+
+	while (0 < (n = fread(buffer, 1, sizeof (buffer), fp))) {
+		if (append(in, &size, buffer, n)) {
+			(void) fclose(fp);
+			return -1;
+		}
+	}
+
+	(void) fclose(fp);
+
+	return 0;
+}
+
+static const unsigned separate_flags[] = {
+	DIGEST_MD5_ENCODED, DIGEST_MD5_DECODED, DIGEST_IXHASH,
+	DIGEST_DKIM_SIMPLE, DIGEST_DKIM_RELAXED
+};
+
+#define SEPARATE_PASSES		(sizeof (separate_flags) / sizeof (*separate_flags))
+
+static Result separate_result, single_result;
+static Pass separate[SEPARATE_PASSES], single;
+
+static int
+benchmark(Input *in)
+{
+	int same;
+	size_t i;
+	unsigned round;
+	unsigned long start;
+	double separate_secs, single_secs, mb;
+
+	start = timerMonotonicMs();
+	for (round = 0; round < rounds; round++) {
+		for (i = 0; i < SEPARATE_PASSES; i++)
+			parse(&separate[i], in);
+	}
+	separate_secs = benchSeconds(start);
+
+	start = timerMonotonicMs();
+	for (round = 0; round < rounds; round++)
+		parse(&single, in);
+	single_secs = benchSeconds(start);
+
+	same = separate_result.length == single_result.length
+		&& memcmp(separate_result.parts, single_result.parts, single_result.length * sizeof (*single_result.parts)) == 0;
+
+	mb = (double) in->length * rounds / (1024.0 * 1024.0);
+
+	(void) printf(
+		"%s bytes=%lu parts=%lu separate=%.1fMB/s single=%.1fMB/s speedup=%.2f%s\n",
+		in->name, (unsigned long) in->length, (unsigned long) single_result.length,
+		0 < separate_secs ? mb / separate_secs : 0.0,
+		0 < single_secs ? mb / single_secs : 0.0,
+		0 < single_secs ? separate_secs / single_secs : 0.0,
+		same ? "" : " DIFFERENT"
+	);
+
+	separate_result.length = 0;
+	single_result.length = 0;
+
+	return same ? 0 : -1;
+}
+
+int
+main(int argc, char **argv)
+{
+	size_t i;
+	Input in;
+	int ch, argi, errors;
+
+	while ((ch = getopt(argc, argv, "r:s:")) != -1) {
+		switch (ch) {
+		case 'r':
+			rounds = (unsigned) strtoul(optarg, NULL, 10);
+			break;
+		case 's':
+			synthetic_size = (size_t) strtoul(optarg, NULL, 10) * 1024;
+			break;
+		default:
+			(void) fputs(usage_msg, stderr);
+			return EX_USAGE;
+		}
+	}
+
+	if (rounds < 1)
+		rounds = 1;
+
+	for (i = 0; i < SEPARATE_PASSES; i++) {
+		if (pass_init(&separate[i], separate_flags[i], &separate_result)) {
+			(void) fprintf(stderr, "%s (%d)\n", strerror(errno), errno);
+			return EX_OSERR;
+		}
+	}
+	if (pass_init(&single, DIGEST_ALL, &single_result)) {
+		(void) fprintf(stderr, "%s (%d)\n", strerror(errno), errno);
+		return EX_OSERR;
+	}
+
+	errors = 0;
+	for (argi = optind; argi < argc; argi++) {
+		if (load(&in, argv[argi])) {
+			(void) fprintf(stderr, "%s: %s (%d)\n", argv[argi], strerror(errno), errno);
+			errors++;
+			continue;
+		}
+		if (benchmark(&in))
+			errors++;
+		free(in.data);
+	}
+
+	if (0 < synthetic_size) {
+		if (synthetic(&in)) {
+			(void) fprintf(stderr, "%s (%d)\n", strerror(errno), errno);
+			return EX_OSERR;
+		}
+		if (benchmark(&in))
+			errors++;
+		free(in.data);
+	}
+
+	for (i = 0; i < SEPARATE_PASSES; i++)
+		mimeFree(separate[i].mime);
+	mimeFree(single.mime);
+	free(separate_result.parts);
+	free(single_result.parts);
+
+	return errors == 0 ? EX_OK : EXIT_FAILURE;
+}
@@ -0,0 +1,298 @@
+/*
+ * dnsrate.c
+ *
+ * DNS List Query Rate Benchmark
+ *
+ * Copyright 2026 by Anthony Howe.  All rights reserved.
+ */
+
+#define _NAME			"dnsrate"
+
+#ifndef DNSRATE_STUB
+#define DNSRATE_STUB		"127.0.0.2"
+#endif
+
+#ifndef DNSRATE_LISTS
+#define DNSRATE_LISTS		16
+#endif
+
+/***********************************************************************
+ *** No configuration below this point.
+ ***********************************************************************/
+#include <com/snert/lib/version.h>
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef HAVE_UNISTD_H
+# include <unistd.h>
+#endif
+
+#if defined(TIME_WITH_SYS_TIME)
+# include <sys/time.h>
+# include <time.h>
+#else
+# if defined(HAVE_SYS_TIME_H)
+#  include <sys/time.h>
+# else
+#  include <time.h>
+# endif
+#endif
+
+#include <com/snert/lib/io/socket3.h>
+#include <com/snert/lib/net/pdq.h>
+#include <com/snert/lib/sys/pthread.h>
+#include <com/snert/lib/sys/sysexits.h>
+#include <com/snert/lib/type/Vector.h>
+#include <com/snert/lib/util/getopt.h>
+
+#include "bench.h"
+
+#define HEADER_SIZE		12
+
+static int external;
+static unsigned long checks = 10000;
+static const char *server = DNSRATE_STUB;
+static char **suffixes;
+
+typedef struct {
+	pthread_t thread;
+	unsigned long answered;
+} Client;
+
+static const char usage_msg[] =
+"usage: " _NAME " [-x][-b batch][-c checks][-E sockets][-l lists][-s ip][-t threads]\n"
+"\n"
+"-b batch\tpackets per system call, 1 disables batching; default 16\n"
+"-c checks\tnumber of DNS list checks per thread; default 10000\n"
+"-E sockets\tuse the shared resolver engine with this many sockets\n"
+"-l lists\tnumber of DNS list suffixes per check; default " QUOTE(DNSRATE_LISTS) "\n"
+"-s ip\t\tname server address; default " DNSRATE_STUB "\n"
+"-t threads\tnumber of client threads checking the same names; default 1\n"
+"-x\t\tuse an external name server instead of the built-in stub\n"
+"\n"
+"Perform DNS list checks with pdqGetDnsList() against a stub name\n"
+"server that answers NXDOMAIN to every query, then report queries per\n"
+"second and per CPU second of the process, less the stub. The answer\n"
+"cache is disabled. The built-in stub binds UDP port 53, which requires\n"
+"root.\n"
+"\n"
+LIBSNERT_COPYRIGHT "\n"
+;
+
+/*
+ * Answer every query with NXDOMAIN, dropping any OPT record.
+ */
+static void *
+stub(void *data)
+{
+	ssize_t length;
+	socklen_t fromlen;
+	SocketAddress from;
+	SOCKET fd = *(SOCKET *) data;
+	unsigned char *ptr, packet[4096];
+
+	for (;;) {
+		fromlen = sizeof (from);
+		length = recvfrom(fd, packet, sizeof (packet), 0, &from.sa, &fromlen);
+		if (length < HEADER_SIZE)
+			continue;
+
+		/* Skip the question name, type, and class. */
+		for (ptr = packet + HEADER_SIZE; ptr < packet + length && *ptr != 0; ptr += *ptr + 1)
+			;
+		ptr += 5;
+		if (packet + length < ptr)
+			continue;
+
+		packet[2] |= 0x80;		/* QR */
+		packet[3] = 0x83;		/* RA, NXDOMAIN */
+		memset(packet + 6, 0, 6);	/* an, ns, ar */
+
+		(void) sendto(fd, packet, ptr - packet, 0, &from.sa, fromlen);
+	}
+
+	return NULL;
+}
+
+static double
+cpu_seconds(clockid_t id)
+{
+	struct timespec ts;
+
+	if (clock_gettime(id, &ts) == 0)
+		return ts.tv_sec + ts.tv_nsec / 1000000000.0;
+
+	return clock() / (double) CLOCKS_PER_SEC;
+}
+
+/*
+ * CPU time of the whole process less that of the built-in stub,
+ * so that the resolver engine thread is counted too.
+ */
+static double
+cpu_client(pthread_t stub_thread)
+{
+	double cpu;
+	clockid_t id;
+
+	cpu = cpu_seconds(CLOCK_PROCESS_CPUTIME_ID);
+	if (!external && pthread_getcpuclockid(stub_thread, &id) == 0)
+		cpu -= cpu_seconds(id);
+
+	return cpu;
+}
+
+static void *
+client(void *data)
+{
+	PDQ *pdq;
+	unsigned long i;
+	PDQ_rr *answers;
+	Client *self = data;
+	char name[DOMAIN_SIZE];
+
+	if ((pdq = pdqOpen()) == NULL) {
+		(void) fprintf(stderr, "pdqOpen: %s (%d)\n", strerror(errno), errno);
+		return NULL;
+	}
+
+	for (i = 0; i < checks; i++) {
+		(void) snprintf(name, sizeof (name), "%lu.%lu.%lu.127", i & 0xFF, (i >> 8) & 0xFF, (i >> 16) & 0xFF);
+		answers = pdqGetDnsList(pdq, PDQ_CLASS_IN, PDQ_TYPE_A, name, (const char **) suffixes, pdqWaitAll);
+		self->answered += pdqListLength(answers);
+		pdqListFree(answers);
+	}
+
+	pdqClose(pdq);
+
+	return NULL;
+}
+
+int
+main(int argc, char **argv)
+{
+	SOCKET fd;
+	Vector servers;
+	Client *clients;
+	pthread_t thread;
+	SocketAddress *address;
+	unsigned long queries;
+	PDQ_engine_stats stats;
+	int ch, threads = 1, lists = DNSRATE_LISTS;
+	char name[DOMAIN_SIZE];
+	unsigned long start;
+	double elapsed, cpu;
+
+	while ((ch = getopt(argc, argv, "b:c:E:l:s:t:x")) != -1) {
+		switch (ch) {
+		case 'b':
+			pdqSetBatchSize((unsigned) strtoul(optarg, NULL, 10));
+			break;
+		case 'c':
+			checks = strtoul(optarg, NULL, 10);
+			break;
+		case 'E':
+			pdqSetEngine((unsigned) strtoul(optarg, NULL, 10));
+			break;
+		case 'l':
+			lists = (int) strtol(optarg, NULL, 10);
+			break;
+		case 's':
+			server = optarg;
+			break;
+		case 't':
+			threads = (int) strtol(optarg, NULL, 10);
+			break;
+		case 'x':
+			external = 1;
+			break;
+		default:
+			(void) fputs(usage_msg, stderr);
+			return EX_USAGE;
+		}
+	}
+
+	if (lists < 1)
+		lists = 1;
+	if (threads < 1)
+		threads = 1;
+
+	if (!external) {
+		if ((address = socketAddressNew(server, 53)) == NULL) {
+			(void) fprintf(stderr, "%s: invalid address\n", server);
+			return EX_USAGE;
+		}
+		if ((fd = socket3_open(address, 0)) == INVALID_SOCKET || socket3_bind(fd, address)) {
+			(void) fprintf(stderr, "stub %s: %s (%d)\n", server, strerror(errno), errno);
+			return EX_OSERR;
+		}
+		free(address);
+		if (pthread_create(&thread, NULL, stub, &fd)) {
+			(void) fprintf(stderr, "pthread_create: %s (%d)\n", strerror(errno), errno);
+			return EX_OSERR;
+		}
+	}
+
+	/* Setting the servers first also skips pdqInit() fetching
+	 * the root hints from the system name servers.
+	 */
+	if ((servers = VectorCreate(1)) == NULL || VectorAdd(servers, strdup(server))
+	|| pdqSetServers(servers)) {
+		(void) fprintf(stderr, "%s: invalid name server\n", server);
+		return EX_USAGE;
+	}
+	VectorDestroy(servers);
+	pdqCacheSetSize(0);
+
+	if ((suffixes = calloc(lists + 1, sizeof (*suffixes))) == NULL
+	|| (clients = calloc(threads, sizeof (*clients))) == NULL) {
+		(void) fprintf(stderr, "%s (%d)\n", strerror(errno), errno);
+		return EX_OSERR;
+	}
+	for (ch = 0; ch < lists; ch++) {
+		(void) snprintf(name, sizeof (name), "list%d.example", ch);
+		suffixes[ch] = strdup(name);
+	}
+
+	cpu = cpu_client(thread);
+	start = timerMonotonicMs();
+
+	for (ch = 0; ch < threads; ch++) {
+		if (pthread_create(&clients[ch].thread, NULL, client, &clients[ch])) {
+			(void) fprintf(stderr, "pthread_create: %s (%d)\n", strerror(errno), errno);
+			return EX_OSERR;
+		}
+	}
+
+	for (queries = 0, ch = 0; ch < threads; ch++) {
+		(void) pthread_join(clients[ch].thread, NULL);
+		queries += clients[ch].answered;
+	}
+
+	cpu = cpu_client(thread) - cpu;
+
+	elapsed = benchSeconds(start);
+	(void) printf(
+		"checks=%lu lists=%d threads=%d answered=%lu seconds=%.3f rate=%.0f/s cpu=%.3f rate/cpu=%.0f/s\n",
+		checks, lists, threads, queries, elapsed,
+		0 < elapsed ? queries / elapsed : 0.0, cpu,
+		0 < cpu ? queries / cpu : 0.0
+	);
+
+	pdqEngineGetStats(&stats);
+	if (0 < stats.queries)
+		(void) printf(
+			"engine queries=%lu coalesced=%lu answers=%lu timeouts=%lu\n",
+			stats.queries, stats.coalesced, stats.answers, stats.timeouts
+		);
+
+	for (ch = 0; ch < lists; ch++)
+		free(suffixes[ch]);
+	free(suffixes);
+	free(clients);
+
+	return queries == checks * lists * threads ? EX_OK : EXIT_FAILURE;
+}
@@ -0,0 +1,76 @@
+/*
+ * kvmcdb.c
+ *
+ * Compile a Key-Value Map into a cdb! File
+ *
+ * Copyright 2026 by Anthony Howe.  All rights reserved.
+ */
+
+#define _NAME			"kvmcdb"
+
+/***********************************************************************
+ *** No configuration below this point.
+ ***********************************************************************/
+#include <com/snert/lib/version.h>
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <com/snert/lib/io/Log.h>
+#include <com/snert/lib/type/kvm.h>
+#include <com/snert/lib/sys/sysexits.h>
+#include <com/snert/lib/util/getopt.h>
+
+static const char usage_msg[] =
+"usage: " _NAME " [-v] map file.cdb\n"
+"\n"
+"-v\t\tverbose logging to standard error\n"
+"\n"
+"map\t\ta kvm map location to copy, eg. file!/etc/mail/access\n"
+"file.cdb\tthe constant database to create or replace\n"
+"\n"
+"Copy every key and value of a map into a constant database file for\n"
+"use with a cdb! map. The file is written beside file.cdb and renamed\n"
+"into place, so programs with the map already open pick up the new\n"
+"version within a few seconds.\n"
+"\n"
+LIBSNERT_COPYRIGHT "\n"
+;
+
+int
+main(int argc, char **argv)
+{
+	kvm *map;
+	int ch, rc;
+
+	while ((ch = getopt(argc, argv, "v")) != -1) {
+		switch (ch) {
+		case 'v':
+			LogOpen("(standard error)");
+			LogSetProgramName(_NAME);
+			break;
+		default:
+			optind = argc;
+			break;
+		}
+	}
+
+	if (argc != optind + 2) {
+		(void) fputs(usage_msg, stderr);
+		return EX_USAGE;
+	}
+
+	if ((map = kvmOpen(_NAME, argv[optind], KVM_MODE_READ_ONLY)) == NULL) {
+		(void) fprintf(stderr, "%s: open failed\n", argv[optind]);
+		return EX_NOINPUT;
+	}
+
+	if ((rc = kvmCdbMake(map, argv[optind+1])) != KVM_OK)
+		(void) fprintf(stderr, "%s: %s (%d)\n", argv[optind+1], strerror(errno), errno);
+
+	map->close(map);
+
+	return rc == KVM_OK ? EX_OK : EX_CANTCREAT;
+}
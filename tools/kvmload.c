@@ -0,0 +1,231 @@
+/*
+ * kvmload.c
+ *
+ * Socket Map Lookup Load Generator
+ *
+ * Copyright 2026 by Anthony Howe.  All rights reserved.
+ */
+
+#define _NAME			"kvmload"
+
+/***********************************************************************
+ *** No configuration below this point.
+ ***********************************************************************/
+#include <com/snert/lib/version.h>
+
+#include <errno.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(TIME_WITH_SYS_TIME)
+# include <sys/time.h>
+# include <time.h>
+#else
+# if defined(HAVE_SYS_TIME_H)
+#  include <sys/time.h>
+# else
+#  include <time.h>
+# endif
+#endif
+
+#include <com/snert/lib/type/kvm.h>
+#include <com/snert/lib/sys/pthread.h>
+#include <com/snert/lib/sys/sysexits.h>
+#include <com/snert/lib/util/getopt.h>
+
+static kvm *map;
+static int fetch;
+static int fill;
+static const char *table = "kvmload";
+static unsigned long keys = 10000;
+static unsigned long lookups = 100000;
+
+typedef struct {
+	pthread_t thread;
+	unsigned long seed;
+	unsigned long found;
+	unsigned long errors;
+} Client;
+
+static const char usage_msg[] =
+"usage: " _NAME " [-fp][-k keys][-o lookups][-T table][-t threads] location\n"
+"\n"
+"-f\t\tuse sendmail FETCH requests instead of GET\n"
+"-k keys\t\tnumber of distinct keys; default 10000\n"
+"-o lookups\tnumber of lookups per thread; default 100000\n"
+"-p\t\tfirst put the keys into the table\n"
+"-T table\tthe table name served by kvmd; default kvmload\n"
+"-t threads\tnumber of concurrent client threads; default 4\n"
+"\n"
+"location\ta socket map, eg. socketmap" KVM_DELIM_S "/tmp/kvmd.sock or\n"
+"\t\tsocketmap" KVM_DELIM_S "127.0.0.1," KVM_PORT_S "\n"
+"\n"
+"Have the threads look up random keys concurrently through the one\n"
+"socket map handle, and report the lookups per second. Start kvmd with\n"
+"a writable table for -p, eg. kvmd -p /tmp/kvmd.sock kvmload" KVM_DELIM_S "hash" KVM_DELIM_S "\n"
+"\n"
+LIBSNERT_COPYRIGHT "\n"
+;
+
+/*
+ * xorshift, so that the threads do not share any random state.
+ */
+static unsigned long
+next_random(unsigned long *seed)
+{
+	unsigned long x = *seed;
+
+	x ^= x << 13;
+	x ^= x >> 7;
+	x ^= x << 17;
+
+	return *seed = x;
+}
+
+static void
+set_key(kvm_data *key, char *buffer, unsigned long n)
+{
+	key->size = (unsigned long) sprintf(buffer, "key:%lu", n);
+	key->data = (unsigned char *) buffer;
+}
+
+static void *
+client(void *data)
+{
+	unsigned long i;
+	Client *self = data;
+	kvm_data key, value;
+	char kbuf[32];
+
+	for (i = 0; i < lookups; i++) {
+		set_key(&key, kbuf, next_random(&self->seed) % keys);
+
+		switch (fetch ? map->fetch(map, &key, &value) : map->get(map, &key, &value)) {
+		case KVM_OK:
+			self->found++;
+			free(value.data);
+			break;
+		case KVM_NOT_FOUND:
+			if (fetch)
+				free(value.data);
+			break;
+		default:
+			self->errors++;
+		}
+	}
+
+	return NULL;
+}
+
+static double
+seconds(struct timeval *start)
+{
+	struct timeval stop;
+
+	(void) gettimeofday(&stop, NULL);
+
+	return (stop.tv_sec - start->tv_sec) + (stop.tv_usec - start->tv_usec) / 1000000.0;
+}
+
+int
+main(int argc, char **argv)
+{
+	int ch, i, threads = 4;
+	Client *clients;
+	kvm_data key, value;
+	struct timeval start;
+	double elapsed;
+	unsigned long n, found, errors;
+	char kbuf[32], vbuf[64];
+
+	while ((ch = getopt(argc, argv, "fk:o:pT:t:")) != -1) {
+		switch (ch) {
+		case 'f':
+			fetch = 1;
+			break;
+		case 'k':
+			keys = strtoul(optarg, NULL, 10);
+			break;
+		case 'o':
+			lookups = strtoul(optarg, NULL, 10);
+			break;
+		case 'p':
+			fill = 1;
+			break;
+		case 'T':
+			table = optarg;
+			break;
+		case 't':
+			threads = (int) strtol(optarg, NULL, 10);
+			break;
+		default:
+			(void) fputs(usage_msg, stderr);
+			return EX_USAGE;
+		}
+	}
+
+	if (argc <= optind) {
+		(void) fputs(usage_msg, stderr);
+		return EX_USAGE;
+	}
+
+	if (keys < 1)
+		keys = 1;
+	if (threads < 1)
+		threads = 1;
+
+#ifdef SIGPIPE
+	/* A dropped connection is reported as a lookup error. */
+	(void) signal(SIGPIPE, SIG_IGN);
+#endif
+	if ((map = kvmOpen(table, argv[optind], 0)) == NULL) {
+		(void) fprintf(stderr, "%s: open failed: %s (%d)\n", argv[optind], strerror(errno), errno);
+		return EX_UNAVAILABLE;
+	}
+	if ((clients = calloc(threads, sizeof (*clients))) == NULL) {
+		(void) fprintf(stderr, "%s (%d)\n", strerror(errno), errno);
+		return EX_OSERR;
+	}
+
+	errors = 0;
+	if (fill) {
+		(void) gettimeofday(&start, NULL);
+		for (n = 0; n < keys; n++) {
+			set_key(&key, kbuf, n);
+			value.size = (unsigned long) sprintf(vbuf, "value:%lu", n);
+			value.data = (unsigned char *) vbuf;
+			if (map->put(map, &key, &value) != KVM_OK)
+				errors++;
+		}
+		elapsed = seconds(&start);
+		(void) printf("fill keys=%lu rate=%.0f/s errors=%lu\n", keys, 0 < elapsed ? keys / elapsed : 0.0, errors);
+	}
+
+	(void) gettimeofday(&start, NULL);
+	for (i = 0; i < threads; i++) {
+		clients[i].seed = 2463534242UL + i;
+		if (pthread_create(&clients[i].thread, NULL, client, &clients[i])) {
+			(void) fprintf(stderr, "pthread_create: %s (%d)\n", strerror(errno), errno);
+			return EX_OSERR;
+		}
+	}
+	for (found = 0, i = 0; i < threads; i++) {
+		(void) pthread_join(clients[i].thread, NULL);
+		errors += clients[i].errors;
+		found += clients[i].found;
+	}
+	elapsed = seconds(&start);
+
+	(void) printf(
+		"map=%s %s threads=%d lookups=%lu found=%lu seconds=%.3f rate=%.0f/s errors=%lu\n",
+		argv[optind], fetch ? "FETCH" : "GET", threads, lookups * threads, found,
+		elapsed, 0 < elapsed ? lookups * threads / elapsed : 0.0, errors
+	);
+
+	map->close(map);
+	free(clients);
+
+	return errors == 0 ? EX_OK : EXIT_FAILURE;
+}
@@ -0,0 +1,214 @@
+/*
+ * kvmrate.c
+ *
+ * Key-Value Map Get/Put Rate Benchmark
+ *
+ * Copyright 2026 by Anthony Howe.  All rights reserved.
+ */
+
+#define _NAME			"kvmrate"
+
+/***********************************************************************
+ *** No configuration below this point.
+ ***********************************************************************/
+#include <com/snert/lib/version.h>
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <com/snert/lib/type/kvm.h>
+#include <com/snert/lib/sys/pthread.h>
+#include <com/snert/lib/sys/sysexits.h>
+#include <com/snert/lib/util/getopt.h>
+
+#include "bench.h"
+
+static kvm *map;
+static unsigned long keys = 200000;
+static unsigned long operations = 1000000;
+static unsigned reads = 90;
+static int borrow;
+
+typedef struct {
+	pthread_t thread;
+	unsigned long seed;
+	unsigned long errors;
+} Client;
+
+static const char usage_msg[] =
+"usage: " _NAME " [-l][-k keys][-o operations][-r percent][-t threads] [map ...]\n"
+"\n"
+"-k keys\t\tnumber of distinct keys; default 200000\n"
+"-l\t\tget values with the lookup method instead of copying them\n"
+"-o operations\tnumber of get or put operations per thread; default 1000000\n"
+"-r percent\tpercentage of the operations that are gets; default 90\n"
+"-t threads\tnumber of concurrent client threads; default 4\n"
+"\n"
+"map\t\ta kvm map location; default hash! and stripe!\n"
+"\n"
+"Fill each map with the keys, then have the threads get and put random\n"
+"keys concurrently, and report the operations per second. Every key is\n"
+"then checked to still be present.\n"
+"\n"
+LIBSNERT_COPYRIGHT "\n"
+;
+
+static void
+set_key(kvm_data *key, char *buffer, unsigned long n)
+{
+	key->size = (unsigned long) sprintf(buffer, "key:%lu", n);
+	key->data = (unsigned char *) buffer;
+}
+
+static void
+see_value(kvm_data *value, void *data)
+{
+	*(unsigned long *) data += value->size;
+}
+
+static void *
+client(void *data)
+{
+	unsigned long i, r;
+	Client *self = data;
+	kvm_data key, value;
+	unsigned long seen = 0;
+	char kbuf[32], vbuf[64];
+
+	for (i = 0; i < operations; i++) {
+		r = benchRandom(&self->seed);
+		set_key(&key, kbuf, (r >> 8) % keys);
+
+		if ((r & 0xFF) * 100 < reads * 256UL) {
+			if (borrow) {
+				if (map->lookup(map, &key, see_value, &seen) != KVM_OK)
+					self->errors++;
+			} else if (map->get(map, &key, &value) == KVM_OK)
+				free(value.data);
+			else
+				self->errors++;
+		} else {
+			value.size = (unsigned long) sprintf(vbuf, "value:%lu:%lu", (r >> 8) % keys, i);
+			value.data = (unsigned char *) vbuf;
+			if (map->put(map, &key, &value) != KVM_OK)
+				self->errors++;
+		}
+	}
+
+	return NULL;
+}
+
+static int
+run(const char *location, int threads)
+{
+	int i;
+	unsigned long n, errors;
+	Client *clients;
+	kvm_data key, value;
+	unsigned long start;
+	double fill, elapsed;
+	char kbuf[32], vbuf[64];
+
+	if ((map = kvmOpen("kvmrate", location, 0)) == NULL) {
+		(void) fprintf(stderr, "%s: open failed\n", location);
+		return -1;
+	}
+	if ((clients = calloc(threads, sizeof (*clients))) == NULL) {
+		(void) fprintf(stderr, "%s (%d)\n", strerror(errno), errno);
+		map->close(map);
+		return -1;
+	}
+
+	start = timerMonotonicMs();
+	for (errors = n = 0; n < keys; n++) {
+		set_key(&key, kbuf, n);
+		value.size = (unsigned long) sprintf(vbuf, "value:%lu", n);
+		value.data = (unsigned char *) vbuf;
+		if (map->put(map, &key, &value) != KVM_OK)
+			errors++;
+	}
+	fill = benchSeconds(start);
+
+	start = timerMonotonicMs();
+	for (i = 0; i < threads; i++) {
+		clients[i].seed = 2463534242UL + i;
+		if (pthread_create(&clients[i].thread, NULL, client, &clients[i])) {
+			(void) fprintf(stderr, "pthread_create: %s (%d)\n", strerror(errno), errno);
+			exit(EX_OSERR);
+		}
+	}
+	for (i = 0; i < threads; i++) {
+		(void) pthread_join(clients[i].thread, NULL);
+		errors += clients[i].errors;
+	}
+	elapsed = benchSeconds(start);
+
+	for (n = 0; n < keys; n++) {
+		set_key(&key, kbuf, n);
+		if (map->get(map, &key, &value) != KVM_OK)
+			errors++;
+		else
+			free(value.data);
+	}
+
+	(void) printf(
+		"map=%s keys=%lu threads=%d reads=%u%% fill=%.0f/s seconds=%.3f rate=%.0f/s errors=%lu\n",
+		location, keys, threads, reads,
+		0 < fill ? keys / fill : 0.0, elapsed,
+		0 < elapsed ? operations * threads / elapsed : 0.0, errors
+	);
+
+	map->close(map);
+	free(clients);
+
+	return errors == 0 ? 0 : -1;
+}
+
+int
+main(int argc, char **argv)
+{
+	int ch, rc, threads = 4;
+
+	while ((ch = getopt(argc, argv, "k:lo:r:t:")) != -1) {
+		switch (ch) {
+		case 'k':
+			keys = strtoul(optarg, NULL, 10);
+			break;
+		case 'l':
+			borrow = 1;
+			break;
+		case 'o':
+			operations = strtoul(optarg, NULL, 10);
+			break;
+		case 'r':
+			reads = (unsigned) strtoul(optarg, NULL, 10);
+			break;
+		case 't':
+			threads = (int) strtol(optarg, NULL, 10);
+			break;
+		default:
+			(void) fputs(usage_msg, stderr);
+			return EX_USAGE;
+		}
+	}
+
+	if (keys < 1)
+		keys = 1;
+	if (100 < reads)
+		reads = 100;
+	if (threads < 1)
+		threads = 1;
+
+	rc = 0;
+	if (argc <= optind) {
+		rc |= run("hash" KVM_DELIM_S, threads);
+		rc |= run("stripe" KVM_DELIM_S, threads);
+	} else {
+		for ( ; optind < argc; optind++)
+			rc |= run(argv[optind], threads);
+	}
+
+	return rc == 0 ? EX_OK : EXIT_FAILURE;
+}
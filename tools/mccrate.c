@@ -0,0 +1,224 @@
+/*
+ * mccrate.c
+ *
+ * Multicast Cache Row Operation Rate Benchmark
+ *
+ * Copyright 2026 by Anthony Howe.  All rights reserved.
+ */
+
+#define _NAME			"mccrate"
+
+/***********************************************************************
+ *** No configuration below this point.
+ ***********************************************************************/
+#include <com/snert/lib/version.h>
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef HAVE_UNISTD_H
+# include <unistd.h>
+#endif
+
+#if defined(TIME_WITH_SYS_TIME)
+# include <sys/time.h>
+# include <time.h>
+#else
+# if defined(HAVE_SYS_TIME_H)
+#  include <sys/time.h>
+# else
+#  include <time.h>
+# endif
+#endif
+
+#include <com/snert/lib/type/mcc.h>
+#include <com/snert/lib/sys/pthread.h>
+#include <com/snert/lib/sys/sysexits.h>
+#include <com/snert/lib/util/getopt.h>
+
+#include "bench.h"
+
+#ifdef HAVE_SQLITE3_H
+
+static unsigned long keys = 10000;
+static unsigned long operations = 20000;
+static unsigned writes = 10;
+static unsigned adds = 5;
+
+typedef struct {
+	pthread_t thread;
+	mcc_handle *mcc;
+	unsigned long seed;
+	unsigned long found;
+	unsigned long errors;
+} Client;
+
+static const char usage_msg[] =
+"usage: " _NAME " [-a percent][-k keys][-o operations][-t threads]\n"
+"\t[-u percent][-w seconds] db.sq3\n"
+"\n"
+"-a percent\tpercentage of operations that are mccAddRowLocal; default 5\n"
+"-k keys\t\tnumber of distinct keys; default 10000\n"
+"-o operations\tnumber of operations per thread; default 20000\n"
+"-t threads\tnumber of concurrent threads; default 16\n"
+"-u percent\tpercentage of operations that are mccPutRowLocal; default 10\n"
+"-w seconds\tkeep the rows in memory and write changes behind every\n"
+"\t\tso many seconds; default use SQLite directly\n"
+"\n"
+"Each thread has its own mcc handle and performs a random mix of\n"
+"row lookups, replacements, and counter increments on the local\n"
+"cache. The remaining operations are mccGetKey.\n"
+"\n"
+LIBSNERT_COPYRIGHT "\n"
+;
+
+static void *
+client(void *data)
+{
+	int rc;
+	unsigned long i, n;
+	mcc_row row;
+	Client *self = data;
+	mcc_handle *mcc = self->mcc;
+
+	for (i = 0; i < operations; i++) {
+		n = benchRandom(&self->seed);
+		(void) mccSetKey(&row, "mccrate:%lu", n % keys);
+
+		if ((n >> 20) % 100 < adds) {
+			mccSetExpires(&row, 3600);
+			rc = mccAddRowLocal(mcc, 1, &row);
+		} else if ((n >> 20) % 100 < adds + writes) {
+			(void) mccSetValue(&row, "value:%lu", i);
+			mccSetExpires(&row, 3600);
+			row.created = time(NULL);
+			rc = mccPutRowLocal(mcc, &row);
+		} else if ((rc = mccGetRow(mcc, &row)) == MCC_OK) {
+			self->found++;
+		}
+
+		if (rc == MCC_ERROR)
+			self->errors++;
+	}
+
+	return NULL;
+}
+
+int
+main(int argc, char **argv)
+{
+	int ch, i, threads = 16;
+	Client *clients;
+	mcc_handle *mcc;
+	unsigned long start;
+	double elapsed;
+	unsigned write_behind = 0;
+	unsigned long found, errors;
+
+	while ((ch = getopt(argc, argv, "a:k:o:t:u:w:")) != -1) {
+		switch (ch) {
+		case 'a':
+			adds = (unsigned) strtoul(optarg, NULL, 10);
+			break;
+		case 'k':
+			keys = strtoul(optarg, NULL, 10);
+			break;
+		case 'o':
+			operations = strtoul(optarg, NULL, 10);
+			break;
+		case 't':
+			threads = (int) strtol(optarg, NULL, 10);
+			break;
+		case 'u':
+			writes = (unsigned) strtoul(optarg, NULL, 10);
+			break;
+		case 'w':
+			write_behind = (unsigned) strtoul(optarg, NULL, 10);
+			break;
+		default:
+			(void) fputs(usage_msg, stderr);
+			return EX_USAGE;
+		}
+	}
+
+	if (argc <= optind || 100 < adds + writes) {
+		(void) fputs(usage_msg, stderr);
+		return EX_USAGE;
+	}
+
+	if (keys < 1)
+		keys = 1;
+	if (threads < 1)
+		threads = 1;
+
+	if (mccInit(argv[optind], NULL) != MCC_OK) {
+		(void) fprintf(stderr, "%s: init failed: %s (%d)\n", argv[optind], strerror(errno), errno);
+		return EX_UNAVAILABLE;
+	}
+
+	/* Create the database while still single threaded. */
+	if ((mcc = mccCreate()) == NULL) {
+		(void) fprintf(stderr, "%s: open failed\n", argv[optind]);
+		return EX_UNAVAILABLE;
+	}
+
+	if (0 < write_behind && mccStartWriteBehind(write_behind) != MCC_OK) {
+		(void) fprintf(stderr, "%s: write-behind failed\n", argv[optind]);
+		return EX_UNAVAILABLE;
+	}
+	if ((clients = calloc(threads, sizeof (*clients))) == NULL) {
+		(void) fprintf(stderr, "%s (%d)\n", strerror(errno), errno);
+		return EX_OSERR;
+	}
+
+	/* Concurrent mccCreate() calls can fail with SQLITE_BUSY
+	 * while preparing statements, so open the handles first.
+	 */
+	for (i = 0; i < threads; i++) {
+		if ((clients[i].mcc = mccCreate()) == NULL) {
+			(void) fprintf(stderr, "%s: open failed\n", argv[optind]);
+			return EX_UNAVAILABLE;
+		}
+	}
+
+	start = timerMonotonicMs();
+	for (i = 0; i < threads; i++) {
+		clients[i].seed = 2463534242UL + i;
+		if (pthread_create(&clients[i].thread, NULL, client, &clients[i])) {
+			(void) fprintf(stderr, "pthread_create: %s (%d)\n", strerror(errno), errno);
+			return EX_OSERR;
+		}
+	}
+	for (found = errors = 0, i = 0; i < threads; i++) {
+		(void) pthread_join(clients[i].thread, NULL);
+		mccDestroy(clients[i].mcc);
+		errors += clients[i].errors;
+		found += clients[i].found;
+	}
+	elapsed = benchSeconds(start);
+
+	(void) printf(
+		"db=%s %s threads=%d operations=%lu found=%lu seconds=%.3f rate=%.0f/s errors=%lu\n",
+		argv[optind], 0 < write_behind ? "memory" : "sqlite", threads, operations * threads,
+		found, elapsed, 0 < elapsed ? operations * threads / elapsed : 0.0, errors
+	);
+
+	mccDestroy(mcc);
+	mccFini();
+	free(clients);
+
+	return errors == 0 ? EX_OK : EXIT_FAILURE;
+}
+
+#else
+
+int
+main(int argc, char **argv)
+{
+	(void) printf("This program requires threaded SQLite3 support.\n");
+	return EXIT_FAILURE;
+}
+
+#endif /* HAVE_SQLITE3_H */
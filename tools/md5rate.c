@@ -0,0 +1,186 @@
+/*
+ * md5rate.c
+ *
+ * MD5 Throughput Benchmark
+ *
+ * Copyright 2026 by Anthony Howe.  All rights reserved.
+ */
+
+#define _NAME			"md5rate"
+
+/***********************************************************************
+ *** No configuration below this point.
+ ***********************************************************************/
+#include <com/snert/lib/version.h>
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <com/snert/lib/sys/sysexits.h>
+#include <com/snert/lib/util/getopt.h>
+#include <com/snert/lib/util/md5.h>
+
+#include "bench.h"
+
+static unsigned streams = 64;
+static size_t total_size = 256 * 1024 * 1024;
+
+static const char usage_msg[] =
+"usage: " _NAME " [-n streams][-t total] [size ...]\n"
+"\n"
+"-n streams\tnumber of independent messages per batch; default 64\n"
+"-t total\tMB to hash for each message size; default 256\n"
+"\n"
+"Hash batches of messages of each size in octets, first one message\n"
+"at a time with md5_append(), then the whole batch with one call of\n"
+"md5_append_multi(), and report the throughput in MB/s. Both must\n"
+"produce the same digests. The default sizes are 64, 512, 1500,\n"
+"4096, and 65536 octets.\n"
+"\n"
+LIBSNERT_COPYRIGHT "\n"
+;
+
+static int
+benchmark(unsigned char *data, size_t size)
+{
+	int same;
+	unsigned i;
+	size_t batch, batches;
+	unsigned long start;
+	double single_secs, multi_secs, mb;
+	md5_state_t *states, **pms;
+	const md5_byte_t **buffers;
+	int *nbytes;
+	md5_byte_t (*single)[16], (*multi)[16];
+
+	states = malloc(streams * sizeof (*states));
+	pms = malloc(streams * sizeof (*pms));
+	buffers = malloc(streams * sizeof (*buffers));
+	nbytes = malloc(streams * sizeof (*nbytes));
+	single = malloc(streams * sizeof (*single));
+	multi = malloc(streams * sizeof (*multi));
+
+	if (states == NULL || pms == NULL || buffers == NULL
+	|| nbytes == NULL || single == NULL || multi == NULL) {
+		(void) fprintf(stderr, "%s (%d)\n", strerror(errno), errno);
+		exit(EX_OSERR);
+	}
+
+	/* Each stream hashes its own slice of the data. */
+	for (i = 0; i < streams; i++) {
+		pms[i] = &states[i];
+		buffers[i] = data + i * size;
+		nbytes[i] = (int) size;
+	}
+
+	if ((batches = total_size / (size * streams)) < 1)
+		batches = 1;
+
+	start = timerMonotonicMs();
+	for (batch = 0; batch < batches; batch++) {
+		for (i = 0; i < streams; i++) {
+			md5_init(&states[i]);
+			md5_append(&states[i], buffers[i], nbytes[i]);
+			md5_finish(&states[i], single[i]);
+		}
+	}
+	single_secs = benchSeconds(start);
+
+	start = timerMonotonicMs();
+	for (batch = 0; batch < batches; batch++) {
+		for (i = 0; i < streams; i++)
+			md5_init(&states[i]);
+		md5_append_multi(pms, buffers, nbytes, streams);
+		for (i = 0; i < streams; i++)
+			md5_finish(&states[i], multi[i]);
+	}
+	multi_secs = benchSeconds(start);
+
+	same = memcmp(single, multi, streams * sizeof (*single)) == 0;
+	mb = (double) size * streams * batches / (1024.0 * 1024.0);
+
+	(void) printf(
+		"size=%lu streams=%u single=%.1fMB/s multi=%.1fMB/s speedup=%.2f%s\n",
+		(unsigned long) size, streams,
+		0 < single_secs ? mb / single_secs : 0.0,
+		0 < multi_secs ? mb / multi_secs : 0.0,
+		0 < multi_secs ? single_secs / multi_secs : 0.0,
+		same ? "" : " DIFFERENT"
+	);
+
+	free(multi);
+	free(single);
+	free(nbytes);
+	free(buffers);
+	free(pms);
+	free(states);
+
+	return same ? 0 : -1;
+}
+
+int
+main(int argc, char **argv)
+{
+	size_t i, size, max_size;
+	int ch, argi, errors;
+	unsigned char *data;
+	unsigned long seed;
+	static const size_t sizes[] = { 64, 512, 1500, 4096, 65536, 0 };
+
+	while ((ch = getopt(argc, argv, "n:t:")) != -1) {
+		switch (ch) {
+		case 'n':
+			streams = (unsigned) strtoul(optarg, NULL, 10);
+			break;
+		case 't':
+			total_size = (size_t) strtoul(optarg, NULL, 10) * 1024 * 1024;
+			break;
+		default:
+			(void) fputs(usage_msg, stderr);
+			return EX_USAGE;
+		}
+	}
+
+	if (streams < 1)
+		streams = 1;
+
+	max_size = sizes[sizeof (sizes) / sizeof (*sizes) - 2];
+	for (argi = optind; argi < argc; argi++) {
+		if (max_size < (size = (size_t) strtoul(argv[argi], NULL, 10)))
+			max_size = size;
+	}
+
+	if ((data = malloc(max_size * streams)) == NULL) {
+		(void) fprintf(stderr, "%s (%d)\n", strerror(errno), errno);
+		return EX_OSERR;
+	}
+
+	seed = 2463534242UL;
+	for (i = 0; i < max_size * streams; i++) {
+		seed ^= seed << 13;
+		seed ^= seed >> 7;
+		seed ^= seed << 17;
+		data[i] = (unsigned char) seed;
+	}
+
+	errors = 0;
+	if (optind < argc) {
+		for (argi = optind; argi < argc; argi++) {
+			if ((size = (size_t) strtoul(argv[argi], NULL, 10)) < 1)
+				continue;
+			if (benchmark(data, size))
+				errors++;
+		}
+	} else {
+		for (i = 0; sizes[i] != 0; i++) {
+			if (benchmark(data, sizes[i]))
+				errors++;
+		}
+	}
+
+	free(data);
+
+	return errors == 0 ? EX_OK : EXIT_FAILURE;
+}
@@ -0,0 +1,356 @@
+/*
+ * mimerate.c
+ *
+ * MIME Parser Throughput Benchmark
+ *
+ * Copyright 2026 by Anthony Howe.  All rights reserved.
+ */
+
+#define _NAME			"mimerate"
+
+/***********************************************************************
+ *** No configuration below this point.
+ ***********************************************************************/
+#include <com/snert/lib/version.h>
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <com/snert/lib/mail/mime.h>
+#include <com/snert/lib/sys/sysexits.h>
+#include <com/snert/lib/util/getopt.h>
+#include <com/snert/lib/util/md5.h>
+
+#include "bench.h"
+
+#define BOUNDARY		"=_mimerate_boundary"
+
+static unsigned rounds = 10;
+static size_t synthetic_size = 4 * 1024 * 1024;
+static int octet_hook;
+
+typedef struct {
+	const char *name;
+	unsigned char *data;
+	size_t length;
+} Input;
+
+typedef struct {
+	md5_state_t md5;
+	unsigned long parts;
+	unsigned long octets;
+} Result;
+
+static const char usage_msg[] =
+"usage: " _NAME " [-o][-r rounds][-s size] [message.eml ...]\n"
+"\n"
+"-o\t\tadd a decoded octet hook, like uri.c\n"
+"-r rounds\tnumber of times to parse each message; default 10\n"
+"-s size\t\tsize in KB of the synthetic attachments; default 4096,\n"
+"\t\tzero to parse only the given messages\n"
+"\n"
+"Parse each message with mimeNextCh() one octet at a time and with\n"
+"mimeNextBuf() a block at a time, and report the throughput in MB/s.\n"
+"Both must produce the same flushed source and decoded buffers. The\n"
+"synthetic messages are a 7bit text body and multipart messages with\n"
+"a base64 and a quoted-printable attachment.\n"
+"\n"
+LIBSNERT_COPYRIGHT "\n"
+;
+
+static const char b64_alphabet[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+static void
+source_flush(Mime *m, void *data)
+{
+	md5_append(&((Result *) data)->md5, m->source.buffer, m->source.length);
+}
+
+static void
+decode_flush(Mime *m, void *data)
+{
+	md5_append(&((Result *) data)->md5, m->decode.buffer, m->decode.length);
+}
+
+static void
+body_finish(Mime *m, void *data)
+{
+	((Result *) data)->parts++;
+	md5_append(&((Result *) data)->md5, (md5_byte_t *) &m->mime_body_decoded_length, sizeof (m->mime_body_decoded_length));
+}
+
+static void
+decoded_octet(Mime *m, int ch, void *data)
+{
+	((Result *) data)->octets++;
+}
+
+static double
+parse(Mime *m, Input *in, int block, Result *result, unsigned char digest[16])
+{
+	size_t i;
+	unsigned round;
+	unsigned long start;
+
+	start = timerMonotonicMs();
+	for (round = 0; round < rounds; round++) {
+		memset(result, 0, sizeof (*result));
+		md5_init(&result->md5);
+
+		mimeMsgStart(m);
+		if (block) {
+			(void) mimeNextBuf(m, in->data, in->length);
+		} else {
+			for (i = 0; i < in->length; i++)
+				(void) mimeNextCh(m, in->data[i]);
+		}
+		(void) mimeNextCh(m, EOF);
+		mimeMsgFinish(m);
+	}
+
+	md5_finish(&result->md5, digest);
+
+	return benchSeconds(start);
+}
+
+static int
+append(Input *in, size_t *size, const char *s, size_t length)
+{
+	unsigned char *data;
+
+	if (*size <= in->length + length) {
+		*size = (in->length + length) * 2;
+		if ((data = realloc(in->data, *size)) == NULL)
+			return -1;
+		in->data = data;
+	}
+
+	memcpy(in->data + in->length, s, length);
+	in->length += length;
+
+	return 0;
+}
+
+#define APPEND(in, size, s)	append(in, size, s, strlen(s))
+
+static const char headers[] =
+"From: sender@example.com\r\n"
+"To: recipient@example.com\r\n"
+"Subject: " _NAME "\r\n"
+"MIME-Version: 1.0\r\n"
+;
+
+static const char multipart[] =
+"Content-Type: multipart/mixed; boundary=\"" BOUNDARY "\"\r\n"
+"\r\n"
+"This is a multi-part message in MIME format.\r\n"
+"\r\n"
+"--" BOUNDARY "\r\n"
+"Content-Type: text/plain; charset=us-ascii\r\n"
+"\r\n"
+"See attachment.\r\n"
+"\r\n"
+"--" BOUNDARY "\r\n"
+;
+
+static const char lorem[] =
+"Lorem ipsum dolor sit amet, consectetur adipiscing elit, sed do eiusmod "
+"tempor incididunt ut labore et dolore magna aliqua. Ut enim ad minim veniam, "
+"quis nostrud exercitation ullamco laboris nisi ut aliquip ex ea commodo. "
+;
+
+static int
+synthetic(Input *in, const char *encoding)
+{
+	size_t size, col;
+	unsigned long seed, x;
+	char line[80], *t;
+
+	size = 0;
+	seed = 2463534242UL;
+	memset(in, 0, sizeof (*in));
+
+	if (APPEND(in, &size, headers))
+		return -1;
+
+	if (strcmp(encoding, "7bit") == 0) {
+		in->name = "synthetic-7bit";
+		if (APPEND(in, &size, "Content-Type: text/plain\r\n\r\n"))
+			return -1;
+		while (in->length < synthetic_size) {
+			/* Wrap lorem at different points for varied line lengths. */
+			x = benchRandom(&seed) % (sizeof (lorem)-1);
+			if (append(in, &size, lorem, x) || APPEND(in, &size, "\r\n"))
+				return -1;
+		}
+		return 0;
+	}
+
+	if (APPEND(in, &size, multipart))
+		return -1;
+
+	if (strcmp(encoding, "base64") == 0) {
+		in->name = "synthetic-base64";
+		if (APPEND(in, &size, "Content-Type: application/octet-stream\r\nContent-Transfer-Encoding: base64\r\n\r\n"))
+			return -1;
+		while (in->length < synthetic_size) {
+			/* 76 column lines of random binary content. */
+			for (t = line, col = 0; col < 76; col += 4) {
+				x = benchRandom(&seed);
+				*t++ = b64_alphabet[x & 63];
+				*t++ = b64_alphabet[(x >> 6) & 63];
+				*t++ = b64_alphabet[(x >> 12) & 63];
+				*t++ = b64_alphabet[(x >> 18) & 63];
+			}
+			*t++ = '\r';
+			*t++ = '\n';
+			if (append(in, &size, line, t - line))
+				return -1;
+		}
+	} else {
+		in->name = "synthetic-qp";
+		if (APPEND(in, &size, "Content-Type: text/plain; charset=iso-8859-1\r\nContent-Transfer-Encoding: quoted-printable\r\n\r\n"))
+			return -1;
+		while (in->length < synthetic_size) {
+			/* Mostly literal text with the odd encoded octet and
+			 * soft line breaks.
+			 */
+			if (append(in, &size, lorem, 70) || APPEND(in, &size, "=E9t=3D=\r\n"))
+				return -1;
+		}
+	}
+
+	return APPEND(in, &size, "\r\n--" BOUNDARY "--\r\n");
+}
+
+static int
+load(Input *in, const char *filename)
+{
+	FILE *fp;
+	size_t n, size;
+	char buffer[8192];
+
+	size = 0;
+	memset(in, 0, sizeof (*in));
+	in->name = filename;
+
+	if ((fp = fopen(filename, "rb")) == NULL)
+		return -1;
+
+	while (0 < (n = fread(buffer, 1, sizeof (buffer), fp))) {
+		if (append(in, &size, buffer, n)) {
+			(void) fclose(fp);
+			return -1;
+		}
+	}
+
+	(void) fclose(fp);
+
+	return 0;
+}
+
+static int
+benchmark(Mime *m, Input *in)
+{
+	int same;
+	double octet_secs, block_secs, mb;
+	Result octet_result, block_result;
+	unsigned char octet_digest[16], block_digest[16];
+	char digest_string[33];
+
+	/* Hooks keep a pointer to the result for the current pass. */
+	m->mime_hook->data = &octet_result;
+	octet_secs = parse(m, in, 0, &octet_result, octet_digest);
+	m->mime_hook->data = &block_result;
+	block_secs = parse(m, in, 1, &block_result, block_digest);
+
+	same = memcmp(octet_digest, block_digest, sizeof (octet_digest)) == 0
+		&& octet_result.parts == block_result.parts
+		&& octet_result.octets == block_result.octets;
+
+	md5_digest_to_string(block_digest, digest_string);
+	mb = (double) in->length * rounds / (1024.0 * 1024.0);
+
+	(void) printf(
+		"%s bytes=%lu parts=%lu octet=%.1fMB/s block=%.1fMB/s speedup=%.2f md5=%s%s\n",
+		in->name, (unsigned long) in->length, block_result.parts,
+		0 < octet_secs ? mb / octet_secs : 0.0,
+		0 < block_secs ? mb / block_secs : 0.0,
+		0 < block_secs ? octet_secs / block_secs : 0.0,
+		digest_string, same ? "" : " DIFFERENT"
+	);
+
+	return same ? 0 : -1;
+}
+
+int
+main(int argc, char **argv)
+{
+	Mime *m;
+	Input in;
+	MimeHooks hook;
+	int ch, argi, errors;
+	static const char *encodings[] = { "7bit", "base64", "quoted-printable", NULL };
+	const char **encoding;
+
+	while ((ch = getopt(argc, argv, "or:s:")) != -1) {
+		switch (ch) {
+		case 'o':
+			octet_hook = 1;
+			break;
+		case 'r':
+			rounds = (unsigned) strtoul(optarg, NULL, 10);
+			break;
+		case 's':
+			synthetic_size = (size_t) strtoul(optarg, NULL, 10) * 1024;
+			break;
+		default:
+			(void) fputs(usage_msg, stderr);
+			return EX_USAGE;
+		}
+	}
+
+	if (rounds < 1)
+		rounds = 1;
+
+	if ((m = mimeCreate()) == NULL) {
+		(void) fprintf(stderr, "mimeCreate: %s (%d)\n", strerror(errno), errno);
+		return EX_OSERR;
+	}
+
+	memset(&hook, 0, sizeof (hook));
+	hook.source_flush = source_flush;
+	hook.decode_flush = decode_flush;
+	hook.body_finish = body_finish;
+	if (octet_hook)
+		hook.decoded_octet = decoded_octet;
+	mimeHooksAdd(m, &hook);
+
+	errors = 0;
+	for (argi = optind; argi < argc; argi++) {
+		if (load(&in, argv[argi])) {
+			(void) fprintf(stderr, "%s: %s (%d)\n", argv[argi], strerror(errno), errno);
+			errors++;
+			continue;
+		}
+		if (benchmark(m, &in))
+			errors++;
+		free(in.data);
+	}
+
+	for (encoding = encodings; 0 < synthetic_size && *encoding != NULL; encoding++) {
+		if (synthetic(&in, *encoding)) {
+			(void) fprintf(stderr, "%s (%d)\n", strerror(errno), errno);
+			return EX_OSERR;
+		}
+		if (benchmark(m, &in))
+			errors++;
+		free(in.data);
+	}
+
+	mimeFree(m);
+
+	return errors == 0 ? EX_OK : EXIT_FAILURE;
+}
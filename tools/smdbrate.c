@@ -0,0 +1,241 @@
+/*
+ * smdbrate.c
+ *
+ * Access Map Lookup Rate Benchmark
+ *
+ * Copyright 2026 by Anthony Howe.  All rights reserved.
+ */
+
+#define _NAME			"smdbrate"
+
+/***********************************************************************
+ *** No configuration below this point.
+ ***********************************************************************/
+#include <com/snert/lib/version.h>
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef HAVE_UNISTD_H
+# include <unistd.h>
+#endif
+
+#include <com/snert/lib/mail/smdb.h>
+#include <com/snert/lib/type/kvm.h>
+#include <com/snert/lib/sys/pthread.h>
+#include <com/snert/lib/sys/sysexits.h>
+#include <com/snert/lib/util/getopt.h>
+
+#include "bench.h"
+
+static smdb *map;
+static unsigned long keys = 100000;
+static unsigned long checks = 1000000;
+static unsigned long names;
+
+typedef struct {
+	pthread_t thread;
+	unsigned long seed;
+	unsigned long found;
+} Client;
+
+static const char usage_msg[] =
+"usage: " _NAME " [-c checks][-C entries][-d dir][-k keys][-t threads][-w names]\n"
+"\n"
+"-c checks\tnumber of lookups per thread; default 1000000\n"
+"-C entries\tput a lookup cache of this size in front of each map\n"
+"-d dir\t\tdirectory for the generated maps; default /tmp\n"
+"-k keys\t\tnumber of IP and domain entries in the map; default 100000\n"
+"-t threads\tnumber of concurrent client threads; default 4\n"
+"-w names\tnumber of distinct names looked up; default twice the keys\n"
+"\n"
+"Generate an access map of connect: IP and domain entries as text, then\n"
+"compile it to cdb and, when available, Berkeley DB. Time half hits and\n"
+"half misses with smdbAccessIp() and smdbAccessDomain() against the\n"
+"file!, cdb!, and db! versions of the same map. A smaller set of names\n"
+"models the repeated checks of the same client within a transaction.\n"
+"\n"
+LIBSNERT_COPYRIGHT "\n"
+;
+
+static void *
+client(void *data)
+{
+	unsigned long i, n;
+	Client *self = data;
+	char name[64];
+
+	for (i = 0; i < checks; i++) {
+		/* Twice the key space, so half the lookups miss. */
+		n = benchRandom(&self->seed) % names;
+		n = n * (keys * 2 / names);
+
+		if (i & 1) {
+			(void) snprintf(name, sizeof (name), "10.%lu.%lu.%lu", (n >> 16) & 0xFF, (n >> 8) & 0xFF, n & 0xFF);
+			self->found += smdbAccessIp(map, "connect:", name, NULL, NULL) != SMDB_ACCESS_NOT_FOUND;
+		} else {
+			(void) snprintf(name, sizeof (name), "mail.host%lu.example", n);
+			self->found += smdbAccessDomain(map, "connect:", name, NULL, NULL) != SMDB_ACCESS_NOT_FOUND;
+		}
+	}
+
+	return NULL;
+}
+
+static int
+make_text(const char *path)
+{
+	FILE *fp;
+	unsigned long n;
+
+	if ((fp = fopen(path, "w")) == NULL)
+		return -1;
+
+	for (n = 0; n < keys; n++) {
+		(void) fprintf(fp, "connect:10.%lu.%lu.%lu\tREJECT\n", (n >> 16) & 0xFF, (n >> 8) & 0xFF, n & 0xFF);
+		(void) fprintf(fp, "connect:host%lu.example\tOK\n", n);
+	}
+
+	return fclose(fp);
+}
+
+#ifdef HAVE_DB_H
+static int
+copy_entry(kvm_data *key, kvm_data *value, void *data)
+{
+	return ((kvm *) data)->put(data, key, value) == KVM_OK;
+}
+#endif
+
+static int
+make_maps(const char *text, const char *cdb, const char *db)
+{
+	kvm *source, *target;
+
+	if ((source = kvmOpen("access", text, KVM_MODE_READ_ONLY)) == NULL)
+		return -1;
+
+	if (kvmCdbMake(source, cdb + sizeof ("cdb" KVM_DELIM_S)-1) != KVM_OK) {
+		source->close(source);
+		return -1;
+	}
+
+	(void) unlink(db + sizeof ("db" KVM_DELIM_S)-1);
+	if ((target = kvmOpen("access", db, 0)) != NULL) {
+#ifdef HAVE_DB_H
+		(void) source->walk(source, copy_entry, target);
+#endif
+		target->close(target);
+	}
+
+	source->close(source);
+
+	return 0;
+}
+
+static int
+run(const char *location, int threads)
+{
+	int i;
+	Client *clients;
+	unsigned long found;
+	unsigned long start;
+	double opened, elapsed;
+
+	start = timerMonotonicMs();
+	if ((map = smdbOpen(location, 1)) == NULL) {
+		(void) printf("map=%s not available\n", location);
+		return 0;
+	}
+	opened = benchSeconds(start);
+
+	if ((clients = calloc(threads, sizeof (*clients))) == NULL) {
+		(void) fprintf(stderr, "%s (%d)\n", strerror(errno), errno);
+		smdbClose(map);
+		return -1;
+	}
+
+	start = timerMonotonicMs();
+	for (i = 0; i < threads; i++) {
+		clients[i].seed = 2463534242UL + i;
+		if (pthread_create(&clients[i].thread, NULL, client, &clients[i])) {
+			(void) fprintf(stderr, "pthread_create: %s (%d)\n", strerror(errno), errno);
+			exit(EX_OSERR);
+		}
+	}
+	for (found = 0, i = 0; i < threads; i++) {
+		(void) pthread_join(clients[i].thread, NULL);
+		found += clients[i].found;
+	}
+	elapsed = benchSeconds(start);
+
+	(void) printf(
+		"map=%s keys=%lu names=%lu cache=%ld threads=%d open=%.3f seconds=%.3f found=%lu rate=%.0f/s\n",
+		location, keys * 2, names, smdbOptCacheSize.value, threads, opened, elapsed, found,
+		0 < elapsed ? checks * threads / elapsed : 0.0
+	);
+
+	smdbClose(map);
+	free(clients);
+
+	return 0;
+}
+
+int
+main(int argc, char **argv)
+{
+	int ch, rc, threads = 4;
+	const char *dir = "/tmp";
+	char text[256], cdb[256], db[256];
+
+	while ((ch = getopt(argc, argv, "c:C:d:k:t:w:")) != -1) {
+		switch (ch) {
+		case 'c':
+			checks = strtoul(optarg, NULL, 10);
+			break;
+		case 'C':
+			smdbOptCacheSize.value = strtol(optarg, NULL, 10);
+			smdbOptCacheTtl.value = 60;
+			break;
+		case 'd':
+			dir = optarg;
+			break;
+		case 'k':
+			keys = strtoul(optarg, NULL, 10);
+			break;
+		case 't':
+			threads = (int) strtol(optarg, NULL, 10);
+			break;
+		case 'w':
+			names = strtoul(optarg, NULL, 10);
+			break;
+		default:
+			(void) fputs(usage_msg, stderr);
+			return EX_USAGE;
+		}
+	}
+
+	if (keys < 1)
+		keys = 1;
+	if (threads < 1)
+		threads = 1;
+	if (names < 1 || keys * 2 < names)
+		names = keys * 2;
+
+	(void) snprintf(text, sizeof (text), "file" KVM_DELIM_S "%s/" _NAME ".txt", dir);
+	(void) snprintf(cdb, sizeof (cdb), "cdb" KVM_DELIM_S "%s/" _NAME ".cdb", dir);
+	(void) snprintf(db, sizeof (db), "db" KVM_DELIM_S "%s/" _NAME ".db", dir);
+
+	if (make_text(text + sizeof ("file" KVM_DELIM_S)-1) || make_maps(text, cdb, db)) {
+		(void) fprintf(stderr, "%s: %s (%d)\n", dir, strerror(errno), errno);
+		return EX_CANTCREAT;
+	}
+
+	rc = run(text, threads);
+	rc |= run(cdb, threads);
+	rc |= run(db, threads);
+
+	return rc == 0 ? EX_OK : EXIT_FAILURE;
+}
@@ -0,0 +1,434 @@
+/*
+ * spftime.c
+ *
+ * SPF Evaluation Timing
+ *
+ * Copyright 2026 by Anthony Howe.  All rights reserved.
+ */
+
+#define _NAME			"spftime"
+
+#ifndef SPFTIME_STUB
+#define SPFTIME_STUB		"127.0.0.3"
+#endif
+
+#ifndef SPFTIME_CLIENT
+#define SPFTIME_CLIENT		"198.51.100.77"
+#endif
+
+#ifndef SPFTIME_DELAY
+#define SPFTIME_DELAY		20
+#endif
+
+#ifndef SPFTIME_INCLUDES
+#define SPFTIME_INCLUDES	3
+#endif
+
+#ifndef SPFTIME_QUEUE
+#define SPFTIME_QUEUE		256
+#endif
+
+/***********************************************************************
+ *** No configuration below this point.
+ ***********************************************************************/
+#include <com/snert/lib/version.h>
+
+#include <ctype.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef HAVE_UNISTD_H
+# include <unistd.h>
+#endif
+
+#if defined(TIME_WITH_SYS_TIME)
+# include <sys/time.h>
+# include <time.h>
+#else
+# if defined(HAVE_SYS_TIME_H)
+#  include <sys/time.h>
+# else
+#  include <time.h>
+# endif
+#endif
+
+#include <com/snert/lib/io/socket3.h>
+#include <com/snert/lib/mail/spf.h>
+#include <com/snert/lib/net/pdq.h>
+#include <com/snert/lib/sys/pthread.h>
+#include <com/snert/lib/sys/sysexits.h>
+#include <com/snert/lib/type/Vector.h>
+#include <com/snert/lib/util/getopt.h>
+
+#define HEADER_SIZE		12
+#define ZONE			"example.test"
+
+typedef struct {
+	struct timespec due;
+	socklen_t fromlen;
+	SocketAddress from;
+	size_t length;
+	unsigned char packet[512];
+} Reply;
+
+static SOCKET fd;
+static int includes = SPFTIME_INCLUDES;
+static unsigned long delay = SPFTIME_DELAY;
+static const char *server = SPFTIME_STUB;
+
+static pthread_mutex_t queue_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t queue_cv = PTHREAD_COND_INITIALIZER;
+static Reply queue[SPFTIME_QUEUE];
+static unsigned queue_head, queue_length;
+
+static const char usage_msg[] =
+"usage: " _NAME " [-x][-c checks][-d ms][-i includes][-s ip]\n"
+"\n"
+"-c checks\tnumber of SPF checks per mode; default 20\n"
+"-d ms\t\tdelay added by the stub to every reply; default " QUOTE(SPFTIME_DELAY) "\n"
+"-i includes\tnumber of include: terms in the SPF record; default " QUOTE(SPFTIME_INCLUDES) "\n"
+"-s ip\t\tname server address; default " SPFTIME_STUB "\n"
+"-x\t\tuse an external name server instead of the built-in stub\n"
+"\n"
+"Check " SPFTIME_CLIENT " against the SPF record of " ZONE ", first\n"
+"evaluating each term's lookups as it is reached, then with prefetching,\n"
+"and report the milliseconds per check. The built-in stub serves a\n"
+"synthetic zone whose record includes others that use a, mx, and ip4\n"
+"terms, the last of which passes. It binds UDP port 53, which requires\n"
+"root.\n"
+"\n"
+LIBSNERT_COPYRIGHT "\n"
+;
+
+static unsigned char *
+put_short(unsigned char *ptr, unsigned value)
+{
+	*ptr++ = (value >> 8) & 0xFF;
+	*ptr++ = value & 0xFF;
+	return ptr;
+}
+
+static unsigned char *
+put_name(unsigned char *ptr, const char *name)
+{
+	size_t length;
+
+	for ( ; *name != '\0'; name += length + (name[length] == '.')) {
+		length = strcspn(name, ".");
+		*ptr++ = (unsigned char) length;
+		memcpy(ptr, name, length);
+		ptr += length;
+	}
+	*ptr++ = 0;
+
+	return ptr;
+}
+
+/*
+ * Append an answer RR for the question name and return its rdata.
+ */
+static unsigned char *
+put_rr(unsigned char *ptr, PDQ_type type)
+{
+	ptr = put_short(ptr, 0xC000 | HEADER_SIZE);
+	ptr = put_short(ptr, type);
+	ptr = put_short(ptr, PDQ_CLASS_IN);
+	ptr = put_short(ptr, 0);
+	ptr = put_short(ptr, 60);
+
+	return ptr + 2;
+}
+
+static unsigned char *
+put_txt(unsigned char *ptr, const char *text)
+{
+	size_t length;
+	unsigned char *rdata;
+
+	rdata = put_rr(ptr, PDQ_TYPE_TXT);
+	for (ptr = rdata; *text != '\0'; text += length) {
+		if (255 < (length = strlen(text)))
+			length = 255;
+		*ptr++ = (unsigned char) length;
+		memcpy(ptr, text, length);
+		ptr += length;
+	}
+	(void) put_short(rdata - 2, ptr - rdata);
+
+	return ptr;
+}
+
+/*
+ * @return
+ *	The length of the reply built in place of the query, or zero
+ *	to ignore the query.
+ */
+static size_t
+answer(unsigned char *packet, size_t length)
+{
+	int n, span;
+	PDQ_type type;
+	size_t offset;
+	unsigned char *ptr, *rdata;
+	char name[DOMAIN_SIZE], text[DOMAIN_SIZE];
+
+	/* Copy the question name in lower case. */
+	offset = 0;
+	for (ptr = packet + HEADER_SIZE; ptr < packet + length && *ptr != 0; ptr += *ptr + 1) {
+		if (sizeof (name) <= offset + *ptr + 1)
+			return 0;
+		if (0 < offset)
+			name[offset++] = '.';
+		for (n = 1; n <= *ptr; n++)
+			name[offset++] = (char) tolower(ptr[n]);
+	}
+	name[offset] = '\0';
+	if (packet + length < ptr + 5)
+		return 0;
+	type = (ptr[1] << 8) | ptr[2];
+	ptr += 5;
+
+	packet[2] = 0x84 | (packet[2] & 0x01);	/* QR, AA, RD */
+	packet[3] = 0x80;			/* RA, NOERROR */
+	memset(packet + 6, 0, 6);		/* an, ns, ar */
+
+	/* Number of an included record, sN.example.test, else -1. */
+	span = 0;
+	if (sscanf(name, "s%d." ZONE "%n", &n, &span) != 1 || span == 0 || name[span] != '\0')
+		n = -1;
+
+	switch (type) {
+	case PDQ_TYPE_A:
+		rdata = put_rr(ptr, PDQ_TYPE_A);
+		memcpy(rdata, "\xC6\x33\x64\xC8", 4);	/* 198.51.100.200 */
+		(void) put_short(rdata - 2, 4);
+		ptr = rdata + 4;
+		packet[7] = 1;
+		break;
+	case PDQ_TYPE_MX:
+		if (n < 0)
+			goto nxdomain;
+		rdata = put_rr(ptr, PDQ_TYPE_MX);
+		(void) snprintf(text, sizeof (text), "mx%d." ZONE, n);
+		ptr = put_name(put_short(rdata, 10), text);
+		(void) put_short(rdata - 2, ptr - rdata);
+		packet[7] = 1;
+		break;
+	case PDQ_TYPE_TXT:
+		if (strcmp(name, ZONE) == 0) {
+			char *record;
+
+			if ((record = malloc(32 + includes * sizeof (text))) == NULL)
+				return 0;
+			offset = snprintf(record, 32, "v=spf1");
+			for (n = 0; n < includes; n++)
+				offset += snprintf(record + offset, sizeof (text), " include:s%d." ZONE, n);
+			(void) strcpy(record + offset, " -all");
+
+			/* Keep within a UDP reply without EDNS. */
+			if ((size_t) (512 - (ptr - packet) - 32) < strlen(record)) {
+				free(record);
+				return 0;
+			}
+			ptr = put_txt(ptr, record);
+			free(record);
+		} else if (0 <= n) {
+			(void) snprintf(
+				text, sizeof (text), "v=spf1 a:h%d." ZONE " mx:s%d." ZONE "%s ?all",
+				n, n, n + 1 == includes ? " ip4:" SPFTIME_CLIENT : ""
+			);
+			ptr = put_txt(ptr, text);
+		} else {
+			goto nxdomain;
+		}
+		packet[7] = 1;
+		break;
+	case PDQ_TYPE_AAAA:
+		/* NODATA */
+		break;
+	default:
+	nxdomain:
+		packet[3] = 0x83;
+	}
+
+	return ptr - packet;
+}
+
+static void
+due_time(struct timespec *ts)
+{
+	(void) clock_gettime(CLOCK_REALTIME, ts);
+	ts->tv_sec += delay / 1000;
+	ts->tv_nsec += (delay % 1000) * 1000000;
+	if (1000000000 <= ts->tv_nsec) {
+		ts->tv_nsec -= 1000000000;
+		ts->tv_sec++;
+	}
+}
+
+/*
+ * Answer the queries, queueing each reply to be sent after the delay.
+ */
+static void *
+stub(void *data)
+{
+	ssize_t length;
+	Reply *reply;
+
+	for (;;) {
+		PTHREAD_MUTEX_LOCK(&queue_mutex);
+		while (SPFTIME_QUEUE <= queue_length)
+			(void) pthread_cond_wait(&queue_cv, &queue_mutex);
+		reply = &queue[(queue_head + queue_length) % SPFTIME_QUEUE];
+		PTHREAD_MUTEX_UNLOCK(&queue_mutex);
+
+		reply->fromlen = sizeof (reply->from);
+		length = recvfrom(fd, reply->packet, sizeof (reply->packet), 0, &reply->from.sa, &reply->fromlen);
+		if (length < HEADER_SIZE || (reply->length = answer(reply->packet, (size_t) length)) == 0)
+			continue;
+		due_time(&reply->due);
+
+		PTHREAD_MUTEX_LOCK(&queue_mutex);
+		queue_length++;
+		(void) pthread_cond_broadcast(&queue_cv);
+		PTHREAD_MUTEX_UNLOCK(&queue_mutex);
+	}
+
+	return NULL;
+}
+
+/*
+ * Send the queued replies when due. The delay is constant, so the
+ * queue is in order of due time.
+ */
+static void *
+sender(void *data)
+{
+	Reply *reply;
+
+	for (;;) {
+		PTHREAD_MUTEX_LOCK(&queue_mutex);
+		while (queue_length == 0)
+			(void) pthread_cond_wait(&queue_cv, &queue_mutex);
+		reply = &queue[queue_head];
+		while (pthread_cond_timedwait(&queue_cv, &queue_mutex, &reply->due) != ETIMEDOUT)
+			;
+		PTHREAD_MUTEX_UNLOCK(&queue_mutex);
+
+		(void) sendto(fd, reply->packet, reply->length, 0, &reply->from.sa, reply->fromlen);
+
+		PTHREAD_MUTEX_LOCK(&queue_mutex);
+		queue_head = (queue_head + 1) % SPFTIME_QUEUE;
+		queue_length--;
+		(void) pthread_cond_broadcast(&queue_cv);
+		PTHREAD_MUTEX_UNLOCK(&queue_mutex);
+	}
+
+	return NULL;
+}
+
+static double
+run(unsigned long checks, int prefetch, int *result)
+{
+	unsigned long i;
+	const char *error;
+	struct timeval start, stop;
+
+	spfPrefetch.value = prefetch;
+	(void) gettimeofday(&start, NULL);
+
+	for (i = 0; i < checks; i++) {
+		pdqCacheFlush();
+		error = spfCheckDomain(SPFTIME_CLIENT, ZONE, result);
+		if (error != NULL)
+			(void) fprintf(stderr, "%s: %s\n", ZONE, error);
+	}
+
+	(void) gettimeofday(&stop, NULL);
+
+	return ((stop.tv_sec - start.tv_sec) * 1000.0 + (stop.tv_usec - start.tv_usec) / 1000.0) / checks;
+}
+
+int
+main(int argc, char **argv)
+{
+	int ch, external;
+	Vector servers;
+	pthread_t thread;
+	SocketAddress *address;
+	unsigned long checks = 20;
+	int serial_result, prefetch_result;
+	double serial_ms, prefetch_ms;
+
+	external = 0;
+
+	while ((ch = getopt(argc, argv, "c:d:i:s:x")) != -1) {
+		switch (ch) {
+		case 'c':
+			checks = strtoul(optarg, NULL, 10);
+			break;
+		case 'd':
+			delay = strtoul(optarg, NULL, 10);
+			break;
+		case 'i':
+			includes = (int) strtol(optarg, NULL, 10);
+			break;
+		case 's':
+			server = optarg;
+			break;
+		case 'x':
+			external = 1;
+			break;
+		default:
+			(void) fputs(usage_msg, stderr);
+			return EX_USAGE;
+		}
+	}
+
+	if (checks < 1)
+		checks = 1;
+	if (includes < 1)
+		includes = 1;
+
+	if (!external) {
+		if ((address = socketAddressNew(server, 53)) == NULL) {
+			(void) fprintf(stderr, "%s: invalid address\n", server);
+			return EX_USAGE;
+		}
+		if ((fd = socket3_open(address, 0)) == INVALID_SOCKET || socket3_bind(fd, address)) {
+			(void) fprintf(stderr, "stub %s: %s (%d)\n", server, strerror(errno), errno);
+			return EX_OSERR;
+		}
+		free(address);
+		if (pthread_create(&thread, NULL, stub, NULL)
+		|| pthread_create(&thread, NULL, sender, NULL)) {
+			(void) fprintf(stderr, "pthread_create: %s (%d)\n", strerror(errno), errno);
+			return EX_OSERR;
+		}
+	}
+
+	/* Setting the servers first also skips pdqInit() fetching
+	 * the root hints from the system name servers.
+	 */
+	if ((servers = VectorCreate(1)) == NULL || VectorAdd(servers, strdup(server))
+	|| pdqSetServers(servers)) {
+		(void) fprintf(stderr, "%s: invalid name server\n", server);
+		return EX_USAGE;
+	}
+	VectorDestroy(servers);
+
+	serial_ms = run(checks, 0, &serial_result);
+	prefetch_ms = run(checks, 1, &prefetch_result);
+
+	(void) printf(
+		"checks=%lu includes=%d delay=%lums serial=%.1fms/%s prefetch=%.1fms/%s speedup=%.2f\n",
+		checks, includes, delay,
+		serial_ms, spfResultString[serial_result],
+		prefetch_ms, spfResultString[prefetch_result],
+		0 < prefetch_ms ? serial_ms / prefetch_ms : 0.0
+	);
+
+	return serial_result == prefetch_result ? EX_OK : EXIT_FAILURE;
+}
@@ -12,6 +12,10 @@
 #define KVM_SQLITE_BUSY_MS	20000
 #endif
 
+#ifndef KVM_SLICE_BUCKETS
+#define KVM_SLICE_BUCKETS	64	/* buckets per lock hold in walk_slice */
+#endif
+
 #undef KVM_BEGIN_WRAPPER
 
 /***********************************************************************
@@ -25,6 +29,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <sys/stat.h>
 
 #ifdef HAVE_FCNTL_H
@@ -66,6 +71,7 @@ extern unsigned int sleep(unsigned int);
 #include <com/snert/lib/io/file.h>
 #include <com/snert/lib/sys/pthread.h>
 #include <com/snert/lib/util/Text.h>
+#include <com/snert/lib/util/timer.h>
 
 #ifdef DEBUG_MALLOC
 # include <com/snert/lib/util/DebugMalloc.h>
@@ -100,6 +106,64 @@ kvm_filepath_stub(kvm *self)
 	return NULL;
 }
 
+#ifndef NOT_FINISHED
+/*
+ * Backends that cannot be walked in slices do it all at once.
+ */
+static int
+kvm_walk_slice_stub(kvm *self, unsigned long *cursor, unsigned ms, int (*function)(kvm_data *, kvm_data *, void *), void *data)
+{
+	if (self == NULL || cursor == NULL || function == NULL)
+		return KVM_ERROR;
+
+	*cursor = 0;
+
+	return (*self->walk)(self, function, data);
+}
+#endif
+
+/*
+ * Backends without a native lookup copy the value with fetch and
+ * release it once the function has seen it. Fetch, not get, since
+ * a socketmap's get is the kvmd extension a sendmail socketmap
+ * server does not understand.
+ */
+static int
+kvm_lookup_stub(kvm *self, kvm_data *key, void (*function)(kvm_data *, void *), void *data)
+{
+	int rc;
+	kvm_data value;
+
+	if (self == NULL || key == NULL || function == NULL)
+		return KVM_ERROR;
+
+	if ((rc = (*self->fetch)(self, key, &value)) == KVM_OK) {
+		(*function)(&value, data);
+		free(value.data);
+	}
+
+	return rc;
+}
+
+/*
+ * A lookup function that makes a private copy of the value, with
+ * an extra NUL byte just in case its a C string.
+ */
+static void
+kvm_copy_value(kvm_data *value, void *data)
+{
+	kvm_data *copy = data;
+
+	if (copy == NULL)
+		return;
+
+	if ((copy->data = malloc(value->size + 1)) != NULL) {
+		memcpy(copy->data, value->data, value->size);
+		copy->data[value->size] = '\0';
+		copy->size = value->size;
+	}
+}
+
 void
 kvmAtForkPrepare(kvm *self)
 {
@@ -161,6 +225,11 @@ kvmCreate(const char *table_name, const char *map_location, int mode)
 	if ((self->_location = strdup(map_location)) == NULL)
 		goto error1;
 
+	self->lookup = kvm_lookup_stub;
+#ifndef NOT_FINISHED
+	self->walk_slice = kvm_walk_slice_stub;
+#endif
+
 	return self;
 error1:
 	if (self->close != NULL)
@@ -380,6 +449,26 @@ error0:
 	return rc;
 }
 
+static int
+kvm_lookup_hash(kvm *self, kvm_data *key, void (*function)(kvm_data *, void *), void *data)
+{
+	int rc;
+	kvm_data v;
+
+	if (self == NULL || key == NULL || function == NULL)
+		return KVM_ERROR;
+
+	PTHREAD_MUTEX_LOCK(&self->_mutex);
+
+	/* Pass by reference while the entry is held by the lock. */
+	if ((rc = kvm_fetch_hash(self, key, &v)) == KVM_OK)
+		(*function)(&v, data);
+
+	PTHREAD_MUTEX_UNLOCK(&self->_mutex);
+
+	return rc;
+}
+
 static int
 kvm_put_hash(kvm *self, kvm_data *key, kvm_data *value)
 {
@@ -542,6 +631,49 @@ error1:
 
 	return rc;
 }
+
+/*
+ * *cursor is the next bucket to visit.
+ */
+static int
+kvm_walk_slice_hash(kvm *self, unsigned long *cursor, unsigned ms, int (*func)(kvm_data *, kvm_data *, void *), void *data)
+{
+	int rc, stop;
+	unsigned long i, end, deadline;
+	kvm_hash **table, *entry, **prev;
+
+	if (self == NULL || cursor == NULL || func == NULL)
+		return KVM_ERROR;
+
+	deadline = timerMonotonicMs() + ms;
+	table = ((kvm_hash_table *) self->_kvm)->table;
+
+	for (stop = 0, i = *cursor; !stop && i < TABLE_SIZE; ) {
+		PTHREAD_MUTEX_LOCK(&self->_mutex);
+		for (end = i + KVM_SLICE_BUCKETS; !stop && i < end && i < TABLE_SIZE; i++) {
+			for (prev = &table[i], entry = *prev; entry != NULL; entry = *prev) {
+				if ((rc = (*func)(&entry->key, &entry->value, data)) == 0) {
+					stop = 1;
+					break;
+				}
+				if (rc < 0) {
+					*prev = entry->next;
+					free(entry);
+				} else {
+					prev = &entry->next;
+				}
+			}
+		}
+		PTHREAD_MUTEX_UNLOCK(&self->_mutex);
+
+		if (deadline <= timerMonotonicMs())
+			break;
+	}
+
+	*cursor = stop || TABLE_SIZE <= i ? 0 : i;
+
+	return KVM_OK;
+}
 #endif
 
 static int
@@ -595,6 +727,7 @@ kvm_open_hash(kvm *self, const char *location, int mode)
 	self->filepath = kvm_filepath_stub;
 	self->fetch = kvm_get_hash;
 	self->get = kvm_get_hash;
+	self->lookup = kvm_lookup_hash;
 	self->put = kvm_put_hash;
 	self->remove = kvm_remove_hash;
 #ifdef NOT_FINISHED
@@ -602,6 +735,7 @@ kvm_open_hash(kvm *self, const char *location, int mode)
 	self->next = kvm_next_hash;
 #else
 	self->walk = kvm_walk_hash;
+	self->walk_slice = kvm_walk_slice_hash;
 #endif
 	self->truncate = kvm_truncate_hash;
 	self->sync = kvm_sync_stub;
@@ -624,280 +758,572 @@ kvm_open_hash(kvm *self, const char *location, int mode)
 }
 
 /***********************************************************************
- *** Flat Text File
+ *** Striped Hash Table
  ***********************************************************************/
 
-typedef struct {
-	char *path;
-	kvm *hash;
-} kvm_file;
+/*
+ * The keys are spread over STRIPE_COUNT independent tables, each with
+ * its own lock, so that threads working on different stripes do not
+ * contend. Each stripe grows by linear hashing, splitting one bucket
+ * per insert once its load exceeds STRIPE_LOAD, so there is never a
+ * pause to rehash a whole table. Entries are carved from slabs kept
+ * per stripe and recycled through free lists by size class.
+ */
+#ifndef STRIPE_BITS
+#define STRIPE_BITS		6
+#endif
 
-static int
-kvm_write(FILE *fp, unsigned char *data, unsigned long length)
-{
-	if (fprintf(fp, "%lu:", length) < 1)
-		return -1;
+#ifndef STRIPE_LOAD
+#define STRIPE_LOAD		2
+#endif
 
-	while (0 < length--) {
-		if (*data != '=' && isprint(*data))
-			fputc(*data, fp);
-		else
-			fprintf(fp, "=%02X", *data);
-		data++;
-	}
+#define STRIPE_COUNT		(1 << STRIPE_BITS)
+#define STRIPE_SEGMENT_SIZE	64		/* buckets, power of 2 */
+#define STRIPE_SLAB_SIZE	(64 * 1024)
+#define STRIPE_CLASS_MIN	64		/* smallest entry, power of 2 */
+#define STRIPE_CLASSES		7		/* 64 .. 4096 bytes */
+#define STRIPE_CLASS_LARGE	(-1)		/* malloc'd, larger than any class */
+
+#if defined(HAVE_PTHREAD_RWLOCK_RDLOCK) && defined(HAVE_PTHREAD_RWLOCK_WRLOCK)
+typedef pthread_rwlock_t stripe_lock;
+# define STRIPE_LOCK_INIT(l)	pthread_rwlock_init(l, NULL)
+# define STRIPE_LOCK_FINI(l)	(void) pthread_rwlock_destroy(l)
+# define STRIPE_READ_LOCK(l)	(void) pthread_rwlock_rdlock(l)
+# define STRIPE_WRITE_LOCK(l)	(void) pthread_rwlock_wrlock(l)
+# define STRIPE_UNLOCK(l)	(void) pthread_rwlock_unlock(l)
+#elif defined(HAVE_PTHREAD_MUTEX_T)
+typedef pthread_mutex_t stripe_lock;
+# define STRIPE_LOCK_INIT(l)	pthread_mutex_init(l, NULL)
+# define STRIPE_LOCK_FINI(l)	(void) pthread_mutex_destroy(l)
+# define STRIPE_READ_LOCK(l)	(void) pthread_mutex_lock(l)
+# define STRIPE_WRITE_LOCK(l)	(void) pthread_mutex_lock(l)
+# define STRIPE_UNLOCK(l)	(void) pthread_mutex_unlock(l)
+#else
+typedef int stripe_lock;
+# define STRIPE_LOCK_INIT(l)	0
+# define STRIPE_LOCK_FINI(l)
+# define STRIPE_READ_LOCK(l)
+# define STRIPE_WRITE_LOCK(l)
+# define STRIPE_UNLOCK(l)
+#endif
 
-	if (fputc(',', fp) == EOF)
-		return -1;
+typedef struct kvm_stripe_entry {
+	struct kvm_stripe_entry *next;
+	unsigned long hash;
+	unsigned long capacity;		/* bytes for key and value */
+	int size_class;
+	kvm_data key;
+	kvm_data value;
+} kvm_stripe_entry;
 
-	return 0;
-}
+typedef struct kvm_stripe_slab {
+	struct kvm_stripe_slab *next;
+} kvm_stripe_slab;
 
-static int
-kvm_read(FILE *fp, unsigned char **data, unsigned long *length)
+typedef struct {
+	stripe_lock lock;
+	unsigned long buckets;		/* in use, linear hashing */
+	unsigned long level;		/* largest power of 2 <= buckets */
+	unsigned long entries;
+	unsigned long segments;		/* length of segment[] */
+	kvm_stripe_entry ***segment;	/* STRIPE_SEGMENT_SIZE buckets each */
+	kvm_stripe_entry *free[STRIPE_CLASSES];
+	kvm_stripe_slab *slabs;
+	unsigned char *slab_next;
+	unsigned long slab_left;
+} kvm_stripe;
+
+typedef struct {
+	kvm_stripe stripe[STRIPE_COUNT];
+} kvm_stripe_table;
+
+/*
+ * D.J. Bernstien Hash version 2 (+ replaced by ^), with a final
+ * mix so that both the stripe and the bucket bits are well spread.
+ */
+static unsigned long
+stripe_hash(unsigned char *buffer, unsigned long size)
 {
-	int ch, i;
-	unsigned long size;
-	unsigned char *buf;
+	unsigned long hash = 5381;
 
-	*data = NULL;
-	*length = 0;
+	while (0 < size--)
+		hash = ((hash << 5) + hash) ^ *buffer++;
 
-	if (fscanf(fp, "%9lu", &size) != 1)
-		goto error0;
-	if (fgetc(fp) != ':')
-		goto error0;
+	hash ^= hash >> 16;
+	hash *= 0x45d9f3bUL;
+	hash ^= hash >> 16;
 
-	if ((buf = malloc(size + 1)) == NULL)
-		goto error0;
+	return hash;
+}
 
-	for (i = 0; i <= size && (ch = fgetc(fp)) != EOF; i++) {
-		if (ch == '=' && fscanf(fp, "%2X", &ch) != 1)
-			goto error1;
-		buf[i] = ch;
-	}
+static kvm_stripe_entry **
+stripe_bucket(kvm_stripe *s, unsigned long hash)
+{
+	unsigned long b, m;
 
-	if (buf[size] != ',')
-		goto error1;
+	/* Low bits pick the stripe, the rest the bucket. */
+	hash >>= STRIPE_BITS;
+	m = s->level;
 
-	buf[size] = '\0';
-	*length = size;
-	*data = buf;
+	if (s->buckets <= (b = hash & (m + m - 1)))
+		b = hash & (m - 1);
 
-	return 0;
-error1:
-	free(buf);
-error0:
-	return -1;
+	return &s->segment[b / STRIPE_SEGMENT_SIZE][b % STRIPE_SEGMENT_SIZE];
 }
 
-static int
-kvm_read_token(FILE *fp, unsigned char **data, unsigned long *length, const char *delims)
+static kvm_stripe_entry *
+stripe_find(kvm_stripe *s, unsigned long hash, kvm_data *key, kvm_stripe_entry ***prev)
 {
-	int ch;
-	long foffset;
-	unsigned long len;
-	unsigned char *buf;
+	kvm_stripe_entry **link, *entry;
 
-	/* Find length of next token. */
-	foffset = ftell(fp);
-	for (len = 0; (ch = fgetc(fp)) != EOF; len++) {
-		if (strchr(delims, ch) != NULL)
+	link = stripe_bucket(s, hash);
+	for (entry = *link; entry != NULL; link = &entry->next, entry = entry->next) {
+		if (entry->hash == hash && key->size == entry->key.size
+		&& memcmp(key->data, entry->key.data, key->size) == 0)
 			break;
 	}
 
-	if (fseek(fp, foffset, SEEK_SET) != 0)
-		return -1;
+	if (prev != NULL)
+		*prev = link;
 
-	/* Allocate space for next token. */
-	if ((buf = malloc(len+1)) == NULL)
-		return -1;
+	return entry;
+}
 
-	/* Re-read and save the next token. */
-	if (fread(buf, 1, len, fp) != len) {
-		free(buf);
-		return -1;
+static kvm_stripe_entry *
+stripe_alloc(kvm_stripe *s, unsigned long length)
+{
+	int size_class;
+	unsigned long size;
+	kvm_stripe_entry *entry;
+	kvm_stripe_slab *slab;
+
+	length += sizeof (*entry);
+	for (size_class = 0, size = STRIPE_CLASS_MIN; size < length; size += size)
+		size_class++;
+
+	if (STRIPE_CLASSES <= size_class) {
+		if ((entry = malloc(length)) == NULL)
+			return NULL;
+		entry->size_class = STRIPE_CLASS_LARGE;
+		entry->capacity = length - sizeof (*entry);
+		return entry;
 	}
 
-	buf[len] = '\0';
-	*length = len;
-	*data = buf;
+	if ((entry = s->free[size_class]) != NULL) {
+		s->free[size_class] = entry->next;
+		return entry;
+	}
 
-	/* Skip delimiters. */
-	while ((ch = fgetc(fp)) != EOF && strchr(delims, ch) != NULL)
-		;
-	ungetc(ch, fp);
+	if (s->slab_left < size) {
+		/* The tail of the previous slab is left unused. */
+		if ((slab = malloc(STRIPE_SLAB_SIZE)) == NULL)
+			return NULL;
+		slab->next = s->slabs;
+		s->slabs = slab;
+		s->slab_next = (unsigned char *) slab + STRIPE_CLASS_MIN;
+		s->slab_left = STRIPE_SLAB_SIZE - STRIPE_CLASS_MIN;
+	}
 
-	return 0;
+	entry = (kvm_stripe_entry *) s->slab_next;
+	s->slab_next += size;
+	s->slab_left -= size;
+
+	entry->size_class = size_class;
+	entry->capacity = size - sizeof (*entry);
+
+	return entry;
 }
 
-static int
-kvm_read_key(FILE *fp, unsigned char **data, unsigned long *length)
+static void
+stripe_free(kvm_stripe *s, kvm_stripe_entry *entry)
 {
-	int ch, len;
+	if (entry->size_class == STRIPE_CLASS_LARGE) {
+		free(entry);
+	} else {
+		entry->next = s->free[entry->size_class];
+		s->free[entry->size_class] = entry;
+	}
+}
 
-	/* Ignore comment and empty lines. */
-	while ((ch = fgetc(fp)) != EOF) {
-		if (ch == '#') {
-			/* Eat comment line. */
-			(void) fscanf(fp, "%*[^\n\r]%*[\n\r]%n", &len);
-		} else if (ch == '\n' || ch == '\r') {
-			/* Eat empty line or discard CR. */
-			;
+/*
+ * Split one bucket into the next unused one, allocating a new
+ * segment when required.
+ */
+static void
+stripe_grow(kvm_stripe *s)
+{
+	unsigned long m, split;
+	kvm_stripe_entry ***segment;
+	kvm_stripe_entry **bucket, *entry, *next, **old, **new;
+
+	if (s->segments <= s->buckets / STRIPE_SEGMENT_SIZE) {
+		if ((segment = realloc(s->segment, 2 * s->segments * sizeof (*segment))) == NULL)
+			return;
+		memset(segment + s->segments, 0, s->segments * sizeof (*segment));
+		s->segments += s->segments;
+		s->segment = segment;
+	}
+
+	if (s->segment[s->buckets / STRIPE_SEGMENT_SIZE] == NULL
+	&& (s->segment[s->buckets / STRIPE_SEGMENT_SIZE] = calloc(STRIPE_SEGMENT_SIZE, sizeof (**s->segment))) == NULL)
+		return;
+
+	m = s->level;
+	split = s->buckets - m;
+
+	bucket = &s->segment[split / STRIPE_SEGMENT_SIZE][split % STRIPE_SEGMENT_SIZE];
+	entry = *bucket;
+	old = bucket;
+	new = &s->segment[s->buckets / STRIPE_SEGMENT_SIZE][s->buckets % STRIPE_SEGMENT_SIZE];
+	s->buckets++;
+
+	for ( ; entry != NULL; entry = next) {
+		next = entry->next;
+		if ((entry->hash >> STRIPE_BITS) & m) {
+			*new = entry;
+			new = &entry->next;
 		} else {
-			break;
+			*old = entry;
+			old = &entry->next;
 		}
 	}
-	ungetc(ch, fp);
+	*new = NULL;
+	*old = NULL;
 
-	return kvm_read_token(fp, data, length, "\t ");
+	if (s->buckets == m + m)
+		s->level = s->buckets;
 }
 
-static int
-kvm_read_value(FILE *fp, unsigned char **data, unsigned long *length)
+static void
+stripe_clear(kvm_stripe *s)
 {
-	return kvm_read_token(fp, data, length, "\n\r");
-}
+	unsigned long i;
+	kvm_stripe_slab *slab, *next;
+	kvm_stripe_entry **bucket, *entry, *enext;
+
+	for (i = 0; i < s->segments && s->segment[i] != NULL; i++) {
+		/* Only the large entries are not in a slab. */
+		for (bucket = s->segment[i]; bucket < s->segment[i] + STRIPE_SEGMENT_SIZE; bucket++) {
+			for (entry = *bucket; entry != NULL; entry = enext) {
+				enext = entry->next;
+				if (entry->size_class == STRIPE_CLASS_LARGE)
+					free(entry);
+			}
+		}
+		if (0 < i) {
+			free(s->segment[i]);
+			s->segment[i] = NULL;
+		}
+	}
+	memset(s->segment[0], 0, STRIPE_SEGMENT_SIZE * sizeof (**s->segment));
 
-#ifdef NOT_USED
-static int
-kvm_fetch_file(kvm *self, kvm_data *key, kvm_data *value)
-{
-	return ((kvm_file *) self->_kvm)->hash->fetch(((kvm_file *) self->_kvm)->hash, key, value);
-}
-#endif
+	for (slab = s->slabs; slab != NULL; slab = next) {
+		next = slab->next;
+		free(slab);
+	}
 
-static int
-kvm_get_file(kvm *self, kvm_data *key, kvm_data *value)
-{
-	return ((kvm_file *) self->_kvm)->hash->get(((kvm_file *) self->_kvm)->hash, key, value);
+	memset(s->free, 0, sizeof (s->free));
+	s->buckets = STRIPE_SEGMENT_SIZE;
+	s->level = STRIPE_SEGMENT_SIZE;
+	s->entries = 0;
+	s->slabs = NULL;
+	s->slab_next = NULL;
+	s->slab_left = 0;
 }
 
 static int
-kvm_put_file(kvm *self, kvm_data *key, kvm_data *value)
+kvm_get_stripe(kvm *self, kvm_data *key, kvm_data *value)
 {
-	return ((kvm_file *) self->_kvm)->hash->put(((kvm_file *) self->_kvm)->hash, key, value);
-}
+	int rc;
+	kvm_stripe *s;
+	unsigned long hash;
+	kvm_stripe_entry *entry;
 
-static int
-kvm_remove_file(kvm *self, kvm_data *key)
-{
-	return ((kvm_file *) self->_kvm)->hash->remove(((kvm_file *) self->_kvm)->hash, key);
-}
+	rc = KVM_ERROR;
 
-#ifdef NOT_FINISHED
-static int
-kvm_first_file(kvm *self)
-{
-	return ((kvm_file *) self->_kvm)->hash->first(((kvm_file *) self->_kvm)->hash);
-}
+	if (self == NULL || key == NULL)
+		goto error0;
 
-static int
-kvm_next_file(kvm *self, kvm_data *key, kvm_data *value)
-{
-	return ((kvm_file *) self->_kvm)->hash->next(((kvm_file *) self->_kvm)->hash, key, value);
-}
+	hash = stripe_hash(key->data, key->size);
+	s = &((kvm_stripe_table *) self->_kvm)->stripe[hash & (STRIPE_COUNT-1)];
 
-#else
+	STRIPE_READ_LOCK(&s->lock);
 
-static int
-kvm_walk_file(kvm *self, int (*func)(kvm_data *, kvm_data *, void *), void *data)
+	if ((entry = stripe_find(s, hash, key, NULL)) == NULL) {
+		rc = KVM_NOT_FOUND;
+		goto error1;
+	}
+
+	if (value != NULL) {
+		if ((value->data = malloc(entry->value.size + 1)) == NULL)
+			goto error1;
+
+		/* Pass by value. */
+		memcpy(value->data, entry->value.data, entry->value.size);
+		value->data[entry->value.size] = '\0';
+		value->size = entry->value.size;
+	}
+
+	rc = KVM_OK;
+error1:
+	STRIPE_UNLOCK(&s->lock);
+error0:
+	return rc;
+}
+
+static int
+kvm_lookup_stripe(kvm *self, kvm_data *key, void (*function)(kvm_data *, void *), void *data)
 {
-	return ((kvm_file *) self->_kvm)->hash->walk(((kvm_file *) self->_kvm)->hash, func, data);
+	int rc;
+	kvm_stripe *s;
+	unsigned long hash;
+	kvm_stripe_entry *entry;
+
+	if (self == NULL || key == NULL || function == NULL)
+		return KVM_ERROR;
+
+	hash = stripe_hash(key->data, key->size);
+	s = &((kvm_stripe_table *) self->_kvm)->stripe[hash & (STRIPE_COUNT-1)];
+
+	STRIPE_READ_LOCK(&s->lock);
+
+	rc = KVM_NOT_FOUND;
+	if ((entry = stripe_find(s, hash, key, NULL)) != NULL) {
+		/* Pass by reference while the stripe is read locked. */
+		(*function)(&entry->value, data);
+		rc = KVM_OK;
+	}
+
+	STRIPE_UNLOCK(&s->lock);
+
+	return rc;
 }
-#endif
 
-static void
-kvm_sync_file(kvm *self)
+static int
+kvm_put_stripe(kvm *self, kvm_data *key, kvm_data *value)
 {
-	long i;
-	FILE *fp;
-	kvm_file *file;
-	kvm_hash *entry, **table;
+	int rc;
+	kvm_stripe *s;
+	unsigned long hash, length;
+	kvm_stripe_entry **prev, *entry, *old;
 
-	file = self->_kvm;
+	rc = KVM_ERROR;
 
-	PTHREAD_MUTEX_LOCK(&self->_mutex);
-	if (!(self->_mode & KVM_MODE_READ_ONLY) && (fp = fopen(file->path, "w")) != NULL) {
-		table = ((kvm_hash_table *) file->hash->_kvm)->table;
+	if (self == NULL || key == NULL || value == NULL)
+		goto error0;
 
-		for (i = 0; i < TABLE_SIZE; i++) {
-			for (entry = table[i]; entry != NULL; entry = entry->next) {
-				if (kvm_write(fp, entry->key.data, entry->key.size))
-					goto error1;
-#ifdef MULTICAST_VERSIONING
-				if (kvm_write(fp, &entry->value.created, sizeof (entry->value.created)))
-					goto error1;
-				if (kvm_write(fp, &entry->value.version, sizeof (entry->value.version)))
-					goto error1;
-#endif
-				if (kvm_write(fp, entry->value.data, entry->value.size))
-					goto error1;
-				if (fputc('\n', fp) == EOF)
-					goto error1;
-			}
+	hash = stripe_hash(key->data, key->size);
+	s = &((kvm_stripe_table *) self->_kvm)->stripe[hash & (STRIPE_COUNT-1)];
+	length = key->size + value->size + 2;
+
+	STRIPE_WRITE_LOCK(&s->lock);
+
+	/* Replace in place when the new value fits. */
+	if ((old = stripe_find(s, hash, key, &prev)) != NULL && length <= old->capacity) {
+		entry = old;
+		old = NULL;
+	} else if ((entry = stripe_alloc(s, length)) == NULL) {
+		goto error1;
+	} else {
+		entry->hash = hash;
+		entry->key.size = key->size;
+		entry->key.data = (unsigned char *) &entry[1];
+		memcpy(entry->key.data, key->data, key->size);
+		entry->key.data[key->size] = '\0';
+
+		if (old != NULL) {
+			entry->next = old->next;
+			stripe_free(s, old);
+		} else {
+			entry->next = *prev;
+			s->entries++;
 		}
-error1:
-		(void) fclose(fp);
+		*prev = entry;
 	}
 
-	PTHREAD_MUTEX_UNLOCK(&self->_mutex);
+	/* Copy by value. */
+	entry->value.size = value->size;
+	entry->value.data = entry->key.data + key->size + 1;
+	memcpy(entry->value.data, value->data, value->size);
+	entry->value.data[value->size] = '\0';
+
+	if (STRIPE_LOAD * s->buckets < s->entries)
+		stripe_grow(s);
+
+	rc = KVM_OK;
+error1:
+	STRIPE_UNLOCK(&s->lock);
+error0:
+	return rc;
 }
 
-static const char *
-kvm_filepath_file(kvm *self)
+static int
+kvm_remove_stripe(kvm *self, kvm_data *key)
 {
-	return ((kvm_file *) self->_kvm)->path;
+	int rc;
+	kvm_stripe *s;
+	unsigned long hash;
+	kvm_stripe_entry **prev, *entry;
+
+	rc = KVM_ERROR;
+
+	if (self == NULL || key == NULL)
+		goto error0;
+
+	hash = stripe_hash(key->data, key->size);
+	s = &((kvm_stripe_table *) self->_kvm)->stripe[hash & (STRIPE_COUNT-1)];
+
+	STRIPE_WRITE_LOCK(&s->lock);
+
+	rc = KVM_NOT_FOUND;
+	if ((entry = stripe_find(s, hash, key, &prev)) != NULL) {
+		*prev = entry->next;
+		stripe_free(s, entry);
+		s->entries--;
+		rc = KVM_OK;
+	}
+
+	STRIPE_UNLOCK(&s->lock);
+error0:
+	return rc;
 }
 
+#ifndef NOT_FINISHED
 static int
-kvm_truncate_file(kvm *self)
+kvm_walk_stripe(kvm *self, int (*func)(kvm_data *, kvm_data *, void *), void *data)
 {
-	int rc;
+	int i, rc, stop;
+	kvm_stripe *s;
+	unsigned long b;
+	kvm_stripe_entry **prev, *entry;
+
+	/* Each stripe is locked in turn, not the whole table. */
+	for (stop = i = 0; !stop && i < STRIPE_COUNT; i++) {
+		s = &((kvm_stripe_table *) self->_kvm)->stripe[i];
+		STRIPE_WRITE_LOCK(&s->lock);
+
+		for (b = 0; !stop && b < s->buckets; b++) {
+			prev = &s->segment[b / STRIPE_SEGMENT_SIZE][b % STRIPE_SEGMENT_SIZE];
+			for (entry = *prev; entry != NULL; entry = *prev) {
+				if ((rc = (*func)(&entry->key, &entry->value, data)) == 0) {
+					stop = 1;
+					break;
+				}
+				if (rc < 0) {
+					*prev = entry->next;
+					stripe_free(s, entry);
+					s->entries--;
+				} else {
+					prev = &entry->next;
+				}
+			}
+		}
 
-	rc = ((kvm_file *) self->_kvm)->hash->truncate(((kvm_file *) self->_kvm)->hash);
+		STRIPE_UNLOCK(&s->lock);
+	}
 
-	if (rc == KVM_OK) {
-		PTHREAD_MUTEX_LOCK(&self->_mutex);
-#if defined(HAVE_TRUNCATE)
-		if (truncate(((kvm_file *) self->_kvm)->path, 0))
-			rc = KVM_ERROR;
-#elif defined(HAVE_FTRUNCATE)
+	return KVM_OK;
+}
+
+/*
+ * *cursor is the stripe plus STRIPE_COUNT times the next bucket to
+ * visit in that stripe. Stripes are visited in turn.
+ *
+ * A key present for the whole walk is visited at least once, but
+ * may be visited twice. A put between calls can split a bucket that
+ * was already visited, see stripe_grow(), moving some of its keys
+ * to the new last bucket, which is still ahead of the cursor. A split
+ * never moves a key behind the cursor, so none are missed. Callers,
+ * such as an expiry sweep, must tolerate seeing a key again.
+ */
+static int
+kvm_walk_slice_stripe(kvm *self, unsigned long *cursor, unsigned ms, int (*func)(kvm_data *, kvm_data *, void *), void *data)
 {
-		int fd;
+	int rc, stop;
+	kvm_stripe *s;
+	unsigned long i, b, end, deadline;
+	kvm_stripe_entry **prev, *entry;
 
-		if ((fd = open(((kvm_file *) self->_kvm)->path, O_RDWR, 0600)) < 0) {
-			rc = KVM_ERROR;
-		} else {
-			if (ftruncate(fd, 0))
-				rc = KVM_ERROR;
-			close(fd);
+	if (self == NULL || cursor == NULL || func == NULL)
+		return KVM_ERROR;
+
+	deadline = timerMonotonicMs() + ms;
+	i = *cursor % STRIPE_COUNT;
+	b = *cursor / STRIPE_COUNT;
+
+	for (stop = 0; !stop && i < STRIPE_COUNT; ) {
+		s = &((kvm_stripe_table *) self->_kvm)->stripe[i];
+		STRIPE_WRITE_LOCK(&s->lock);
+
+		for (end = b + KVM_SLICE_BUCKETS; !stop && b < end && b < s->buckets; b++) {
+			prev = &s->segment[b / STRIPE_SEGMENT_SIZE][b % STRIPE_SEGMENT_SIZE];
+			for (entry = *prev; entry != NULL; entry = *prev) {
+				if ((rc = (*func)(&entry->key, &entry->value, data)) == 0) {
+					stop = 1;
+					break;
+				}
+				if (rc < 0) {
+					*prev = entry->next;
+					stripe_free(s, entry);
+					s->entries--;
+				} else {
+					prev = &entry->next;
+				}
+			}
+		}
+
+		/* Next stripe? */
+		if (s->buckets <= b) {
+			b = 0;
+			i++;
 		}
+
+		STRIPE_UNLOCK(&s->lock);
+
+		if (deadline <= timerMonotonicMs())
+			break;
+	}
+
+	*cursor = stop || STRIPE_COUNT <= i ? 0 : i + b * STRIPE_COUNT;
+
+	return KVM_OK;
 }
-#else
-# error "Require ftruncate() or truncate() equivalent."
 #endif
-		PTHREAD_MUTEX_UNLOCK(&self->_mutex);
+
+static int
+kvm_truncate_stripe(kvm *self)
+{
+	int i;
+	kvm_stripe *s;
+
+	for (i = 0; i < STRIPE_COUNT; i++) {
+		s = &((kvm_stripe_table *) self->_kvm)->stripe[i];
+		STRIPE_WRITE_LOCK(&s->lock);
+		stripe_clear(s);
+		STRIPE_UNLOCK(&s->lock);
 	}
 
-	return rc;
+	return KVM_OK;
 }
 
 static void
-kvm_close_file(kvm *self)
+kvm_close_stripe(kvm *self)
 {
-	kvm_file *file;
+	int i;
+	kvm_stripe *s;
 
 	if (self != NULL) {
 		if (self->_kvm != NULL) {
-			file = self->_kvm;
-
-			if (file->hash != NULL) {
-				kvm_sync_file(self);
-				file->hash->close(file->hash);
+			for (i = 0; i < STRIPE_COUNT; i++) {
+				s = &((kvm_stripe_table *) self->_kvm)->stripe[i];
+				if (s->segment == NULL)
+					break;
+				stripe_clear(s);
+				free(s->segment[0]);
+				free(s->segment);
+				STRIPE_LOCK_FINI(&s->lock);
 			}
-
-			free(file->path);
-			free(file);
+			free(self->_kvm);
 		}
 
 		kvmClose(self);
@@ -905,107 +1331,1478 @@ kvm_close_file(kvm *self)
 }
 
 static int
-kvm_open_file(kvm *self, const char *location, int mode)
+kvm_open_stripe(kvm *self, const char *location, int mode)
 {
-	FILE *fp;
-	kvm_data k, v;
-	kvm_file *file;
-	char *fmode = "rw";
-#ifdef HAVE_SYS_STAT_H
-	struct stat sb;
-#endif
+	int i;
+	kvm_stripe *s;
+	kvm_stripe_table *t;
 
-	self->close = kvm_close_file;
-	self->filepath = kvm_filepath_file;
-	self->fetch = kvm_get_file;
-	self->get = kvm_get_file;
-	self->put = kvm_put_file;
-	self->remove = kvm_remove_file;
-#ifdef NOT_FINISHED
-	self->first = kvm_first_file;
-	self->next = kvm_next_file;
-#else
-	self->walk = kvm_walk_file;
+	self->close = kvm_close_stripe;
+	self->filepath = kvm_filepath_stub;
+	self->fetch = kvm_get_stripe;
+	self->get = kvm_get_stripe;
+	self->lookup = kvm_lookup_stripe;
+	self->put = kvm_put_stripe;
+	self->remove = kvm_remove_stripe;
+#ifndef NOT_FINISHED
+	self->walk = kvm_walk_stripe;
+	self->walk_slice = kvm_walk_slice_stripe;
 #endif
-	self->truncate = kvm_truncate_file;
-	self->sync = kvm_sync_file;
-	self->_mode = mode;
+	self->truncate = kvm_truncate_stripe;
+	self->sync = kvm_sync_stub;
 
 	self->begin = kvm_begin_stub;
 	self->commit = kvm_commit_stub;
 	self->rollback = kvm_rollback_stub;
 
-	if (mode & KVM_MODE_READ_ONLY) {
-		fmode = "r";
-		self->put = kvm_put_stub;
-		self->remove = kvm_remove_stub;
+	if ((t = calloc(1, sizeof (*t))) == NULL)
+		goto error0;
+
+	for (i = 0; i < STRIPE_COUNT; i++) {
+		s = &t->stripe[i];
+		if ((s->segment = calloc(1, sizeof (*s->segment))) == NULL)
+			goto error1;
+		if ((s->segment[0] = calloc(STRIPE_SEGMENT_SIZE, sizeof (**s->segment))) == NULL)
+			goto error2;
+		if (STRIPE_LOCK_INIT(&s->lock))
+			goto error3;
+		s->segments = 1;
+		s->buckets = STRIPE_SEGMENT_SIZE;
+		s->level = STRIPE_SEGMENT_SIZE;
 	}
 
-	if ((file = malloc(sizeof (*file))) == NULL)
-		goto error0;
+	self->_kvm = t;
 
-	self->_kvm = file;
+	return KVM_OK;
+error3:
+	free(s->segment[0]);
+error2:
+	free(s->segment);
+error1:
+	/* Undo the stripes already set up. */
+	while (0 < i--) {
+		s = &t->stripe[i];
+		free(s->segment[0]);
+		free(s->segment);
+		STRIPE_LOCK_FINI(&s->lock);
+	}
+	free(t);
+error0:
+	return KVM_ERROR;
+}
 
-	if ((file->hash = kvmOpen(self->_table, NULL, 0)) == NULL)
-		goto error0;
+/***********************************************************************
+ *** Flat Text File
+ ***********************************************************************/
 
-	if ((file->path = strdup(location)) == NULL)
-		goto error0;
+typedef struct {
+	char *path;
+	kvm *hash;
+} kvm_file;
 
-	if ((fp = fopen(location, fmode)) != NULL) {
-		int (*get_key)(FILE *, unsigned char **, unsigned long *);
-		int (*get_value)(FILE *, unsigned char **, unsigned long *);
+static int
+kvm_write(FILE *fp, unsigned char *data, unsigned long length)
+{
+	if (fprintf(fp, "%lu:", length) < 1)
+		return -1;
 
-		if (kvm_read(fp, &k.data, &k.size) && !feof(fp) && !ferror(fp)) {
-			/* File looks like a human made key-value file. */
-			get_key = kvm_read_key;
-			get_value = kvm_read_value;
-			self->_mode |= KVM_MODE_READ_ONLY;
-		} else {
-			/* File looks like a kvm file. */
-			get_key = kvm_read;
-			get_value = kvm_read;
-		}
+	while (0 < length--) {
+		if (*data != '=' && isprint(*data))
+			fputc(*data, fp);
+		else
+			fprintf(fp, "=%02X", *data);
+		data++;
+	}
 
-		rewind(fp);
-		while (!feof(fp)) {
+	if (fputc(',', fp) == EOF)
+		return -1;
+
+	return 0;
+}
+
+static int
+kvm_read(FILE *fp, unsigned char **data, unsigned long *length)
+{
+	int ch, i;
+	unsigned long size;
+	unsigned char *buf;
+
+	*data = NULL;
+	*length = 0;
+
+	if (fscanf(fp, "%9lu", &size) != 1)
+		goto error0;
+	if (fgetc(fp) != ':')
+		goto error0;
+
+	if ((buf = malloc(size + 1)) == NULL)
+		goto error0;
+
+	for (i = 0; i <= size && (ch = fgetc(fp)) != EOF; i++) {
+		if (ch == '=' && fscanf(fp, "%2X", &ch) != 1)
+			goto error1;
+		buf[i] = ch;
+	}
+
+	if (buf[size] != ',')
+		goto error1;
+
+	buf[size] = '\0';
+	*length = size;
+	*data = buf;
+
+	return 0;
+error1:
+	free(buf);
+error0:
+	return -1;
+}
+
+static int
+kvm_read_token(FILE *fp, unsigned char **data, unsigned long *length, const char *delims)
+{
+	int ch;
+	long foffset;
+	unsigned long len;
+	unsigned char *buf;
+
+	/* Find length of next token. */
+	foffset = ftell(fp);
+	for (len = 0; (ch = fgetc(fp)) != EOF; len++) {
+		if (strchr(delims, ch) != NULL)
+			break;
+	}
+
+	if (fseek(fp, foffset, SEEK_SET) != 0)
+		return -1;
+
+	/* Allocate space for next token. */
+	if ((buf = malloc(len+1)) == NULL)
+		return -1;
+
+	/* Re-read and save the next token. */
+	if (fread(buf, 1, len, fp) != len) {
+		free(buf);
+		return -1;
+	}
+
+	buf[len] = '\0';
+	*length = len;
+	*data = buf;
+
+	/* Skip delimiters. */
+	while ((ch = fgetc(fp)) != EOF && strchr(delims, ch) != NULL)
+		;
+	ungetc(ch, fp);
+
+	return 0;
+}
+
+static int
+kvm_read_key(FILE *fp, unsigned char **data, unsigned long *length)
+{
+	int ch, len;
+
+	/* Ignore comment and empty lines. */
+	while ((ch = fgetc(fp)) != EOF) {
+		if (ch == '#') {
+			/* Eat comment line. */
+			(void) fscanf(fp, "%*[^\n\r]%*[\n\r]%n", &len);
+		} else if (ch == '\n' || ch == '\r') {
+			/* Eat empty line or discard CR. */
+			;
+		} else {
+			break;
+		}
+	}
+	ungetc(ch, fp);
+
+	return kvm_read_token(fp, data, length, "\t ");
+}
+
+static int
+kvm_read_value(FILE *fp, unsigned char **data, unsigned long *length)
+{
+	return kvm_read_token(fp, data, length, "\n\r");
+}
+
+#ifdef NOT_USED
+static int
+kvm_fetch_file(kvm *self, kvm_data *key, kvm_data *value)
+{
+	return ((kvm_file *) self->_kvm)->hash->fetch(((kvm_file *) self->_kvm)->hash, key, value);
+}
+#endif
+
+static int
+kvm_get_file(kvm *self, kvm_data *key, kvm_data *value)
+{
+	return ((kvm_file *) self->_kvm)->hash->get(((kvm_file *) self->_kvm)->hash, key, value);
+}
+
+static int
+kvm_lookup_file(kvm *self, kvm_data *key, void (*function)(kvm_data *, void *), void *data)
+{
+	return ((kvm_file *) self->_kvm)->hash->lookup(((kvm_file *) self->_kvm)->hash, key, function, data);
+}
+
+static int
+kvm_put_file(kvm *self, kvm_data *key, kvm_data *value)
+{
+	return ((kvm_file *) self->_kvm)->hash->put(((kvm_file *) self->_kvm)->hash, key, value);
+}
+
+static int
+kvm_remove_file(kvm *self, kvm_data *key)
+{
+	return ((kvm_file *) self->_kvm)->hash->remove(((kvm_file *) self->_kvm)->hash, key);
+}
+
+#ifdef NOT_FINISHED
+static int
+kvm_first_file(kvm *self)
+{
+	return ((kvm_file *) self->_kvm)->hash->first(((kvm_file *) self->_kvm)->hash);
+}
+
+static int
+kvm_next_file(kvm *self, kvm_data *key, kvm_data *value)
+{
+	return ((kvm_file *) self->_kvm)->hash->next(((kvm_file *) self->_kvm)->hash, key, value);
+}
+
+#else
+
+static int
+kvm_walk_file(kvm *self, int (*func)(kvm_data *, kvm_data *, void *), void *data)
+{
+	return ((kvm_file *) self->_kvm)->hash->walk(((kvm_file *) self->_kvm)->hash, func, data);
+}
+#endif
+
+static void
+kvm_sync_file(kvm *self)
+{
+	long i;
+	FILE *fp;
+	kvm_file *file;
+	kvm_hash *entry, **table;
+
+	file = self->_kvm;
+
+	PTHREAD_MUTEX_LOCK(&self->_mutex);
+	if (!(self->_mode & KVM_MODE_READ_ONLY) && (fp = fopen(file->path, "w")) != NULL) {
+		table = ((kvm_hash_table *) file->hash->_kvm)->table;
+
+		for (i = 0; i < TABLE_SIZE; i++) {
+			for (entry = table[i]; entry != NULL; entry = entry->next) {
+				if (kvm_write(fp, entry->key.data, entry->key.size))
+					goto error1;
+#ifdef MULTICAST_VERSIONING
+				if (kvm_write(fp, &entry->value.created, sizeof (entry->value.created)))
+					goto error1;
+				if (kvm_write(fp, &entry->value.version, sizeof (entry->value.version)))
+					goto error1;
+#endif
+				if (kvm_write(fp, entry->value.data, entry->value.size))
+					goto error1;
+				if (fputc('\n', fp) == EOF)
+					goto error1;
+			}
+		}
+error1:
+		(void) fclose(fp);
+	}
+
+	PTHREAD_MUTEX_UNLOCK(&self->_mutex);
+}
+
+static const char *
+kvm_filepath_file(kvm *self)
+{
+	return ((kvm_file *) self->_kvm)->path;
+}
+
+static int
+kvm_truncate_file(kvm *self)
+{
+	int rc;
+
+	rc = ((kvm_file *) self->_kvm)->hash->truncate(((kvm_file *) self->_kvm)->hash);
+
+	if (rc == KVM_OK) {
+		PTHREAD_MUTEX_LOCK(&self->_mutex);
+#if defined(HAVE_TRUNCATE)
+		if (truncate(((kvm_file *) self->_kvm)->path, 0))
+			rc = KVM_ERROR;
+#elif defined(HAVE_FTRUNCATE)
+{
+		int fd;
+
+		if ((fd = open(((kvm_file *) self->_kvm)->path, O_RDWR, 0600)) < 0) {
+			rc = KVM_ERROR;
+		} else {
+			if (ftruncate(fd, 0))
+				rc = KVM_ERROR;
+			close(fd);
+		}
+}
+#else
+# error "Require ftruncate() or truncate() equivalent."
+#endif
+		PTHREAD_MUTEX_UNLOCK(&self->_mutex);
+	}
+
+	return rc;
+}
+
+static void
+kvm_close_file(kvm *self)
+{
+	kvm_file *file;
+
+	if (self != NULL) {
+		if (self->_kvm != NULL) {
+			file = self->_kvm;
+
+			if (file->hash != NULL) {
+				kvm_sync_file(self);
+				file->hash->close(file->hash);
+			}
+
+			free(file->path);
+			free(file);
+		}
+
+		kvmClose(self);
+	}
+}
+
+static int
+kvm_open_file(kvm *self, const char *location, int mode)
+{
+	FILE *fp;
+	kvm_data k, v;
+	kvm_file *file;
+	char *fmode = "rw";
+#ifdef HAVE_SYS_STAT_H
+	struct stat sb;
+#endif
+
+	self->close = kvm_close_file;
+	self->filepath = kvm_filepath_file;
+	self->fetch = kvm_get_file;
+	self->get = kvm_get_file;
+	self->lookup = kvm_lookup_file;
+	self->put = kvm_put_file;
+	self->remove = kvm_remove_file;
+#ifdef NOT_FINISHED
+	self->first = kvm_first_file;
+	self->next = kvm_next_file;
+#else
+	self->walk = kvm_walk_file;
+#endif
+	self->truncate = kvm_truncate_file;
+	self->sync = kvm_sync_file;
+	self->_mode = mode;
+
+	self->begin = kvm_begin_stub;
+	self->commit = kvm_commit_stub;
+	self->rollback = kvm_rollback_stub;
+
+	if (mode & KVM_MODE_READ_ONLY) {
+		fmode = "r";
+		self->put = kvm_put_stub;
+		self->remove = kvm_remove_stub;
+	}
+
+	if ((file = malloc(sizeof (*file))) == NULL)
+		goto error0;
+
+	self->_kvm = file;
+
+	if ((file->hash = kvmOpen(self->_table, NULL, 0)) == NULL)
+		goto error0;
+
+	if ((file->path = strdup(location)) == NULL)
+		goto error0;
+
+	if ((fp = fopen(location, fmode)) != NULL) {
+		int (*get_key)(FILE *, unsigned char **, unsigned long *);
+		int (*get_value)(FILE *, unsigned char **, unsigned long *);
+
+		if (kvm_read(fp, &k.data, &k.size) && !feof(fp) && !ferror(fp)) {
+			/* File looks like a human made key-value file. */
+			get_key = kvm_read_key;
+			get_value = kvm_read_value;
+			self->_mode |= KVM_MODE_READ_ONLY;
+		} else {
+			/* File looks like a kvm file. */
+			get_key = kvm_read;
+			get_value = kvm_read;
+		}
+
+		rewind(fp);
+		while (!feof(fp)) {
 			if ((*get_key)(fp, &k.data, &k.size)) {
 				if (feof(fp))
 					break;
 				goto error1;
 			}
-			if ((*get_value)(fp, &v.data, &v.size)) {
-				if (feof(fp))
-					break;
-				goto error2;
+			if ((*get_value)(fp, &v.data, &v.size)) {
+				if (feof(fp))
+					break;
+				goto error2;
+			}
+
+			if (*k.data != '#' && file->hash->put(file->hash, &k, &v))
+				goto error3;
+
+			free(v.data);
+			free(k.data);
+		}
+
+		(void) fclose(fp);
+	} else if (errno == ENOENT && (self->_mode & KVM_MODE_READ_ONLY)) {
+#ifndef NDEBUG
+		syslog(LOG_ERR, "open error \"%s\": %s (%d)", location, strerror(errno), errno);
+#endif
+		goto error0;
+	} else if (errno != 0 && errno != ENOENT) {
+		goto error0;
+	}
+
+	return KVM_OK;
+error3:
+	free(v.data);
+error2:
+	free(k.data);
+error1:
+	(void) fclose(fp);
+error0:
+	return KVM_ERROR;
+}
+
+/***********************************************************************
+ *** Constant Database
+ ***********************************************************************/
+
+/*
+ * A read-only map in D.J. Bernstein's cdb format, so that files built
+ * by cdbmake(1) or kvmcdb(1) can be used. The file is mapped into
+ * memory and a lookup is a hash probe of at most a few slots, without
+ * copying the file or locking it. An update is done by building a new
+ * file and renaming it over the old one, which is noticed by a stat()
+ * at most once every KVM_CDB_CHECK seconds rather than per lookup.
+ *
+ *	header	256 pairs of (table position, table slots)
+ *	records	(key length, value length, key, value) ...
+ *	tables	256 tables of (hash, record position) slots
+ *
+ * All numbers are 32-bit little endian.
+ */
+#ifndef KVM_CDB_CHECK
+#define KVM_CDB_CHECK		5
+#endif
+
+#define CDB_HEADER_SIZE		2048
+#define CDB_MAX_SIZE		0xFFFFFFFFUL
+
+static unsigned long
+cdb_hash(unsigned char *buffer, unsigned long size)
+{
+	unsigned long hash = 5381;
+
+	while (0 < size--)
+		hash = ((hash + (hash << 5)) ^ *buffer++) & 0xFFFFFFFFUL;
+
+	return hash;
+}
+
+static unsigned long
+cdb_get32(const unsigned char *p)
+{
+	return (unsigned long) p[0] | (unsigned long) p[1] << 8
+		| (unsigned long) p[2] << 16 | (unsigned long) p[3] << 24;
+}
+
+static void
+cdb_put32(unsigned char *p, unsigned long n)
+{
+	p[0] = (unsigned char) n;
+	p[1] = (unsigned char) (n >> 8);
+	p[2] = (unsigned char) (n >> 16);
+	p[3] = (unsigned char) (n >> 24);
+}
+
+#if defined(HAVE_SYS_MMAN_H) && defined(HAVE_MMAP)
+#include <sys/mman.h>
+
+typedef struct {
+	char *path;
+	stripe_lock lock;
+	unsigned char *base;
+	unsigned long size;
+	time_t checked;
+	time_t mtime;
+	ino_t inode;
+	dev_t device;
+} kvm_cdb;
+
+/*
+ * Map the file at kc->path, replacing any previous mapping only
+ * once the new one is known to be good.
+ */
+static int
+cdb_map(kvm_cdb *kc)
+{
+	int fd;
+	void *base;
+	struct stat sb;
+
+	if ((fd = open(kc->path, O_RDONLY)) < 0)
+		goto error0;
+
+	if (fstat(fd, &sb) || sb.st_size < CDB_HEADER_SIZE || CDB_MAX_SIZE < (unsigned long) sb.st_size) {
+		errno = EINVAL;
+		goto error1;
+	}
+
+	if ((base = mmap(NULL, (size_t) sb.st_size, PROT_READ, MAP_SHARED, fd, 0)) == MAP_FAILED)
+		goto error1;
+
+	(void) close(fd);
+
+	if (kc->base != NULL)
+		(void) munmap(kc->base, (size_t) kc->size);
+
+	kc->base = base;
+	kc->size = (unsigned long) sb.st_size;
+	kc->mtime = sb.st_mtime;
+	kc->inode = sb.st_ino;
+	kc->device = sb.st_dev;
+
+	return 0;
+error1:
+	(void) close(fd);
+error0:
+	syslog(LOG_ERR, "cdb \"%s\" map failed: %s (%d)", kc->path, strerror(errno), errno);
+	return -1;
+}
+
+/*
+ * Return with the read lock held, having first swapped in a newer
+ * file if one has been renamed into place since the last check.
+ */
+static void
+cdb_read_lock(kvm_cdb *kc)
+{
+	time_t now;
+	struct stat sb;
+
+	now = time(NULL);
+	STRIPE_READ_LOCK(&kc->lock);
+
+	if (now < kc->checked + KVM_CDB_CHECK)
+		return;
+
+	STRIPE_UNLOCK(&kc->lock);
+	STRIPE_WRITE_LOCK(&kc->lock);
+
+	/* Another thread may have done the check while we waited. */
+	if (kc->checked + KVM_CDB_CHECK <= now) {
+		kc->checked = now;
+
+		if (stat(kc->path, &sb) == 0
+		&& (sb.st_mtime != kc->mtime || sb.st_ino != kc->inode
+		||  sb.st_dev != kc->device || (unsigned long) sb.st_size != kc->size)) {
+			syslog(LOG_INFO, "reopening \"%s\"...", kc->path);
+			(void) cdb_map(kc);
+		}
+	}
+
+	STRIPE_UNLOCK(&kc->lock);
+	STRIPE_READ_LOCK(&kc->lock);
+}
+
+/*
+ * Find key in the mapped file and point value at the data within
+ * the mapping. Every position read from the file is checked, so a
+ * corrupt file cannot cause a read outside of the mapping.
+ */
+static int
+cdb_find(kvm_cdb *kc, kvm_data *key, kvm_data *value)
+{
+	unsigned char *slot, *record;
+	unsigned long hash, table, slots, i, at, position, klen, dlen;
+
+	if (kc->base == NULL)
+		return KVM_ERROR;
+
+	hash = cdb_hash(key->data, key->size);
+	table = cdb_get32(kc->base + (hash & 0xFF) * 8);
+	slots = cdb_get32(kc->base + (hash & 0xFF) * 8 + 4);
+
+	if (slots == 0)
+		return KVM_NOT_FOUND;
+	if (kc->size < table || (kc->size - table) / 8 < slots)
+		return KVM_ERROR;
+
+	at = (hash >> 8) % slots;
+
+	for (i = 0; i < slots; i++) {
+		slot = kc->base + table + at * 8;
+		if (++at == slots)
+			at = 0;
+
+		if ((position = cdb_get32(slot + 4)) == 0)
+			break;
+		if (cdb_get32(slot) != hash)
+			continue;
+
+		if (kc->size - 8 < position)
+			return KVM_ERROR;
+		record = kc->base + position;
+
+		klen = cdb_get32(record);
+		dlen = cdb_get32(record + 4);
+		if (kc->size - position - 8 < klen + dlen || klen + dlen < klen)
+			return KVM_ERROR;
+
+		if (klen == key->size && memcmp(record + 8, key->data, klen) == 0) {
+			value->data = record + 8 + klen;
+			value->size = dlen;
+			return KVM_OK;
+		}
+	}
+
+	return KVM_NOT_FOUND;
+}
+
+static int
+kvm_lookup_cdb(kvm *self, kvm_data *key, void (*function)(kvm_data *, void *), void *data)
+{
+	int rc;
+	kvm_cdb *kc;
+	kvm_data v;
+
+	if (self == NULL || key == NULL || function == NULL)
+		return KVM_ERROR;
+
+	kc = self->_kvm;
+	cdb_read_lock(kc);
+
+	/* Pass by reference into the mapping, which is not unmapped
+	 * until any reload can get the write lock.
+	 */
+	if ((rc = cdb_find(kc, key, &v)) == KVM_OK)
+		(*function)(&v, data);
+
+	STRIPE_UNLOCK(&kc->lock);
+
+	return rc;
+}
+
+static int
+kvm_get_cdb(kvm *self, kvm_data *key, kvm_data *value)
+{
+	int rc;
+
+	if (value != NULL)
+		value->data = NULL;
+
+	rc = kvm_lookup_cdb(self, key, kvm_copy_value, value);
+	if (rc == KVM_OK && value != NULL && value->data == NULL)
+		rc = KVM_ERROR;
+
+	return rc;
+}
+
+static int
+kvm_walk_cdb(kvm *self, int (*func)(kvm_data *, kvm_data *, void *), void *data)
+{
+	kvm_cdb *kc;
+	kvm_data k, v;
+	unsigned long at, end;
+
+	if (self == NULL || func == NULL)
+		return KVM_ERROR;
+
+	kc = self->_kvm;
+	cdb_read_lock(kc);
+
+	if (kc->base != NULL) {
+		/* The records lie between the header and the first table. */
+		if (kc->size < (end = cdb_get32(kc->base)))
+			end = kc->size;
+
+		for (at = CDB_HEADER_SIZE; at + 8 <= end; at += 8 + k.size + v.size) {
+			k.size = cdb_get32(kc->base + at);
+			v.size = cdb_get32(kc->base + at + 4);
+			if (end - at - 8 < k.size + v.size || k.size + v.size < k.size)
+				break;
+
+			k.data = kc->base + at + 8;
+			v.data = k.data + k.size;
+
+			/* Read-only, so a request to remove is ignored. */
+			if ((*func)(&k, &v, data) == 0)
+				break;
+		}
+	}
+
+	STRIPE_UNLOCK(&kc->lock);
+
+	return KVM_OK;
+}
+
+static const char *
+kvm_filepath_cdb(kvm *self)
+{
+	return ((kvm_cdb *) self->_kvm)->path;
+}
+
+static void
+kvm_close_cdb(kvm *self)
+{
+	kvm_cdb *kc;
+
+	if (self != NULL) {
+		if ((kc = self->_kvm) != NULL) {
+			if (kc->base != NULL)
+				(void) munmap(kc->base, (size_t) kc->size);
+			STRIPE_LOCK_FINI(&kc->lock);
+			free(kc->path);
+			free(kc);
+		}
+		kvmClose(self);
+	}
+}
+
+static int
+kvm_open_cdb(kvm *self, const char *location, int mode)
+{
+	kvm_cdb *kc;
+
+	self->close = kvm_close_cdb;
+	self->filepath = kvm_filepath_cdb;
+	self->fetch = kvm_get_cdb;
+	self->get = kvm_get_cdb;
+	self->lookup = kvm_lookup_cdb;
+	self->put = kvm_put_stub;
+	self->remove = kvm_remove_stub;
+#ifndef NOT_FINISHED
+	self->walk = kvm_walk_cdb;
+#endif
+	self->truncate = kvm_truncate_stub;
+	self->sync = kvm_sync_stub;
+	self->_mode = mode | KVM_MODE_READ_ONLY;
+
+	self->begin = kvm_begin_stub;
+	self->commit = kvm_commit_stub;
+	self->rollback = kvm_rollback_stub;
+
+	if ((kc = calloc(1, sizeof (*kc))) == NULL)
+		return KVM_ERROR;
+	if (STRIPE_LOCK_INIT(&kc->lock)) {
+		free(kc);
+		return KVM_ERROR;
+	}
+
+	self->_kvm = kc;
+
+	if ((kc->path = strdup(location)) == NULL)
+		return KVM_ERROR;
+
+	if (cdb_map(kc))
+		return KVM_ERROR;
+
+	kc->checked = time(NULL);
+
+	return KVM_OK;
+}
+
+#endif /* defined(HAVE_SYS_MMAN_H) && defined(HAVE_MMAP) */
+
+typedef struct {
+	FILE *fp;
+	unsigned long position;
+	unsigned long length;
+	unsigned long size;
+	unsigned long *slots;		/* pairs of hash and position */
+	int error;
+} cdb_maker;
+
+static int
+cdb_make_record(kvm_data *key, kvm_data *value, void *data)
+{
+	unsigned long *slots;
+	cdb_maker *maker = data;
+	unsigned char head[8];
+
+	if (CDB_MAX_SIZE - maker->position < 8 + key->size + value->size
+	/* Room left for the hash tables, 16 bytes per record. */
+	|| (CDB_MAX_SIZE - maker->position - 8 - key->size - value->size) / 16 <= maker->length) {
+		errno = EFBIG;
+		goto error0;
+	}
+
+	if (maker->size <= maker->length) {
+		if ((slots = realloc(maker->slots, (maker->size + 1024) * 2 * sizeof (*slots))) == NULL)
+			goto error0;
+		maker->slots = slots;
+		maker->size += 1024;
+	}
+
+	cdb_put32(head, key->size);
+	cdb_put32(head + 4, value->size);
+
+	if (fwrite(head, sizeof (head), 1, maker->fp) != 1
+	|| fwrite(key->data, 1, key->size, maker->fp) != key->size
+	|| fwrite(value->data, 1, value->size, maker->fp) != value->size)
+		goto error0;
+
+	maker->slots[maker->length * 2] = cdb_hash(key->data, key->size);
+	maker->slots[maker->length * 2 + 1] = maker->position;
+	maker->position += 8 + key->size + value->size;
+	maker->length++;
+
+	return 1;
+error0:
+	maker->error = errno;
+	return 0;
+}
+
+/*
+ * Write the 256 hash tables after the records and fill in the header.
+ * Each table has twice as many slots as it has records, so probes are
+ * short, and a slot is the hash and record position of one key.
+ */
+static int
+cdb_make_tables(cdb_maker *maker)
+{
+	int rc;
+	unsigned long i, t, n, at, *slots;
+	unsigned long count[256];
+	unsigned char header[CDB_HEADER_SIZE];
+
+	rc = -1;
+	memset(count, 0, sizeof (count));
+	for (i = 0; i < maker->length; i++)
+		count[maker->slots[i * 2] & 0xFF]++;
+
+	for (n = t = 0; t < 256; t++)
+		if (n < count[t])
+			n = count[t];
+
+	if ((slots = malloc((n * 2 + 1) * 2 * sizeof (*slots))) == NULL)
+		goto error0;
+
+	for (t = 0; t < 256; t++) {
+		n = count[t] * 2;
+		cdb_put32(header + t * 8, maker->position);
+		cdb_put32(header + t * 8 + 4, n);
+
+		memset(slots, 0, n * 2 * sizeof (*slots));
+		for (i = 0; i < maker->length; i++) {
+			if ((maker->slots[i * 2] & 0xFF) != t)
+				continue;
+
+			/* Linear probe from the hash's home slot. */
+			for (at = (maker->slots[i * 2] >> 8) % n; slots[at * 2 + 1] != 0; )
+				if (++at == n)
+					at = 0;
+
+			slots[at * 2] = maker->slots[i * 2];
+			slots[at * 2 + 1] = maker->slots[i * 2 + 1];
+		}
+
+		for (i = 0; i < n; i++) {
+			unsigned char slot[8];
+
+			cdb_put32(slot, slots[i * 2]);
+			cdb_put32(slot + 4, slots[i * 2 + 1]);
+			if (fwrite(slot, sizeof (slot), 1, maker->fp) != 1)
+				goto error1;
+		}
+
+		maker->position += n * 8;
+	}
+
+	if (fseek(maker->fp, 0L, SEEK_SET) || fwrite(header, sizeof (header), 1, maker->fp) != 1)
+		goto error1;
+
+	rc = 0;
+error1:
+	free(slots);
+error0:
+	return rc;
+}
+
+/**
+ * @param map
+ *	A key-value map to copy.
+ *
+ * @param path
+ *	The file path of a cdb file to create or replace. The new file is
+ *	first written to path.tmp and then renamed, so that any cdb! map
+ *	already open on path will swap to it.
+ *
+ * @return
+ *	KVM_OK on success, otherwise KVM_ERROR.
+ */
+int
+kvmCdbMake(kvm *map, const char *path)
+{
+	int rc;
+	char *tmp;
+	size_t length;
+	cdb_maker maker;
+	unsigned char header[CDB_HEADER_SIZE];
+
+	rc = KVM_ERROR;
+	memset(&maker, 0, sizeof (maker));
+
+	if (map == NULL || path == NULL)
+		goto error0;
+
+	length = strlen(path);
+	if ((tmp = malloc(length + sizeof (".tmp"))) == NULL)
+		goto error0;
+	memcpy(tmp, path, length);
+	memcpy(tmp + length, ".tmp", sizeof (".tmp"));
+
+	if ((maker.fp = fopen(tmp, "wb")) == NULL)
+		goto error1;
+
+	/* Reserve space for the header, which is filled in last. */
+	memset(header, 0, sizeof (header));
+	if (fwrite(header, sizeof (header), 1, maker.fp) != 1)
+		goto error2;
+	maker.position = CDB_HEADER_SIZE;
+
+	if (map->walk(map, cdb_make_record, &maker) != KVM_OK || maker.error != 0) {
+		errno = maker.error;
+		goto error2;
+	}
+
+	if (cdb_make_tables(&maker))
+		goto error2;
+
+	if (fflush(maker.fp) || fsync(fileno(maker.fp)))
+		goto error2;
+
+	if (fclose(maker.fp)) {
+		maker.fp = NULL;
+		goto error2;
+	}
+	maker.fp = NULL;
+
+	if (rename(tmp, path))
+		goto error2;
+
+	rc = KVM_OK;
+error2:
+	if (maker.fp != NULL)
+		(void) fclose(maker.fp);
+	if (rc != KVM_OK) {
+		syslog(LOG_ERR, "cdb \"%s\" make failed: %s (%d)", path, strerror(errno), errno);
+		(void) unlink(tmp);
+	}
+	free(maker.slots);
+error1:
+	free(tmp);
+error0:
+	return rc;
+}
+
+/***********************************************************************
+ *** Lookup Cache
+ ***********************************************************************/
+
+/*
+ * A bounded memo of recent lookups in front of another map, including
+ * those that were not found, which is most of them for an access map
+ * probed with successively shorter keys. Entries are held in sets of
+ * CACHE_WAYS, replacing the oldest, and expire after a TTL. When the
+ * map's file is replaced, noticed by a stat() at most once a second,
+ * the whole cache is invalidated by bumping a generation number.
+ *
+ * A miss reads the backend without holding the set lock, so a put or
+ * remove of the same key can complete in between. Each set has its own
+ * version, bumped when a key is forgotten, and a miss only fills the
+ * set if its version is unchanged since before the backend read.
+ */
+#define CACHE_WAYS		4
+#define CACHE_LOCKS		64		/* power of 2 */
+
+/* Once the file changes, keep invalidating every second for longer
+ * than a backend can take to reopen it, so the cache does not fill
+ * up again from the old file.
+ */
+#define CACHE_SETTLE		(KVM_CDB_CHECK + 1)
+
+typedef struct {
+	unsigned long hash;
+	unsigned long generation;
+	time_t expires;
+	kvm_data key;			/* key and value share one block */
+	kvm_data value;			/* data is NULL when not found */
+} kvm_cache_entry;
+
+typedef struct {
+	kvm *map;
+	time_t ttl;
+	unsigned long sets;		/* power of 2 */
+	kvm_cache_entry *entries;	/* sets * CACHE_WAYS */
+	unsigned long *versions;	/* sets */
+	stripe_lock locks[CACHE_LOCKS];
+	stripe_lock control;
+	int ready;			/* locks initialised */
+	unsigned long generation;
+	time_t checked;
+	time_t settled;
+	time_t mtime;
+	ino_t inode;
+	off_t size;
+} kvm_cache;
+
+typedef struct {
+	void (*function)(kvm_data *, void *);
+	void *data;
+	kvm_data copy;
+} kvm_cache_fill;
+
+static void
+cache_stat(kvm_cache *kc, struct stat *sb)
+{
+	kc->mtime = sb->st_mtime;
+	kc->inode = sb->st_ino;
+	kc->size = sb->st_size;
+}
+
+/*
+ * The current generation, after checking at most once a second
+ * whether the underlying file has been changed or replaced.
+ */
+static unsigned long
+cache_generation(kvm_cache *kc, time_t now)
+{
+	struct stat sb;
+	const char *path;
+	unsigned long generation;
+
+	STRIPE_READ_LOCK(&kc->control);
+	if (kc->checked != now) {
+		STRIPE_UNLOCK(&kc->control);
+		STRIPE_WRITE_LOCK(&kc->control);
+
+		/* Another thread may have done the check while we waited. */
+		if (kc->checked != now) {
+			kc->checked = now;
+			if ((path = kc->map->filepath(kc->map)) != NULL && stat(path, &sb) == 0
+			&& (sb.st_mtime != kc->mtime || sb.st_ino != kc->inode || sb.st_size != kc->size)) {
+				cache_stat(kc, &sb);
+				kc->settled = now + CACHE_SETTLE;
+				kc->generation++;
+			} else if (now <= kc->settled) {
+				kc->generation++;
+			}
+		}
+	}
+	generation = kc->generation;
+	STRIPE_UNLOCK(&kc->control);
+
+	return generation;
+}
+
+static void
+cache_invalidate(kvm_cache *kc)
+{
+	STRIPE_WRITE_LOCK(&kc->control);
+	kc->generation++;
+	STRIPE_UNLOCK(&kc->control);
+}
+
+/*
+ * Each set is always covered by the same one of the locks.
+ */
+static stripe_lock *
+cache_lock(kvm_cache *kc, unsigned long hash)
+{
+	return &kc->locks[(hash & (kc->sets-1)) & (CACHE_LOCKS-1)];
+}
+
+static void
+cache_fill(kvm_data *value, void *data)
+{
+	kvm_cache_fill *fill = data;
+
+	(*fill->function)(value, fill->data);
+	kvm_copy_value(value, &fill->copy);
+}
+
+static void
+cache_forget(kvm_cache *kc, kvm_data *key)
+{
+	stripe_lock *lock;
+	unsigned long hash, i;
+	kvm_cache_entry *entry;
+
+	hash = stripe_hash(key->data, key->size);
+	entry = &kc->entries[(hash & (kc->sets-1)) * CACHE_WAYS];
+	lock = cache_lock(kc, hash);
+
+	STRIPE_WRITE_LOCK(lock);
+	kc->versions[hash & (kc->sets-1)]++;
+	for (i = 0; i < CACHE_WAYS; i++, entry++) {
+		if (entry->key.data != NULL && entry->hash == hash
+		&& entry->key.size == key->size && memcmp(entry->key.data, key->data, key->size) == 0) {
+			free(entry->key.data);
+			entry->key.data = NULL;
+		}
+	}
+	STRIPE_UNLOCK(lock);
+}
+
+static int
+kvm_lookup_cache(kvm *self, kvm_data *key, void (*function)(kvm_data *, void *), void *data)
+{
+	int rc;
+	time_t now;
+	kvm_cache *kc;
+	stripe_lock *lock;
+	kvm_cache_fill fill;
+	unsigned char *block;
+	kvm_cache_entry *set, *entry, *oldest;
+	unsigned long hash, generation, version, i;
+
+	if (self == NULL || key == NULL || function == NULL)
+		return KVM_ERROR;
+
+	kc = self->_kvm;
+	now = time(NULL);
+	generation = cache_generation(kc, now);
+	hash = stripe_hash(key->data, key->size);
+	set = &kc->entries[(hash & (kc->sets-1)) * CACHE_WAYS];
+	lock = cache_lock(kc, hash);
+
+	STRIPE_READ_LOCK(lock);
+	version = kc->versions[hash & (kc->sets-1)];
+	for (entry = set, i = 0; i < CACHE_WAYS; i++, entry++) {
+		if (entry->key.data != NULL && entry->hash == hash
+		&& entry->generation == generation && now < entry->expires
+		&& entry->key.size == key->size && memcmp(entry->key.data, key->data, key->size) == 0) {
+			rc = KVM_NOT_FOUND;
+			if (entry->value.data != NULL) {
+				(*function)(&entry->value, data);
+				rc = KVM_OK;
+			}
+			STRIPE_UNLOCK(lock);
+			return rc;
+		}
+	}
+	STRIPE_UNLOCK(lock);
+
+	fill.function = function;
+	fill.data = data;
+	fill.copy.data = NULL;
+	fill.copy.size = 0;
+
+	/* Errors are not remembered, so the next lookup tries again. */
+	if ((rc = kc->map->lookup(kc->map, key, cache_fill, &fill)) == KVM_ERROR
+	|| (rc == KVM_OK && fill.copy.data == NULL))
+		return rc;
+
+	if ((block = malloc(key->size + 1 + fill.copy.size + 1)) == NULL) {
+		free(fill.copy.data);
+		return rc;
+	}
+
+	STRIPE_WRITE_LOCK(lock);
+
+	/* A key in this set was put or removed during the backend read,
+	 * so what was read may already be stale. Answer, but don't keep it.
+	 */
+	if (kc->versions[hash & (kc->sets-1)] != version) {
+		STRIPE_UNLOCK(lock);
+		free(fill.copy.data);
+		free(block);
+		return rc;
+	}
+
+	/* Take the same key, else a free or stale way, else the oldest. */
+	oldest = set;
+	for (entry = set, i = 0; i < CACHE_WAYS; i++, entry++) {
+		if (entry->key.data == NULL || entry->generation != generation || entry->expires <= now
+		|| (entry->hash == hash && entry->key.size == key->size && memcmp(entry->key.data, key->data, key->size) == 0)) {
+			oldest = entry;
+			break;
+		}
+		if (entry->expires < oldest->expires)
+			oldest = entry;
+	}
+
+	free(oldest->key.data);
+	oldest->hash = hash;
+	oldest->generation = generation;
+	oldest->expires = now + kc->ttl;
+	oldest->key.data = block;
+	oldest->key.size = key->size;
+	memcpy(block, key->data, key->size);
+	block[key->size] = '\0';
+	oldest->value.data = NULL;
+	oldest->value.size = 0;
+	if (rc == KVM_OK) {
+		oldest->value.data = block + key->size + 1;
+		oldest->value.size = fill.copy.size;
+		memcpy(oldest->value.data, fill.copy.data, fill.copy.size + 1);
+	}
+
+	STRIPE_UNLOCK(lock);
+	free(fill.copy.data);
+
+	return rc;
+}
+
+static int
+kvm_get_cache(kvm *self, kvm_data *key, kvm_data *value)
+{
+	int rc;
+
+	if (value != NULL)
+		value->data = NULL;
+
+	rc = kvm_lookup_cache(self, key, kvm_copy_value, value);
+	if (rc == KVM_OK && value != NULL && value->data == NULL)
+		rc = KVM_ERROR;
+
+	return rc;
+}
+
+static int
+kvm_put_cache(kvm *self, kvm_data *key, kvm_data *value)
+{
+	int rc;
+	kvm_cache *kc = self->_kvm;
+
+	rc = kc->map->put(kc->map, key, value);
+	cache_forget(kc, key);
+
+	return rc;
+}
+
+static int
+kvm_remove_cache(kvm *self, kvm_data *key)
+{
+	int rc;
+	kvm_cache *kc = self->_kvm;
+
+	rc = kc->map->remove(kc->map, key);
+	cache_forget(kc, key);
+
+	return rc;
+}
+
+static int
+kvm_truncate_cache(kvm *self)
+{
+	kvm_cache *kc = self->_kvm;
+
+	cache_invalidate(kc);
+	return kc->map->truncate(kc->map);
+}
+
+static int
+kvm_walk_cache(kvm *self, int (*func)(kvm_data *, kvm_data *, void *), void *data)
+{
+	int rc;
+	kvm_cache *kc = self->_kvm;
+
+	/* A walk may remove entries, which the cache cannot see. Lookups
+	 * during the walk can cache such an entry again, so invalidate
+	 * once more after.
+	 */
+	cache_invalidate(kc);
+	rc = kc->map->walk(kc->map, func, data);
+	cache_invalidate(kc);
+
+	return rc;
+}
+
+static int
+kvm_walk_slice_cache(kvm *self, unsigned long *cursor, unsigned ms, int (*func)(kvm_data *, kvm_data *, void *), void *data)
+{
+	int rc;
+	kvm_cache *kc = self->_kvm;
+
+	/* Same as kvm_walk_cache(), for each slice. */
+	cache_invalidate(kc);
+	rc = kc->map->walk_slice(kc->map, cursor, ms, func, data);
+	cache_invalidate(kc);
+
+	return rc;
+}
+
+static const char *
+kvm_filepath_cache(kvm *self)
+{
+	return ((kvm_cache *) self->_kvm)->map->filepath(((kvm_cache *) self->_kvm)->map);
+}
+
+static void
+kvm_sync_cache(kvm *self)
+{
+	((kvm_cache *) self->_kvm)->map->sync(((kvm_cache *) self->_kvm)->map);
+}
+
+static int
+kvm_begin_cache(kvm *self)
+{
+	return ((kvm_cache *) self->_kvm)->map->begin(((kvm_cache *) self->_kvm)->map);
+}
+
+static int
+kvm_commit_cache(kvm *self)
+{
+	return ((kvm_cache *) self->_kvm)->map->commit(((kvm_cache *) self->_kvm)->map);
+}
+
+static int
+kvm_rollback_cache(kvm *self)
+{
+	kvm_cache *kc = self->_kvm;
+
+	/* Entries forgotten by put or remove may come back. */
+	cache_invalidate(kc);
+
+	return kc->map->rollback(kc->map);
+}
+
+static void
+kvm_close_cache(kvm *self)
+{
+	int i;
+	unsigned long j;
+	kvm_cache *kc;
+
+	if (self != NULL) {
+		if ((kc = self->_kvm) != NULL) {
+			if (kc->map != NULL)
+				kc->map->close(kc->map);
+			if (kc->entries != NULL) {
+				for (j = 0; j < kc->sets * CACHE_WAYS; j++)
+					free(kc->entries[j].key.data);
+				free(kc->entries);
 			}
+			free(kc->versions);
+			for (i = 0; i < kc->ready && i < CACHE_LOCKS; i++)
+				STRIPE_LOCK_FINI(&kc->locks[i]);
+			if (CACHE_LOCKS < kc->ready)
+				STRIPE_LOCK_FINI(&kc->control);
+			free(kc);
+		}
+		kvmClose(self);
+	}
+}
+
+/**
+ * @param map
+ *	An open key-value map to put a lookup cache in front of.
+ *
+ * @param entries
+ *	The maximum number of keys, found or not, to remember.
+ *
+ * @param ttl
+ *	The number of seconds to remember a lookup.
+ *
+ * @return
+ *	A pointer to a kvm structure on success, which owns map and
+ *	closes it when closed. Otherwise NULL and map remains the
+ *	caller's.
+ */
+kvm *
+kvmCacheOpen(kvm *map, unsigned long entries, unsigned long ttl)
+{
+	int i;
+	kvm *self;
+	kvm_cache *kc;
+	struct stat sb;
+	const char *path;
 
-			if (*k.data != '#' && file->hash->put(file->hash, &k, &v))
-				goto error3;
+	if (map == NULL || entries == 0 || ttl == 0)
+		goto error0;
 
-			free(v.data);
-			free(k.data);
-		}
+	if ((self = kvmCreate(map->_table, map->_location, map->_mode)) == NULL)
+		goto error0;
 
-		(void) fclose(fp);
-	} else if (errno == ENOENT && (self->_mode & KVM_MODE_READ_ONLY)) {
-#ifndef NDEBUG
-		syslog(LOG_ERR, "open error \"%s\": %s (%d)", location, strerror(errno), errno);
+	self->close = kvm_close_cache;
+	self->filepath = kvm_filepath_cache;
+	self->fetch = kvm_get_cache;
+	self->get = kvm_get_cache;
+	self->lookup = kvm_lookup_cache;
+	self->put = kvm_put_cache;
+	self->remove = kvm_remove_cache;
+#ifndef NOT_FINISHED
+	self->walk = kvm_walk_cache;
+	self->walk_slice = kvm_walk_slice_cache;
 #endif
-		goto error0;
-	} else if (errno != 0 && errno != ENOENT) {
-		goto error0;
+	self->truncate = kvm_truncate_cache;
+	self->sync = kvm_sync_cache;
+	self->begin = kvm_begin_cache;
+	self->commit = kvm_commit_cache;
+	self->rollback = kvm_rollback_cache;
+
+	if ((kc = calloc(1, sizeof (*kc))) == NULL)
+		goto error1;
+
+	self->_kvm = kc;
+
+	for (kc->sets = 1; kc->sets * CACHE_WAYS < entries; kc->sets <<= 1)
+		;
+
+	if ((kc->entries = calloc(kc->sets * CACHE_WAYS, sizeof (*kc->entries))) == NULL)
+		goto error1;
+	if ((kc->versions = calloc(kc->sets, sizeof (*kc->versions))) == NULL)
+		goto error1;
+
+	for ( ; kc->ready < CACHE_LOCKS; kc->ready++) {
+		if (STRIPE_LOCK_INIT(&kc->locks[kc->ready]))
+			goto error1;
 	}
+	if (STRIPE_LOCK_INIT(&kc->control))
+		goto error1;
+	kc->ready++;
 
-	return KVM_OK;
-error3:
-	free(v.data);
-error2:
-	free(k.data);
+	kc->ttl = (time_t) ttl;
+	kc->checked = time(NULL);
+	if ((path = map->filepath(map)) != NULL && stat(path, &sb) == 0)
+		cache_stat(kc, &sb);
+
+	/* Only now take ownership of the map. */
+	kc->map = map;
+
+	return self;
 error1:
-	(void) fclose(fp);
+	kvm_close_cache(self);
 error0:
-	return KVM_ERROR;
+	return NULL;
+}
+
+/**
+ * @param self
+ *	A key-value map.
+ *
+ * @return
+ *	The map behind a lookup cache, otherwise self.
+ */
+kvm *
+kvmCacheMap(kvm *self)
+{
+	if (self != NULL && self->close == kvm_close_cache)
+		return ((kvm_cache *) self->_kvm)->map;
+
+	return self;
 }
 
 /***********************************************************************
@@ -1291,15 +3088,16 @@ kvm_check_db(kvm *self)
 }
 
 static int
-kvm_get_db(kvm *self, kvm_data *key, kvm_data *value)
+kvm_lookup_db(kvm *self, kvm_data *key, void (*function)(kvm_data *, void *), void *data)
 {
 	int rc;
 	DBT k, v;
+	kvm_data value;
 	kvm_db *kdb;
 
 	rc = KVM_ERROR;
 
-	if (self == NULL || key == NULL)
+	if (self == NULL || key == NULL || function == NULL)
 		goto error0;
 
 	PTHREAD_MUTEX_LOCK(&self->_mutex);
@@ -1364,15 +3162,12 @@ kvm_get_db(kvm *self, kvm_data *key, kvm_data *value)
 			goto error1;
 		}
 
-		if (value != NULL) {
-			/* Add an extra NUL byte just in case its a C string. */
-			if ((value->data = malloc(v.size + 1)) == NULL)
-				goto error1;
-
-			memcpy(value->data, v.data, v.size);
-			value->data[v.size] = '\0';
-			value->size = v.size;
-		}
+		/* Pass by reference; the DBT is only valid until the
+		 * next call into the database, which the mutex blocks.
+		 */
+		value.size = v.size;
+		value.data = (unsigned char *) v.data;
+		(*function)(&value, data);
 
 		rc = KVM_OK;
 error1:
@@ -1383,6 +3178,21 @@ error0:
 	return rc;
 }
 
+static int
+kvm_get_db(kvm *self, kvm_data *key, kvm_data *value)
+{
+	int rc;
+
+	if (value != NULL)
+		value->data = NULL;
+
+	rc = kvm_lookup_db(self, key, kvm_copy_value, value);
+	if (rc == KVM_OK && value != NULL && value->data == NULL)
+		rc = KVM_ERROR;
+
+	return rc;
+}
+
 static int
 kvm_put_db(kvm *self, kvm_data *key, kvm_data *value)
 {
@@ -1581,7 +3391,7 @@ kvm_walk_db(kvm *self, int (*func)(kvm_data *, kvm_data *, void *), void *data)
 				key.data = k.data;
 				key.size = k.size;
 
-				value.data = v.data;
+				value.data = (unsigned char *) v.data;
 				value.size = v.size;
 
 				if ((ret = (*func)(&key, &value, data)) == 0)
@@ -1609,7 +3419,7 @@ kvm_walk_db(kvm *self, int (*func)(kvm_data *, kvm_data *, void *), void *data)
 				key.data = k.data;
 				key.size = k.size;
 
-				value.data = v.data;
+				value.data = (unsigned char *) v.data;
 				value.size = v.size;
 
 				if ((ret = (*func)(&key, &value, data)) == 0)
@@ -1661,6 +3471,7 @@ kvm_open_db(kvm *self, const char *location, int mode)
 	self->filepath = kvm_filepath_db;
 	self->fetch = kvm_get_db;
 	self->get = kvm_get_db;
+	self->lookup = kvm_lookup_db;
 	self->put = kvm_put_db;
 	self->remove = kvm_remove_db;
 #ifdef NOT_FINISHED
@@ -1921,238 +3732,400 @@ error0:
 	return bytes != 0 ? KVM_ERROR : KVM_EOF;
 }
 
-int
-kvm_check_socket(kvm *self)
+#ifndef KVM_SOCKET_POOL
+#define KVM_SOCKET_POOL		4
+#endif
+#ifndef KVM_SOCKET_BUFFER
+#define KVM_SOCKET_BUFFER	4096
+#endif
+
+/*
+ * Each socketmap handle keeps a small pool of connections opened
+ * on demand. A request takes a ticket and writes the whole request
+ * in one call under the connection's write lock, then waits under
+ * the read lock for the replies ahead of it to be consumed. Many
+ * requests can be outstanding on one connection; the server answers
+ * them in the order they were sent, so the ticket order is the reply
+ * order.
+ *
+ * A connection that fails is shut down, which fails every request
+ * still in flight on it. The next request to write on it reconnects,
+ * bumping the generation so that any thread still waiting on the old
+ * stream gives up.
+ */
+typedef struct {
+	Socket2 *socket;
+	int write_broken;		/* write_lock */
+	volatile int read_broken;	/* read_lock to set, writers peek */
+	unsigned long sent;		/* next ticket, write_lock */
+	unsigned long served;		/* ticket being answered, read_lock */
+	unsigned long generation;	/* both locks to change */
+	pthread_mutex_t write_lock;
+	pthread_mutex_t read_lock;
+	pthread_cond_t turn;
+	unsigned long offset;		/* read buffer, read_lock */
+	unsigned long length;
+	unsigned char buffer[KVM_SOCKET_BUFFER];
+} kvm_socket_conn;
+
+typedef struct {
+	char *location;
+	unsigned ready;
+	unsigned long next;
+	kvm_socket_conn conn[KVM_SOCKET_POOL];
+} kvm_socket;
+
+/*
+ * Called with both the write and read locks held.
+ */
+static int
+kvm_connect_socket(kvm *self, kvm_socket_conn *conn)
 {
-	if (self->_kvm != NULL)
-		return 0;
+	kvm_socket *pool = self->_kvm;
 
-	if (0 < debug)
-		syslog(LOG_WARN, "re-opening socketmap \"%s\"", self->_location);
+	if (conn->socket != NULL) {
+		if (0 < debug)
+			syslog(LOG_WARN, "re-opening socketmap \"%s\"", self->_location);
+		socketClose(conn->socket);
+		conn->socket = NULL;
+	}
 
-	/* Ignore "dereferencing type-punned pointer will break strict-aliasing rules" warning. */
-	return socketOpenClient(self->_location + sizeof ("socketmap" KVM_DELIM_S)-1, KVM_PORT, SOCKET_CONNECT_TIMEOUT, NULL, (Socket2 **) &self->_kvm);
+	conn->generation++;
+	conn->sent = conn->served = 0;
+	conn->write_broken = conn->read_broken = 0;
+	conn->offset = conn->length = 0;
+	(void) pthread_cond_broadcast(&conn->turn);
+
+	return socketOpenClient(pool->location, KVM_PORT, SOCKET_CONNECT_TIMEOUT, NULL, &conn->socket);
 }
 
+/*
+ * Called with the read lock held.
+ */
 static int
-kvm_fetch_socket(struct kvm *self, kvm_data *key, kvm_data *value)
+kvm_fill_socket(kvm_socket_conn *conn)
 {
-	int rc;
-	unsigned char *out;
-	unsigned length, out_length, data_length;
+	long bytes;
 
-	rc = KVM_ERROR;
+	if (0 < conn->offset) {
+		conn->length -= conn->offset;
+		memmove(conn->buffer, conn->buffer + conn->offset, conn->length);
+		conn->offset = 0;
+	}
 
-	if (self == NULL || key == NULL || value == NULL)
-		goto error0;
+	if (!socketHasInput(conn->socket, socketGetTimeout(conn->socket))) {
+		syslog(LOG_ERR, "%s.%d: read timeout: %s (%d)", __FUNCTION__, __LINE__, strerror(errno), errno);
+		return -1;
+	}
 
-	memset(value, 0, sizeof (*value));
+	bytes = socketRead(conn->socket, conn->buffer + conn->length, sizeof (conn->buffer) - conn->length);
+	if (bytes <= 0) {
+		if (bytes < 0)
+			syslog(LOG_ERR, "%s.%d: read error: %s (%d)", __FUNCTION__, __LINE__, strerror(errno), errno);
+		return -1;
+	}
 
-	PTHREAD_MUTEX_LOCK(&self->_mutex);
-	if (kvm_check_socket(self))
-		goto error1;
+	conn->length += bytes;
 
-	/* Build the query so it can be sent with one call. */
-	data_length = strlen(self->_table) + 1 + key->size;
-	out_length = 10 + data_length + 2;
-	if ((out = malloc(out_length)) == NULL)
-		goto error1;
+	return 0;
+}
+
+/*
+ * Read one net string from the connection's buffer, refilling it as
+ * needed. Called with the read lock held. The returned data is
+ * allocated and NUL terminated.
+ */
+static int
+kvm_recv_socket(kvm_socket_conn *conn, kvm_data *field)
+{
+	unsigned long size, have, need;
+	unsigned char *digit, *start;
 
-	PTHREAD_FREE_PUSH(out);
+	field->data = NULL;
+	field->size = 0;
 
-	/* Assumes null terminated C strings for the table name and key. */
-	length = snprintf((char *) out, out_length, "%u:%s %s,", (unsigned) data_length, self->_table, key->data);
-	if (out_length <= length) {
-		/* Buffer overflow. key->size != strlen(key->data)
-		 * probably because the key->data is not properly
-		 * null terminated.
-		 */
-		syslog(LOG_ERR, "%s.%d: buffer overflow", __FUNCTION__, __LINE__);
-		goto error2;
+	/* Leading decimal length and colon, at most 10 digits. */
+	for (;;) {
+		size = 0;
+		start = conn->buffer + conn->offset;
+		for (digit = start; digit < conn->buffer + conn->length && isdigit(*digit); digit++)
+			size = size * 10 + *digit - '0';
+
+		if (10 < digit - start) {
+			syslog(LOG_ERR, "%s.%d: invalid length", __FUNCTION__, __LINE__);
+			return KVM_ERROR;
+		}
+		if (digit < conn->buffer + conn->length)
+			break;
+		if (kvm_fill_socket(conn))
+			return KVM_ERROR;
 	}
 
-	if (1 < debug)
-		syslog(LOG_DEBUG, "< %s", out);
+	if (digit == start || *digit != ':') {
+		syslog(LOG_ERR, "%s.%d: invalid length", __FUNCTION__, __LINE__);
+		return KVM_ERROR;
+	}
 
-	if (socketWrite(self->_kvm, out, length) != length) {
-		syslog(LOG_ERR, "%s.%d: write error: %s (%d)", __FUNCTION__, __LINE__, strerror(errno), errno);
-		goto error3;
+	conn->offset = digit + 1 - conn->buffer;
+
+	if ((field->data = malloc(size + 1)) == NULL) {
+		syslog(LOG_ERR, "%s.%d: out of memory", __FUNCTION__, __LINE__);
+		return KVM_ERROR;
 	}
 
-	if (kvm_recv(self->_kvm, &value->data, &value->size))
-		goto error3;
+	/* The data and its trailing comma. */
+	for (have = 0; have < size + 1; have += need) {
+		if (conn->length <= conn->offset && kvm_fill_socket(conn))
+			goto error1;
 
-	if (*value->data == 'O') {
-		/* The query/response was "OK "; remove
-		 * the prefix from the returned value.
-		 */
-		value->size -= 3;
-		memmove(value->data, value->data+3, value->size);
-		rc = KVM_OK;
-	} else if (*value->data == 'N') {
-		rc = KVM_NOT_FOUND;
+		need = conn->length - conn->offset;
+		if (size + 1 - have < need)
+			need = size + 1 - have;
+
+		(void) memcpy(field->data + have, conn->buffer + conn->offset, need);
+		conn->offset += need;
 	}
 
-	value->data[value->size] = '\0';
-error3:
-	if (rc == KVM_ERROR && errno != 0) {
-		if (0 < debug)
-			syslog(LOG_ERR, "%s: close socketmap \"%s\": %s (%d)", __FUNCTION__, self->_location, strerror(errno), errno);
-		socketClose(self->_kvm);
-		self->_kvm = NULL;
+	if (field->data[size] != ',') {
+		syslog(LOG_ERR, "%s.%d: missing comma", __FUNCTION__, __LINE__);
+		goto error1;
 	}
-error2:
-	PTHREAD_FREE_POP(1);
+
+	field->data[size] = '\0';
+	field->size = size;
+
+	if (1 < debug)
+		syslog(LOG_DEBUG, "> %lu:%s,", size, field->data);
+
+	return KVM_OK;
 error1:
-	PTHREAD_MUTEX_UNLOCK(&self->_mutex);
-error0:
-	return rc;
+	free(field->data);
+	field->data = NULL;
+
+	return KVM_ERROR;
+}
+
+static unsigned char *
+kvm_netstring(unsigned char *out, const void *data, unsigned long size)
+{
+	out += sprintf((char *) out, "%lu:", size);
+	(void) memcpy(out, data, size);
+	out[size] = ',';
+
+	return out + size + 1;
 }
 
+/*
+ * Send a complete request and wait for its reply on one of the pooled
+ * connections. The status is always read; when the status is OK and
+ * row is not NULL, a following value row is read too. Both are to be
+ * freed by the caller.
+ */
 static int
-kvm_get_socket(struct kvm *self, kvm_data *key, kvm_data *value)
+kvm_call_socket(kvm *self, unsigned char *request, unsigned long length, kvm_data *status, kvm_data *row)
 {
 	int rc;
-	kvm_data result, v;
+	kvm_socket_conn *conn;
+	kvm_socket *pool = self->_kvm;
+	unsigned long ticket, generation;
 
 	rc = KVM_ERROR;
+	status->data = NULL;
+	if (row != NULL)
+		row->data = NULL;
 
-	if (self == NULL || key == NULL)
+	PTHREAD_MUTEX_LOCK(&self->_mutex);
+	conn = &pool->conn[pool->next++ % KVM_SOCKET_POOL];
+	PTHREAD_MUTEX_UNLOCK(&self->_mutex);
+
+	if (1 < debug)
+		syslog(LOG_DEBUG, "< %.*s", (int) length, request);
+
+	if (pthread_mutex_lock(&conn->write_lock))
 		goto error0;
 
-	MEMSET(&result, 0, sizeof (result));
-	PTHREAD_MUTEX_LOCK(&self->_mutex);
-	if (kvm_check_socket(self))
-		goto error1;
-	if (kvm_send(self->_kvm, (unsigned char *) self->_table, strlen(self->_table)))
-		goto error2;
-	if (kvm_send(self->_kvm, (unsigned char *) "GET", sizeof ("GET")-1))
-		goto error2;
-	if (kvm_send(self->_kvm, key->data, key->size))
-		goto error2;
+	/* read_broken is only cleared with both locks held, so peeking
+	 * at it here at worst finds out one request late.
+	 */
+	if (conn->socket == NULL || conn->write_broken || conn->read_broken) {
+		(void) pthread_mutex_lock(&conn->read_lock);
+		if (kvm_connect_socket(self, conn)) {
+			(void) pthread_mutex_unlock(&conn->read_lock);
+			(void) pthread_mutex_unlock(&conn->write_lock);
+			goto error0;
+		}
+		(void) pthread_mutex_unlock(&conn->read_lock);
+	}
 
-	if (kvm_recv(self->_kvm, &result.data, &result.size))
-		goto error2;
-	if (0 < result.size) {
-		switch (*result.data) {
-		case 'O':
-			if (kvm_recv(self->_kvm, &v.data, &v.size))
-				goto error2;
+	ticket = conn->sent++;
+	generation = conn->generation;
+
+	if (socketWrite(conn->socket, request, length) != length) {
+		syslog(LOG_ERR, "%s.%d: write error: %s (%d)", __FUNCTION__, __LINE__, strerror(errno), errno);
+		(void) socketShutdown(conn->socket, SHUT_RDWR);
+		conn->write_broken = 1;
+	}
+
+	(void) pthread_mutex_unlock(&conn->write_lock);
+
+	if (pthread_mutex_lock(&conn->read_lock))
+		goto error0;
+
+	while (conn->served != ticket && conn->generation == generation)
+		(void) pthread_cond_wait(&conn->turn, &conn->read_lock);
 
-			if (value != NULL)
-				*value = v;
+	if (conn->generation != generation)
+		goto error1;
 
+	if (!conn->read_broken) {
+		if (kvm_recv_socket(conn, status) == KVM_OK
+		&& (row == NULL || 0 == status->size || *status->data != 'O' || kvm_recv_socket(conn, row) == KVM_OK))
 			rc = KVM_OK;
-			break;
-		case 'N':
-			rc = KVM_NOT_FOUND;
-			break;
+
+		if (rc == KVM_ERROR) {
+			if (0 < debug)
+				syslog(LOG_ERR, "%s: close socketmap \"%s\": %s (%d)", __FUNCTION__, self->_location, strerror(errno), errno);
+			(void) socketShutdown(conn->socket, SHUT_RDWR);
+			conn->read_broken = 1;
+			free(status->data);
+			status->data = NULL;
 		}
 	}
-	free(result.data);
-error2:
-	if (rc == KVM_ERROR) {
-		if (0 < debug)
-			syslog(LOG_ERR, "%s: close socketmap \"%s\": %s (%d)", __FUNCTION__, self->_location, strerror(errno), errno);
-		socketClose(self->_kvm);
-		self->_kvm = NULL;
-		errno = 0;
-	}
+
+	conn->served++;
+	(void) pthread_cond_broadcast(&conn->turn);
 error1:
-	PTHREAD_MUTEX_UNLOCK(&self->_mutex);
+	(void) pthread_mutex_unlock(&conn->read_lock);
 error0:
 	return rc;
 }
 
 static int
-kvm_put_socket(struct kvm *self, kvm_data *key, kvm_data *value)
+kvm_fetch_socket(struct kvm *self, kvm_data *key, kvm_data *value)
 {
 	int rc;
-	kvm_data result;
+	kvm_data status;
+	unsigned long table_length;
+	unsigned char *request, *out;
 
 	rc = KVM_ERROR;
 
 	if (self == NULL || key == NULL || value == NULL)
 		goto error0;
 
-	PTHREAD_MUTEX_LOCK(&self->_mutex);
-	if (kvm_check_socket(self))
+	memset(value, 0, sizeof (*value));
+
+	/* $length ":" $table_name " " $key "," in one buffer. */
+	table_length = strlen(self->_table);
+	if ((request = malloc(20 + table_length + 1 + key->size + 1)) == NULL)
+		goto error0;
+
+	out = request + sprintf((char *) request, "%lu:%s ", table_length + 1 + key->size, self->_table);
+	(void) memcpy(out, key->data, key->size);
+	out += key->size;
+	*out++ = ',';
+
+	if (kvm_call_socket(self, request, out - request, &status, NULL))
 		goto error1;
 
-	if (kvm_send(self->_kvm, (unsigned char *) self->_table, strlen(self->_table)))
-		goto error2;
-	if (kvm_send(self->_kvm, (unsigned char *) "PUT", sizeof ("PUT")-1))
-		goto error2;
-	if (kvm_send(self->_kvm, key->data, key->size))
-		goto error2;
-	if (kvm_send(self->_kvm, value->data, value->size))
-		goto error2;
+	*value = status;
+	rc = KVM_ERROR;
 
-	if (kvm_recv(self->_kvm, &result.data, &result.size))
-		goto error2;
-	if (0 < result.size && *result.data == 'O')
+	if (0 < value->size && *value->data == 'O') {
+		/* The query/response was "OK "; remove
+		 * the prefix from the returned value.
+		 */
+		value->size = value->size < 3 ? 0 : value->size - 3;
+		memmove(value->data, value->data+3, value->size);
 		rc = KVM_OK;
-	free(result.data);
-error2:
-	if (rc == KVM_ERROR) {
-		if (0 < debug)
-			syslog(LOG_ERR, "%s: close socketmap \"%s\": %s (%d)", __FUNCTION__, self->_location, strerror(errno), errno);
-		socketClose(self->_kvm);
-		self->_kvm = NULL;
-		errno = 0;
+	} else if (0 < value->size && *value->data == 'N') {
+		rc = KVM_NOT_FOUND;
 	}
+
+	value->data[value->size] = '\0';
 error1:
-	PTHREAD_MUTEX_UNLOCK(&self->_mutex);
+	free(request);
 error0:
 	return rc;
 }
 
 static int
-kvm_remove_socket(struct kvm *self, kvm_data *key)
+kvm_command_socket(kvm *self, const char *command, kvm_data *key, kvm_data *value, kvm_data *row)
 {
 	int rc;
-	kvm_data result;
+	kvm_data status;
+	unsigned long table_length, command_length, length;
+	unsigned char *request, *out;
 
-	rc = KVM_ERROR;
+	table_length = strlen(self->_table);
+	command_length = strlen(command);
+	length = 3 * 20 + table_length + command_length + key->size;
+	if (value != NULL)
+		length += 20 + value->size;
 
-	if (self == NULL || key == NULL)
-		goto error0;
+	if ((request = malloc(length)) == NULL)
+		return KVM_ERROR;
 
-	MEMSET(&result, 0, sizeof (result));
-	PTHREAD_MUTEX_LOCK(&self->_mutex);
-	if (kvm_check_socket(self))
-		goto error1;
+	out = kvm_netstring(request, self->_table, table_length);
+	out = kvm_netstring(out, command, command_length);
+	out = kvm_netstring(out, key->data, key->size);
+	if (value != NULL)
+		out = kvm_netstring(out, value->data, value->size);
 
-	if (kvm_send(self->_kvm, (unsigned char *) self->_table, strlen(self->_table)))
-		goto error2;
-	if (kvm_send(self->_kvm, (unsigned char *) "REMOVE",  sizeof ("REMOVE")-1))
-		goto error2;
-	if (kvm_send(self->_kvm, key->data, key->size))
-		goto error2;
+	rc = kvm_call_socket(self, request, out - request, &status, row);
+	free(request);
 
-	if (kvm_recv(self->_kvm, &result.data, &result.size))
-		goto error2;
-	if (0 < result.size) {
-		switch (*result.data) {
-		case 'O': rc = KVM_OK; break;
-		case 'N': rc = KVM_NOT_FOUND; break;
+	if (rc == KVM_OK) {
+		rc = KVM_ERROR;
+		if (0 < status.size) {
+			switch (*status.data) {
+			case 'O': rc = KVM_OK; break;
+			case 'N': rc = KVM_NOT_FOUND; break;
+			}
 		}
+		free(status.data);
 	}
-	free(result.data);
-error2:
-	if (rc == KVM_ERROR) {
-		if (0 < debug)
-			syslog(LOG_ERR, "%s: close socketmap \"%s\": %s (%d)", __FUNCTION__, self->_location, strerror(errno), errno);
-		socketClose(self->_kvm);
-		self->_kvm = NULL;
-		errno = 0;
+
+	return rc;
+}
+
+static int
+kvm_get_socket(struct kvm *self, kvm_data *key, kvm_data *value)
+{
+	int rc;
+	kvm_data row;
+
+	if (self == NULL || key == NULL)
+		return KVM_ERROR;
+
+	if ((rc = kvm_command_socket(self, "GET", key, NULL, &row)) == KVM_OK) {
+		if (value != NULL)
+			*value = row;
+		else
+			free(row.data);
 	}
-error1:
-	PTHREAD_MUTEX_UNLOCK(&self->_mutex);
-error0:
+
 	return rc;
 }
 
+static int
+kvm_put_socket(struct kvm *self, kvm_data *key, kvm_data *value)
+{
+	if (self == NULL || key == NULL || value == NULL)
+		return KVM_ERROR;
+
+	return kvm_command_socket(self, "PUT", key, value, NULL) == KVM_OK ? KVM_OK : KVM_ERROR;
+}
+
+static int
+kvm_remove_socket(struct kvm *self, kvm_data *key)
+{
+	if (self == NULL || key == NULL)
+		return KVM_ERROR;
+
+	return kvm_command_socket(self, "REMOVE", key, NULL, NULL);
+}
+
 #ifdef NOT_FINISHED
 static int
 kvm_first_socket(struct kvm *self)
@@ -2167,29 +4140,33 @@ kvm_next_socket(struct kvm *self, kvm_data *key, kvm_data *value)
 }
 #else
 
+/*
+ * A walk is a conversation of its own, so it gets its own connection
+ * rather than holding up the pipelined ones.
+ */
 static int
 kvm_walk_socket(kvm *self, int (*func)(kvm_data *, kvm_data *, void *), void *data)
 {
 	int rc, ret, ch;
+	Socket2 *socket;
 	kvm_data result, key, value;
 
 	rc = KVM_ERROR;
 
-	if (self == NULL || func)
+	if (self == NULL || func == NULL)
 		goto error0;
 
-	PTHREAD_MUTEX_LOCK(&self->_mutex);
-	if (kvm_check_socket(self))
-		goto error1;
+	if (socketOpenClient(((kvm_socket *) self->_kvm)->location, KVM_PORT, SOCKET_CONNECT_TIMEOUT, NULL, &socket))
+		goto error0;
 
-	if (kvm_send(self->_kvm, (unsigned char *) self->_table, strlen(self->_table)))
-		goto error2;
-	if (kvm_send(self->_kvm, (unsigned char *) "FIRST", sizeof ("FIRST")-1))
-		goto error2;
+	if (kvm_send(socket, (unsigned char *) self->_table, strlen(self->_table)))
+		goto error1;
+	if (kvm_send(socket, (unsigned char *) "FIRST", sizeof ("FIRST")-1))
+		goto error1;
 
 	for (;;) {
-		if (kvm_recv(self->_kvm, &result.data, &result.size))
-			goto error2;
+		if (kvm_recv(socket, &result.data, &result.size))
+			goto error1;
 
 		ch = *result.data;
 		free(result.data);
@@ -2197,14 +4174,14 @@ kvm_walk_socket(kvm *self, int (*func)(kvm_data *, kvm_data *, void *), void *da
 		if (ch == 'N')
 			break;
 		if (ch != 'O')
-			goto error2;
+			goto error1;
 
-		if (kvm_recv(self->_kvm, &key.data, &key.size))
-			goto error2;
+		if (kvm_recv(socket, &key.data, &key.size))
+			goto error1;
 
-		if (kvm_recv(self->_kvm, &value.data, &value.size)) {
+		if (kvm_recv(socket, &value.data, &value.size)) {
 			free(key.data);
-			goto error2;
+			goto error1;
 		}
 
 		ret = (*func)(&key, &value, data);
@@ -2215,34 +4192,45 @@ kvm_walk_socket(kvm *self, int (*func)(kvm_data *, kvm_data *, void *), void *da
 		if (ret == 0)
 			break;
 
-		if (kvm_send(self->_kvm, (unsigned char *) self->_table, strlen(self->_table)))
-			goto error2;
-		if (kvm_send(self->_kvm, (unsigned char *) "NEXT", sizeof ("NEXT")-1))
-			goto error2;
+		if (kvm_send(socket, (unsigned char *) self->_table, strlen(self->_table)))
+			goto error1;
+		if (kvm_send(socket, (unsigned char *) "NEXT", sizeof ("NEXT")-1))
+			goto error1;
 	}
 
 	rc = KVM_OK;
-error2:
-	if (rc == KVM_ERROR) {
-		if (0 < debug)
-			syslog(LOG_ERR, "%s: close socketmap \"%s\": %s (%d)", __FUNCTION__, self->_location, strerror(errno), errno);
-		socketClose(self->_kvm);
-		self->_kvm = NULL;
-		errno = 0;
-	}
 error1:
-	PTHREAD_MUTEX_UNLOCK(&self->_mutex);
+	if (rc == KVM_ERROR && 0 < debug)
+		syslog(LOG_ERR, "%s: close socketmap \"%s\": %s (%d)", __FUNCTION__, self->_location, strerror(errno), errno);
+	socketClose(socket);
 error0:
 	return rc;
 }
 
 #endif
 
+static void
+kvm_free_socket(kvm_socket *pool)
+{
+	kvm_socket_conn *conn;
+
+	if (pool != NULL) {
+		for (conn = pool->conn; conn < pool->conn + pool->ready; conn++) {
+			socketClose(conn->socket);
+			(void) pthread_cond_destroy(&conn->turn);
+			(void) pthread_mutex_destroy(&conn->read_lock);
+			(void) pthread_mutex_destroy(&conn->write_lock);
+		}
+		free(pool->location);
+		free(pool);
+	}
+}
+
 static void
 kvm_close_socket(kvm *self)
 {
 	if (self != NULL) {
-		socketClose(self->_kvm);
+		kvm_free_socket(self->_kvm);
 		kvmClose(self);
 		errno = 0;
 	}
@@ -2251,6 +4239,9 @@ kvm_close_socket(kvm *self)
 static int
 kvm_open_socket(kvm *self, const char *location, int mode)
 {
+	kvm_socket *pool;
+	kvm_socket_conn *conn;
+
 	self->close = kvm_close_socket;
 	self->filepath = kvm_filepath_stub;
 	self->fetch = kvm_fetch_socket;
@@ -2276,11 +4267,40 @@ kvm_open_socket(kvm *self, const char *location, int mode)
 		self->remove = kvm_remove_stub;
 	}
 
-	/* Ignore "dereferencing type-punned pointer will break strict-aliasing rules" warning. */
-	if (socketOpenClient(location, KVM_PORT, SOCKET_CONNECT_TIMEOUT, NULL, (Socket2 **) &self->_kvm))
-		return KVM_ERROR;
+	if ((pool = calloc(1, sizeof (*pool))) == NULL)
+		goto error0;
+	self->_kvm = pool;
+
+	if ((pool->location = strdup(location)) == NULL)
+		goto error0;
+
+	for (conn = pool->conn; conn < pool->conn + KVM_SOCKET_POOL; conn++) {
+		if (pthread_mutex_init(&conn->write_lock, NULL))
+			goto error0;
+		if (pthread_mutex_init(&conn->read_lock, NULL)) {
+			(void) pthread_mutex_destroy(&conn->write_lock);
+			goto error0;
+		}
+		if (pthread_cond_init(&conn->turn, NULL)) {
+			(void) pthread_mutex_destroy(&conn->read_lock);
+			(void) pthread_mutex_destroy(&conn->write_lock);
+			goto error0;
+		}
+		pool->ready++;
+	}
+
+	/* Connect the first of the pool now to report a bad location
+	 * at open; the others are connected on first use.
+	 */
+	if (socketOpenClient(location, KVM_PORT, SOCKET_CONNECT_TIMEOUT, NULL, &pool->conn[0].socket))
+		goto error0;
 
 	return KVM_OK;
+error0:
+	kvm_free_socket(pool);
+	self->_kvm = NULL;
+
+	return KVM_ERROR;
 }
 
 /***********************************************************************
@@ -3229,8 +5249,12 @@ static kvm_method kvm_open_table[] = {
 	{ sizeof ("sql")-1, "sql", kvm_open_sql },
 #endif
 	{ sizeof ("hash")-1, "hash", kvm_open_hash },
+	{ sizeof ("stripe")-1, "stripe", kvm_open_stripe },
 	{ sizeof ("text")-1, "text", kvm_open_file },
 	{ sizeof ("file")-1, "file", kvm_open_file },
+#if defined(HAVE_SYS_MMAN_H) && defined(HAVE_MMAP)
+	{ sizeof ("cdb")-1, "cdb", kvm_open_cdb },
+#endif
 	{ sizeof ("socketmap")-1, "socketmap", kvm_open_socket },
 	{ sizeof ("multicast")-1, "multicast", kvm_open_multicast },
 	{ 0, NULL, NULL }
@@ -3256,6 +5280,7 @@ kvmDebug(int level)
  *		/path/map.db		(historical)
  *		db!/path/map.db
  *		db!btree!/path/map.db
+ *		cdb!/path/map.cdb	(read-only)
  *		sql!/path/database
  *		socketmap!host,port
  *		socketmap!/path/local/socket
@@ -3309,13 +5334,20 @@ kvmOpen(const char *table_name, const char *map_location, int mode)
 # define _POSIX_PTHREAD_SEMANTICS
 #endif
 #include <signal.h>
+#include <unistd.h>
 
+#include <com/snert/lib/io/events.h>
+#include <com/snert/lib/io/socket3.h>
 #include <com/snert/lib/util/getopt.h>
 
 static char usage[] =
-"usage: kvmd [-dsv][-p port][-t timeout] map ...\n"
+"usage: kvmd [-dsv][-e loops][-p port][-t timeout] map ...\n"
 "\n"
 "-d\t\tstart as a background daemon process\n"
+#ifndef USE_LIBEV
+"-e loops\tserve clients from this many event loops instead of\n"
+"\t\ta thread per client; requests may be pipelined either way\n"
+#endif
 "-p port\t\tthe socket-map port number or path, default " KVM_PORT_S "\n"
 "-s\t\tremain single threaded for testing\n"
 "-t timeout\tsocket timeout in seconds, default 60\n"
@@ -3328,8 +5360,12 @@ static char usage[] =
 "The following forms of type" KVM_DELIM_S "[sub-type" KVM_DELIM_S "]location are supported:\n"
 "\n"
 "  hash" KVM_DELIM_S "\n"
+"  stripe" KVM_DELIM_S "\n"
 "  text" KVM_DELIM_S "/path/map.txt\n"
 "  file" KVM_DELIM_S "/path/map.txt\n"
+#if defined(HAVE_SYS_MMAN_H) && defined(HAVE_MMAP)
+"  cdb" KVM_DELIM_S "/path/map.cdb\n"
+#endif
 #ifdef HAVE_DB_H
 "  db" KVM_DELIM_S "/path/map.db\n"
 "  db" KVM_DELIM_S "btree" KVM_DELIM_S "/path/map.db\n"
@@ -3458,111 +5494,545 @@ request(Socket2 *client, char *addr)
 		goto error1;
 	}
 
-	if ((map = find_table((char *) query.data)) == NULL) {
-		kvm_send(client, (unsigned char *) "PERM invalid table", sizeof ("PERM invalid table")-1);
-		goto error1;
+	if ((map = find_table((char *) query.data)) == NULL) {
+		kvm_send(client, (unsigned char *) "PERM invalid table", sizeof ("PERM invalid table")-1);
+		goto error1;
+	}
+
+	/* Otherwise handle extended socket map semantics. */
+	free(query.data);
+
+	if ((rc = kvm_recv(client, &query.data, &query.size)) != KVM_OK) {
+		kvm_send(client, (unsigned char *) "PERM command read error", sizeof ("PERM command read error")-1);
+		goto error0;
+	}
+
+	key.data = NULL;
+	value.data = NULL;
+
+	if (TextInsensitiveCompare("GET", (char *) query.data) == 0) {
+		if (0 < debug)
+			syslog(LOG_INFO, "%s GET %s", addr, map->_table);
+
+		if ((rc = kvm_recv(client, &key.data, &key.size)) != KVM_OK) {
+			kvm_send(client, (unsigned char *) "PERM key read error", sizeof ("PERM key read error")-1);
+			goto error1;
+		}
+
+		switch (map->get(map, &key, &value)) {
+		case KVM_ERROR:
+			(void) kvm_send(client, (unsigned char *) "PERM", sizeof ("PERM")-1);
+			syslog(LOG_ERR, "GET '%s' failed", key.data);
+			break;
+		case KVM_NOT_FOUND:
+			(void) kvm_send(client, (unsigned char *) "NOTFOUND", sizeof ("NOTFOUND")-1);
+			break;
+		case KVM_OK:
+			kvm_send(client, (unsigned char *) "OK", 2);
+			(void) kvm_send(client, value.data, value.size);
+			free(value.data);
+			break;
+		}
+
+	} else if (TextInsensitiveCompare("PUT", (char *) query.data) == 0) {
+		if (0 < debug)
+			syslog(LOG_INFO, "%s PUT %s", addr, map->_table);
+
+		if ((rc = kvm_recv(client, &key.data, &key.size)) != KVM_OK) {
+			kvm_send(client, (unsigned char *) "PERM key read error", sizeof ("PERM key read error")-1);
+			goto error1;
+		}
+
+		if ((rc = kvm_recv(client, &value.data, &value.size)) != KVM_OK) {
+			kvm_send(client, (unsigned char *) "PERM value read error", sizeof ("PERM value read error")-1);
+			goto error2;
+		}
+
+		if (map->put(map, &key, &value) == KVM_ERROR) {
+			syslog(LOG_ERR, "PUT '%s' '%s' failed", key.data, value.data);
+			(void) kvm_send(client, (unsigned char *) "PERM put failed", sizeof ("PERM put failed")-1);
+		} else {
+			kvm_send(client, (unsigned char *) "OK", 2);
+		}
+		free(value.data);
+	} else if (TextInsensitiveCompare("REMOVE", (char *) query.data) == 0) {
+		if (0 < debug)
+			syslog(LOG_INFO, "%s REMOVE %s", addr, map->_table);
+
+		if ((rc = kvm_recv(client, &key.data, &key.size)) != KVM_OK) {
+			kvm_send(client, (unsigned char *) "PERM key read error", sizeof ("PERM key read error")-1);
+			goto error1;
+		}
+
+		if (map->remove(map, &key) == KVM_ERROR) {
+			syslog(LOG_ERR, "REMOVE '%s' failed", key.data);
+			(void) kvm_send(client, (unsigned char *) "PERM remove failed", sizeof ("PERM remove failed")-1);
+		} else {
+			kvm_send(client, (unsigned char *) "OK", 2);
+		}
+	} else {
+		if (0 < debug)
+			syslog(LOG_INFO, "%s invalid %s \"%s\"", addr, map->_table, query.data);
+		(void) kvm_send(client, (unsigned char *) "PERM invalid operation", sizeof ("PERM invalid operation")-1);
+	}
+error2:
+	free(key.data);
+error1:
+	free(query.data);
+error0:
+	return rc == KVM_OK;
+}
+
+void *
+process(void *data)
+{
+	char addr[256];
+	Socket2 *client = data;
+
+	socketSetNonBlocking(client, 1);
+	socketSetTimeout(client, timeout);
+	(void) socketAddressGetString(&client->address, 1, addr, sizeof (addr));
+
+	while (request(client, addr))
+		;
+
+	socketClose(client);
+
+	PTHREAD_END(NULL);
+}
+
+#ifndef USE_LIBEV
+/*
+ * Event driven server: each loop multiplexes many clients, parsing
+ * whole requests out of a per-client input buffer and queuing replies
+ * in request order, so a client may pipeline as many requests as it
+ * likes without waiting for each reply.
+ */
+#define CLIENT_BUFFER	4096
+
+typedef struct {
+	Event event;
+	int failed;
+	char addr[256];
+	unsigned char *input;
+	unsigned long input_offset;
+	unsigned long input_length;
+	unsigned long input_size;
+	unsigned char *output;
+	unsigned long output_offset;
+	unsigned long output_length;
+	unsigned long output_size;
+} kvmd_client;
+
+typedef struct {
+	kvmd_client *client;
+	const char *status;
+} kvmd_found;
+
+static int event_loops;
+
+static void
+client_free(void *_client)
+{
+	kvmd_client *client = _client;
+
+	if (client != NULL) {
+		socket3_close(client->event.fd);
+		free(client->output);
+		free(client->input);
+		free(client);
+	}
+}
+
+static void
+client_close(Events *loop, Event *event, int _reserved_)
+{
+	if (0 < debug)
+		syslog(LOG_DEBUG, "%s close", ((kvmd_client *) event->data)->addr);
+	eventRemove(loop, event);
+}
+
+static void
+client_netstring(kvmd_client *client, const char *prefix, const unsigned char *data, unsigned long size)
+{
+	unsigned char *buf;
+	unsigned long prefix_length, need;
+
+	prefix_length = strlen(prefix);
+	need = client->output_length + 20 + prefix_length + size + 1;
+
+	if (client->output_size < need) {
+		need += CLIENT_BUFFER;
+		if ((buf = realloc(client->output, need)) == NULL) {
+			syslog(LOG_ERR, "%s.%d: out of memory", __FUNCTION__, __LINE__);
+			client->failed = 1;
+			return;
+		}
+		client->output = buf;
+		client->output_size = need;
+	}
+
+	buf = client->output + client->output_length;
+	buf += sprintf((char *) buf, "%lu:%s", prefix_length + size, prefix);
+	(void) memcpy(buf, data, size);
+	buf[size] = ',';
+	client->output_length = buf + size + 1 - client->output;
+}
+
+static void
+client_found(kvm_data *value, void *data)
+{
+	kvmd_found *found = data;
+
+	if (*found->status == '\0') {
+		/* GET status and value rows. */
+		client_netstring(found->client, "OK", NULL, 0);
+		client_netstring(found->client, "", value->data, value->size);
+	} else {
+		/* FETCH "OK " prefixed value. */
+		client_netstring(found->client, found->status, value->data, value->size);
+	}
+}
+
+/*
+ * Parse one net string at *offset. Return 1 with the field when it is
+ * complete, 0 when more input is needed, or -1 for an invalid format.
+ * The field is not NUL terminated until the whole request is complete,
+ * since an incomplete request is parsed again when more input arrives.
+ */
+static int
+client_field(kvmd_client *client, unsigned long *offset, kvm_data *field)
+{
+	unsigned long size;
+	unsigned char *digit, *start, *stop;
+
+	size = 0;
+	stop = client->input + client->input_length;
+	start = client->input + *offset;
+
+	for (digit = start; digit < stop && isdigit(*digit); digit++) {
+		if (10 <= digit - start)
+			return -1;
+		size = size * 10 + *digit - '0';
+	}
+	if (stop <= digit)
+		return 0;
+	if (digit == start || *digit != ':')
+		return -1;
+	if (stop - digit - 1 < size + 1)
+		return 0;
+	if (digit[1 + size] != ',')
+		return -1;
+
+	field->data = digit + 1;
+	field->size = size;
+	*offset = digit + 1 + size + 1 - client->input;
+
+	return 1;
+}
+
+#define IS_COMMAND(f, s)	((f).size == sizeof (s)-1 && TextInsensitiveCompareN((char *) (f).data, s, sizeof (s)-1) == 0)
+
+/*
+ * Handle one complete request from the input buffer. Return 1 if a
+ * request was handled, 0 when more input is needed, or -1 for an
+ * invalid request.
+ */
+static int
+client_request(kvmd_client *client)
+{
+	int rc;
+	kvm *map;
+	kvmd_found found;
+	unsigned long offset;
+	kvm_data query, command, key, value;
+
+	offset = client->input_offset;
+	found.client = client;
+
+	if ((rc = client_field(client, &offset, &query)) <= 0)
+		return rc;
+
+	/* Check for sendmail socket map FETCH semantics. */
+	if ((key.data = memchr(query.data, ' ', query.size)) != NULL) {
+		client->input_offset = offset;
+		query.data[query.size] = '\0';
+		*key.data++ = '\0';
+		key.size = query.size - (key.data - query.data);
+
+		if (0 < debug)
+			syslog(LOG_DEBUG, "%s FETCH %s \"%s\"", client->addr, query.data, key.data);
+
+		if ((map = find_table((char *) query.data)) == NULL) {
+			client_netstring(client, "PERM invalid table", NULL, 0);
+			return 1;
+		}
+
+		found.status = "OK ";
+		switch (map->lookup(map, &key, client_found, &found)) {
+		case KVM_ERROR:
+			client_netstring(client, "PERM", NULL, 0);
+			break;
+		case KVM_NOT_FOUND:
+			client_netstring(client, "NOTFOUND", NULL, 0);
+			break;
+		}
+
+		return 1;
 	}
 
-	/* Otherwise handle extended socket map semantics. */
-	free(query.data);
-
-	if ((rc = kvm_recv(client, &query.data, &query.size)) != KVM_OK) {
-		kvm_send(client, (unsigned char *) "PERM command read error", sizeof ("PERM command read error")-1);
-		goto error0;
+	/* Otherwise extended socket map semantics. */
+	if ((rc = client_field(client, &offset, &command)) <= 0)
+		return rc;
+
+	if (IS_COMMAND(command, "GET") || IS_COMMAND(command, "REMOVE")) {
+		if ((rc = client_field(client, &offset, &key)) <= 0)
+			return rc;
+		value.data = NULL;
+	} else if (IS_COMMAND(command, "PUT")) {
+		if ((rc = client_field(client, &offset, &key)) <= 0)
+			return rc;
+		if ((rc = client_field(client, &offset, &value)) <= 0)
+			return rc;
+		value.data[value.size] = '\0';
+	} else {
+		if (0 < debug)
+			syslog(LOG_INFO, "%s invalid command", client->addr);
+		client_netstring(client, "PERM invalid operation", NULL, 0);
+		client->input_offset = offset;
+		return 1;
 	}
 
-	key.data = NULL;
-	value.data = NULL;
+	/* Complete request; terminate the fields in place. */
+	client->input_offset = offset;
+	query.data[query.size] = '\0';
+	command.data[command.size] = '\0';
+	key.data[key.size] = '\0';
 
-	if (TextInsensitiveCompare("GET", (char *) query.data) == 0) {
-		if (0 < debug)
-			syslog(LOG_INFO, "%s GET %s", addr, map->_table);
+	if (0 < debug)
+		syslog(LOG_INFO, "%s %s %s", client->addr, command.data, query.data);
 
-		if ((rc = kvm_recv(client, &key.data, &key.size)) != KVM_OK) {
-			kvm_send(client, (unsigned char *) "PERM key read error", sizeof ("PERM key read error")-1);
-			goto error1;
-		}
+	if ((map = find_table((char *) query.data)) == NULL) {
+		client_netstring(client, "PERM invalid table", NULL, 0);
+		return 1;
+	}
 
-		switch (map->get(map, &key, &value)) {
+	switch (*command.data) {
+	case 'G': case 'g':
+		found.status = "";
+		switch (map->lookup(map, &key, client_found, &found)) {
 		case KVM_ERROR:
-			(void) kvm_send(client, (unsigned char *) "PERM", sizeof ("PERM")-1);
+			client_netstring(client, "PERM", NULL, 0);
 			syslog(LOG_ERR, "GET '%s' failed", key.data);
 			break;
 		case KVM_NOT_FOUND:
-			(void) kvm_send(client, (unsigned char *) "NOTFOUND", sizeof ("NOTFOUND")-1);
-			break;
-		case KVM_OK:
-			kvm_send(client, (unsigned char *) "OK", 2);
-			(void) kvm_send(client, value.data, value.size);
-			free(value.data);
+			client_netstring(client, "NOTFOUND", NULL, 0);
 			break;
 		}
+		break;
+	case 'P': case 'p':
+		if (map->put(map, &key, &value) == KVM_ERROR) {
+			syslog(LOG_ERR, "PUT '%s' '%s' failed", key.data, value.data);
+			client_netstring(client, "PERM put failed", NULL, 0);
+		} else {
+			client_netstring(client, "OK", NULL, 0);
+		}
+		break;
+	default:
+		if (map->remove(map, &key) == KVM_ERROR) {
+			syslog(LOG_ERR, "REMOVE '%s' failed", key.data);
+			client_netstring(client, "PERM remove failed", NULL, 0);
+		} else {
+			client_netstring(client, "OK", NULL, 0);
+		}
+	}
 
-	} else if (TextInsensitiveCompare("PUT", (char *) query.data) == 0) {
-		if (0 < debug)
-			syslog(LOG_INFO, "%s PUT %s", addr, map->_table);
+	return 1;
+}
 
-		if ((rc = kvm_recv(client, &key.data, &key.size)) != KVM_OK) {
-			kvm_send(client, (unsigned char *) "PERM key read error", sizeof ("PERM key read error")-1);
-			goto error1;
+static void
+client_io(Events *loop, Event *event, int _reserved_)
+{
+	long bytes;
+	unsigned char *buf;
+	kvmd_client *client = event->data;
+
+	if (errno != 0 && errno != EAGAIN && errno != EWOULDBLOCK)
+		goto error0;
+
+	/* Drain queued replies before reading any more requests, so
+	 * a client that does not read its replies cannot grow the
+	 * output without limit.
+	 */
+	if (client->output_offset < client->output_length) {
+		bytes = socket3_write(event->fd, client->output + client->output_offset, client->output_length - client->output_offset, NULL);
+		if (bytes < 0) {
+			if (errno != EAGAIN && errno != EWOULDBLOCK)
+				goto error0;
+			bytes = 0;
 		}
+		client->output_offset += bytes;
 
-		if ((rc = kvm_recv(client, &value.data, &value.size)) != KVM_OK) {
-			kvm_send(client, (unsigned char *) "PERM value read error", sizeof ("PERM value read error")-1);
-			goto error2;
+		if (client->output_offset < client->output_length) {
+			eventSetType(event, EVENT_WRITE);
+			return;
 		}
+		client->output_offset = client->output_length = 0;
+		eventSetType(event, EVENT_READ);
+	}
 
-		if (map->put(map, &key, &value) == KVM_ERROR) {
-			syslog(LOG_ERR, "PUT '%s' '%s' failed", key.data, value.data);
-			(void) kvm_send(client, (unsigned char *) "PERM put failed", sizeof ("PERM put failed")-1);
-		} else {
-			kvm_send(client, (unsigned char *) "OK", 2);
+	if (eventGetType(event) == EVENT_READ) {
+		if (client->input_size - client->input_length < CLIENT_BUFFER / 2) {
+			if ((buf = realloc(client->input, client->input_size + CLIENT_BUFFER)) == NULL)
+				goto error0;
+			client->input = buf;
+			client->input_size += CLIENT_BUFFER;
 		}
-	} else if (TextInsensitiveCompare("REMOVE", (char *) query.data) == 0) {
-		if (0 < debug)
-			syslog(LOG_INFO, "%s REMOVE %s", addr, map->_table);
 
-		if ((rc = kvm_recv(client, &key.data, &key.size)) != KVM_OK) {
-			kvm_send(client, (unsigned char *) "PERM key read error", sizeof ("PERM key read error")-1);
-			goto error1;
+		bytes = socket3_read(event->fd, client->input + client->input_length, client->input_size - client->input_length, NULL);
+		if (bytes == 0)
+			goto error0;
+		if (bytes < 0) {
+			if (errno != EAGAIN && errno != EWOULDBLOCK)
+				goto error0;
+			bytes = 0;
 		}
+		client->input_length += bytes;
+	}
 
-		if (map->remove(map, &key) == KVM_ERROR) {
-			syslog(LOG_ERR, "REMOVE '%s' failed", key.data);
-			(void) kvm_send(client, (unsigned char *) "PERM remove failed", sizeof ("PERM remove failed")-1);
-		} else {
-			kvm_send(client, (unsigned char *) "OK", 2);
+	while (!client->failed && (bytes = client_request(client)) == 1)
+		;
+
+	if (bytes < 0 || client->failed) {
+		syslog(LOG_ERR, "%s invalid request", client->addr);
+		goto error0;
+	}
+
+	/* Keep any partial request at the front of the buffer. */
+	if (0 < client->input_offset) {
+		client->input_length -= client->input_offset;
+		memmove(client->input, client->input + client->input_offset, client->input_length);
+		client->input_offset = 0;
+	}
+
+	if (0 < client->output_length) {
+		bytes = socket3_write(event->fd, client->output, client->output_length, NULL);
+		if (bytes < 0) {
+			if (errno != EAGAIN && errno != EWOULDBLOCK)
+				goto error0;
+			bytes = 0;
 		}
-	} else {
-		if (0 < debug)
-			syslog(LOG_INFO, "%s invalid %s \"%s\"", addr, map->_table, query.data);
-		(void) kvm_send(client, (unsigned char *) "PERM invalid operation", sizeof ("PERM invalid operation")-1);
+		if ((client->output_offset = bytes) < client->output_length)
+			eventSetType(event, EVENT_WRITE);
+		else
+			client->output_offset = client->output_length = 0;
 	}
-error2:
-	free(key.data);
-error1:
-	free(query.data);
+
+	return;
 error0:
-	return rc == KVM_OK;
+	client_close(loop, event, 0);
 }
 
-void *
-process(void *data)
+static void
+server_io(Events *loop, Event *event, int _reserved_)
 {
-	char addr[256];
-	Socket2 *client = data;
+	SOCKET fd;
+	kvmd_client *client;
+	SocketAddress caddr;
 
-	socketSetNonBlocking(client, 1);
-	socketSetTimeout(client, timeout);
-	(void) socketAddressGetString(&client->address, 1, addr, sizeof (addr));
+	eventResetTimeout(event);
+	if (errno == ETIMEDOUT)
+		return;
 
-	while (request(client, addr))
-		;
+	/* Every loop waits on the same listener; the losers of a
+	 * race for a new connection see EAGAIN.
+	 */
+	if ((fd = socket3_accept(event->fd, &caddr)) < 0)
+		return;
 
-	socketClose(client);
+	(void) socket3_set_nonblocking(fd, 1);
+	(void) fileSetCloseOnExec(fd, 1);
 
-	PTHREAD_END(NULL);
+	if ((client = calloc(1, sizeof (*client))) == NULL) {
+		syslog(LOG_ERR, "%s.%d: out of memory", __FUNCTION__, __LINE__);
+		socket3_close(fd);
+		return;
+	}
+
+	if (0 < debug)
+		(void) socketAddressGetString(&caddr, 1, client->addr, sizeof (client->addr));
+
+	eventInit(&client->event, fd, EVENT_READ);
+	eventSetTimeout(&client->event, timeout / 1000);
+	eventSetCbIo(&client->event, client_io);
+	eventSetCbTimer(&client->event, client_close);
+	client->event.free = client_free;
+	client->event.data = client;
+
+	if (eventAdd(loop, &client->event))
+		client_free(client);
+}
+
+static void
+server_free(void *_event)
+{
+	Event *event = _event;
+
+	if (event != NULL) {
+		socket3_close(event->fd);
+		free(event);
+	}
+}
+
+static int
+serve_events(Socket2 *server)
+{
+	SOCKET fd;
+	unsigned i;
+	Event *event;
+	EventsGroup *group;
+
+	if ((group = eventsGroupNew(event_loops)) == NULL) {
+		syslog(LOG_ERR, "eventsGroupNew() failed: %s (%d)", strerror(errno), errno);
+		return -1;
+	}
+
+	/* Share the one listening socket rather than use SO_REUSEPORT,
+	 * which does not apply to a local (unix domain) socket path.
+	 */
+	for (i = 0; i < eventsGroupLength(group); i++) {
+		if ((fd = dup(socketGetFd(server))) < 0)
+			goto error1;
+
+		(void) fileSetCloseOnExec(fd, 1);
+		(void) socket3_set_nonblocking(fd, 1);
+
+		if ((event = eventNew(fd, EVENT_READ)) == NULL) {
+			socket3_close(fd);
+			goto error1;
+		}
+		event->free = server_free;
+		eventSetCbIo(event, server_io);
+
+		if (eventAdd(eventsGroupGet(group, i), event)) {
+			server_free(event);
+			goto error1;
+		}
+	}
+
+	syslog(LOG_INFO, "%u event loops", eventsGroupLength(group));
+
+	(void) eventsGroupRun(group);
+	eventsGroupFree(group);
+
+	return 0;
+error1:
+	syslog(LOG_ERR, "event listener failed: %s (%d)", strerror(errno), errno);
+	eventsGroupFree(group);
+
+	return -1;
 }
+#endif /* USE_LIBEV */
 
 void
 close_maps(void)
@@ -3579,7 +6049,7 @@ init_maps(int argc, char **argv)
 	int argi, mode;
 	char *table, *colon;
 
-	if ((maps = malloc(argc + 1)) == NULL) {
+	if ((maps = malloc((argc + 1) * sizeof (*maps))) == NULL) {
 		syslog(LOG_ERR, "%s (%d)", strerror(errno), errno);
 		exit(71);
 	}
@@ -3615,16 +6085,22 @@ int
 main(int argc, char **argv)
 {
 	int ch;
+	SOCKET fd;
 	SocketAddress *addr;
 	Socket2 *server, *client;
 
 	openlog("kvmd", LOG_PID, LOG_USER);
 
-	while ((ch = getopt(argc, argv, "dsh:p:t:v")) != -1) {
+	while ((ch = getopt(argc, argv, "de:sh:p:t:v")) != -1) {
 		switch (ch) {
 		case 'd':
 			daemon_mode = 1;
 			break;
+#ifndef USE_LIBEV
+		case 'e':
+			event_loops = (int) strtol(optarg, NULL, 10);
+			break;
+#endif
 		case 's':
 			single_thread = 1;
 			break;
@@ -3672,6 +6148,19 @@ main(int argc, char **argv)
 		exit(71);
 	}
 
+	/* Remove a stale local socket left by a previous instance,
+	 * but not one that another instance is still serving.
+	 */
+	if (*host == '/' && (fd = socket3_open(addr, 1)) != SOCKET_ERROR) {
+		if (connect(fd, (struct sockaddr *) addr, socketAddressLength(addr)) == 0) {
+			syslog(LOG_ERR, "socketmap server already running on \"%s\"", host);
+			exit(71);
+		}
+		if (errno == ECONNREFUSED)
+			(void) unlink(host);
+		socket3_close(fd);
+	}
+
 	if ((server = socketOpen(addr, 1)) == NULL) {
 		syslog(LOG_ERR, "socketOpen() failed");
 		exit(71);
@@ -3679,7 +6168,8 @@ main(int argc, char **argv)
 
 	socketSetTimeout(server, timeout);
 
-	if (socketSetReuse(server, 1)) {
+	/* SO_REUSEADDR does not apply to a local socket. */
+	if (*host != '/' && socketSetReuse(server, 1)) {
 		syslog(LOG_ERR, "socketSetResuse() of socketmap server failed");
 		exit(71);
 	}
@@ -3711,6 +6201,11 @@ main(int argc, char **argv)
 #endif
 	syslog(LOG_INFO, "listening on port %d", port);
 
+#ifndef USE_LIBEV
+	if (0 < event_loops)
+		exit(serve_events(server) ? 1 : 0);
+#endif
+
 	for (;;) {
 		if ((client = socketAccept(server)) == NULL)
 			continue;
@@ -3758,6 +6253,241 @@ main(int argc, char **argv)
 	return 0;
 }
 
+#endif
+
+#ifdef TEST
+/***********************************************************************
+ *** kvm walk_slice test
+ ***********************************************************************/
+
+#include <stdio.h>
+
+#define TEST_KEYS	4000
+
+typedef struct {
+	unsigned long seen[TEST_KEYS];
+	long stop_after;
+	int remove_even;
+} test_walk;
+
+static int
+test_key_index(kvm_data *key)
+{
+	long n;
+	char buffer[32];
+
+	if (sizeof (buffer) <= key->size)
+		return -1;
+	(void) memcpy(buffer, key->data, key->size);
+	buffer[key->size] = '\0';
+	n = strtol(buffer + 3, NULL, 10);
+
+	return n < 0 || TEST_KEYS <= n ? -1 : (int) n;
+}
+
+static int
+test_visit(kvm_data *key, kvm_data *value, void *data)
+{
+	int n;
+	test_walk *tw = data;
+
+	if ((n = test_key_index(key)) < 0)
+		return 1;
+	tw->seen[n]++;
+
+	if (0 < tw->stop_after && --tw->stop_after == 0)
+		return 0;
+
+	return tw->remove_even && (n & 1) == 0 ? -1 : 1;
+}
+
+/*
+ * Walk the whole map in zero millisecond slices, so that each call
+ * covers only a few buckets and must resume from the cursor.
+ */
+static unsigned long
+test_walk_slices(kvm *map, test_walk *tw)
+{
+	unsigned long calls, cursor;
+
+	cursor = 0;
+	calls = 0;
+	do {
+		if (map->walk_slice(map, &cursor, 0, test_visit, tw) != KVM_OK)
+			return 0;
+		calls++;
+	} while (cursor != 0);
+
+	return calls;
+}
+
+static int
+test_map(const char *location, int cached)
+{
+	int i, errors;
+	char buffer[32];
+	unsigned long calls;
+	kvm *map, *wrapped;
+	kvm_data key, value;
+	static test_walk tw;
+
+	errors = 0;
+	printf("--%s%s\n", location, cached ? " cached" : "");
+
+	if ((map = kvmOpen("test", location, 0)) == NULL) {
+		printf("kvmOpen...FAIL\n");
+		return 1;
+	}
+	if (cached) {
+		if ((wrapped = kvmCacheOpen(map, 1024, 60)) == NULL) {
+			printf("kvmCacheOpen...FAIL\n");
+			map->close(map);
+			return 1;
+		}
+		map = wrapped;
+	}
+
+	for (i = 0; i < TEST_KEYS; i++) {
+		key.size = snprintf(buffer, sizeof (buffer), "key%d", i);
+		key.data = (unsigned char *) buffer;
+		value = key;
+		if (map->put(map, &key, &value) != KVM_OK)
+			errors++;
+	}
+	printf("put %d...%s\n", TEST_KEYS, errors == 0 ? "OK" : "FAIL");
+
+	/* Every key once, over several resumed calls. */
+	memset(&tw, 0, sizeof (tw));
+	calls = test_walk_slices(map, &tw);
+	for (i = 0; i < TEST_KEYS; i++) {
+		if (tw.seen[i] != 1)
+			break;
+	}
+	printf("resume calls=%lu...%s\n", calls, 1 < calls && i == TEST_KEYS ? "OK" : "FAIL");
+	errors += !(1 < calls && i == TEST_KEYS);
+
+	/* Stopping early resets the cursor. */
+	memset(&tw, 0, sizeof (tw));
+	tw.stop_after = 10;
+	calls = test_walk_slices(map, &tw);
+	printf("stop calls=%lu...%s\n", calls, calls == 1 ? "OK" : "FAIL");
+	errors += calls != 1;
+
+	/* Look up the even keys, filling the cache, if any. */
+	for (i = 0; i < TEST_KEYS; i += 2) {
+		key.size = snprintf(buffer, sizeof (buffer), "key%d", i);
+		key.data = (unsigned char *) buffer;
+		if (map->get(map, &key, &value) == KVM_OK)
+			free(value.data);
+	}
+
+	/* Remove the even keys across the slices. */
+	memset(&tw, 0, sizeof (tw));
+	tw.remove_even = 1;
+	calls = test_walk_slices(map, &tw);
+
+	memset(&tw, 0, sizeof (tw));
+	(void) test_walk_slices(map, &tw);
+	for (i = 0; i < TEST_KEYS; i++) {
+		if (tw.seen[i] != (unsigned long) (i & 1))
+			break;
+	}
+	printf("remove calls=%lu...%s\n", calls, 1 < calls && i == TEST_KEYS ? "OK" : "FAIL");
+	errors += !(1 < calls && i == TEST_KEYS);
+
+	for (i = 0; i < TEST_KEYS; i++) {
+		key.size = snprintf(buffer, sizeof (buffer), "key%d", i);
+		key.data = (unsigned char *) buffer;
+		if (map->get(map, &key, &value) == KVM_OK) {
+			free(value.data);
+			if ((i & 1) == 0)
+				break;
+		} else if (i & 1) {
+			break;
+		}
+	}
+	printf("get after remove...%s\n", i == TEST_KEYS ? "OK" : "FAIL");
+	errors += i != TEST_KEYS;
+
+	map->close(map);
+
+	return errors;
+}
+
+static kvm *test_cache;
+static int (*test_cache_lookup)(kvm *, kvm_data *, void (*)(kvm_data *, void *), void *);
+
+/*
+ * A backend read that a remove through the cache overtakes before
+ * the cache gets to fill in what was read.
+ */
+static int
+test_lookup_removed(kvm *self, kvm_data *key, void (*function)(kvm_data *, void *), void *data)
+{
+	int rc;
+
+	rc = (*test_cache_lookup)(self, key, function, data);
+	(void) test_cache->remove(test_cache, key);
+
+	return rc;
+}
+
+static int
+test_cache_race(void)
+{
+	int rc;
+	kvm *map;
+	kvm_data key, value;
+
+	printf("--cache remove during lookup\n");
+
+	if ((map = kvmOpen("test", "hash" KVM_DELIM_S, 0)) == NULL) {
+		printf("kvmOpen...FAIL\n");
+		return 1;
+	}
+	key.data = value.data = (unsigned char *) "key0";
+	key.size = value.size = sizeof ("key0")-1;
+	(void) map->put(map, &key, &value);
+
+	if ((test_cache = kvmCacheOpen(map, 16, 60)) == NULL) {
+		printf("kvmCacheOpen...FAIL\n");
+		map->close(map);
+		return 1;
+	}
+
+	test_cache_lookup = map->lookup;
+	map->lookup = test_lookup_removed;
+	if (test_cache->get(test_cache, &key, &value) == KVM_OK)
+		free(value.data);
+	map->lookup = test_cache_lookup;
+
+	if ((rc = test_cache->get(test_cache, &key, &value)) == KVM_OK)
+		free(value.data);
+	printf("get after remove...%s\n", rc == KVM_NOT_FOUND ? "OK" : "FAIL");
+
+	test_cache->close(test_cache);
+
+	return rc != KVM_NOT_FOUND;
+}
+
+int
+main(int argc, char **argv)
+{
+	int errors = 0;
+
+	printf("\n--kvm walk_slice--\n");
+
+	errors += test_map("hash" KVM_DELIM_S, 0);
+	errors += test_map("stripe" KVM_DELIM_S, 0);
+	errors += test_map("hash" KVM_DELIM_S, 1);
+	errors += test_map("stripe" KVM_DELIM_S, 1);
+	errors += test_cache_race();
+
+	printf("%s\n", errors == 0 ? "OK" : "FAIL");
+
+	return errors == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
 #endif
 /***********************************************************************
  *** END
@@ -22,15 +22,53 @@
 #define MCC_SQLITE_BUSY_MS	15000
 #endif
 
+#ifndef MCC_SEND_MAX
+#define MCC_SEND_MAX		16	/* peers per sendmmsg() call */
+#endif
+
+#ifndef MCC_EXPIRE_ROWS
+#define MCC_EXPIRE_ROWS		256	/* rows deleted per expire step */
+#endif
+
+#ifndef MCC_EXPIRE_SLICE_MS
+#define MCC_EXPIRE_SLICE_MS	50	/* see mccSetExpireSlice() */
+#endif
+
+#ifndef MCC_EXPIRE_BUCKETS
+#define MCC_EXPIRE_BUCKETS	64	/* memory store buckets per lock hold */
+#endif
+
+#ifndef MCC_RECV_MAX
+#define MCC_RECV_MAX		16	/* packets per recvmmsg() call */
+#endif
+
+#ifndef MCC_QUEUE_SIZE
+#define MCC_QUEUE_SIZE		1024	/* rows per apply thread, power of 2 */
+#endif
+
+#ifndef MCC_APPLY_BATCH
+#define MCC_APPLY_BATCH		64	/* rows per apply transaction */
+#endif
+
 /***********************************************************************
  *** No configuration below this point.
  ***********************************************************************/
 
+#ifdef __linux__
+/* Required for sendmmsg() and recvmmsg(). */
+# undef _GNU_SOURCE
+# define _GNU_SOURCE
+#endif
+
 #include <com/snert/lib/version.h>
 #include <com/snert/lib/type/mcc.h>
 
 #ifdef HAVE_SQLITE3_H
 
+#if MCC_BATCH_SIZE < MCC_PACKET_SIZE
+# error "MCC_BATCH_SIZE must be at least MCC_PACKET_SIZE"
+#endif
+
 #include <ctype.h>
 #include <errno.h>
 #include <stdlib.h>
@@ -51,6 +89,7 @@
 #include <com/snert/lib/util/md5.h>
 #include <com/snert/lib/util/Text.h>
 #include <com/snert/lib/sys/Time.h>
+#include <com/snert/lib/util/timer.h>
 
 #ifdef DEBUG_MALLOC
 # include <com/snert/lib/util/DebugMalloc.h>
@@ -494,16 +533,13 @@ mccSqlStep(mcc_handle *mcc, sqlite3_stmt *sql_stmt, const char *sql_stmt_text)
 	return rc;
 }
 
-int
-mccDeleteKey(mcc_handle *mcc, const unsigned char *key, unsigned length)
+static int
+mcc_sql_remove(mcc_handle *mcc, const unsigned char *key, unsigned length)
 {
 	int rc;
 
 	rc = MCC_ERROR;
 
-	if (mcc == NULL || key == NULL)
-		goto error0;
-
 	if (sqlite3_bind_text(mcc->remove, 1, (const char *) key, length, SQLITE_STATIC) != SQLITE_OK)
 		goto error0;
 	if (mccSqlStep(mcc, mcc->remove, MCC_SQL_DELETE) == SQLITE_DONE)
@@ -513,157 +549,1851 @@ error0:
 	return rc;
 }
 
-int
-mccSetSyncByName(mcc_handle *mcc, const char *name)
+static int
+mcc_sql_put(mcc_handle *mcc, mcc_row *row)
 {
-	int i;
+	int rc;
+
+	rc = MCC_ERROR;
+
+	if (sqlite3_bind_text(mcc->replace, 1, (const char *) MCC_PTR_K(row), MCC_GET_K_SIZE(row), SQLITE_TRANSIENT) != SQLITE_OK)
+		goto error0;
+	if (sqlite3_bind_text(mcc->replace, 2, (const char *) MCC_PTR_V(row), MCC_GET_V_SIZE(row), SQLITE_TRANSIENT) != SQLITE_OK)
+		goto error1;
+	if (sqlite3_bind_int(mcc->replace, 3, (int) row->expires) != SQLITE_OK)
+		goto error1;
+	if (sqlite3_bind_int(mcc->replace, 4, (int) row->created) != SQLITE_OK)
+		goto error1;
+	if (mccSqlStep(mcc, mcc->replace, MCC_SQL_REPLACE) == SQLITE_DONE)
+		rc = MCC_OK;
+error1:
+	(void) sqlite3_clear_bindings(mcc->replace);
+error0:
+	return rc;
+}
+
+/***********************************************************************
+ *** Memory Store with SQLite Write-Behind
+ ***********************************************************************/
+
+/*
+ * The rows live in a hash table split into shards, each with its own
+ * mutex, so that lookups and updates of unrelated keys do not contend
+ * and never touch SQLite. A changed row is marked dirty and linked
+ * once onto its shard's dirty list, however often it changes between
+ * flushes. A removed row stays in the table, marked deleted, until
+ * the flush thread has written the delete.
+ *
+ * The flush thread detaches each shard's dirty list under the shard
+ * mutex, copies the rows out into a batch, then writes the batch in
+ * one SQLite transaction without holding any shard mutex. The rows
+ * in the batch are marked flushing and a deleted one is kept until
+ * the transaction commits; should it fail, they are put back on the
+ * dirty lists for the next flush.
+ */
+
+#define MCC_STORE_SHARD_BITS	6
+#define MCC_STORE_SHARDS	(1 << MCC_STORE_SHARD_BITS)
+#define MCC_STORE_BUCKETS	256		/* initial per shard, power of 2 */
+#define MCC_STORE_LOAD		2		/* entries per bucket before growing */
+
+#define MCC_ENTRY_DIRTY		0x01
+#define MCC_ENTRY_DELETED	0x02
+#define MCC_ENTRY_FLUSHING	0x04
+
+typedef struct mcc_entry {
+	struct mcc_entry *next;		/* hash chain */
+	struct mcc_entry *dirty;	/* shard dirty list */
+	unsigned long hash;
+	unsigned flags;
+	time_t expires;
+	time_t created;
+	unsigned k_size;
+	unsigned v_size;
+	unsigned space;			/* allocated data bytes */
+	unsigned char *data;		/* key followed by value */
+} mcc_entry;
+
+typedef struct {
+	pthread_mutex_t mutex;
+	mcc_entry **table;
+	unsigned long size;		/* buckets, power of 2 */
+	unsigned long length;		/* entries, including deleted */
+	mcc_entry *dirty;
+} mcc_shard;
+
+typedef struct {
+	unsigned char op;		/* MCC_CMD_PUT or MCC_CMD_REMOVE */
+	unsigned char pad;
+	uint16_t k_size;
+	uint16_t v_size;
+	time_t expires;
+	time_t created;
+} mcc_record;
+
+/*
+ * Returned by the store and batch functions once mccStopWriteBehind()
+ * or mccStopBatch() has stopped them, so that a caller which read the
+ * cache.store or cache.batch pointer just before it was cleared falls
+ * back to SQLite or sending the row at once.
+ */
+#define MCC_STOPPED		(-100)
+
+struct mcc_store {
+	int running;
+	int stopped;			/* set with every mutex held */
+	int truncate;			/* mccDeleteAll() since the last flush */
+	unsigned ready;			/* shards initialised */
+	unsigned period;		/* seconds between flushes */
+	pthread_t thread;
+	pthread_mutex_t mutex;
+	pthread_cond_t wakeup;
+	unsigned char *batch;		/* flush thread only */
+	unsigned long batch_size;
+	struct mcc_store *next;		/* cache.stores_stopped */
+	mcc_shard shard[MCC_STORE_SHARDS];
+};
+
+static unsigned long
+mcc_store_hash(const unsigned char *key, unsigned length)
+{
+	unsigned long hash = 5381;
+
+	while (0 < length--)
+		hash = ((hash << 5) + hash) ^ *key++;
+
+	return hash;
+}
+
+#define MCC_STORE_SHARD(s, h)	(&(s)->shard[(h) & (MCC_STORE_SHARDS-1)])
+#define MCC_STORE_BUCKET(t, h)	(&(t)->table[((h) >> MCC_STORE_SHARD_BITS) & ((t)->size-1)])
+
+static mcc_entry **
+mcc_store_find(mcc_shard *shard, unsigned long hash, const unsigned char *key, unsigned length)
+{
+	mcc_entry **prev, *entry;
+
+	for (prev = MCC_STORE_BUCKET(shard, hash); (entry = *prev) != NULL; prev = &entry->next) {
+		if (entry->hash == hash && entry->k_size == length && memcmp(entry->data, key, length) == 0)
+			break;
+	}
+
+	return prev;
+}
+
+static void
+mcc_store_grow(mcc_shard *shard)
+{
+	unsigned long i, size;
+	mcc_entry **table, *entry, *next, **bucket;
+
+	size = shard->size * 2;
+	if ((table = calloc(size, sizeof (*table))) == NULL)
+		return;
+
+	for (i = 0; i < shard->size; i++) {
+		for (entry = shard->table[i]; entry != NULL; entry = next) {
+			next = entry->next;
+			bucket = &table[(entry->hash >> MCC_STORE_SHARD_BITS) & (size-1)];
+			entry->next = *bucket;
+			*bucket = entry;
+		}
+	}
+
+	free(shard->table);
+	shard->table = table;
+	shard->size = size;
+}
+
+static void
+mcc_store_dirty(mcc_shard *shard, mcc_entry *entry)
+{
+	if (!(entry->flags & MCC_ENTRY_DIRTY)) {
+		entry->flags |= MCC_ENTRY_DIRTY;
+		entry->dirty = shard->dirty;
+		shard->dirty = entry;
+	}
+}
+
+static void
+mcc_entry_free(mcc_entry *entry)
+{
+	if (entry != NULL) {
+		free(entry->data);
+		free(entry);
+	}
+}
+
+/*
+ * Called with the shard mutex held.
+ */
+static int
+mcc_store_set(mcc_shard *shard, unsigned long hash, mcc_row *row, int dirty)
+{
+	unsigned char *data;
+	mcc_entry **prev, *entry;
+	unsigned k_size, v_size;
+
+	k_size = MCC_GET_K_SIZE(row);
+	v_size = MCC_GET_V_SIZE(row);
+	prev = mcc_store_find(shard, hash, MCC_PTR_K(row), k_size);
+
+	if ((entry = *prev) == NULL) {
+		if ((entry = calloc(1, sizeof (*entry))) == NULL)
+			return MCC_ERROR;
+		if ((entry->data = malloc(k_size + v_size)) == NULL) {
+			free(entry);
+			return MCC_ERROR;
+		}
+		entry->hash = hash;
+		entry->k_size = k_size;
+		entry->space = k_size + v_size;
+		(void) memcpy(entry->data, MCC_PTR_K(row), k_size);
+
+		entry->next = *MCC_STORE_BUCKET(shard, hash);
+		*MCC_STORE_BUCKET(shard, hash) = entry;
+		if (shard->size * MCC_STORE_LOAD < ++shard->length)
+			mcc_store_grow(shard);
+	} else if (entry->space < k_size + v_size) {
+		if ((data = realloc(entry->data, k_size + v_size)) == NULL)
+			return MCC_ERROR;
+		entry->data = data;
+		entry->space = k_size + v_size;
+	}
+
+	(void) memcpy(entry->data + k_size, MCC_PTR_V(row), v_size);
+	entry->v_size = v_size;
+	entry->expires = row->expires;
+	entry->created = row->created;
+	entry->flags &= ~MCC_ENTRY_DELETED;
+
+	if (dirty)
+		mcc_store_dirty(shard, entry);
+
+	return MCC_OK;
+}
+
+/*
+ * Called with the shard mutex held.
+ */
+static void
+mcc_store_copy(mcc_entry *entry, mcc_row *row)
+{
+	time_t now;
+
+	MCC_SET_COMMAND(row, '\0');
+	MCC_SET_K_SIZE(row, entry->k_size);
+	(void) memcpy(MCC_PTR_K(row), entry->data, entry->k_size);
+
+	MCC_SET_EXTRA(row, '\0');
+	MCC_SET_V_SIZE(row, entry->v_size);
+	(void) memcpy(MCC_PTR_V(row), entry->data + entry->k_size, entry->v_size);
+
+	row->expires = entry->expires;
+	row->created = entry->created;
+
+	(void) time(&now);
+	row->ttl = now < row->expires ? row->expires - now : 0;
+}
+
+static int
+mcc_store_get(struct mcc_store *store, const unsigned char *key, unsigned length, mcc_row *row)
+{
+	int rc;
+	mcc_entry *entry;
+	mcc_shard *shard;
+	unsigned long hash;
+
+	rc = MCC_NOT_FOUND;
+	hash = mcc_store_hash(key, length);
+	shard = MCC_STORE_SHARD(store, hash);
+
+	PTHREAD_MUTEX_LOCK(&shard->mutex);
+	if (store->stopped) {
+		rc = MCC_STOPPED;
+	} else {
+		entry = *mcc_store_find(shard, hash, key, length);
+		if (entry != NULL && !(entry->flags & MCC_ENTRY_DELETED)) {
+			mcc_store_copy(entry, row);
+			rc = MCC_OK;
+		}
+	}
+	PTHREAD_MUTEX_UNLOCK(&shard->mutex);
+
+	return rc;
+}
+
+static int
+mcc_store_put(struct mcc_store *store, mcc_row *row)
+{
+	int rc;
+	mcc_shard *shard;
+	unsigned long hash;
+
+	rc = MCC_ERROR;
+	hash = mcc_store_hash(MCC_PTR_K(row), MCC_GET_K_SIZE(row));
+	shard = MCC_STORE_SHARD(store, hash);
+
+	PTHREAD_MUTEX_LOCK(&shard->mutex);
+	rc = store->stopped ? MCC_STOPPED : mcc_store_set(shard, hash, row, 1);
+	PTHREAD_MUTEX_UNLOCK(&shard->mutex);
+
+	return rc;
+}
+
+/*
+ * Unlike the SQLite version, the read-modify-write is done under the
+ * shard mutex, so concurrent adds to the same key are not lost.
+ */
+static int
+mcc_store_add(struct mcc_store *store, long add, mcc_row *row)
+{
+	int rc, length;
+	long number;
+	mcc_entry *entry;
+	mcc_shard *shard;
+	unsigned long hash;
+	char value[24];
+
+	rc = MCC_ERROR;
+	number = 0;
+	hash = mcc_store_hash(MCC_PTR_K(row), MCC_GET_K_SIZE(row));
+	shard = MCC_STORE_SHARD(store, hash);
+
+	PTHREAD_MUTEX_LOCK(&shard->mutex);
+	if (store->stopped) {
+		rc = MCC_STOPPED;
+		goto error1;
+	}
+	entry = *mcc_store_find(shard, hash, MCC_PTR_K(row), MCC_GET_K_SIZE(row));
+	if (entry != NULL && !(entry->flags & MCC_ENTRY_DELETED)) {
+		/* Same limit as a row read and NUL terminated in place. */
+		if (MCC_DATA_SIZE-1 <= entry->k_size + entry->v_size)
+			goto error1;
+		length = entry->v_size < sizeof (value) ? entry->v_size : sizeof (value)-1;
+		(void) memcpy(value, entry->data + entry->k_size, length);
+		value[length] = '\0';
+		number = strtol(value, NULL, 10);
+		row->created = entry->created;
+	}
+
+	number += add;
+	length = snprintf((char *)MCC_PTR_V(row), MCC_GET_V_SPACE(row), "%ld", number);
+	MCC_SET_V_SIZE(row, length);
+
+	rc = mcc_store_set(shard, hash, row, 1);
+error1:
+	PTHREAD_MUTEX_UNLOCK(&shard->mutex);
+
+	return rc;
+}
+
+static int
+mcc_store_remove(struct mcc_store *store, const unsigned char *key, unsigned length)
+{
+	int rc;
+	mcc_entry *entry;
+	mcc_shard *shard;
+	unsigned long hash;
+
+	rc = MCC_OK;
+	hash = mcc_store_hash(key, length);
+	shard = MCC_STORE_SHARD(store, hash);
+
+	PTHREAD_MUTEX_LOCK(&shard->mutex);
+	if (store->stopped) {
+		rc = MCC_STOPPED;
+	} else {
+		entry = *mcc_store_find(shard, hash, key, length);
+		if (entry != NULL && !(entry->flags & MCC_ENTRY_DELETED)) {
+			entry->flags |= MCC_ENTRY_DELETED;
+			mcc_store_dirty(shard, entry);
+		}
+	}
+	PTHREAD_MUTEX_UNLOCK(&shard->mutex);
+
+	return rc;
+}
+
+/*
+ * Called with the shard mutex held. Unlink and free the entry the
+ * chain pointer prev refers to, unless it is waiting to be flushed
+ * or being flushed, in which case it is only marked deleted.
+ */
+static void
+mcc_store_drop(mcc_shard *shard, mcc_entry **prev)
+{
+	mcc_entry *entry = *prev;
+
+	if (entry->flags & (MCC_ENTRY_DIRTY|MCC_ENTRY_FLUSHING)) {
+		entry->flags |= MCC_ENTRY_DELETED;
+	} else {
+		*prev = entry->next;
+		shard->length--;
+		mcc_entry_free(entry);
+	}
+}
+
+/*
+ * Each shard is swept MCC_EXPIRE_BUCKETS at a time, so that a large
+ * shard is not locked for the whole sweep. Should the shard grow
+ * between two holds, entries from buckets already swept can only
+ * move to buckets not yet swept, so none are missed.
+ */
+static void
+mcc_store_expire(struct mcc_store *store, time_t when)
+{
+	int more;
+	unsigned long i, end;
+	mcc_shard *shard;
+	mcc_entry **prev, *entry;
+
+	for (shard = store->shard; shard < store->shard + MCC_STORE_SHARDS; shard++) {
+		for (more = 1, i = 0; more; ) {
+			PTHREAD_MUTEX_LOCK(&shard->mutex);
+			for (end = i + MCC_EXPIRE_BUCKETS; i < end && i < shard->size; i++) {
+				for (prev = &shard->table[i]; (entry = *prev) != NULL; ) {
+					if (entry->expires <= when && !(entry->flags & MCC_ENTRY_DELETED)) {
+						mcc_store_drop(shard, prev);
+						/* Was it unlinked or only marked? */
+						if (*prev != entry)
+							continue;
+					}
+					prev = &entry->next;
+				}
+			}
+			more = i < shard->size;
+			PTHREAD_MUTEX_UNLOCK(&shard->mutex);
+		}
+	}
+}
+
+static void
+mcc_store_clear(mcc_shard *shard)
+{
+	unsigned long i;
+	mcc_entry *entry, *next;
+
+	for (i = 0; i < shard->size; i++) {
+		for (entry = shard->table[i]; entry != NULL; entry = next) {
+			next = entry->next;
+			mcc_entry_free(entry);
+		}
+		shard->table[i] = NULL;
+	}
+	shard->length = 0;
+	shard->dirty = NULL;
+}
+
+static int
+mcc_store_truncate(struct mcc_store *store)
+{
+	int rc;
+	mcc_shard *shard;
+
+	rc = MCC_STOPPED;
+
+	/* Hold the store mutex so that a flush collects its rows either
+	 * entirely before or entirely after the truncate.
+	 */
+	PTHREAD_MUTEX_LOCK(&store->mutex);
+	if (!store->stopped) {
+		for (shard = store->shard; shard < store->shard + MCC_STORE_SHARDS; shard++) {
+			PTHREAD_MUTEX_LOCK(&shard->mutex);
+			mcc_store_clear(shard);
+			PTHREAD_MUTEX_UNLOCK(&shard->mutex);
+		}
+		store->truncate = 1;
+		rc = MCC_OK;
+	}
+	PTHREAD_MUTEX_UNLOCK(&store->mutex);
+
+	return rc;
+}
+
+/*
+ * Called with the shard mutex held. Append one record to the batch.
+ */
+static int
+mcc_store_record(struct mcc_store *store, unsigned long *length, mcc_entry *entry)
+{
+	mcc_record record;
+	unsigned long need;
+	unsigned char *batch;
+
+	need = *length + sizeof (record) + entry->k_size + entry->v_size;
+	if (store->batch_size < need) {
+		need += 64 * 1024;
+		if ((batch = realloc(store->batch, need)) == NULL)
+			return MCC_ERROR;
+		store->batch = batch;
+		store->batch_size = need;
+	}
+
+	memset(&record, 0, sizeof (record));
+	record.op = (entry->flags & MCC_ENTRY_DELETED) ? MCC_CMD_REMOVE : MCC_CMD_PUT;
+	record.k_size = entry->k_size;
+	record.v_size = record.op == MCC_CMD_PUT ? entry->v_size : 0;
+	record.expires = entry->expires;
+	record.created = entry->created;
+
+	(void) memcpy(store->batch + *length, &record, sizeof (record));
+	*length += sizeof (record);
+	(void) memcpy(store->batch + *length, entry->data, record.k_size + record.v_size);
+	*length += record.k_size + record.v_size;
+
+	return MCC_OK;
+}
+
+/*
+ * Called once the batch has been committed or rolled back. Clear the
+ * flushing mark of each row in the batch. A deleted row that has not
+ * changed again is freed after a commit; after a rollback every row
+ * goes back on its shard's dirty list, to be written with whatever
+ * value it has by the next flush. A row no longer found was cleared
+ * by mccDeleteAll() in the meantime.
+ */
+static void
+mcc_store_flushed(struct mcc_store *store, unsigned long length, int committed)
+{
+	mcc_shard *shard;
+	mcc_record record;
+	unsigned long hash, offset;
+	mcc_entry **prev, *entry;
+
+	for (offset = 0; offset < length; offset += record.k_size + record.v_size) {
+		(void) memcpy(&record, store->batch + offset, sizeof (record));
+		offset += sizeof (record);
+
+		hash = mcc_store_hash(store->batch + offset, record.k_size);
+		shard = MCC_STORE_SHARD(store, hash);
+
+		PTHREAD_MUTEX_LOCK(&shard->mutex);
+		prev = mcc_store_find(shard, hash, store->batch + offset, record.k_size);
+		if ((entry = *prev) != NULL) {
+			entry->flags &= ~MCC_ENTRY_FLUSHING;
+			if (!committed)
+				mcc_store_dirty(shard, entry);
+			else if ((entry->flags & (MCC_ENTRY_DELETED|MCC_ENTRY_DIRTY)) == MCC_ENTRY_DELETED)
+				mcc_store_drop(shard, prev);
+		}
+		PTHREAD_MUTEX_UNLOCK(&shard->mutex);
+	}
+}
+
+/*
+ * Write the rows changed since the last flush in one transaction.
+ * Only ever called by one thread at a time.
+ */
+static int
+mcc_store_flush(mcc_handle *mcc, struct mcc_store *store)
+{
+	int rc, truncate;
+	mcc_row row;
+	mcc_shard *shard;
+	mcc_record record;
+	unsigned long length, offset, rows;
+	mcc_entry *entry, *next;
+
+	PTHREAD_MUTEX_LOCK(&store->mutex);
+	truncate = store->truncate;
+	store->truncate = 0;
+
+	length = 0;
+	for (shard = store->shard; shard < store->shard + MCC_STORE_SHARDS; shard++) {
+		PTHREAD_MUTEX_LOCK(&shard->mutex);
+		for (entry = shard->dirty; entry != NULL; entry = next) {
+			next = entry->dirty;
+
+			if (mcc_store_record(store, &length, entry) != MCC_OK) {
+				/* Keep the rest for the next flush. */
+				shard->dirty = entry;
+				break;
+			}
+
+			entry->flags = (entry->flags & ~MCC_ENTRY_DIRTY) | MCC_ENTRY_FLUSHING;
+			entry->dirty = NULL;
+		}
+		if (entry == NULL)
+			shard->dirty = NULL;
+		PTHREAD_MUTEX_UNLOCK(&shard->mutex);
+	}
+	PTHREAD_MUTEX_UNLOCK(&store->mutex);
+
+	if (length == 0 && !truncate)
+		return MCC_OK;
+
+	rc = MCC_ERROR;
+	if (mccSqlStep(mcc, mcc->begin, MCC_SQL_BEGIN) != SQLITE_DONE)
+		goto error0;
+	if (truncate && mccSqlStep(mcc, mcc->truncate, MCC_SQL_TRUNCATE) != SQLITE_DONE)
+		goto error1;
+
+	for (rows = offset = 0; offset < length; rows++) {
+		(void) memcpy(&record, store->batch + offset, sizeof (record));
+		offset += sizeof (record);
+
+		if (record.op == MCC_CMD_REMOVE) {
+			if (mcc_sql_remove(mcc, store->batch + offset, record.k_size) != MCC_OK)
+				goto error1;
+		} else {
+			MCC_SET_K_SIZE(&row, record.k_size);
+			MCC_SET_V_SIZE(&row, record.v_size);
+			(void) memcpy(MCC_PTR_K(&row), store->batch + offset, record.k_size + record.v_size);
+			row.expires = record.expires;
+			row.created = record.created;
+			if (mcc_sql_put(mcc, &row) != MCC_OK)
+				goto error1;
+		}
+		offset += record.k_size + record.v_size;
+	}
+
+	if (mccSqlStep(mcc, mcc->commit, MCC_SQL_COMMIT) != SQLITE_DONE)
+		goto error1;
+
+	if (1 < debug)
+		syslog(LOG_DEBUG, "mcc flushed rows=%lu truncate=%d", rows, truncate);
+
+	mcc_store_flushed(store, length, 1);
+
+	return MCC_OK;
+error1:
+	(void) mccSqlStep(mcc, mcc->rollback, MCC_SQL_ROLLBACK);
+error0:
+	syslog(LOG_ERR, "mcc \"%s\" write-behind failed", cache.path);
+
+	if (truncate) {
+		PTHREAD_MUTEX_LOCK(&store->mutex);
+		store->truncate = 1;
+		PTHREAD_MUTEX_UNLOCK(&store->mutex);
+	}
+	mcc_store_flushed(store, length, 0);
+
+	return rc;
+}
+
+static void *
+mcc_store_thread(void *data)
+{
+	mcc_handle *mcc;
+	struct timespec abstime;
+	struct mcc_store *store = data;
+
+	if ((mcc = mccCreate()) == NULL) {
+		syslog(LOG_ERR, log_error, __FILE__, __LINE__, strerror(errno), errno);
+		goto error0;
+	}
+
+	PTHREAD_MUTEX_LOCK(&store->mutex);
+	while (store->running) {
+		abstime.tv_sec = time(NULL) + store->period;
+		abstime.tv_nsec = 0;
+		(void) pthread_cond_timedwait(&store->wakeup, &store->mutex, &abstime);
+
+		(void) pthread_mutex_unlock(&store->mutex);
+		(void) mcc_store_flush(mcc, store);
+		(void) pthread_mutex_lock(&store->mutex);
+	}
+	PTHREAD_MUTEX_UNLOCK(&store->mutex);
+
+	/* Final flush of anything changed while stopping. */
+	(void) mcc_store_flush(mcc, store);
+	mccDestroy(mcc);
+error0:
+	PTHREAD_END(NULL);
+}
+
+static void
+mcc_store_free(struct mcc_store *store)
+{
+	mcc_shard *shard;
+
+	if (store != NULL) {
+		for (shard = store->shard; shard < store->shard + store->ready; shard++) {
+			mcc_store_clear(shard);
+			free(shard->table);
+			(void) pthread_mutex_destroy(&shard->mutex);
+		}
+		(void) pthread_cond_destroy(&store->wakeup);
+		(void) pthread_mutex_destroy(&store->mutex);
+		free(store->batch);
+		free(store);
+	}
+}
+
+static void
+mcc_store_lock(struct mcc_store *store)
+{
+	int i;
+
+	if (store != NULL) {
+		(void) pthread_mutex_lock(&store->mutex);
+		for (i = 0; i < MCC_STORE_SHARDS; i++)
+			(void) pthread_mutex_lock(&store->shard[i].mutex);
+	}
+}
+
+static void
+mcc_store_unlock(struct mcc_store *store)
+{
+	int i;
+
+	if (store != NULL) {
+		for (i = MCC_STORE_SHARDS; 0 < i--; )
+			(void) pthread_mutex_unlock(&store->shard[i].mutex);
+		(void) pthread_mutex_unlock(&store->mutex);
+	}
+}
+
+static struct mcc_store *
+mcc_store_create(void)
+{
+	mcc_shard *shard;
+	struct mcc_store *store;
+
+	if ((store = calloc(1, sizeof (*store))) == NULL)
+		goto error0;
+	if (pthread_mutex_init(&store->mutex, NULL))
+		goto error1;
+	if (pthread_cond_init(&store->wakeup, NULL)) {
+		(void) pthread_mutex_destroy(&store->mutex);
+		goto error1;
+	}
+
+	for (shard = store->shard; shard < store->shard + MCC_STORE_SHARDS; shard++) {
+		if ((shard->table = calloc(MCC_STORE_BUCKETS, sizeof (*shard->table))) == NULL)
+			goto error2;
+		if (pthread_mutex_init(&shard->mutex, NULL)) {
+			free(shard->table);
+			goto error2;
+		}
+		shard->size = MCC_STORE_BUCKETS;
+		store->ready++;
+	}
+
+	return store;
+error2:
+	mcc_store_free(store);
+	return NULL;
+error1:
+	free(store);
+error0:
+	return NULL;
+}
+
+static int
+mcc_store_load(mcc_handle *mcc, struct mcc_store *store)
+{
+	int rc;
+	mcc_row row;
+	unsigned long hash, rows;
+	sqlite3_stmt *select_all;
+
+	if (sqlite3_prepare_v2_blocking(mcc->db, MCC_SQL_SELECT_ALL, -1, &select_all, NULL) != SQLITE_OK) {
+		syslog(LOG_ERR, "mcc statement error: %s %s", MCC_SQL_SELECT_ALL, sqlite3_errmsg(mcc->db));
+		return MCC_ERROR;
+	}
+
+	for (rows = 0; (rc = mccSqlStep(mcc, select_all, MCC_SQL_SELECT_ALL)) == SQLITE_ROW; rows++) {
+		MCC_SET_COMMAND(&row, '\0');
+		MCC_SET_EXTRA(&row, '\0');
+		MCC_SET_K_SIZE(&row, sqlite3_column_bytes(select_all, 0));
+		(void) memcpy(MCC_PTR_K(&row), sqlite3_column_text(select_all, 0), MCC_GET_K_SIZE(&row));
+		MCC_SET_V_SIZE(&row, sqlite3_column_bytes(select_all, 1));
+		(void) memcpy(MCC_PTR_V(&row), sqlite3_column_text(select_all, 1), MCC_GET_V_SIZE(&row));
+		row.expires = (uint32_t) sqlite3_column_int(select_all, 2);
+		row.created = (uint32_t) sqlite3_column_int(select_all, 3);
+
+		/* Single threaded still, but the helpers expect the lock. */
+		hash = mcc_store_hash(MCC_PTR_K(&row), MCC_GET_K_SIZE(&row));
+		PTHREAD_MUTEX_LOCK(&MCC_STORE_SHARD(store, hash)->mutex);
+		rc = mcc_store_set(MCC_STORE_SHARD(store, hash), hash, &row, 0);
+		PTHREAD_MUTEX_UNLOCK(&MCC_STORE_SHARD(store, hash)->mutex);
+		if (rc != MCC_OK)
+			break;
+	}
+	(void) sqlite3_finalize(select_all);
+
+	if (0 < debug)
+		syslog(LOG_DEBUG, "mcc \"%s\" loaded rows=%lu", cache.path, rows);
+
+	return rc == SQLITE_DONE ? MCC_OK : MCC_ERROR;
+}
+
+/*
+ * Another thread may have read cache.store just before it is cleared,
+ * so the store is only marked stopped, which sends its users back to
+ * SQLite, and is kept until mccFini().
+ */
+void
+mccStopWriteBehind(void)
+{
+	int running;
+	mcc_handle *mcc;
+	mcc_shard *shard;
+	struct mcc_store *store;
+
+	if ((store = cache.store) == NULL)
+		return;
+
+	PTHREAD_MUTEX_LOCK(&store->mutex);
+	running = store->running;
+	store->running = 0;
+	(void) pthread_cond_signal(&store->wakeup);
+	PTHREAD_MUTEX_UNLOCK(&store->mutex);
+
+	/* A forked child has no flush thread. */
+	if (running)
+		(void) pthread_join(store->thread, NULL);
+
+	mcc_store_lock(store);
+	store->stopped = 1;
+	cache.store = NULL;
+	mcc_store_unlock(store);
+
+	/* Flush what changed before the store was stopped. */
+	if ((mcc = mccCreate()) != NULL) {
+		(void) mcc_store_flush(mcc, store);
+		mccDestroy(mcc);
+	}
+
+	for (shard = store->shard; shard < store->shard + MCC_STORE_SHARDS; shard++) {
+		PTHREAD_MUTEX_LOCK(&shard->mutex);
+		mcc_store_clear(shard);
+		PTHREAD_MUTEX_UNLOCK(&shard->mutex);
+	}
+	store->next = cache.stores_stopped;
+	cache.stores_stopped = store;
+}
+
+int
+mccStartWriteBehind(unsigned seconds)
+{
+	int rc;
+	mcc_handle *mcc;
+	struct mcc_store *store;
+	pthread_attr_t pthread_attr;
+
+	mccStopWriteBehind();
+
+	if ((store = mcc_store_create()) == NULL) {
+		syslog(LOG_ERR, log_error, __FILE__, __LINE__, strerror(errno), errno);
+		goto error0;
+	}
+	store->period = 0 < seconds ? seconds : 1;
+	store->running = 1;
+
+	if ((mcc = mccCreate()) == NULL)
+		goto error1;
+	rc = mcc_store_load(mcc, store);
+	mccDestroy(mcc);
+	if (rc != MCC_OK)
+		goto error1;
+
+#ifdef HAVE_PTHREAD_ATTR_INIT
+	if (pthread_attr_init(&pthread_attr))
+		goto error1;
+
+# if defined(HAVE_PTHREAD_ATTR_SETSCOPE)
+	(void) pthread_attr_setscope(&pthread_attr, PTHREAD_SCOPE_SYSTEM);
+# endif
+# if defined(HAVE_PTHREAD_ATTR_SETSTACKSIZE)
+	(void) pthread_attr_setstacksize(&pthread_attr, MCC_STACK_SIZE);
+# endif
+#endif
+	rc = pthread_create(&store->thread, &pthread_attr, mcc_store_thread, store);
+#ifdef HAVE_PTHREAD_ATTR_INIT
+	(void) pthread_attr_destroy(&pthread_attr);
+#endif
+	if (rc != 0) {
+		syslog(LOG_ERR, "mcc write-behind thread error: %s, (%d)", strerror(errno), errno);
+		goto error1;
+	}
+
+	cache.store = store;
+
+	return MCC_OK;
+error1:
+	mcc_store_free(store);
+error0:
+	return MCC_ERROR;
+}
+
+/***********************************************************************
+ ***
+ ***********************************************************************/
+
+int
+mccDeleteKey(mcc_handle *mcc, const unsigned char *key, unsigned length)
+{
+	int rc;
+	struct mcc_store *store;
+
+	if (mcc == NULL || key == NULL)
+		return MCC_ERROR;
+
+	if ((store = cache.store) != NULL && (rc = mcc_store_remove(store, key, length)) != MCC_STOPPED)
+		return rc;
+
+	return mcc_sql_remove(mcc, key, length);
+}
+
+int
+mccSetSyncByName(mcc_handle *mcc, const char *name)
+{
+	int i;
+
+	for (i = 0; synchronous[i] != NULL; i++) {
+		if (TextInsensitiveCompare(name, synchronous[i]) == 0)
+			return mccSetSync(mcc, i);
+	}
+
+	return MCC_ERROR;
+}
+
+int
+mccSetSync(mcc_handle *mcc, int level)
+{
+	int rc;
+	char *error;
+
+	rc = MCC_ERROR;
+
+	if (mcc == NULL || level < MCC_SYNC_OFF || MCC_SYNC_FULL < level)
+		return MCC_ERROR;
+
+	PTHREAD_DISABLE_CANCEL();
+	if (sqlite3_exec(mcc->db, synchronous_stmt[level], NULL, NULL, &error) == SQLITE_OK) {
+		rc = MCC_OK;
+	} else {
+		syslog(LOG_ERR, "sql=%s error %s: %s", cache.path, synchronous_stmt[level], error);
+		sqlite3_free(error);
+	}
+	PTHREAD_RESTORE_CANCEL();
+
+	return rc;
+}
+
+int
+mccPutRowLocal(mcc_handle *mcc, mcc_row *row)
+{
+	int rc;
+	struct mcc_store *store;
+
+	rc = MCC_ERROR;
+
+	if (mcc == NULL || row == NULL)
+		goto error0;
+
+	if (1 < debug)
+		syslog(
+			LOG_DEBUG,
+			"%s key=%d:" MCC_FMT_K " value=%d:" MCC_FMT_V " expires=" MCC_FMT_E " created=" MCC_FMT_C,
+			__FUNCTION__,
+			MCC_GET_K_SIZE(row), MCC_FMT_K_ARG(row),
+			MCC_GET_V_SIZE(row), MCC_FMT_V_ARG(row),
+			MCC_FMT_E_ARG(row), MCC_FMT_C_ARG(row)
+		);
+
+	if ((store = cache.store) == NULL || (rc = mcc_store_put(store, row)) == MCC_STOPPED)
+		rc = mcc_sql_put(mcc, row);
+error0:
+	return rc;
+}
+
+int
+mccSetMulticastTTL(int ttl)
+{
+	return socketMulticastTTL(cache.server, ttl);
+}
+
+/*
+ * Send a packet to every unicast and multicast address, using one
+ * system call for several peers where sendmmsg() is available.
+ */
+static int
+mcc_send_peers(unsigned char *packet, int packet_length)
+{
+	int rc;
+	SocketAddress **table;
+#ifdef HAVE_SENDMMSG
+	int i, n, sent;
+	struct iovec iov;
+	struct mmsghdr msgs[MCC_SEND_MAX];
+#endif
+	rc = MCC_OK;
+
+	PTHREAD_MUTEX_LOCK(&cache.mutex);
+	if (cache.server == NULL || cache.unicast_ip == NULL) {
+		rc = MCC_ERROR;
+	} else {
+#ifdef HAVE_SENDMMSG
+		iov.iov_base = packet;
+		iov.iov_len = packet_length;
+
+		for (table = cache.unicast_ip; *table != NULL; ) {
+			for (n = 0; n < MCC_SEND_MAX && *table != NULL; n++, table++) {
+				memset(&msgs[n], 0, sizeof (msgs[n]));
+				msgs[n].msg_hdr.msg_name = (void *) &(*table)->sa;
+				msgs[n].msg_hdr.msg_namelen = socketAddressLength(*table);
+				msgs[n].msg_hdr.msg_iov = &iov;
+				msgs[n].msg_hdr.msg_iovlen = 1;
+			}
+			for (i = 0; i < n; i += sent) {
+				if ((sent = sendmmsg(socketGetFd(cache.server), msgs + i, n - i, 0)) < 0) {
+					if (errno == EINTR) {
+						sent = 0;
+						continue;
+					}
+					/* Skip the peer that failed. */
+					rc = MCC_ERROR;
+					sent = 1;
+				}
+			}
+		}
+#else
+		for (table = cache.unicast_ip; *table != NULL; table++) {
+			if (socketWriteTo(cache.server, packet, packet_length, *table) != packet_length)
+				rc = MCC_ERROR;
+		}
+#endif
+	}
+	PTHREAD_MUTEX_UNLOCK(&cache.mutex);
+
+	return rc;
+}
+
+/***********************************************************************
+ *** Batched Replication
+ ***********************************************************************/
+
+/*
+ * Row changes are appended, in packet byte order, to a packet that
+ * is sent when the next row would not fit or when the oldest row has
+ * waited the delay. The MAC is computed as each row is appended, so
+ * that sending only hashes the 8 bytes of head.
+ */
+
+struct mcc_batch {
+	int running;
+	int stopped;			/* mccStopBatch() */
+	unsigned delay_ms;
+	pthread_t thread;
+	pthread_mutex_t mutex;
+	pthread_cond_t wakeup;
+	struct timespec deadline;	/* when the first row must be sent */
+	uint32_t sequence;
+	unsigned rows;
+	unsigned length;
+	siphash_state_t mac;
+	struct mcc_batch *next;		/* cache.batches_stopped */
+	unsigned char packet[MCC_BATCH_SIZE];
+};
+
+/*
+ * Called with the batch mutex held.
+ */
+static int
+mcc_batch_flush(struct mcc_batch *batch)
+{
+	int rc;
+	uint16_t word;
+	uint32_t sequence;
+
+	if (batch->rows == 0)
+		return MCC_OK;
+
+	sequence = htonl(batch->sequence++);
+	(void) memcpy(batch->packet + 16, &sequence, sizeof (sequence));
+	word = htons(MCC_CMD_BATCH << 9);
+	(void) memcpy(batch->packet + 20, &word, sizeof (word));
+	word = htons(batch->rows);
+	(void) memcpy(batch->packet + 22, &word, sizeof (word));
+
+	siphash_append(&batch->mac, batch->packet + 16, MCC_BATCH_ROW_HEAD);
+	memset(batch->packet, 0, 16);
+	siphash_finish(&batch->mac, batch->packet);
+
+	rc = mcc_send_peers(batch->packet, batch->length);
+
+	if (1 < debug)
+		syslog(LOG_DEBUG, "mcc batch sent rows=%u length=%u", batch->rows, batch->length);
+
+	batch->rows = 0;
+	batch->length = MCC_HEAD_SIZE;
+
+	return rc;
+}
+
+/*
+ * The row is already in network byte order.
+ */
+static int
+mcc_batch_append(struct mcc_batch *batch, mcc_row *row, int packet_length)
+{
+	int rc, length;
+	struct timeval now;
+
+	length = packet_length - sizeof (row->digest);
+	rc = MCC_OK;
+
+	PTHREAD_MUTEX_LOCK(&batch->mutex);
+	if (batch->stopped) {
+		rc = MCC_STOPPED;
+		goto error1;
+	}
+	if (MCC_BATCH_SIZE < batch->length + length)
+		rc = mcc_batch_flush(batch);
+
+	if (batch->rows == 0) {
+		siphash_init(&batch->mac, cache.secret_key);
+
+		(void) gettimeofday(&now, NULL);
+		batch->deadline.tv_sec = now.tv_sec + batch->delay_ms / 1000;
+		batch->deadline.tv_nsec = (now.tv_usec + batch->delay_ms % 1000 * 1000) * 1000;
+		if (1000000000 <= batch->deadline.tv_nsec) {
+			batch->deadline.tv_nsec -= 1000000000;
+			batch->deadline.tv_sec++;
+		}
+		(void) pthread_cond_signal(&batch->wakeup);
+	}
+
+	(void) memcpy(batch->packet + batch->length, (unsigned char *) row + sizeof (row->digest), length);
+	siphash_append(&batch->mac, batch->packet + batch->length, length);
+	batch->length += length;
+	batch->rows++;
+error1:
+	PTHREAD_MUTEX_UNLOCK(&batch->mutex);
+
+	return rc;
+}
+
+static void *
+mcc_batch_thread(void *data)
+{
+	struct mcc_batch *batch = data;
+
+	PTHREAD_MUTEX_LOCK(&batch->mutex);
+	while (batch->running) {
+		if (batch->rows == 0)
+			(void) pthread_cond_wait(&batch->wakeup, &batch->mutex);
+		else if (pthread_cond_timedwait(&batch->wakeup, &batch->mutex, &batch->deadline) == ETIMEDOUT)
+			(void) mcc_batch_flush(batch);
+	}
+	(void) mcc_batch_flush(batch);
+	PTHREAD_MUTEX_UNLOCK(&batch->mutex);
+
+	PTHREAD_END(NULL);
+}
+
+static void
+mcc_batch_free(struct mcc_batch *batch)
+{
+	if (batch != NULL) {
+		(void) pthread_cond_destroy(&batch->wakeup);
+		(void) pthread_mutex_destroy(&batch->mutex);
+		free(batch);
+	}
+}
+
+/*
+ * Another thread may have read cache.batch just before it is cleared,
+ * so the batch is only marked stopped, which has mccSend() send the
+ * row itself, and is kept until mccFini().
+ */
+void
+mccStopBatch(void)
+{
+	int running;
+	struct mcc_batch *batch;
+
+	if ((batch = cache.batch) == NULL)
+		return;
+
+	PTHREAD_MUTEX_LOCK(&batch->mutex);
+	running = batch->running;
+	batch->running = 0;
+	batch->stopped = 1;
+	cache.batch = NULL;
+	(void) pthread_cond_signal(&batch->wakeup);
+	PTHREAD_MUTEX_UNLOCK(&batch->mutex);
+
+	if (running)
+		(void) pthread_join(batch->thread, NULL);
+
+	batch->next = cache.batches_stopped;
+	cache.batches_stopped = batch;
+}
+
+int
+mccStartBatch(unsigned ms)
+{
+	int rc;
+	struct mcc_batch *batch;
+	pthread_attr_t pthread_attr;
+
+	mccStopBatch();
+
+	if ((batch = calloc(1, sizeof (*batch))) == NULL) {
+		syslog(LOG_ERR, log_error, __FILE__, __LINE__, strerror(errno), errno);
+		goto error0;
+	}
+	if (pthread_mutex_init(&batch->mutex, NULL)) {
+		free(batch);
+		goto error0;
+	}
+	if (pthread_cond_init(&batch->wakeup, NULL)) {
+		(void) pthread_mutex_destroy(&batch->mutex);
+		free(batch);
+		goto error0;
+	}
+	batch->delay_ms = ms;
+	batch->length = MCC_HEAD_SIZE;
+	batch->running = 1;
+
+#ifdef HAVE_PTHREAD_ATTR_INIT
+	if (pthread_attr_init(&pthread_attr))
+		goto error1;
+
+# if defined(HAVE_PTHREAD_ATTR_SETSCOPE)
+	(void) pthread_attr_setscope(&pthread_attr, PTHREAD_SCOPE_SYSTEM);
+# endif
+# if defined(HAVE_PTHREAD_ATTR_SETSTACKSIZE)
+	(void) pthread_attr_setstacksize(&pthread_attr, MCC_STACK_SIZE);
+# endif
+#endif
+	rc = pthread_create(&batch->thread, &pthread_attr, mcc_batch_thread, batch);
+#ifdef HAVE_PTHREAD_ATTR_INIT
+	(void) pthread_attr_destroy(&pthread_attr);
+#endif
+	if (rc != 0) {
+		syslog(LOG_ERR, "mcc batch thread error: %s, (%d)", strerror(errno), errno);
+		goto error1;
+	}
+
+	cache.batch = batch;
+
+	return MCC_OK;
+error1:
+	mcc_batch_free(batch);
+error0:
+	return MCC_ERROR;
+}
+
+/***********************************************************************
+ ***
+ ***********************************************************************/
+
+int
+mccSend(mcc_handle *mcc, mcc_row *row, uint8_t command)
+{
+	time_t now;
+	md5_state_t md5;
+	int rc, packet_length;
+	struct mcc_batch *batch;
+
+	if (!cache.is_running)
+		return MCC_OK;
+
+	(void) time(&now);
+	mccUpdateActive("127.0.0.1", (uint32_t *)&now);
+
+	/* Covert some of the values to network byte order. */
+	MCC_SET_COMMAND(row, command);
+	packet_length = MCC_PACKET_LENGTH(row);
+
+	row->ttl = htonl(row->ttl);
+	row->k_size = htons(row->k_size);
+	row->v_size = htons(row->v_size);
+
+	if ((batch = cache.batch) == NULL || (rc = mcc_batch_append(batch, row, packet_length)) == MCC_STOPPED) {
+		md5_init(&md5);
+		md5_append(&md5, (md5_byte_t *) row+sizeof (row->digest), packet_length - sizeof (row->digest));
+		md5_append(&md5, (md5_byte_t *) cache.secret, cache.secret_length);
+		md5_finish(&md5, (md5_byte_t *) row->digest);
+
+		rc = mcc_send_peers((unsigned char *) row, packet_length);
+	}
+
+	/* Restore our record. */
+	row->ttl = ntohl(row->ttl);
+	row->k_size = ntohs(row->k_size);
+	row->v_size = ntohs(row->v_size);
+
+	if (1 < debug)
+		syslog(LOG_DEBUG, "%s command=%c key=" MCC_FMT_K, __FUNCTION__, MCC_GET_COMMAND(row), MCC_FMT_K_ARG(row));
+
+	return rc;
+}
+
+/*
+ * Apply a row received from a peer. The row is in host byte order.
+ */
+static void
+mcc_listener_row(mcc_handle *mcc, const char *ip, time_t now, mcc_row *row)
+{
+	int cmd;
+	mcc_row old_row;
+	mcc_key_hook **hooks, *hook;
+
+	row->created = now;
+	row->expires = now + row->ttl;
+
+	if (1 < debug) {
+		syslog(
+			LOG_DEBUG, "mcc from=[%s] cmd=%c key=" MCC_FMT_K,
+			ip, MCC_GET_COMMAND(row), MCC_FMT_K_ARG(row)
+		);
+	}
+
+	switch (cmd = MCC_GET_COMMAND(row)) {
+		long add;
+
+	case MCC_CMD_ADD:
+		if (MCC_DATA_SIZE-1 <= MCC_GET_K_SIZE(row) + MCC_GET_V_SIZE(row)) {
+			syslog(LOG_ERR, "mcc size error key=" MCC_FMT_K, MCC_FMT_K_ARG(row));
+			return;
+		}
+		MCC_PTR_V(row)[MCC_GET_V_SIZE(row)] = '\0';
+		add = strtol((char *)MCC_PTR_V(row), NULL, 10);
+		/*@fallthrough@*/
+
+		while (0)  {
+	case MCC_CMD_INC: add = +1; break;
+	case MCC_CMD_DEC: add = -1; break;
+		}
+
+		if (mccAddRowLocal(mcc, add, row) != MCC_OK) {
+			syslog(LOG_ERR, "mcc put error key=" MCC_FMT_K, MCC_FMT_K_ARG(row));
+			return;
+		}
+		break;
+
+	case MCC_CMD_PUT:
+		/* Preserve created timestamp for an existing
+		 * row (see smtpf grey-listing).  Ignore row
+		 * not found and error; use the created value
+		 * assigned above.
+		 */
+		if (mccGetKey(mcc, (const unsigned char *) MCC_PTR_K(row), MCC_GET_K_SIZE(row), &old_row) == MCC_OK) {
+			row->created = old_row.created;
+		}
+		if (cache.hook.remote_replace != NULL
+		&& (*cache.hook.remote_replace)(mcc, NULL, NULL, row)) {
+			return;
+		}
+		if (mccPutRowLocal(mcc, row) != MCC_OK) {
+			syslog(LOG_ERR, "mcc put error key=" MCC_FMT_K, MCC_FMT_K_ARG(row));
+			return;
+		}
+		break;
+
+	case MCC_CMD_REMOVE:
+		if (cache.hook.remote_remove != NULL
+		&& (*cache.hook.remote_remove)(mcc, NULL, NULL, row)) {
+			return;
+		}
+		if (mccDeleteKey(mcc, MCC_PTR_K(row), MCC_GET_K_SIZE(row)) != MCC_OK) {
+			syslog(LOG_ERR, "mcc remove error key=" MCC_FMT_K, MCC_FMT_K_ARG(row));
+			return;
+		}
+		break;
+
+	case MCC_CMD_OTHER:
+		/* Look for a matching prefix.
+		 *
+		 * NOTE that mcc->mutex is NOT locked around the loop
+		 * as the key_hooks that are called will manipulate
+		 * the cache using the MCC API which lock mcc->mutex
+		 * themselves.
+		 */
+		for (hooks = (mcc_key_hook **) VectorBase(cache.key_hooks); *hooks != NULL; hooks++) {
+			hook = *hooks;
+
+			if (hook->prefix_length <= MCC_GET_K_SIZE(row)
+			&& memcmp(MCC_PTR_K(row), hook->prefix, hook->prefix_length) == 0) {
+				(*hook->process)(mcc, hook, ip, row);
+				break;
+			}
+		}
+		break;
+
+	default:
+		syslog(LOG_ERR, "mcc from=[%s] unknown cmd=%c", ip, cmd);
+	}
+}
+
+/***********************************************************************
+ *** Listener Apply Queues
+ ***********************************************************************/
+
+/*
+ * The listener thread only reads, verifies, and queues rows; it never
+ * takes cache.mutex nor touches the database. Each apply thread has a
+ * single producer, single consumer ring that the listener fills, so
+ * neither side takes a lock to pass a row. An apply thread drains its
+ * ring in transactions of up to MCC_APPLY_BATCH rows, and only takes
+ * its mutex to sleep when the ring is empty.
+ */
+
+#if defined(__ATOMIC_SEQ_CST)
+# define MCC_ATOMIC_LOAD(p)		__atomic_load_n((p), __ATOMIC_SEQ_CST)
+# define MCC_ATOMIC_STORE(p, v)		__atomic_store_n((p), (v), __ATOMIC_SEQ_CST)
+#else
+/* Without compiler atomics fall back on a mutex for its barriers. */
+static pthread_mutex_t mcc_atomic_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static unsigned long
+mcc_atomic_load(volatile unsigned long *p)
+{
+	unsigned long value;
+
+	(void) pthread_mutex_lock(&mcc_atomic_mutex);
+	value = *p;
+	(void) pthread_mutex_unlock(&mcc_atomic_mutex);
+
+	return value;
+}
+
+static void
+mcc_atomic_store(volatile unsigned long *p, unsigned long value)
+{
+	(void) pthread_mutex_lock(&mcc_atomic_mutex);
+	*p = value;
+	(void) pthread_mutex_unlock(&mcc_atomic_mutex);
+}
+
+# define MCC_ATOMIC_LOAD(p)		mcc_atomic_load(p)
+# define MCC_ATOMIC_STORE(p, v)		mcc_atomic_store((p), (v))
+#endif
+
+typedef struct {
+	time_t now;
+	char ip[IPV6_STRING_SIZE];
+	mcc_row row;
+} mcc_queued;
+
+struct mcc_apply {
+	pthread_t thread;
+	mcc_handle *mcc;
+	pthread_mutex_t mutex;
+	pthread_cond_t wakeup;
+	int running;			/* protected by mutex */
+	unsigned long waiting;		/* consumer is, or is about to be, asleep */
+	unsigned long head;		/* next slot to apply, consumer only */
+	char pad[64];			/* keep head and tail in separate cache lines */
+	unsigned long tail;		/* next slot to fill, producer only */
+	mcc_queued ring[MCC_QUEUE_SIZE];
+};
+
+#if (MCC_QUEUE_SIZE & (MCC_QUEUE_SIZE-1)) != 0
+# error "MCC_QUEUE_SIZE must be a power of 2"
+#endif
+
+static unsigned mcc_apply_threads = 1;
+
+#define MCC_QUEUE_INDEX(i)	((i) & (MCC_QUEUE_SIZE-1))
+
+/*
+ * Listener thread only.
+ */
+static void
+mcc_apply_push(const char *ip, time_t now, mcc_row *row)
+{
+	unsigned long tail;
+	mcc_queued *slot;
+	struct mcc_apply *apply;
+
+	apply = cache.apply[djb_hash_index(MCC_PTR_K(row), MCC_GET_K_SIZE(row), cache.apply_count)];
+
+	tail = apply->tail;
+	if (MCC_QUEUE_SIZE <= tail - MCC_ATOMIC_LOAD(&apply->head)) {
+		MCC_ATOMIC_STORE(&cache.dropped, cache.dropped + 1);
+		return;
+	}
+
+	slot = &apply->ring[MCC_QUEUE_INDEX(tail)];
+	slot->now = now;
+	(void) TextCopy(slot->ip, sizeof (slot->ip), ip);
+	(void) memcpy(&slot->row, row, MCC_PACKET_LENGTH(row));
+
+	MCC_ATOMIC_STORE(&apply->tail, tail + 1);
+	MCC_ATOMIC_STORE(&cache.received, cache.received + 1);
+
+	if (MCC_ATOMIC_LOAD(&apply->waiting)) {
+		PTHREAD_MUTEX_LOCK(&apply->mutex);
+		(void) pthread_cond_signal(&apply->wakeup);
+		PTHREAD_MUTEX_UNLOCK(&apply->mutex);
+	}
+}
+
+static void *
+mcc_apply_thread(void *data)
+{
+	int in_transaction;
+	unsigned long head, tail, stop;
+	struct mcc_apply *apply = data;
+
+	for (head = apply->head; ; ) {
+		tail = MCC_ATOMIC_LOAD(&apply->tail);
+
+		if (head == tail) {
+			(void) pthread_mutex_lock(&apply->mutex);
+			MCC_ATOMIC_STORE(&apply->waiting, 1);
+			while (apply->running && MCC_ATOMIC_LOAD(&apply->tail) == head)
+				(void) pthread_cond_wait(&apply->wakeup, &apply->mutex);
+			MCC_ATOMIC_STORE(&apply->waiting, 0);
+			tail = MCC_ATOMIC_LOAD(&apply->tail);
+			(void) pthread_mutex_unlock(&apply->mutex);
+
+			/* Stopped and drained? */
+			if (head == tail)
+				break;
+		}
+
+		stop = MCC_APPLY_BATCH < tail - head ? head + MCC_APPLY_BATCH : tail;
+
+		/* The memory store has no use for SQLite transactions. */
+		in_transaction = cache.store == NULL && 1 < stop - head
+			&& mccSqlStep(apply->mcc, apply->mcc->begin, MCC_SQL_BEGIN) == SQLITE_DONE;
+
+		for ( ; head != stop; head++) {
+			mcc_queued *slot = &apply->ring[MCC_QUEUE_INDEX(head)];
+			mcc_listener_row(apply->mcc, slot->ip, slot->now, &slot->row);
+
+			/* Release the slot to the listener. */
+			MCC_ATOMIC_STORE(&apply->head, head + 1);
+		}
+
+		if (in_transaction && mccSqlStep(apply->mcc, apply->mcc->commit, MCC_SQL_COMMIT) != SQLITE_DONE)
+			(void) mccSqlStep(apply->mcc, apply->mcc->rollback, MCC_SQL_ROLLBACK);
+	}
+
+	PTHREAD_END(NULL);
+}
+
+static void
+mcc_apply_free(struct mcc_apply *apply)
+{
+	if (apply != NULL) {
+		mccDestroy(apply->mcc);
+		(void) pthread_cond_destroy(&apply->wakeup);
+		(void) pthread_mutex_destroy(&apply->mutex);
+		free(apply);
+	}
+}
+
+/*
+ * Stop the apply threads after they have applied the rows queued.
+ */
+static void
+mcc_apply_stop(void)
+{
+	int running;
+	unsigned i;
+	struct mcc_apply *apply;
+
+	if (cache.apply == NULL)
+		return;
+
+	for (i = 0; i < cache.apply_count; i++) {
+		if ((apply = cache.apply[i]) == NULL)
+			continue;
+
+		PTHREAD_MUTEX_LOCK(&apply->mutex);
+		/* Not running after a fork, see mccAtForkChild(). */
+		if ((running = apply->running)) {
+			apply->running = 0;
+			(void) pthread_cond_signal(&apply->wakeup);
+		}
+		PTHREAD_MUTEX_UNLOCK(&apply->mutex);
+
+		if (running)
+			(void) pthread_join(apply->thread, NULL);
+		mcc_apply_free(apply);
+	}
+
+	free(cache.apply);
+	cache.apply = NULL;
+}
+
+static int
+mcc_apply_start(void)
+{
+	int rc;
+	unsigned i;
+	struct mcc_apply *apply;
+	pthread_attr_t pthread_attr;
+
+	cache.received = cache.dropped = cache.rejected = 0;
+	cache.apply_count = mcc_apply_threads;
+	if ((cache.apply = calloc(cache.apply_count, sizeof (*cache.apply))) == NULL)
+		goto error0;
+
+	for (i = 0; i < cache.apply_count; i++) {
+		if ((apply = calloc(1, sizeof (*apply))) == NULL)
+			goto error0;
+		if (pthread_mutex_init(&apply->mutex, NULL)) {
+			free(apply);
+			goto error0;
+		}
+		if (pthread_cond_init(&apply->wakeup, NULL)) {
+			(void) pthread_mutex_destroy(&apply->mutex);
+			free(apply);
+			goto error0;
+		}
+
+		/* Open the handles one at a time, since concurrent
+		 * mccCreate() can fail preparing statements.
+		 */
+		if ((apply->mcc = mccCreate()) == NULL) {
+			mcc_apply_free(apply);
+			goto error0;
+		}
+		apply->running = 1;
+
+#ifdef HAVE_PTHREAD_ATTR_INIT
+		if (pthread_attr_init(&pthread_attr)) {
+			mcc_apply_free(apply);
+			goto error0;
+		}
+# if defined(HAVE_PTHREAD_ATTR_SETSCOPE)
+		(void) pthread_attr_setscope(&pthread_attr, PTHREAD_SCOPE_SYSTEM);
+# endif
+# if defined(HAVE_PTHREAD_ATTR_SETSTACKSIZE)
+		(void) pthread_attr_setstacksize(&pthread_attr, MCC_STACK_SIZE);
+# endif
+#endif
+		rc = pthread_create(&apply->thread, &pthread_attr, mcc_apply_thread, apply);
+#ifdef HAVE_PTHREAD_ATTR_INIT
+		(void) pthread_attr_destroy(&pthread_attr);
+#endif
+		if (rc != 0) {
+			mcc_apply_free(apply);
+			goto error0;
+		}
 
-	for (i = 0; synchronous[i] != NULL; i++) {
-		if (TextInsensitiveCompare(name, synchronous[i]) == 0)
-			return mccSetSync(mcc, i);
+		cache.apply[i] = apply;
 	}
 
+	return MCC_OK;
+error0:
+	syslog(LOG_ERR, "mcc apply thread error: %s (%d)", strerror(errno), errno);
+	mcc_apply_stop();
+
 	return MCC_ERROR;
 }
 
-int
-mccSetSync(mcc_handle *mcc, int level)
+void
+mccSetApplyThreads(unsigned count)
 {
-	int rc;
-	char *error;
+	mcc_apply_threads = 0 < count ? count : 1;
+}
 
-	rc = MCC_ERROR;
+void
+mccGetListenerStats(mcc_listener_stats *stats)
+{
+	unsigned i;
 
-	if (mcc == NULL || level < MCC_SYNC_OFF || MCC_SYNC_FULL < level)
-		return MCC_ERROR;
+	stats->received = MCC_ATOMIC_LOAD(&cache.received);
+	stats->dropped = MCC_ATOMIC_LOAD(&cache.dropped);
+	stats->rejected = MCC_ATOMIC_LOAD(&cache.rejected);
 
-	PTHREAD_DISABLE_CANCEL();
-	if (sqlite3_exec(mcc->db, synchronous_stmt[level], NULL, NULL, &error) == SQLITE_OK) {
-		rc = MCC_OK;
-	} else {
-		syslog(LOG_ERR, "sql=%s error %s: %s", cache.path, synchronous_stmt[level], error);
-		sqlite3_free(error);
+	stats->queued = 0;
+	if (cache.apply != NULL) {
+		for (i = 0; i < cache.apply_count; i++) {
+			if (cache.apply[i] != NULL) {
+				stats->queued += MCC_ATOMIC_LOAD(&cache.apply[i]->tail)
+					- MCC_ATOMIC_LOAD(&cache.apply[i]->head);
+			}
+		}
 	}
-	PTHREAD_RESTORE_CANCEL();
+}
 
-	return rc;
+/***********************************************************************
+ *** Listener
+ ***********************************************************************/
+
+static void
+mcc_listener_reject(const char *ip, const char *fmt)
+{
+	MCC_ATOMIC_STORE(&cache.rejected, cache.rejected + 1);
+	syslog(LOG_ERR, fmt, ip);
 }
 
-int
-mccPutRowLocal(mcc_handle *mcc, mcc_row *row)
+/*
+ * Verify and queue each row of an MCC_CMD_BATCH packet.
+ */
+static void
+mcc_listener_batch(const char *ip, time_t now, unsigned char *packet, long nbytes)
 {
-	int rc;
+	mcc_row row;
+	uint16_t rows;
+	siphash_state_t mac;
+	unsigned char *stop;
+	uint8_t our_mac[SIPHASH_DIGEST_SIZE];
+
+	siphash_init(&mac, cache.secret_key);
+	siphash_append(&mac, packet + MCC_HEAD_SIZE, nbytes - MCC_HEAD_SIZE);
+	siphash_append(&mac, packet + 16, MCC_BATCH_ROW_HEAD);
+	siphash_finish(&mac, our_mac);
+
+	if (memcmp(our_mac, packet, sizeof (our_mac)) != 0) {
+		mcc_listener_reject(ip, "mcc batch digest error from [%s]");
+		mccNotesUpdate(ip, "mac=", "mac=N");
+		return;
+	}
+	mccNotesUpdate(ip, "mac=", "mac=Y");
 
-	rc = MCC_ERROR;
+	(void) memcpy(&rows, packet + 22, sizeof (rows));
+	rows = ntohs(rows);
+	stop = packet + nbytes;
 
-	if (mcc == NULL || row == NULL)
-		goto error0;
+	for (packet += MCC_HEAD_SIZE; 0 < rows--; ) {
+		if (stop < packet + MCC_BATCH_ROW_HEAD)
+			goto error0;
+		(void) memcpy(&row.ttl, packet, MCC_BATCH_ROW_HEAD);
+		packet += MCC_BATCH_ROW_HEAD;
 
-	if (1 < debug)
-		syslog(
-			LOG_DEBUG,
-			"%s key=%d:" MCC_FMT_K " value=%d:" MCC_FMT_V " expires=" MCC_FMT_E " created=" MCC_FMT_C,
-			__FUNCTION__,
-			MCC_GET_K_SIZE(row), MCC_FMT_K_ARG(row),
-			MCC_GET_V_SIZE(row), MCC_FMT_V_ARG(row),
-			MCC_FMT_E_ARG(row), MCC_FMT_C_ARG(row)
-		);
+		row.ttl = ntohl(row.ttl);
+		row.k_size = ntohs(row.k_size);
+		row.v_size = ntohs(row.v_size);
 
-	if (sqlite3_bind_text(mcc->replace, 1, (const char *) MCC_PTR_K(row), MCC_GET_K_SIZE(row), SQLITE_TRANSIENT) != SQLITE_OK)
-		goto error0;
-	if (sqlite3_bind_text(mcc->replace, 2, (const char *) MCC_PTR_V(row), MCC_GET_V_SIZE(row), SQLITE_TRANSIENT) != SQLITE_OK)
-		goto error1;
-	if (sqlite3_bind_int(mcc->replace, 3, (int) row->expires) != SQLITE_OK)
-		goto error1;
-	if (sqlite3_bind_int(mcc->replace, 4, (int) row->created) != SQLITE_OK)
-		goto error1;
-	if (mccSqlStep(mcc, mcc->replace, MCC_SQL_REPLACE) == SQLITE_DONE)
-		rc = MCC_OK;
-error1:
-	(void) sqlite3_clear_bindings(mcc->replace);
-error0:
-	return rc;
-}
+		if (MCC_DATA_SIZE < MCC_GET_K_SIZE(&row) + MCC_GET_V_SIZE(&row)
+		|| stop < packet + MCC_GET_K_SIZE(&row) + MCC_GET_V_SIZE(&row))
+			goto error0;
+		(void) memcpy(row.data, packet, MCC_GET_K_SIZE(&row) + MCC_GET_V_SIZE(&row));
+		packet += MCC_GET_K_SIZE(&row) + MCC_GET_V_SIZE(&row);
 
-int
-mccSetMulticastTTL(int ttl)
-{
-	return socketMulticastTTL(cache.server, ttl);
+		mcc_apply_push(ip, now, &row);
+	}
+
+	return;
+error0:
+	mcc_listener_reject(ip, "mcc batch format error from [%s]");
 }
 
-int
-mccSend(mcc_handle *mcc, mcc_row *row, uint8_t command)
+static void
+mcc_listener_packet(SocketAddress *from, unsigned char *packet, long nbytes)
 {
 	time_t now;
+	mcc_row row;
 	md5_state_t md5;
-	SocketAddress **table;
-	int rc, packet_length;
+	int packet_length;
+	unsigned char our_digest[16];
+	char ip[IPV6_STRING_SIZE];
 
-	if (!cache.is_running)
-		return MCC_OK;
+	(void) socketAddressGetString(from, 0, ip, sizeof (ip));
 
 	(void) time(&now);
-	mccUpdateActive("127.0.0.1", (uint32_t *)&now);
+	mccUpdateActive(ip, (uint32_t *)&now);
 
-	/* Covert some of the values to network byte order. */
-	MCC_SET_COMMAND(row, command);
-	packet_length = MCC_PACKET_LENGTH(row);
+	if (MCC_HEAD_SIZE <= nbytes && (packet[20] >> 1) == MCC_CMD_BATCH) {
+		mcc_listener_batch(ip, now, packet, nbytes);
+		return;
+	}
 
-	row->ttl = htonl(row->ttl);
-	row->k_size = htons(row->k_size);
-	row->v_size = htons(row->v_size);
+	/* Single row packet. The receive slot is sized for a batch, so
+	 * both the datagram and the length it claims must fit a row.
+	 */
+	if (nbytes < MCC_HEAD_SIZE || MCC_PACKET_SIZE < nbytes) {
+		mcc_listener_reject(ip, "mcc packet size error from [%s]");
+		return;
+	}
+	(void) memcpy(&row, packet, nbytes);
+
+	row.k_size = ntohs(row.k_size);
+	row.v_size = ntohs(row.v_size);
+	packet_length = MCC_PACKET_LENGTH(&row);
+	row.k_size = htons(row.k_size);
+	row.v_size = htons(row.v_size);
+
+	if (nbytes < packet_length || MCC_PACKET_SIZE < packet_length) {
+		mcc_listener_reject(ip, "mcc packet size error from [%s]");
+		return;
+	}
 
 	md5_init(&md5);
-	md5_append(&md5, (md5_byte_t *) row+sizeof (row->digest), packet_length - sizeof (row->digest));
+	md5_append(&md5, (md5_byte_t *) packet + sizeof (row.digest), packet_length - sizeof (row.digest));
 	md5_append(&md5, (md5_byte_t *) cache.secret, cache.secret_length);
-	md5_finish(&md5, (md5_byte_t *) row->digest);
+	md5_finish(&md5, (md5_byte_t *) our_digest);
 
-	rc = MCC_OK;
-
-	PTHREAD_MUTEX_LOCK(&cache.mutex);
-	for (table = cache.unicast_ip; *table != NULL; table++) {
-		if (socketWriteTo(cache.server, (unsigned char *) row, packet_length, *table) != packet_length)
-			rc = MCC_ERROR;
+	if (memcmp(our_digest, row.digest, sizeof (our_digest)) != 0) {
+		mcc_listener_reject(ip, "mcc digest error from [%s]");
+		mccNotesUpdate(ip, "md5=", "md5=N");
+		return;
 	}
-	PTHREAD_MUTEX_UNLOCK(&cache.mutex);
+	mccNotesUpdate(ip, "md5=", "md5=Y");
 
-	/* Restore our record. */
-	row->ttl = ntohl(row->ttl);
-	row->k_size = ntohs(row->k_size);
-	row->v_size = ntohs(row->v_size);
+	row.ttl = ntohl(row.ttl);
+	row.k_size = ntohs(row.k_size);
+	row.v_size = ntohs(row.v_size);
 
-	if (1 < debug)
-		syslog(LOG_DEBUG, "%s command=%c key=" MCC_FMT_K, __FUNCTION__, MCC_GET_COMMAND(row), MCC_FMT_K_ARG(row));
+	mcc_apply_push(ip, now, &row);
+}
 
-	return rc;
+typedef struct {
+	long length[MCC_RECV_MAX];
+	SocketAddress from[MCC_RECV_MAX];
+	unsigned char packet[MCC_RECV_MAX][MCC_BATCH_SIZE];
+} mcc_recv;
+
+/*
+ * Read as many waiting packets as possible with one system call.
+ * The socket is only shared with senders, which need no lock against
+ * a reader.
+ *
+ * @return
+ *	The number of packets read or -1 on error.
+ */
+static int
+mcc_listener_read(mcc_recv *recv)
+{
+#ifdef HAVE_RECVMMSG
+	int i, length;
+	struct iovec iov[MCC_RECV_MAX];
+	struct mmsghdr msgs[MCC_RECV_MAX];
+
+	for (i = 0; i < MCC_RECV_MAX; i++) {
+		iov[i].iov_base = (void *) recv->packet[i];
+		iov[i].iov_len = sizeof (recv->packet[i]);
+		memset(&msgs[i], 0, sizeof (msgs[i]));
+		msgs[i].msg_hdr.msg_name = (void *) &recv->from[i];
+		msgs[i].msg_hdr.msg_namelen = sizeof (recv->from[i]);
+		msgs[i].msg_hdr.msg_iov = &iov[i];
+		msgs[i].msg_hdr.msg_iovlen = 1;
+	}
+
+	if ((length = recvmmsg(socketGetFd(cache.server), msgs, MCC_RECV_MAX, MSG_DONTWAIT, NULL)) < 0)
+		return -1;
+
+	for (i = 0; i < length; i++)
+		recv->length[i] = msgs[i].msg_len;
+
+	return length;
+#else
+	recv->length[0] = socketReadFrom(cache.server, recv->packet[0], sizeof (recv->packet[0]), &recv->from[0]);
+
+	return recv->length[0] < 0 ? -1 : 1;
+#endif
 }
 
 static void *
 mcc_listener_thread(void *data)
 {
-	int cmd;
-	long nbytes;
-	md5_state_t md5;
-	mcc_handle *mcc;
-	int packet_length;
-	SocketAddress from;
-	mcc_row row, old_row;
-	mcc_key_hook **hooks, *hook;
-	unsigned char our_digest[16];
-	char ip[IPV6_STRING_SIZE], *listen_addr;
+	int i, length;
+	mcc_recv *recv;
+	char *listen_addr;
 
-	if ((mcc = mccCreate()) == NULL)
+	if ((recv = malloc(sizeof (*recv))) == NULL)
 		goto error0;
-	pthread_cleanup_push(mccDestroy, mcc);
+	pthread_cleanup_push(free, recv);
 
 	listen_addr = socketAddressToString(&cache.server->address);
 	pthread_cleanup_push(free, listen_addr);
 
 	syslog(LOG_INFO, "started mcc listener %s", listen_addr);
 
-	/* Silience "may be used uninitialized in this function" warning. */
-	nbytes = 0;
-
 	for (cache.is_running = 1; cache.is_running; ) {
 		if (!socketHasInput(cache.server, MCC_LISTENER_TIMEOUT)) {
 			if (1 < debug)
@@ -671,127 +2401,16 @@ mcc_listener_thread(void *data)
 			continue;
 		}
 
-		PTHREAD_MUTEX_LOCK(&cache.mutex);
-		nbytes = socketReadFrom(cache.server, (unsigned char *) &row, sizeof (row), &from);
-		PTHREAD_MUTEX_UNLOCK(&cache.mutex);
-
-		if (nbytes <= 0) {
-			syslog(LOG_ERR, "mcc socket read error: %s (%d)", strerror(errno), errno);
-			continue;
-		}
-
-		(void) socketAddressGetString(&from, 0, ip, sizeof (ip));
-
-		row.k_size = ntohs(row.k_size);
-		row.v_size = ntohs(row.v_size);
-		packet_length = MCC_PACKET_LENGTH(&row);
-		row.k_size = htons(row.k_size);
-		row.v_size = htons(row.v_size);
-
-		md5_init(&md5);
-		md5_append(&md5, (md5_byte_t *) &row + sizeof (row.digest), packet_length - sizeof (row.digest));
-		md5_append(&md5, (md5_byte_t *) cache.secret, cache.secret_length);
-		md5_finish(&md5, (md5_byte_t *) our_digest);
-
-		if (memcmp(our_digest, row.digest, sizeof (our_digest)) != 0) {
-			syslog(LOG_ERR, "mcc digest error from [%s]", ip);
-			mccNotesUpdate(ip, "md5=", "md5=N");
+		if ((length = mcc_listener_read(recv)) < 0) {
+			if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+				syslog(LOG_ERR, "mcc socket read error: %s (%d)", strerror(errno), errno);
 			continue;
 		}
-		mccNotesUpdate(ip, "md5=", "md5=Y");
-
-		row.ttl = ntohl(row.ttl);
-		row.k_size = ntohs(row.k_size);
-		row.v_size = ntohs(row.v_size);
-
-		(void) time(&row.expires);
-		mccUpdateActive(ip, (uint32_t *)&row.expires);
-		row.created = row.expires;
-		row.expires += row.ttl;
-
-		if (1 < debug) {
-			syslog(
-				LOG_DEBUG, "mcc from=[%s] cmd=%c key=" MCC_FMT_K,
-				ip, MCC_GET_COMMAND(&row), MCC_FMT_K_ARG(&row)
-			);
-		}
-
-		switch (cmd = MCC_GET_COMMAND(&row)) {
-			long add;
-
-		case MCC_CMD_ADD:
-			if (MCC_DATA_SIZE-1 <= MCC_GET_K_SIZE(&row) + MCC_GET_V_SIZE(&row)) {
-				syslog(LOG_ERR, "mcc size error key=" MCC_FMT_K, MCC_FMT_K_ARG(&row));
-				continue;
-			}
-			MCC_PTR_V(&row)[MCC_GET_V_SIZE(&row)] = '\0';
-			add = strtol((char *)MCC_PTR_V(&row), NULL, 10);
-			/*@fallthrough@*/
-
-			while (0)  {
-		case MCC_CMD_INC: add = +1; break;
-		case MCC_CMD_DEC: add = -1; break;
-			}
-
-			if (mccAddRowLocal(mcc, add, &row) != MCC_OK) {
-				syslog(LOG_ERR, "mcc put error key=" MCC_FMT_K, MCC_FMT_K_ARG(&row));
-				continue;
-			}
-			break;
-
-		case MCC_CMD_PUT:
-			/* Preserve created timestamp for an existing
-			 * row (see smtpf grey-listing).  Ignore row
-			 * not found and error; use the created value
-			 * assigned above.
-			 */
-			if (mccGetKey(mcc, (const unsigned char *) MCC_PTR_K(&row), MCC_GET_K_SIZE(&row), &old_row) == MCC_OK) {
-				row.created = old_row.created;
-			}
-			if (cache.hook.remote_replace != NULL
-			&& (*cache.hook.remote_replace)(mcc, NULL, NULL, &row)) {
-				continue;
-			}
-			if (mccPutRowLocal(mcc, &row) != MCC_OK) {
-				syslog(LOG_ERR, "mcc put error key=" MCC_FMT_K, MCC_FMT_K_ARG(&row));
-				continue;
-			}
-			break;
-
-		case MCC_CMD_REMOVE:
-			if (cache.hook.remote_remove != NULL
-			&& (*cache.hook.remote_remove)(mcc, NULL, NULL, &row)) {
-				continue;
-			}
-			if (mccDeleteKey(mcc, MCC_PTR_K(&row), MCC_GET_K_SIZE(&row)) != MCC_OK) {
-				syslog(LOG_ERR, "mcc remove error key=" MCC_FMT_K, MCC_FMT_K_ARG(&row));
-				continue;
-			}
-			break;
-
-		case MCC_CMD_OTHER:
-			/* Look for a matching prefix.
-			 *
-			 * NOTE that mcc->mutex is NOT locked around the loop
-			 * as the key_hooks that are called will manipulate
-			 * the cache using the MCC API which lock mcc->mutex
-			 * themselves.
-			 */
-			for (hooks = (mcc_key_hook **) VectorBase(cache.key_hooks); *hooks != NULL; hooks++) {
-				hook = *hooks;
-
-				if (hook->prefix_length <= MCC_GET_K_SIZE(&row)
-				&& memcmp(MCC_PTR_K(&row), hook->prefix, hook->prefix_length) == 0) {
-					(*hook->process)(mcc, hook, ip, &row);
-					break;
-				}
-			}
-			break;
 
-		default:
-			syslog(LOG_ERR, "mcc from=[%s] unknown cmd=%c", ip, cmd);
+		for (i = 0; i < length; i++) {
+			if (0 < recv->length[i])
+				mcc_listener_packet(&recv->from[i], recv->packet[i], recv->length[i]);
 		}
-
 	}
 
 	syslog(LOG_INFO, "mcc listener %s thread exit", listen_addr);
@@ -826,6 +2445,12 @@ mccStopListener(void)
 		(void) pthread_join(cache.listener, &rv);
 	}
 
+	/* Apply what the listener queued, then stop the apply threads.
+	 * These threads are never cancelled, since they could be in the
+	 * middle of a SQLite call holding its locks.
+	 */
+	mcc_apply_stop();
+
 	if (cache.unicast_ip != NULL) {
 		for (table = cache.unicast_ip; *table != NULL; table++)
 			free(*table);
@@ -954,6 +2579,10 @@ mccStartListener(const char **ip_array, int port)
 			goto error1;
 		}
 	}
+
+	if (mcc_apply_start())
+		goto error1;
+
 #ifdef HAVE_PTHREAD_ATTR_INIT
 	if (pthread_attr_init(&pthread_attr))
 		goto error1;
@@ -988,6 +2617,7 @@ int
 mccGetKey(mcc_handle *mcc, const unsigned char *key, unsigned length, mcc_row *row)
 {
 	int rc;
+	struct mcc_store *store;
 
 	rc = MCC_ERROR;
 
@@ -997,6 +2627,12 @@ mccGetKey(mcc_handle *mcc, const unsigned char *key, unsigned length, mcc_row *r
 	if (1 < debug)
 		syslog(LOG_DEBUG, "%s key=%.*s", __FUNCTION__, length, key);
 
+	if ((store = cache.store) != NULL) {
+		if ((rc = mcc_store_get(store, key, length, row)) != MCC_STOPPED)
+			return rc;
+		rc = MCC_ERROR;
+	}
+
 	if (sqlite3_bind_text(mcc->select_one, 1, (const char *) key, length, SQLITE_STATIC) != SQLITE_OK)
 		goto error0;
 
@@ -1099,10 +2735,14 @@ mccPutKeyValue(mcc_handle *mcc, const char *key, const char *value, unsigned lon
 int
 mccAddRowLocal(mcc_handle *mcc, long add, mcc_row *row)
 {
-	int length;
+	int rc, length;
+	struct mcc_store *store;
 	time_t expires;
 	long number = 0;
 
+	if ((store = cache.store) != NULL && (rc = mcc_store_add(store, add, row)) != MCC_STOPPED)
+		return rc;
+
 	/* Save expires timestamp for mccPutRowLocal(). */
 	expires = row->expires;
 
@@ -1193,10 +2833,19 @@ mccDeleteRow(mcc_handle *mcc, mcc_row *row)
 	return mccDeleteRowLocal(mcc, row);
 }
 
+void
+mccSetExpireSlice(unsigned ms)
+{
+	cache.expire_slice_ms = ms;
+}
+
 int
 mccExpireRows(mcc_handle *mcc, time_t *when)
 {
 	int rc;
+	unsigned slice_ms;
+	unsigned long rows, deadline;
+	struct mcc_store *store;
 
 	rc = MCC_ERROR;
 
@@ -1210,8 +2859,34 @@ mccExpireRows(mcc_handle *mcc, time_t *when)
 		goto error0;
 	if (cache.hook.expire != NULL && (*cache.hook.expire)(mcc, NULL))
 		goto error1;
-	if (mccSqlStep(mcc, mcc->expire, MCC_SQL_EXPIRE) == SQLITE_DONE)
-		rc = MCC_OK;
+	if ((store = cache.store) != NULL)
+		mcc_store_expire(store, *when);
+	if (sqlite3_bind_int(mcc->expire, 2, MCC_EXPIRE_ROWS) != SQLITE_OK)
+		goto error1;
+
+	/* Rather than one DELETE holding the write lock until every
+	 * expired row is gone, delete MCC_EXPIRE_ROWS at a time and
+	 * pause after each slice of steps.
+	 */
+	slice_ms = cache.expire_slice_ms;
+	deadline = timerMonotonicMs() + slice_ms;
+
+	for (rows = 0; ; ) {
+		if (mccSqlStep(mcc, mcc->expire, MCC_SQL_EXPIRE) != SQLITE_DONE)
+			goto error1;
+		if (sqlite3_changes(mcc->db) < MCC_EXPIRE_ROWS)
+			break;
+		rows += MCC_EXPIRE_ROWS;
+
+		if (0 < slice_ms && deadline <= timerMonotonicMs()) {
+			if (1 < debug)
+				syslog(LOG_DEBUG, "%s slice rows=%lu", __FUNCTION__, rows);
+			pthreadSleep(slice_ms / UNIT_MILLI, (slice_ms % UNIT_MILLI) * UNIT_MICRO);
+			deadline = timerMonotonicMs() + slice_ms;
+		}
+	}
+
+	rc = MCC_OK;
 error1:
 	(void) sqlite3_clear_bindings(mcc->expire);
 error0:
@@ -1222,14 +2897,18 @@ int
 mccDeleteAll(mcc_handle *mcc)
 {
 	int rc;
+	struct mcc_store *store;
 
 	rc = MCC_ERROR;
 
 	if (mcc == NULL)
 		goto error0;
 
-	if (mccSqlStep(mcc, mcc->truncate, MCC_SQL_TRUNCATE) == SQLITE_DONE)
+	if ((store = cache.store) != NULL && mcc_store_truncate(store) == MCC_OK) {
 		rc = MCC_OK;
+	} else if (mccSqlStep(mcc, mcc->truncate, MCC_SQL_TRUNCATE) == SQLITE_DONE) {
+		rc = MCC_OK;
+	}
 error0:
 	return rc;
 }
@@ -1238,6 +2917,7 @@ int
 mccSetSecret(const char *secret)
 {
 	char *copy;
+	md5_state_t md5;
 
 	if ((copy = strdup(secret)) == NULL)
 		return MCC_ERROR;
@@ -1246,6 +2926,11 @@ mccSetSecret(const char *secret)
 	cache.secret = copy;
 	cache.secret_length = strlen(copy);
 
+	/* The batch MAC key is derived from the shared secret. */
+	md5_init(&md5);
+	md5_append(&md5, (md5_byte_t *) cache.secret, cache.secret_length);
+	md5_finish(&md5, (md5_byte_t *) cache.secret_key);
+
 	return MCC_OK;
 }
 
@@ -1328,16 +3013,41 @@ error1:
 	return MCC_OK;
 }
 
+static void
+mcc_apply_lock(int lock)
+{
+	unsigned i;
+
+	if (cache.apply != NULL) {
+		for (i = 0; i < cache.apply_count; i++) {
+			if (cache.apply[i] == NULL)
+				continue;
+			if (lock)
+				(void) pthread_mutex_lock(&cache.apply[i]->mutex);
+			else
+				(void) pthread_mutex_unlock(&cache.apply[i]->mutex);
+		}
+	}
+}
+
 void
 mccAtForkPrepare(void)
 {
 	(void) pthread_mutex_lock(&cache.mutex);
 	(void) pthread_mutex_lock(&cache.active_mutex);
+	mcc_store_lock(cache.store);
+	if (cache.batch != NULL)
+		(void) pthread_mutex_lock(&cache.batch->mutex);
+	mcc_apply_lock(1);
 }
 
 void
 mccAtForkParent(void)
 {
+	mcc_apply_lock(0);
+	if (cache.batch != NULL)
+		(void) pthread_mutex_unlock(&cache.batch->mutex);
+	mcc_store_unlock(cache.store);
 	(void) pthread_mutex_unlock(&cache.active_mutex);
 	(void) pthread_mutex_unlock(&cache.mutex);
 }
@@ -1345,9 +3055,31 @@ mccAtForkParent(void)
 void
 mccAtForkChild(void)
 {
+	unsigned i;
+
+	if (cache.apply != NULL) {
+		mcc_apply_lock(0);
+		/* No apply threads in the child, see mcc_apply_stop(). */
+		for (i = 0; i < cache.apply_count; i++) {
+			if (cache.apply[i] != NULL)
+				cache.apply[i]->running = 0;
+		}
+	}
+	if (cache.batch != NULL) {
+		(void) pthread_mutex_unlock(&cache.batch->mutex);
+		/* No batch thread in the child, see mccStopBatch(). */
+		cache.batch->running = 0;
+	}
+	mcc_store_unlock(cache.store);
 	(void) pthread_mutex_unlock(&cache.active_mutex);
 	(void) pthread_mutex_unlock(&cache.mutex);
 
+	/* The flush thread is not in the child; mccStopWriteBehind()
+	 * will flush from the calling thread instead.
+	 */
+	if (cache.store != NULL)
+		cache.store->running = 0;
+
 	(void) pthread_mutex_destroy(&cache.active_mutex);
 	(void) pthread_mutex_destroy(&cache.mutex);
 
@@ -1431,12 +3163,26 @@ error0:
 void
 mccFini(void)
 {
+	struct mcc_batch *batch;
+	struct mcc_store *store;
+
 	if (0 < debug)
 		syslog(LOG_DEBUG, "%s", __FUNCTION__);
 
 	/* Stop these threads before releasing the rest. */
+	mccStopBatch();
 	mccStopListener();
 	mccStopGc();
+	mccStopWriteBehind();
+
+	for ( ; cache.batches_stopped != NULL; cache.batches_stopped = batch) {
+		batch = cache.batches_stopped->next;
+		mcc_batch_free(cache.batches_stopped);
+	}
+	for ( ; cache.stores_stopped != NULL; cache.stores_stopped = store) {
+		store = cache.stores_stopped->next;
+		mcc_store_free(cache.stores_stopped);
+	}
 
 	mcc_active_cleanup(cache.active);
 	VectorDestroy(cache.key_hooks);
@@ -1450,6 +3196,7 @@ int
 mccInit(const char *path, mcc_hooks *hooks)
 {
 	memset(&cache, 0, sizeof (cache));
+	cache.expire_slice_ms = MCC_EXPIRE_SLICE_MS;
 
 	if ((cache.path = strdup(path)) == NULL) {
 		syslog(LOG_ERR, log_error, __FILE__, __LINE__, strerror(errno), errno);
@@ -1511,11 +3258,14 @@ error0:
 #undef MCC_CACHE_TTL
 #define MCC_CACHE_TTL		300
 
-static const char usage_opt[] = "Lg:i:p:s:t:v";
+static const char usage_opt[] = "a:b:Lg:i:p:s:t:vw:";
 
 static char usage[] =
-"usage: mcc [-Lv][-g seconds][-i list][-p port][-s secret][-t seconds] db.sq3\n"
+"usage: mcc [-Lv][-a threads][-b ms][-g seconds][-i list][-p port][-s secret]\n"
+"\t[-t seconds][-w seconds] db.sq3\n"
 "\n"
+"-a threads\tnumber of threads applying received rows; default 1\n"
+"-b ms\t\tsend batch packets, holding row changes up to ms\n"
 "-g seconds\tGC thread interval\n"
 "-i list\t\tcomma separated list of multicast and/or unicast hosts\n"
 "-L\t\tallow multicast loopback\n"
@@ -1523,6 +3273,7 @@ static char usage[] =
 "-s secret\tshared secret for packet validation\n"
 "-t seconds\tcache time-to-live in seconds per record; default " QUOTE(MCC_CACHE_TTL) "\n"
 "-v\t\tverbose logging to the user log\n"
+"-w seconds\tkeep rows in memory, writing changes behind to SQLite\n"
 "\n"
 "Standard input are commands of the form:\n"
 "\n"
@@ -1533,6 +3284,7 @@ static char usage[] =
 "ADD key number\n"
 "DEC key\n"
 "INC key\n"
+"STAT\n"
 "QUIT\n"
 "\n"
 "Note that a key cannot contain whitespace, while the value may.\n"
@@ -1544,6 +3296,9 @@ LIBSNERT_COPYRIGHT "\n"
 
 static char *cache_secret;
 static unsigned gc_period;
+static unsigned write_behind;
+static unsigned batch_ms;
+static unsigned apply_threads;
 static int multicast_loopback;
 
 static Vector unicast_list = NULL;
@@ -1621,6 +3376,15 @@ main(int argc, char **argv)
 		case 'v':
 			++debug;
 			break;
+		case 'w':
+			write_behind = (unsigned) strtol(optarg, NULL, 10);
+			break;
+		case 'b':
+			batch_ms = (unsigned) strtol(optarg, NULL, 10);
+			break;
+		case 'a':
+			apply_threads = (unsigned) strtol(optarg, NULL, 10);
+			break;
 		default:
 			(void) fprintf(stderr, usage);
 			exit(EX_USAGE);
@@ -1660,30 +3424,37 @@ main(int argc, char **argv)
 
 	/* Get a database handle.  If database doesn't exist it will
 	 * be created while we're still single threaded.  mccCreate is
-	 * also called by mcc_listener_thread to get a handle, however,
+	 * also called by mccStartListener for each apply thread, however,
 	 * the database should already be created to avoid locking
 	 * conflict between threads.
 	 */
 	if ((mcc = mccCreate()) == NULL)
 		goto error0;
 
+	if (0 < write_behind && mccStartWriteBehind(write_behind) == MCC_ERROR)
+		goto error1;
 	if (0 < gc_period)
 		mccStartGc(gc_period);
 	if (cache_secret != NULL)
 		mccSetSecret(cache_secret);
+	if (0 < apply_threads)
+		mccSetApplyThreads(apply_threads);
 	if (mccStartListener((const char **) VectorBase(unicast_list), unicast_listener_port) == MCC_ERROR)
 		goto error1;
 	if (multicast_loopback)
 		(void) socketMulticastLoopback(cache.server, 1);
+	if (0 < batch_ms && mccStartBatch(batch_ms) == MCC_ERROR)
+		goto error1;
 	syslog(LOG_INFO, "mcc " LIBSNERT_COPYRIGHT);
 
 	rc = EXIT_SUCCESS;
 
 	for (lineno = 1; 0 <= (length = TextInputLine2(stdin, buffer, sizeof (buffer), 0)); lineno++) {
-		enum { IDX_QUIT, IDX_GET, IDX_PUT, IDX_RESET, IDX_DEL, IDX_ADD, IDX_INC, IDX_DEC };
+		enum { IDX_QUIT, IDX_GET, IDX_PUT, IDX_RESET, IDX_DEL, IDX_ADD, IDX_INC, IDX_DEC, IDX_STAT };
 		static char *commands[] = {
-			"quit", "get", "put", "reset", "del", "add", "inc", "dec",  NULL
+			"quit", "get", "put", "reset", "del", "add", "inc", "dec", "stat", NULL
 		};
+		mcc_listener_stats stats;
 		char **cmd;
 
 		if (length == 0 || buffer[0] == '#')
@@ -1727,6 +3498,15 @@ main(int argc, char **argv)
 		}
 		if (cmd == commands)
 			break;
+		if (cmd - commands == IDX_STAT) {
+			mccGetListenerStats(&stats);
+			printf(
+				"received=%lu dropped=%lu rejected=%lu queued=%lu\n",
+				stats.received, stats.dropped, stats.rejected, stats.queued
+			);
+			fflush(stdout);
+			continue;
+		}
 
 		switch (mccGetKey(mcc, MCC_PTR_K(&new_row), MCC_GET_K_SIZE(&new_row), &old_row)) {
 		case MCC_OK:
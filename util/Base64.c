@@ -12,6 +12,7 @@
 
 #include <com/snert/lib/version.h>
 #include <com/snert/lib/util/Base64.h>
+#include <com/snert/lib/util/b64.h>
 
 #ifdef DEBUG_MALLOC
 # include <com/snert/lib/util/DebugMalloc.h>
@@ -255,6 +256,7 @@ Base64DecodeBuffer(Base64 self, const char *s, long slength, char **t, long *tle
 {
 	long i;
 	int octet;
+	size_t n;
 	char *octets;
 
 	if (s == NULL || slength < 4 || t == NULL || tlength == NULL)
@@ -269,6 +271,17 @@ Base64DecodeBuffer(Base64 self, const char *s, long slength, char **t, long *tle
 	*t = octets;
 
 	for (i = 0; i < slength; i++) {
+		if (self->_state == START || self->_state == DECODE_A) {
+			/* Whole quanta in bulk, the rest one character at a time. */
+			n = b64DecodeQuanta((unsigned char *) s + i, slength - i, (unsigned char *) octets + *tlength, slength - slength/4 - *tlength);
+			if (0 < n) {
+				self->_state = DECODE_A;
+				*tlength += n / 4 * 3;
+				if (slength <= (i += n))
+					break;
+			}
+		}
+
 		octet = Base64Decode(self, s[i]);
 		switch (octet) {
 		case BASE64_EOF:
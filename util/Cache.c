@@ -18,6 +18,7 @@
 #include <sys/stat.h>
 
 #include <com/snert/lib/io/posix.h>
+#include <com/snert/lib/sys/pthread.h>
 #include <com/snert/lib/type/Data.h>
 #include <com/snert/lib/type/Hash.h>
 #include <com/snert/lib/util/Cache.h>
@@ -36,11 +37,38 @@
 
 #define REF_CACHE(v)		((Cache)(v))
 
+#ifndef CACHE_SHARDED_SIZE
+#define CACHE_SHARDED_SIZE	(64 * 1024)	/* default entries */
+#endif
+
 /***********************************************************************
  *** Class variables.
  ***********************************************************************/
 
 static int debug = 0;
+static unsigned long sharded_size = CACHE_SHARDED_SIZE;
+
+/***********************************************************************
+ *** Common instance methods
+ ***********************************************************************/
+
+/*
+ * Handlers without a native lookup copy the value with get and
+ * destroy it once the function has seen it.
+ */
+static int
+CacheLookupStub(Cache self, Data key, void (*function)(Data value, void *data), void *data)
+{
+	Data value;
+
+	if ((value = self->get(self, key)) == NULL)
+		return -1;
+
+	(*function)(value, data);
+	value->destroy(value);
+
+	return 0;
+}
 
 /***********************************************************************
  *** Hash instance methods
@@ -63,6 +91,16 @@ CacheHashGet(Cache self, Data key)
 	return value->clone(value);
 }
 
+static int
+CacheHashLookup(Cache self, Data key, void (*function)(Data value, void *data), void *data)
+{
+	Object value = HashGet(self->_cache, key);
+	if (value == NULL)
+		return -1;
+	(*function)((Data) value, data);
+	return 0;
+}
+
 static long
 CacheHashSize(Cache self)
 {
@@ -135,6 +173,16 @@ CachePropGet(Cache self, Data key)
 	return value->clone(value);
 }
 
+static int
+CachePropLookup(Cache self, Data key, void (*function)(Data value, void *data), void *data)
+{
+	Data value = PropertiesGetData(self->_cache, key);
+	if (value == NULL)
+		return -1;
+	(*function)(value, data);
+	return 0;
+}
+
 static long
 CachePropSize(Cache self)
 {
@@ -187,6 +235,415 @@ CachePropDestroy(void *self)
 	free(self);
 }
 
+/***********************************************************************
+ *** Sharded instance methods
+ ***********************************************************************/
+
+/*
+ * A bounded, thread-safe cache. Keys are spread over CACHE_SHARDS
+ * independent tables, each with its own mutex, so that threads
+ * working on different keys rarely contend and callers need no lock
+ * of their own. Each shard holds a fixed number of entries; once full,
+ * a CLOCK hand sweeps the shard's slots, sparing those referenced
+ * since its last pass, and evicts the first one that was not.
+ */
+#ifndef CACHE_SHARD_BITS
+#define CACHE_SHARD_BITS	6
+#endif
+
+#define CACHE_SHARDS		(1 << CACHE_SHARD_BITS)
+
+typedef struct cache_entry {
+	struct cache_entry *next;
+	unsigned long hash;
+	unsigned long slot;
+	int referenced;
+	struct data key;
+	struct data value;
+} CacheEntry;
+
+typedef struct {
+	pthread_mutex_t mutex;
+	unsigned long hand;		/* next slot the clock visits */
+	unsigned long length;		/* entries in use */
+	unsigned long capacity;		/* length of slots[] and free[] */
+	unsigned long buckets;		/* power of 2 */
+	unsigned long unused;		/* entries on the free[] stack */
+	unsigned long *free;
+	CacheEntry **slots;
+	CacheEntry **table;
+} CacheShard;
+
+typedef struct {
+	CacheShard shard[CACHE_SHARDS];
+} CacheSharded;
+
+#define SHARD(c, h)	(&((CacheSharded *) (c)->_cache)->shard[(h) & (CACHE_SHARDS-1)])
+#define BUCKET(s, h)	(&(s)->table[((h) >> CACHE_SHARD_BITS) & ((s)->buckets-1)])
+
+/*
+ * D.J. Bernstien Hash version 2 (+ replaced by ^), with a final
+ * mix so that both the shard and the bucket bits are well spread.
+ */
+static unsigned long
+CacheShardedHash(unsigned char *buffer, long size)
+{
+	unsigned long hash = 5381;
+
+	while (0 < size--)
+		hash = ((hash << 5) + hash) ^ *buffer++;
+
+	hash ^= hash >> 16;
+	hash *= 0x45d9f3bUL;
+	hash ^= hash >> 16;
+
+	return hash;
+}
+
+static CacheEntry **
+CacheShardedFind(CacheShard *shard, unsigned long hash, Data key)
+{
+	CacheEntry **prev, *entry;
+
+	for (prev = BUCKET(shard, hash); (entry = *prev) != NULL; prev = &entry->next) {
+		if (entry->hash == hash && entry->key._length == key->length(key)
+		&& memcmp(entry->key._base, key->base(key), entry->key._length) == 0)
+			break;
+	}
+
+	return prev;
+}
+
+/*
+ * Unlink and free the entry at *prev, releasing its slot.
+ */
+static void
+CacheShardedDrop(CacheShard *shard, CacheEntry **prev)
+{
+	CacheEntry *entry = *prev;
+
+	*prev = entry->next;
+	shard->slots[entry->slot] = NULL;
+	shard->free[shard->unused++] = entry->slot;
+	shard->length--;
+	free(entry);
+}
+
+/*
+ * Sweep the clock until it finds an entry not referenced since its
+ * last pass and evict it. Only called when the shard is full, so
+ * there are no empty slots to step over.
+ */
+static void
+CacheShardedEvict(CacheShard *shard)
+{
+	CacheEntry *entry;
+
+	for (;;) {
+		entry = shard->slots[shard->hand];
+		shard->hand = (shard->hand + 1) % shard->capacity;
+
+		if (entry->referenced) {
+			entry->referenced = 0;
+			continue;
+		}
+
+		CacheShardedDrop(shard, CacheShardedFind(shard, entry->hash, &entry->key));
+		break;
+	}
+}
+
+static Data
+CacheShardedGet(Cache self, Data key)
+{
+	Data value;
+	CacheEntry *entry;
+	CacheShard *shard;
+	unsigned long hash;
+
+	value = NULL;
+	hash = CacheShardedHash(key->base(key), key->length(key));
+	shard = SHARD(self, hash);
+
+	PTHREAD_MUTEX_LOCK(&shard->mutex);
+
+	if ((entry = *CacheShardedFind(shard, hash, key)) != NULL) {
+		entry->referenced = 1;
+		value = DataCreateCopyBytes(entry->value._base, entry->value._length);
+	}
+
+	PTHREAD_MUTEX_UNLOCK(&shard->mutex);
+
+	return value;
+}
+
+static int
+CacheShardedLookup(Cache self, Data key, void (*function)(Data value, void *data), void *data)
+{
+	int rc;
+	CacheEntry *entry;
+	CacheShard *shard;
+	unsigned long hash;
+
+	rc = -1;
+	hash = CacheShardedHash(key->base(key), key->length(key));
+	shard = SHARD(self, hash);
+
+	PTHREAD_MUTEX_LOCK(&shard->mutex);
+
+	/* Pass by reference while the entry is held by the lock. */
+	if ((entry = *CacheShardedFind(shard, hash, key)) != NULL) {
+		entry->referenced = 1;
+		(*function)(&entry->value, data);
+		rc = 0;
+	}
+
+	PTHREAD_MUTEX_UNLOCK(&shard->mutex);
+
+	return rc;
+}
+
+static int
+CacheShardedPut(Cache self, Data key, Data value)
+{
+	int rc;
+	CacheShard *shard;
+	unsigned long hash;
+	CacheEntry **prev, *entry;
+	long klen, vlen;
+
+	rc = -1;
+	klen = key->length(key);
+	vlen = value->length(value);
+	hash = CacheShardedHash(key->base(key), klen);
+	shard = SHARD(self, hash);
+
+	/* Copy by value, NUL terminated for the benefit of C strings. */
+	if ((entry = malloc(sizeof (*entry) + klen + vlen + 2)) == NULL)
+		goto error0;
+
+	entry->hash = hash;
+	entry->referenced = 0;
+	DataInitWithBytes(&entry->key, (unsigned char *) &entry[1], klen);
+	memcpy(entry->key._base, key->base(key), klen);
+	entry->key._base[klen] = '\0';
+	DataInitWithBytes(&entry->value, entry->key._base + klen + 1, vlen);
+	memcpy(entry->value._base, value->base(value), vlen);
+	entry->value._base[vlen] = '\0';
+
+	PTHREAD_MUTEX_LOCK(&shard->mutex);
+
+	/* Replace an existing entry in its slot. */
+	if (*(prev = CacheShardedFind(shard, hash, key)) != NULL)
+		CacheShardedDrop(shard, prev);
+	else if (shard->capacity <= shard->length)
+		CacheShardedEvict(shard);
+
+	entry->slot = shard->free[--shard->unused];
+	shard->slots[entry->slot] = entry;
+	entry->next = *BUCKET(shard, hash);
+	*BUCKET(shard, hash) = entry;
+	shard->length++;
+	rc = 0;
+
+	PTHREAD_MUTEX_UNLOCK(&shard->mutex);
+error0:
+	return rc;
+}
+
+static int
+CacheShardedRemove(Cache self, Data key)
+{
+	int rc;
+	CacheShard *shard;
+	unsigned long hash;
+	CacheEntry **prev;
+
+	rc = -1;
+	hash = CacheShardedHash(key->base(key), key->length(key));
+	shard = SHARD(self, hash);
+
+	PTHREAD_MUTEX_LOCK(&shard->mutex);
+
+	if (*(prev = CacheShardedFind(shard, hash, key)) != NULL) {
+		CacheShardedDrop(shard, prev);
+		rc = 0;
+	}
+
+	PTHREAD_MUTEX_UNLOCK(&shard->mutex);
+
+	return rc;
+}
+
+/*
+ * Each shard is locked in turn, not the whole cache. The function
+ * may not call back into the same cache.
+ */
+static int
+CacheShardedWalk(Cache self, int (*function)(void *key, void *value, void *data), void *data)
+{
+	int stop;
+	unsigned long i;
+	CacheShard *shard;
+	CacheEntry *entry;
+
+	for (stop = 0, shard = SHARD(self, 0); !stop && shard < SHARD(self, 0) + CACHE_SHARDS; shard++) {
+		PTHREAD_MUTEX_LOCK(&shard->mutex);
+
+		for (i = 0; i < shard->capacity; i++) {
+			if ((entry = shard->slots[i]) == NULL)
+				continue;
+
+			switch ((*function)(&entry->key, &entry->value, data)) {
+			case 0:
+				stop = 1;
+				break;
+			case -1:
+				CacheShardedDrop(shard, CacheShardedFind(shard, entry->hash, &entry->key));
+				continue;
+			default:
+				continue;
+			}
+			break;
+		}
+
+		PTHREAD_MUTEX_UNLOCK(&shard->mutex);
+	}
+
+	return 0;
+}
+
+static void
+CacheShardedClear(CacheShard *shard)
+{
+	unsigned long i;
+
+	for (i = 0; i < shard->capacity; i++) {
+		free(shard->slots[i]);
+		shard->slots[i] = NULL;
+		shard->free[i] = shard->capacity - 1 - i;
+	}
+	for (i = 0; i < shard->buckets; i++)
+		shard->table[i] = NULL;
+
+	shard->unused = shard->capacity;
+	shard->length = 0;
+	shard->hand = 0;
+}
+
+static int
+CacheShardedRemoveAll(Cache self)
+{
+	CacheShard *shard;
+
+	for (shard = SHARD(self, 0); shard < SHARD(self, 0) + CACHE_SHARDS; shard++) {
+		PTHREAD_MUTEX_LOCK(&shard->mutex);
+		CacheShardedClear(shard);
+		PTHREAD_MUTEX_UNLOCK(&shard->mutex);
+	}
+
+	return 0;
+}
+
+static long
+CacheShardedSize(Cache self)
+{
+	long size;
+	CacheShard *shard;
+
+	size = 0;
+	for (shard = SHARD(self, 0); shard < SHARD(self, 0) + CACHE_SHARDS; shard++) {
+		PTHREAD_MUTEX_LOCK(&shard->mutex);
+		size += shard->length;
+		PTHREAD_MUTEX_UNLOCK(&shard->mutex);
+	}
+
+	return size;
+}
+
+static int
+CacheShardedIsEmpty(Cache self)
+{
+	return CacheShardedSize(self) == 0;
+}
+
+static int
+CacheShardedSync(Cache self)
+{
+	/* Do nothing. */
+	return 0;
+}
+
+static void
+CacheShardedFree(CacheSharded *sharded, int shards)
+{
+	unsigned long i;
+	CacheShard *shard;
+
+	if (sharded != NULL) {
+		for (shard = sharded->shard; shard < sharded->shard + shards; shard++) {
+			if (shard->slots != NULL) {
+				for (i = 0; i < shard->capacity; i++)
+					free(shard->slots[i]);
+			}
+			free(shard->slots);
+			free(shard->table);
+			free(shard->free);
+			(void) pthread_mutex_destroy(&shard->mutex);
+		}
+		free(sharded);
+	}
+}
+
+static void
+CacheShardedDestroy(void *self)
+{
+	CacheShardedFree(REF_CACHE(self)->_cache, CACHE_SHARDS);
+	free(REF_CACHE(self)->_name);
+	free(self);
+}
+
+static CacheSharded *
+CacheShardedCreate(unsigned long entries)
+{
+	int i;
+	CacheShard *shard;
+	CacheSharded *sharded;
+
+	if ((sharded = calloc(1, sizeof (*sharded))) == NULL)
+		goto error0;
+
+	/* Round up so that every shard holds at least one entry. */
+	entries = (entries + CACHE_SHARDS - 1) / CACHE_SHARDS;
+	if (entries < 1)
+		entries = 1;
+
+	for (i = 0; i < CACHE_SHARDS; i++) {
+		shard = &sharded->shard[i];
+		if (pthread_mutex_init(&shard->mutex, NULL))
+			goto error1;
+
+		shard->capacity = entries;
+		for (shard->buckets = 1; shard->buckets < entries; shard->buckets <<= 1)
+			;
+
+		if ((shard->slots = calloc(entries, sizeof (*shard->slots))) == NULL
+		||  (shard->free = calloc(entries, sizeof (*shard->free))) == NULL
+		||  (shard->table = calloc(shard->buckets, sizeof (*shard->table))) == NULL) {
+			i++;
+			goto error1;
+		}
+
+		CacheShardedClear(shard);
+	}
+
+	return sharded;
+error1:
+	CacheShardedFree(sharded, i);
+error0:
+	return NULL;
+}
+
 /***********************************************************************
  *** Berkeley DB instance methods
  ***********************************************************************/
@@ -693,13 +1150,20 @@ CacheSetDebug(int flag)
 	debug = flag;
 }
 
+void
+CacheSetShardedSize(unsigned long entries)
+{
+	sharded_size = 0 < entries ? entries : CACHE_SHARDED_SIZE;
+}
+
 Cache
 CacheCreate(const char *handler, const char *name)
 {
 	Cache cache;
+	struct data model;
 
 	if (handler == NULL || *handler == '\0')
-		goto error0;
+		handler = DEFAULT_HANDLER;
 
 	if ((cache = malloc(sizeof (*cache))) == NULL)
 		goto error0;
@@ -709,9 +1173,11 @@ CacheCreate(const char *handler, const char *name)
 
 	ObjectInit(cache);
 	cache->objectName = "Cache";
-	cache->objectMethodCount += 9;
+	cache->objectMethodCount += 10;
 	cache->objectSize = sizeof (*cache);
 	cache->setDebug = CacheSetDebug;
+	cache->lookup = CacheLookupStub;
+	cache->_cache = NULL;
 
 	if (TextInsensitiveCompare(handler, "bdb") == 0) {
 #if defined(HAVE_DB_H)
@@ -753,6 +1219,7 @@ CacheCreate(const char *handler, const char *name)
 		cache->size = CachePropSize;
 		cache->sync = CachePropSync;
 		cache->walk = CachePropWalk;
+		cache->lookup = CachePropLookup;
 	} else if (TextInsensitiveCompare(handler, "hash") == 0) {
 		cache->_cache = HashCreate();
 
@@ -765,6 +1232,22 @@ CacheCreate(const char *handler, const char *name)
 		cache->size = CacheHashSize;
 		cache->sync = CacheHashSync;
 		cache->walk = CacheHashWalk;
+		cache->lookup = CacheHashLookup;
+	} else if (TextInsensitiveCompare(handler, "sharded") == 0) {
+		/* Initialise Data's model while still single threaded. */
+		DataInit(&model);
+		cache->_cache = CacheShardedCreate(sharded_size);
+
+		cache->destroy = CacheShardedDestroy;
+		cache->get = CacheShardedGet;
+		cache->isEmpty = CacheShardedIsEmpty;
+		cache->put = CacheShardedPut;
+		cache->remove = CacheShardedRemove;
+		cache->removeAll = CacheShardedRemoveAll;
+		cache->size = CacheShardedSize;
+		cache->sync = CacheShardedSync;
+		cache->walk = CacheShardedWalk;
+		cache->lookup = CacheShardedLookup;
 	}
 
 	if (cache->_cache == NULL)
@@ -808,6 +1291,12 @@ isNotNull(void *ptr)
 	printf("OK\n");
 }
 
+void
+lookupValue(Data value, void *data)
+{
+	/* Do nothing. */
+}
+
 int
 printKeyValue(void *key, void *value, void *data)
 {
@@ -817,6 +1306,34 @@ printKeyValue(void *key, void *value, void *data)
 	return 1;
 }
 
+void
+TestEviction(Cache cache, long max)
+{
+	long i;
+	struct data k, v;
+	char key[40];
+
+	for (i = 0; i < max * 4; i++) {
+		snprintf(key, sizeof (key), "key%ld", i);
+		DataInitWithBytes(&k, (unsigned char *) key, strlen(key));
+		DataInitWithBytes(&v, (unsigned char *) key, strlen(key));
+		if (cache->put(cache, &k, &v)) {
+			printf("put...FAIL\n");
+			exit(1);
+		}
+
+		/* Keep key0 referenced, so the clock spares it. */
+		DataInitWithBytes(&k, (unsigned char *) "key0", 4);
+		if (cache->lookup(cache, &k, lookupValue, NULL)) {
+			printf("key0 evicted...FAIL\n");
+			exit(1);
+		}
+	}
+
+	printf("size=%ld max=%ld...%s\n", cache->size(cache), max, max < cache->size(cache) ? "FAIL" : "OK");
+	cache->destroy(cache);
+}
+
 void
 TestCache(Cache cache)
 {
@@ -873,6 +1390,15 @@ main(int argc, char **argv)
 	isNotNull(a = CacheCreate("hash", "cache.hash"));
 	TestCache(a);
 
+	printf("\ncreate sharded cache...");
+	isNotNull(a = CacheCreate("sharded", "cache.sharded"));
+	TestCache(a);
+
+	printf("\nsharded cache eviction...");
+	CacheSetShardedSize(256);
+	isNotNull(a = CacheCreate("sharded", "cache.sharded"));
+	TestEviction(a, 256);
+
 	printf("\ncreate bdb cache...");
 	if ((a = CacheCreate("bdb", "cache.bdb")) == NULL) {
 		printf("FAIL (no BDB support maybe)\n");
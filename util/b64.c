@@ -12,8 +12,19 @@
 
 #include <com/snert/lib/version.h>
 #include <stdlib.h>
+#include <string.h>
 #include <com/snert/lib/util/b64.h>
 
+#if defined(__GNUC__) && defined(__SSE2__)
+# define B64_SSE2
+# include <emmintrin.h>
+/* AVX2 is selected at run time, so the library does not need -mavx2. */
+# if (defined(__x86_64__) || defined(__i386__)) && (4 < __GNUC__ || (__GNUC__ == 4 && 9 <= __GNUC_MINOR__) || defined(__clang__))
+#  define B64_AVX2
+#  include <immintrin.h>
+# endif
+#endif
+
 /***********************************************************************
  *** Base 64 Decoding
  ***********************************************************************/
@@ -226,7 +237,7 @@ int
 b64DecodeBuffer(B64 *b64, const char *input, size_t in_length, unsigned char *output, size_t out_size, size_t *out_length)
 {
 	int octet;
-	size_t ilen, olen;
+	size_t ilen, olen, n;
 
 	if (b64 == NULL || output == NULL || out_size == 0)
 		return BASE64_ERROR;
@@ -242,6 +253,13 @@ b64DecodeBuffer(B64 *b64, const char *input, size_t in_length, unsigned char *ou
 		if (out_size <= olen)
 			break;
 
+		/* Whole quanta in bulk, the rest one character at a time. */
+		n = b64DecodeBlock(b64, (unsigned char *) input + ilen, in_length - ilen, output + olen, out_size - olen);
+		olen += n / 4 * 3;
+		ilen += n;
+		if (in_length <= ilen || out_size <= olen)
+			break;
+
 		if ((octet = b64Decode(b64, input[ilen])) == BASE64_NEXT)
 			continue;
 		if (octet == BASE64_ERROR)
@@ -261,6 +279,345 @@ b64DecodeBuffer(B64 *b64, const char *input, size_t in_length, unsigned char *ou
 	return (b64->_state == BASE64_DECODE_A || b64->_state == BASE64_EOF) ? 0 : BASE64_NEXT;
 }
 
+/***********************************************************************
+ *** Block Decoding
+ ***********************************************************************/
+
+#define XX	0xFF
+
+/* Base64 alphabet to 6-bit value; XX for everything else, including
+ * the pad character, so that a block stops on it.
+ */
+static const unsigned char decodeQuantum[256] = {
+	XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX,
+	XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX,
+	XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, 62, XX, XX, XX, 63,
+	52, 53, 54, 55, 56, 57, 58, 59, 60, 61, XX, XX, XX, XX, XX, XX,
+	XX,  0,  1,  2,  3,  4,  5,  6,  7,  8,  9, 10, 11, 12, 13, 14,
+	15, 16, 17, 18, 19, 20, 21, 22, 23, 24, 25, XX, XX, XX, XX, XX,
+	XX, 26, 27, 28, 29, 30, 31, 32, 33, 34, 35, 36, 37, 38, 39, 40,
+	41, 42, 43, 44, 45, 46, 47, 48, 49, 50, 51, XX, XX, XX, XX, XX,
+	XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX,
+	XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX,
+	XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX,
+	XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX,
+	XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX,
+	XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX,
+	XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX,
+	XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX,
+};
+
+/* Hexadecimal digit to value, either case as for mimeStateQpDecode. */
+static const unsigned char decodeHex[256] = {
+	XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX,
+	XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX,
+	XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX,
+	 0,  1,  2,  3,  4,  5,  6,  7,  8,  9, XX, XX, XX, XX, XX, XX,
+	XX, 10, 11, 12, 13, 14, 15, XX, XX, XX, XX, XX, XX, XX, XX, XX,
+	XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX,
+	XX, 10, 11, 12, 13, 14, 15, XX, XX, XX, XX, XX, XX, XX, XX, XX,
+	XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX,
+	XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX,
+	XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX,
+	XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX,
+	XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX,
+	XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX,
+	XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX,
+	XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX,
+	XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX,
+};
+
+#ifdef B64_AVX2
+static int has_avx2 = -1;
+
+/*
+ * 32 characters to 24 octets per step, see Wojciech Mula and Daniel
+ * Lemire, "Faster Base64 Encoding and Decoding Using AVX2 Instructions".
+ * Stops before the first 32 character block with a non-alphabet
+ * character. The store writes 32 octets, so out_size must allow it.
+ */
+__attribute__((target("avx2")))
+static size_t
+b64DecodeAvx2(const unsigned char *input, size_t in_length, unsigned char *output, size_t out_size)
+{
+	size_t i, o;
+	__m256i str, hi_nibbles, lo_nibbles, hi, lo, roll;
+	const __m256i mask_2F = _mm256_set1_epi8(0x2F);
+	const __m256i lut_lo = _mm256_setr_epi8(
+		0x15, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x13, 0x1A, 0x1B, 0x1B, 0x1B, 0x1A,
+		0x15, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x13, 0x1A, 0x1B, 0x1B, 0x1B, 0x1A
+	);
+	const __m256i lut_hi = _mm256_setr_epi8(
+		0x10, 0x10, 0x01, 0x02, 0x04, 0x08, 0x04, 0x08, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10,
+		0x10, 0x10, 0x01, 0x02, 0x04, 0x08, 0x04, 0x08, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10
+	);
+	const __m256i lut_roll = _mm256_setr_epi8(
+		0, 16, 19, 4, -65, -65, -71, -71, 0, 0, 0, 0, 0, 0, 0, 0,
+		0, 16, 19, 4, -65, -65, -71, -71, 0, 0, 0, 0, 0, 0, 0, 0
+	);
+	const __m256i pack = _mm256_setr_epi8(
+		2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1,
+		2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1
+	);
+
+	for (i = o = 0; i + 32 <= in_length && o + 32 <= out_size; i += 32, o += 24) {
+		str = _mm256_loadu_si256((const __m256i *)(input + i));
+
+		/* Classify each character by its high and low nibbles. */
+		hi_nibbles = _mm256_and_si256(_mm256_srli_epi32(str, 4), mask_2F);
+		lo_nibbles = _mm256_and_si256(str, mask_2F);
+		hi = _mm256_shuffle_epi8(lut_hi, hi_nibbles);
+		lo = _mm256_shuffle_epi8(lut_lo, lo_nibbles);
+		if (!_mm256_testz_si256(lo, hi))
+			break;
+
+		/* Map to 6-bit values; '/' shares a high nibble with '+'. */
+		roll = _mm256_shuffle_epi8(lut_roll, _mm256_add_epi8(_mm256_cmpeq_epi8(str, mask_2F), hi_nibbles));
+		str = _mm256_add_epi8(str, roll);
+
+		/* Pack 4 x 6 bits into 3 octets per 32-bit lane. */
+		str = _mm256_maddubs_epi16(str, _mm256_set1_epi32(0x01400140));
+		str = _mm256_madd_epi16(str, _mm256_set1_epi32(0x00011000));
+		str = _mm256_shuffle_epi8(str, pack);
+		str = _mm256_permutevar8x32_epi32(str, _mm256_setr_epi32(0, 1, 2, 4, 5, 6, -1, -1));
+		_mm256_storeu_si256((__m256i *)(output + o), str);
+	}
+
+	return i;
+}
+#endif
+
+#ifdef B64_SSE2
+/*
+ * 16 characters to 12 octets per step. SSE2 has no byte shuffle, so
+ * classify with range compares and pack the 24-bit lanes by hand.
+ */
+static size_t
+b64DecodeSse2(const unsigned char *input, size_t in_length, unsigned char *output, size_t out_size)
+{
+	size_t i, o;
+	unsigned j, lanes[4];
+	__m128i str, upper, lower, digit, plus, slash, delta;
+
+	for (i = o = 0; i + 16 <= in_length && o + 12 <= out_size; i += 16, o += 12) {
+		str = _mm_loadu_si128((const __m128i *)(input + i));
+
+		/* Octets 0x80..0xFF are negative and so fail every range. */
+		upper = _mm_and_si128(_mm_cmpgt_epi8(str, _mm_set1_epi8('A'-1)), _mm_cmplt_epi8(str, _mm_set1_epi8('Z'+1)));
+		lower = _mm_and_si128(_mm_cmpgt_epi8(str, _mm_set1_epi8('a'-1)), _mm_cmplt_epi8(str, _mm_set1_epi8('z'+1)));
+		digit = _mm_and_si128(_mm_cmpgt_epi8(str, _mm_set1_epi8('0'-1)), _mm_cmplt_epi8(str, _mm_set1_epi8('9'+1)));
+		plus = _mm_cmpeq_epi8(str, _mm_set1_epi8('+'));
+		slash = _mm_cmpeq_epi8(str, _mm_set1_epi8('/'));
+
+		if (_mm_movemask_epi8(_mm_or_si128(_mm_or_si128(upper, lower), _mm_or_si128(digit, _mm_or_si128(plus, slash)))) != 0xFFFF)
+			break;
+
+		delta = _mm_or_si128(
+			_mm_or_si128(_mm_and_si128(upper, _mm_set1_epi8(-65)), _mm_and_si128(lower, _mm_set1_epi8(-71))),
+			_mm_or_si128(_mm_and_si128(digit, _mm_set1_epi8(4)),
+				_mm_or_si128(_mm_and_si128(plus, _mm_set1_epi8(19)), _mm_and_si128(slash, _mm_set1_epi8(16))))
+		);
+		str = _mm_add_epi8(str, delta);
+
+		/* aaaaaa bbbbbb -> 12 bits per 16-bit word, then 24 bits per lane. */
+		str = _mm_or_si128(_mm_slli_epi16(_mm_and_si128(str, _mm_set1_epi16(0x00FF)), 6), _mm_srli_epi16(str, 8));
+		str = _mm_or_si128(_mm_slli_epi32(_mm_and_si128(str, _mm_set1_epi32(0x0000FFFF)), 12), _mm_srli_epi32(str, 16));
+		_mm_storeu_si128((__m128i *) lanes, str);
+
+		for (j = 0; j < 4; j++) {
+			output[o + j*3 + 0] = (unsigned char)(lanes[j] >> 16);
+			output[o + j*3 + 1] = (unsigned char)(lanes[j] >> 8);
+			output[o + j*3 + 2] = (unsigned char) lanes[j];
+		}
+	}
+
+	return i;
+}
+
+/*
+ * @return
+ *	The length of the leading run without CR, LF, or equals-sign.
+ */
+static size_t
+qpLiteralSpan(const unsigned char *input, size_t length)
+{
+	int mask;
+	size_t i;
+	__m128i str;
+
+	for (i = 0; i + 16 <= length; i += 16) {
+		str = _mm_loadu_si128((const __m128i *)(input + i));
+		mask = _mm_movemask_epi8(_mm_or_si128(
+			_mm_or_si128(_mm_cmpeq_epi8(str, _mm_set1_epi8('\r')), _mm_cmpeq_epi8(str, _mm_set1_epi8('\n'))),
+			_mm_cmpeq_epi8(str, _mm_set1_epi8('='))
+		));
+		if (mask != 0)
+			return i + __builtin_ctz(mask);
+	}
+	for ( ; i < length; i++) {
+		if (input[i] == '\r' || input[i] == '\n' || input[i] == '=')
+			break;
+	}
+
+	return i;
+}
+#else
+static size_t
+qpLiteralSpan(const unsigned char *input, size_t length)
+{
+	size_t i;
+
+	for (i = 0; i < length; i++) {
+		if (input[i] == '\r' || input[i] == '\n' || input[i] == '=')
+			break;
+	}
+
+	return i;
+}
+#endif
+
+/**
+ * @param input
+ *	The Base64 input to decode.
+ *
+ * @param in_length
+ *	The length of the input.
+ *
+ * @param output
+ *	A pointer to an output buffer to receive the decoded octets.
+ *
+ * @param out_size
+ *	The size of the output buffer.
+ *
+ * @return
+ *	The number of input characters decoded, always a multiple of 4.
+ *	The output length is 3 octets per 4 input characters. Decoding
+ *	stops before the first quantum with a character outside the
+ *	Base64 alphabet, like white space or padding, or that does not
+ *	fit in the output buffer.
+ */
+size_t
+b64DecodeQuanta(const unsigned char *input, size_t in_length, unsigned char *output, size_t out_size)
+{
+	size_t i, o;
+	unsigned a, b, c, d;
+
+	i = o = 0;
+#ifdef B64_AVX2
+	if (has_avx2 < 0)
+		has_avx2 = __builtin_cpu_supports("avx2") != 0;
+	if (has_avx2) {
+		i = b64DecodeAvx2(input, in_length, output, out_size);
+		o = i / 4 * 3;
+	}
+#endif
+#ifdef B64_SSE2
+	i += b64DecodeSse2(input + i, in_length - i, output + o, out_size - o);
+	o = i / 4 * 3;
+#endif
+	for ( ; i + 4 <= in_length && o + 3 <= out_size; i += 4, o += 3) {
+		a = decodeQuantum[input[i]];
+		b = decodeQuantum[input[i+1]];
+		c = decodeQuantum[input[i+2]];
+		d = decodeQuantum[input[i+3]];
+		if ((a | b | c | d) & 0x80)
+			break;
+
+		output[o] = (unsigned char)(a << 2 | b >> 4);
+		output[o+1] = (unsigned char)(b << 4 | c >> 2);
+		output[o+2] = (unsigned char)(c << 6 | d);
+	}
+
+	return i;
+}
+
+/**
+ * @param b64
+ *	A pointer to B64 state structure.
+ *
+ * @param input
+ *	The Base64 input to decode.
+ *
+ * @param in_length
+ *	The length of the input.
+ *
+ * @param output
+ *	A pointer to an output buffer to receive the decoded octets.
+ *
+ * @param out_size
+ *	The size of the output buffer.
+ *
+ * @return
+ *	The number of input characters decoded, as b64DecodeQuanta().
+ *	Zero if the B64 state is not at the start of a quantum, in
+ *	which case continue with b64Decode().
+ */
+size_t
+b64DecodeBlock(B64 *b64, const unsigned char *input, size_t in_length, unsigned char *output, size_t out_size)
+{
+	size_t length;
+
+	if (b64->_state != BASE64_START && b64->_state != BASE64_DECODE_A)
+		return 0;
+
+	if (0 < (length = b64DecodeQuanta(input, in_length, output, out_size)))
+		b64->_state = BASE64_DECODE_A;
+
+	return length;
+}
+
+/**
+ * @param input
+ *	The quoted-printable input to decode.
+ *
+ * @param in_length
+ *	The length of the input.
+ *
+ * @param output
+ *	A pointer to an output buffer to receive the decoded octets.
+ *
+ * @param out_size
+ *	The size of the output buffer.
+ *
+ * @param out_length
+ *	The length of the decoded output is passed back.
+ *
+ * @return
+ *	The number of input octets decoded. Literal octets are copied
+ *	and =XX hexadecimal sequences, either case, are decoded. Stops
+ *	at a CR, LF, soft line break, invalid or incomplete =XX, or when
+ *	the output buffer is full; continue from there octet by octet.
+ */
+size_t
+qpDecodeBlock(const unsigned char *input, size_t in_length, unsigned char *output, size_t out_size, size_t *out_length)
+{
+	size_t i, o, n;
+	unsigned hi, lo;
+
+	for (i = o = 0; i < in_length && o < out_size; ) {
+		n = in_length - i;
+		if (out_size - o < n)
+			n = out_size - o;
+
+		n = qpLiteralSpan(input + i, n);
+		memcpy(output + o, input + i, n);
+		i += n;
+		o += n;
+
+		if (in_length <= i || out_size <= o || input[i] != '=' || in_length < i + 3)
+			break;
+		if ((hi = decodeHex[input[i+1]]) == XX || (lo = decodeHex[input[i+2]]) == XX)
+			break;
+
+		output[o++] = (unsigned char)(hi << 4 | lo);
+		i += 3;
+	}
+
+	*out_length = o;
+
+	return i;
+}
+
 /**
  * @param input_length
  *	The input length.
@@ -93,7 +93,7 @@ ixhash_hash1(md5_state_t *md5, const unsigned char *body, size_t size)
 		 * original procmail script was feed messages with LF
 		 * newlines, not the original SMTP data that use CRLF.
 		 */
-		if (ch == '\r' && 0 < size && body[1] == '\n')
+		if (ch == '\r' && 1 < size && body[1] == '\n')
 			continue;
 		if (isspace(ch) && prev == ch)
 			continue;
@@ -184,6 +184,156 @@ ixhash_hash3(md5_state_t *md5, const unsigned char *body, size_t size)
 	}
 }
 
+/***********************************************************************
+ *** All three hashes in one pass
+ ***********************************************************************/
+
+#define IX_SPACE		0x01	/* isspace */
+#define IX_GRAPH		0x02	/* isgraph */
+#define IX_PRINT		0x04	/* isprint */
+#define IX_SPACE_TAB		0x08	/* space or tab */
+#define IX_GLYPH		0x10	/* special_glyphs */
+#define IX_DROP2		0x20	/* deleted by hash2 */
+#define IX_DROP3		0x40	/* deleted by hash3 */
+
+/* The classes of each octet in the C locale, the same tests the
+ * ixhash_hash1(), ixhash_hash2(), and ixhash_hash3() filters make.
+ */
+static const unsigned char ixhash_class[256] = {
+	0x70, 0x60, 0x60, 0x60, 0x60, 0x60, 0x60, 0x60, 0x60, 0x69, 0x61, 0x61, 0x61, 0x61, 0x60, 0x60,	/* 0x00 */
+	0x60, 0x60, 0x60, 0x60, 0x60, 0x60, 0x60, 0x60, 0x60, 0x60, 0x60, 0x60, 0x60, 0x60, 0x60, 0x60,	/* 0x10 */
+	0x4d, 0x16, 0x06, 0x26, 0x06, 0x26, 0x26, 0x16, 0x16, 0x16, 0x16, 0x06, 0x16, 0x06, 0x06, 0x06,	/* 0x20 */
+	0x26, 0x26, 0x26, 0x26, 0x26, 0x26, 0x26, 0x26, 0x26, 0x26, 0x06, 0x26, 0x16, 0x66, 0x16, 0x16,	/* 0x30 */
+	0x16, 0x26, 0x26, 0x26, 0x26, 0x26, 0x26, 0x26, 0x26, 0x26, 0x26, 0x26, 0x26, 0x26, 0x26, 0x26,	/* 0x40 */
+	0x26, 0x26, 0x26, 0x26, 0x26, 0x26, 0x26, 0x26, 0x26, 0x26, 0x26, 0x06, 0x06, 0x06, 0x06, 0x06,	/* 0x50 */
+	0x06, 0x26, 0x26, 0x26, 0x26, 0x26, 0x26, 0x26, 0x26, 0x26, 0x26, 0x26, 0x26, 0x26, 0x26, 0x26,	/* 0x60 */
+	0x26, 0x26, 0x26, 0x26, 0x26, 0x26, 0x26, 0x26, 0x26, 0x26, 0x26, 0x06, 0x16, 0x06, 0x06, 0x60,	/* 0x70 */
+	0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,	/* 0x80 */
+	0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,	/* 0x90 */
+	0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,	/* 0xA0 */
+	0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,	/* 0xB0 */
+	0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,	/* 0xC0 */
+	0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,	/* 0xD0 */
+	0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,	/* 0xE0 */
+	0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,	/* 0xF0 */
+};
+
+void
+ixhash_init(ixhash_state *ix)
+{
+	int i;
+
+	for (i = 0; i < 3; i++) {
+		md5_init(&ix->md5[i]);
+		ix->out_length[i] = 0;
+		ix->prev[i] = -1;
+	}
+
+	ix->length = ix->lf = ix->space_tab = ix->delims = 0;
+	ix->last = -1;
+	ix->cr = 0;
+}
+
+/*
+ * Collect the filtered octets and hash them a buffer at a time
+ * rather than one md5_append() per octet.
+ */
+static void
+ixhash_out(ixhash_state *ix, int i, int ch)
+{
+	ix->out[i][ix->out_length[i]++] = ch;
+	if (sizeof (ix->out[i]) <= ix->out_length[i]) {
+		md5_append(&ix->md5[i], ix->out[i], (int) ix->out_length[i]);
+		ix->out_length[i] = 0;
+	}
+}
+
+/* Same as ixhash_hash1() once CRLF has been reduced to LF. */
+static void
+ixhash_out1(ixhash_state *ix, int ch)
+{
+	if ((ixhash_class[ch] & IX_SPACE) && ix->prev[0] == ch)
+		return;
+	ix->prev[0] = ch;
+	if (!(ixhash_class[ch] & IX_GRAPH))
+		ixhash_out(ix, 0, ch);
+}
+
+void
+ixhash_append(ixhash_state *ix, const unsigned char *body, size_t size)
+{
+	int ch, ch2;
+	unsigned class;
+
+	ix->length += size;
+
+	for ( ; 0 < size; size--, body++) {
+		ch = *body;
+		class = ixhash_class[ch];
+
+		if (ch == '\n')
+			ix->lf++;
+		if (class & IX_SPACE_TAB)
+			ix->space_tab++;
+		if ((class & IX_GLYPH) || (ch == '/' && ix->last == ':'))
+			ix->delims++;
+		ix->last = ch;
+
+		/* hash1: hold a CR until we know if LF follows. */
+		if (ix->cr) {
+			ix->cr = 0;
+			if (ch != '\n')
+				ixhash_out1(ix, '\r');
+		}
+		if (ch == '\r')
+			ix->cr = 1;
+		else
+			ixhash_out1(ix, ch);
+
+		/* hash2: the underscore is compared as a dot, but
+		 * hashed as is, same as ixhash_hash2().
+		 */
+		if (!(class & IX_DROP2)) {
+			ch2 = ch == '_' ? '.' : ch;
+			if (!((ixhash_class[ch2] & IX_PRINT) && ix->prev[1] == ch2)) {
+				ix->prev[1] = ch2;
+				ixhash_out(ix, 1, ch);
+			}
+		}
+
+		/* hash3 */
+		if (!(class & IX_DROP3) && !((class & IX_GRAPH) && ix->prev[2] == ch)) {
+			ix->prev[2] = ch;
+			ixhash_out(ix, 2, ch);
+		}
+	}
+}
+
+int
+ixhash_finish(ixhash_state *ix, md5_byte_t digest[3][16])
+{
+	int i;
+
+	if (ix->cr) {
+		ix->cr = 0;
+		ixhash_out1(ix, '\r');
+	}
+
+	for (i = 0; i < 3; i++) {
+		md5_append(&ix->md5[i], ix->out[i], (int) ix->out_length[i]);
+		md5_finish(&ix->md5[i], digest[i]);
+	}
+
+	if (2 <= ix->lf && 20 <= ix->space_tab)
+		return 1;
+	if (3 <= ix->delims)
+		return 2;
+	if (8 <= ix->length)
+		return 3;
+
+	return 0;
+}
+
 /***********************************************************************
  ***
  ***********************************************************************/
@@ -37,6 +37,9 @@
   <ghost@aladdin.com>.  Other authors are noted in the change history
   that follows (in reverse chronological order):
 
+  2026-10-16 ah  Simpler F and G; compile-time byte order from the
+	compiler when known; round steps shared with md5_append_multi(),
+	which hashes several independent streams in vector lanes.
   2002-04-13 lpd Clarified derivation from RFC 1321; now handles byte order
 	either statically or dynamically; added missing #include <string.h>
 	in library.
@@ -66,6 +69,8 @@
 #undef BYTE_ORDER	/* 1 = big-endian, -1 = little-endian, 0 = unknown */
 #ifdef ARCH_IS_BIG_ENDIAN
 #  define BYTE_ORDER (ARCH_IS_BIG_ENDIAN ? 1 : -1)
+#elif defined(__BYTE_ORDER__) && defined(__ORDER_BIG_ENDIAN__)
+#  define BYTE_ORDER (__BYTE_ORDER__ == __ORDER_BIG_ENDIAN__ ? 1 : -1)
 #else
 #  define BYTE_ORDER 0
 #endif
@@ -137,6 +142,100 @@
 #define T64 /* 0xeb86d391 */ (T_MASK ^ 0x14792c6e)
 
 
+#define ROTATE_LEFT(x, n) (((x) << (n)) | ((x) >> (32 - (n))))
+
+/*
+ * The auxiliary functions of RFC 1321 section 3.4. F and G are written
+ * with one less operation than in the RFC:
+ *
+ *	F(x,y,z) = XY v not(X) Z	= z ^ (x & (y ^ z))
+ *	G(x,y,z) = XZ v Y not(Z)	= y ^ (z & (x ^ y))
+ *
+ * Only operators that also apply to GCC vector types are used, so the
+ * same round steps serve md5_process() and the multi-buffer lanes.
+ */
+#define F(x, y, z) ((z) ^ ((x) & ((y) ^ (z))))
+#define G(x, y, z) ((y) ^ ((z) & ((x) ^ (y))))
+#define H(x, y, z) ((x) ^ (y) ^ (z))
+#define I(x, y, z) ((y) ^ ((x) | ~(z)))
+
+/* Let [abcd k s i] denote the operation
+   a = b + ((a + FN(b,c,d) + X[k] + T[i]) <<< s). */
+#define SET(FN, a, b, c, d, k, s, Ti)\
+  t = a + FN(b,c,d) + X[k] + Ti;\
+  a = ROTATE_LEFT(t, s) + b
+
+/* The 64 operations of the four rounds on a, b, c, d, X, and t. */
+#define MD5_ROUNDS \
+    /* Round 1. */ \
+    SET(F, a, b, c, d,  0,  7,  T1); \
+    SET(F, d, a, b, c,  1, 12,  T2); \
+    SET(F, c, d, a, b,  2, 17,  T3); \
+    SET(F, b, c, d, a,  3, 22,  T4); \
+    SET(F, a, b, c, d,  4,  7,  T5); \
+    SET(F, d, a, b, c,  5, 12,  T6); \
+    SET(F, c, d, a, b,  6, 17,  T7); \
+    SET(F, b, c, d, a,  7, 22,  T8); \
+    SET(F, a, b, c, d,  8,  7,  T9); \
+    SET(F, d, a, b, c,  9, 12, T10); \
+    SET(F, c, d, a, b, 10, 17, T11); \
+    SET(F, b, c, d, a, 11, 22, T12); \
+    SET(F, a, b, c, d, 12,  7, T13); \
+    SET(F, d, a, b, c, 13, 12, T14); \
+    SET(F, c, d, a, b, 14, 17, T15); \
+    SET(F, b, c, d, a, 15, 22, T16); \
+    /* Round 2. */ \
+    SET(G, a, b, c, d,  1,  5, T17); \
+    SET(G, d, a, b, c,  6,  9, T18); \
+    SET(G, c, d, a, b, 11, 14, T19); \
+    SET(G, b, c, d, a,  0, 20, T20); \
+    SET(G, a, b, c, d,  5,  5, T21); \
+    SET(G, d, a, b, c, 10,  9, T22); \
+    SET(G, c, d, a, b, 15, 14, T23); \
+    SET(G, b, c, d, a,  4, 20, T24); \
+    SET(G, a, b, c, d,  9,  5, T25); \
+    SET(G, d, a, b, c, 14,  9, T26); \
+    SET(G, c, d, a, b,  3, 14, T27); \
+    SET(G, b, c, d, a,  8, 20, T28); \
+    SET(G, a, b, c, d, 13,  5, T29); \
+    SET(G, d, a, b, c,  2,  9, T30); \
+    SET(G, c, d, a, b,  7, 14, T31); \
+    SET(G, b, c, d, a, 12, 20, T32); \
+    /* Round 3. */ \
+    SET(H, a, b, c, d,  5,  4, T33); \
+    SET(H, d, a, b, c,  8, 11, T34); \
+    SET(H, c, d, a, b, 11, 16, T35); \
+    SET(H, b, c, d, a, 14, 23, T36); \
+    SET(H, a, b, c, d,  1,  4, T37); \
+    SET(H, d, a, b, c,  4, 11, T38); \
+    SET(H, c, d, a, b,  7, 16, T39); \
+    SET(H, b, c, d, a, 10, 23, T40); \
+    SET(H, a, b, c, d, 13,  4, T41); \
+    SET(H, d, a, b, c,  0, 11, T42); \
+    SET(H, c, d, a, b,  3, 16, T43); \
+    SET(H, b, c, d, a,  6, 23, T44); \
+    SET(H, a, b, c, d,  9,  4, T45); \
+    SET(H, d, a, b, c, 12, 11, T46); \
+    SET(H, c, d, a, b, 15, 16, T47); \
+    SET(H, b, c, d, a,  2, 23, T48); \
+    /* Round 4. */ \
+    SET(I, a, b, c, d,  0,  6, T49); \
+    SET(I, d, a, b, c,  7, 10, T50); \
+    SET(I, c, d, a, b, 14, 15, T51); \
+    SET(I, b, c, d, a,  5, 21, T52); \
+    SET(I, a, b, c, d, 12,  6, T53); \
+    SET(I, d, a, b, c,  3, 10, T54); \
+    SET(I, c, d, a, b, 10, 15, T55); \
+    SET(I, b, c, d, a,  1, 21, T56); \
+    SET(I, a, b, c, d,  8,  6, T57); \
+    SET(I, d, a, b, c, 15, 10, T58); \
+    SET(I, c, d, a, b,  6, 15, T59); \
+    SET(I, b, c, d, a, 13, 21, T60); \
+    SET(I, a, b, c, d,  4,  6, T61); \
+    SET(I, d, a, b, c, 11, 10, T62); \
+    SET(I, c, d, a, b,  2, 15, T63); \
+    SET(I, b, c, d, a,  9, 21, T64)
+
 static void
 md5_process(md5_state_t *pms, const md5_byte_t *data /*[64]*/)
 {
@@ -203,111 +302,7 @@ md5_process(md5_state_t *pms, const md5_byte_t *data /*[64]*/)
 #endif
     }
 
-#define ROTATE_LEFT(x, n) (((x) << (n)) | ((x) >> (32 - (n))))
-
-    /* Round 1. */
-    /* Let [abcd k s i] denote the operation
-       a = b + ((a + F(b,c,d) + X[k] + T[i]) <<< s). */
-#define F(x, y, z) (((x) & (y)) | (~(x) & (z)))
-#define SET(a, b, c, d, k, s, Ti)\
-  t = a + F(b,c,d) + X[k] + Ti;\
-  a = ROTATE_LEFT(t, s) + b
-    /* Do the following 16 operations. */
-    SET(a, b, c, d,  0,  7,  T1);
-    SET(d, a, b, c,  1, 12,  T2);
-    SET(c, d, a, b,  2, 17,  T3);
-    SET(b, c, d, a,  3, 22,  T4);
-    SET(a, b, c, d,  4,  7,  T5);
-    SET(d, a, b, c,  5, 12,  T6);
-    SET(c, d, a, b,  6, 17,  T7);
-    SET(b, c, d, a,  7, 22,  T8);
-    SET(a, b, c, d,  8,  7,  T9);
-    SET(d, a, b, c,  9, 12, T10);
-    SET(c, d, a, b, 10, 17, T11);
-    SET(b, c, d, a, 11, 22, T12);
-    SET(a, b, c, d, 12,  7, T13);
-    SET(d, a, b, c, 13, 12, T14);
-    SET(c, d, a, b, 14, 17, T15);
-    SET(b, c, d, a, 15, 22, T16);
-#undef SET
-
-     /* Round 2. */
-     /* Let [abcd k s i] denote the operation
-          a = b + ((a + G(b,c,d) + X[k] + T[i]) <<< s). */
-#define G(x, y, z) (((x) & (z)) | ((y) & ~(z)))
-#define SET(a, b, c, d, k, s, Ti)\
-  t = a + G(b,c,d) + X[k] + Ti;\
-  a = ROTATE_LEFT(t, s) + b
-     /* Do the following 16 operations. */
-    SET(a, b, c, d,  1,  5, T17);
-    SET(d, a, b, c,  6,  9, T18);
-    SET(c, d, a, b, 11, 14, T19);
-    SET(b, c, d, a,  0, 20, T20);
-    SET(a, b, c, d,  5,  5, T21);
-    SET(d, a, b, c, 10,  9, T22);
-    SET(c, d, a, b, 15, 14, T23);
-    SET(b, c, d, a,  4, 20, T24);
-    SET(a, b, c, d,  9,  5, T25);
-    SET(d, a, b, c, 14,  9, T26);
-    SET(c, d, a, b,  3, 14, T27);
-    SET(b, c, d, a,  8, 20, T28);
-    SET(a, b, c, d, 13,  5, T29);
-    SET(d, a, b, c,  2,  9, T30);
-    SET(c, d, a, b,  7, 14, T31);
-    SET(b, c, d, a, 12, 20, T32);
-#undef SET
-
-     /* Round 3. */
-     /* Let [abcd k s t] denote the operation
-          a = b + ((a + H(b,c,d) + X[k] + T[i]) <<< s). */
-#define H(x, y, z) ((x) ^ (y) ^ (z))
-#define SET(a, b, c, d, k, s, Ti)\
-  t = a + H(b,c,d) + X[k] + Ti;\
-  a = ROTATE_LEFT(t, s) + b
-     /* Do the following 16 operations. */
-    SET(a, b, c, d,  5,  4, T33);
-    SET(d, a, b, c,  8, 11, T34);
-    SET(c, d, a, b, 11, 16, T35);
-    SET(b, c, d, a, 14, 23, T36);
-    SET(a, b, c, d,  1,  4, T37);
-    SET(d, a, b, c,  4, 11, T38);
-    SET(c, d, a, b,  7, 16, T39);
-    SET(b, c, d, a, 10, 23, T40);
-    SET(a, b, c, d, 13,  4, T41);
-    SET(d, a, b, c,  0, 11, T42);
-    SET(c, d, a, b,  3, 16, T43);
-    SET(b, c, d, a,  6, 23, T44);
-    SET(a, b, c, d,  9,  4, T45);
-    SET(d, a, b, c, 12, 11, T46);
-    SET(c, d, a, b, 15, 16, T47);
-    SET(b, c, d, a,  2, 23, T48);
-#undef SET
-
-     /* Round 4. */
-     /* Let [abcd k s t] denote the operation
-          a = b + ((a + I(b,c,d) + X[k] + T[i]) <<< s). */
-#define I(x, y, z) ((y) ^ ((x) | ~(z)))
-#define SET(a, b, c, d, k, s, Ti)\
-  t = a + I(b,c,d) + X[k] + Ti;\
-  a = ROTATE_LEFT(t, s) + b
-     /* Do the following 16 operations. */
-    SET(a, b, c, d,  0,  6, T49);
-    SET(d, a, b, c,  7, 10, T50);
-    SET(c, d, a, b, 14, 15, T51);
-    SET(b, c, d, a,  5, 21, T52);
-    SET(a, b, c, d, 12,  6, T53);
-    SET(d, a, b, c,  3, 10, T54);
-    SET(c, d, a, b, 10, 15, T55);
-    SET(b, c, d, a,  1, 21, T56);
-    SET(a, b, c, d,  8,  6, T57);
-    SET(d, a, b, c, 15, 10, T58);
-    SET(c, d, a, b,  6, 15, T59);
-    SET(b, c, d, a, 13, 21, T60);
-    SET(a, b, c, d,  4,  6, T61);
-    SET(d, a, b, c, 11, 10, T62);
-    SET(c, d, a, b,  2, 15, T63);
-    SET(b, c, d, a,  9, 21, T64);
-#undef SET
+    MD5_ROUNDS;
 
      /* Then perform the following additions. (That is increment each
         of the four registers by the value it had before this block
@@ -341,22 +336,32 @@ md5_init(md5_state_t *pms)
     pms->abcd[3] = 0x10325476;
 }
 
+/* Update the message length and return the offset into the block. */
+static int
+md5_count(md5_state_t *pms, int nbytes)
+{
+    int offset = (pms->count[0] >> 3) & 63;
+    md5_word_t nbits = (md5_word_t)(nbytes << 3);
+
+    pms->count[1] += nbytes >> 29;
+    pms->count[0] += nbits;
+    if (pms->count[0] < nbits)
+	pms->count[1]++;
+
+    return offset;
+}
+
 void
 md5_append(md5_state_t *pms, const md5_byte_t *data, int nbytes)
 {
     const md5_byte_t *p = data;
     int left = nbytes;
-    int offset = (pms->count[0] >> 3) & 63;
-    md5_word_t nbits = (md5_word_t)(nbytes << 3);
+    int offset;
 
     if (data == NULL || nbytes <= 0)
 	return;
 
-    /* Update the message length. */
-    pms->count[1] += nbytes >> 29;
-    pms->count[0] += nbits;
-    if (pms->count[0] < nbits)
-	pms->count[1]++;
+    offset = md5_count(pms, nbytes);
 
     /* Process an initial partial block. */
     if (offset) {
@@ -379,6 +384,200 @@ md5_append(md5_state_t *pms, const md5_byte_t *data, int nbytes)
 	memcpy(pms->buf, p, left);
 }
 
+/***********************************************************************
+ *** Multi-buffer
+ ***********************************************************************/
+
+#if defined(__GNUC__) && (4 < __GNUC__ || (__GNUC__ == 4 && 9 <= __GNUC_MINOR__) || defined(__clang__))
+# define MD5_VECTOR
+/* AVX2 is selected at run time, so the library does not need -mavx2. */
+# if defined(__x86_64__) || defined(__i386__)
+#  define MD5_AVX2
+# endif
+#endif
+
+#ifdef MD5_VECTOR
+/*
+ * A GCC vector of one 32-bit word per lane. The compiler maps it onto
+ * whatever SIMD registers the target has, eg. two SSE2 registers or
+ * one AVX2 register for eight lanes.
+ */
+typedef md5_word_t md5_vector __attribute__((vector_size(MD5_LANES * sizeof (md5_word_t))));
+
+typedef struct {
+    md5_state_t *pms;
+    const md5_byte_t *p;	/* remaining input */
+    int left;
+    const md5_byte_t *block;	/* next block to process or NULL */
+} md5_lane;
+
+/*
+ * Select the next full block of a lane, else save the final partial
+ * block. Return zero when the lane has no more blocks.
+ */
+static int
+md5_lane_next(md5_lane *lane)
+{
+    if (64 <= lane->left) {
+	lane->block = lane->p;
+	lane->p += 64;
+	lane->left -= 64;
+	return 1;
+    }
+    if (0 < lane->left)
+	memcpy(lane->pms->buf, lane->p, lane->left);
+    lane->left = 0;
+    lane->block = NULL;
+    return 0;
+}
+
+static void
+md5_lane_start(md5_lane *lane, md5_state_t *pms, const md5_byte_t *data, int nbytes)
+{
+    int offset, copy;
+
+    lane->pms = pms;
+    lane->p = data;
+    lane->left = 0;
+    lane->block = NULL;
+
+    if (data == NULL || nbytes <= 0)
+	return;
+
+    lane->left = nbytes;
+    offset = md5_count(pms, nbytes);
+
+    /* Complete an initial partial block. The rest of the input
+     * waits until the state buffer has been processed.
+     */
+    if (offset) {
+	copy = (offset + nbytes > 64 ? 64 - offset : nbytes);
+	memcpy(pms->buf + offset, data, copy);
+	lane->p += copy;
+	lane->left -= copy;
+	if (offset + copy == 64)
+	    lane->block = pms->buf;
+	return;
+    }
+
+    (void) md5_lane_next(lane);
+}
+
+/*
+ * One block for each lane with a block. Idle lanes compute garbage
+ * that is not stored.
+ */
+static inline __attribute__((always_inline)) void
+md5_process_vector(md5_lane lanes[MD5_LANES])
+{
+    int j, k;
+    const md5_byte_t *xp;
+    md5_vector a, b, c, d, t, X[16], aa, bb, cc, dd;
+
+    a = b = c = d = (md5_vector) { 0 };
+    for (k = 0; k < 16; k++)
+	X[k] = a;
+
+    for (j = 0; j < MD5_LANES; j++) {
+	if (lanes[j].block == NULL)
+	    continue;
+	a[j] = lanes[j].pms->abcd[0];
+	b[j] = lanes[j].pms->abcd[1];
+	c[j] = lanes[j].pms->abcd[2];
+	d[j] = lanes[j].pms->abcd[3];
+	for (xp = lanes[j].block, k = 0; k < 16; k++, xp += 4)
+	    X[k][j] = xp[0] | (xp[1] << 8) | (xp[2] << 16) | ((md5_word_t) xp[3] << 24);
+    }
+
+    aa = a; bb = b; cc = c; dd = d;
+
+    MD5_ROUNDS;
+
+    a += aa; b += bb; c += cc; d += dd;
+
+    for (j = 0; j < MD5_LANES; j++) {
+	if (lanes[j].block == NULL)
+	    continue;
+	lanes[j].pms->abcd[0] = a[j];
+	lanes[j].pms->abcd[1] = b[j];
+	lanes[j].pms->abcd[2] = c[j];
+	lanes[j].pms->abcd[3] = d[j];
+    }
+}
+
+#ifdef MD5_AVX2
+static int has_avx2 = -1;
+
+__attribute__((target("avx2")))
+static void
+md5_process_avx2(md5_lane lanes[MD5_LANES])
+{
+    md5_process_vector(lanes);
+}
+#endif
+
+static void
+md5_process_lanes(md5_lane lanes[MD5_LANES])
+{
+#ifdef MD5_AVX2
+    if (has_avx2 < 0)
+	has_avx2 = __builtin_cpu_supports("avx2") != 0;
+    if (has_avx2) {
+	md5_process_avx2(lanes);
+	return;
+    }
+#endif
+    md5_process_vector(lanes);
+}
+#endif /* MD5_VECTOR */
+
+void
+md5_append_multi(md5_state_t *pms[], const md5_byte_t *data[], const int nbytes[], int n)
+{
+#ifdef MD5_VECTOR
+    int i, j, next, active;
+    md5_lane lanes[MD5_LANES];
+
+    memset(lanes, 0, sizeof (lanes));
+
+    for (i = next = 0; ; ) {
+	/* Give each idle lane the next stream with a full block. */
+	for (active = j = 0; j < MD5_LANES; j++) {
+	    while (lanes[j].block == NULL && next < n) {
+		md5_lane_start(&lanes[j], pms[next], data[next], nbytes[next]);
+		next++;
+	    }
+	    if (lanes[j].block != NULL) {
+		active++;
+		i = j;
+	    }
+	}
+
+	if (active == 0)
+	    break;
+
+	if (active == 1) {
+	    /* Only one stream left, so nothing to do in parallel. */
+	    do
+		md5_process(lanes[i].pms, lanes[i].block);
+	    while (md5_lane_next(&lanes[i]));
+	    continue;
+	}
+
+	md5_process_lanes(lanes);
+	for (j = 0; j < MD5_LANES; j++) {
+	    if (lanes[j].block != NULL)
+		(void) md5_lane_next(&lanes[j]);
+	}
+    }
+#else
+    int i;
+
+    for (i = 0; i < n; i++)
+	md5_append(pms[i], data[i], nbytes[i]);
+#endif
+}
+
 void
 md5_finish(md5_state_t *pms, md5_byte_t digest[16])
 {
@@ -435,26 +634,119 @@ print_digest(uint8_t digest[16])
 		printf("%02x", *digest);
 }
 
+static int
+check(const char *name, uint8_t digest[16], uint8_t expect[16])
+{
+	if (memcmp(expect, digest, 16) == 0)
+		return 0;
+
+	printf("%s got=", name);
+	print_digest(digest);
+	printf(" expected=");
+	print_digest(expect);
+	printf("\n");
+
+	return 1;
+}
+
+static unsigned long
+next_random(unsigned long *seed)
+{
+	*seed = *seed * 1103515245UL + 12345UL;
+	return (*seed >> 16) & 0x7FFF;
+}
+
+#define STREAMS		(3 * MD5_LANES + 5)
+#define STREAM_SIZE	2048
+
 int
 main(int argc, char **argv)
 {
-	int exit_code = 0;
-	md5_state_t md5;
-	uint8_t digest[16];
+	int i, n, split, exit_code = 0;
+	unsigned long seed = 1;
+	md5_state_t md5, expect[STREAMS], multi[STREAMS];
+	md5_state_t *pms[STREAMS];
+	const md5_byte_t *data[STREAMS];
+	int nbytes[STREAMS];
+	uint8_t digest[16], expect_digest[16];
+	static unsigned char buffer[STREAM_SIZE + 1];
 	unsigned char *(*t)[2];
+	static const uint8_t million_a[16] = {
+		0x77, 0x07, 0xd6, 0xae, 0x4e, 0x02, 0x7c, 0x70, 0xee, 0xa2, 0xa9, 0x35, 0xc2, 0x29, 0x6f, 0x21
+	};
 
+	/* RFC 1321 test suite. */
 	for (t = tests; (*t)[1] != NULL; t++) {
 		md5_init(&md5);
 		md5_append(&md5, (*t)[1], strlen((char *) (*t)[1]));
 		md5_finish(&md5, digest);
+		exit_code |= check((char *) (*t)[1], digest, (*t)[0]);
+	}
+
+	/* A million "a" in odd sized pieces. */
+	memset(buffer, 'a', sizeof (buffer));
+	md5_init(&md5);
+	for (i = 1000000; 0 < i; i -= n) {
+		n = i < 999 ? i : 999;
+		md5_append(&md5, buffer, n);
+	}
+	md5_finish(&md5, digest);
+	exit_code |= check("million a", digest, (uint8_t *) million_a);
+
+	/* Split at every offset, with unaligned input. */
+	for (i = 0; i < (int) sizeof (buffer); i++)
+		buffer[i] = (unsigned char) next_random(&seed);
+	md5_init(&md5);
+	md5_append(&md5, buffer, 300);
+	md5_finish(&md5, expect_digest);
+	for (split = 0; split <= 300; split++) {
+		md5_init(&md5);
+		md5_append(&md5, buffer + 1, 0);
+		md5_append(&md5, buffer, split);
+		md5_append(&md5, buffer + split, 300 - split);
+		md5_finish(&md5, digest);
+		if (check("split", digest, expect_digest)) {
+			exit_code = 1;
+			break;
+		}
+	}
+
+	/* The RFC test suite as streams of one md5_append_multi(). */
+	for (n = 0, t = tests; (*t)[1] != NULL; t++, n++) {
+		pms[n] = &multi[n];
+		md5_init(pms[n]);
+		data[n] = (*t)[1];
+		nbytes[n] = strlen((char *) (*t)[1]);
+	}
+	md5_append_multi(pms, data, nbytes, n);
+	for (i = 0, t = tests; i < n; i++, t++) {
+		md5_finish(pms[i], digest);
+		exit_code |= check((char *) (*t)[1], digest, (*t)[0]);
+	}
 
-		if (memcmp((*t)[0], digest, sizeof (digest)) != 0) {
-			printf("md5(\"%s\") got=", (*t)[1]);
-			print_digest(digest);
-			printf(" expected=");
-			print_digest((*t)[0]);
-			printf("\n");
+	/* More streams than lanes, with random lengths and a partial
+	 * block already in some of the states, in several rounds.
+	 */
+	for (i = 0; i < STREAMS; i++) {
+		md5_init(&expect[i]);
+		md5_init(&multi[i]);
+		pms[i] = &multi[i];
+	}
+	for (split = 0; split < 4; split++) {
+		for (i = 0; i < STREAMS; i++) {
+			n = (int) (next_random(&seed) % STREAM_SIZE);
+			data[i] = buffer + (next_random(&seed) & 1);
+			nbytes[i] = i % 7 == 0 ? n % 64 : n;
+			md5_append(&expect[i], data[i], nbytes[i]);
+		}
+		md5_append_multi(pms, data, nbytes, STREAMS);
+	}
+	for (i = 0; i < STREAMS; i++) {
+		md5_finish(&expect[i], expect_digest);
+		md5_finish(&multi[i], digest);
+		if (check("multi", digest, expect_digest)) {
 			exit_code = 1;
+			break;
 		}
 	}
 
@@ -0,0 +1,171 @@
+/*
+ * siphash.c
+ *
+ * SipHash-2-4, a fast keyed hash suitable as a short message MAC.
+ * See Aumasson & Bernstein, "SipHash: a fast short-input PRF", 2012.
+ *
+ * Copyright 2026 by Anthony Howe. All rights reserved.
+ */
+
+#include <com/snert/lib/version.h>
+#include <string.h>
+#include <com/snert/lib/util/siphash.h>
+
+#define ROTL(x, b)	(uint64_t)(((x) << (b)) | ((x) >> (64 - (b))))
+
+#define SIPROUND(v) \
+	do { \
+		v[0] += v[1]; v[1] = ROTL(v[1], 13); v[1] ^= v[0]; v[0] = ROTL(v[0], 32); \
+		v[2] += v[3]; v[3] = ROTL(v[3], 16); v[3] ^= v[2]; \
+		v[0] += v[3]; v[3] = ROTL(v[3], 21); v[3] ^= v[0]; \
+		v[2] += v[1]; v[1] = ROTL(v[1], 17); v[1] ^= v[2]; v[2] = ROTL(v[2], 32); \
+	} while (0)
+
+static uint64_t
+get_le64(const uint8_t *p)
+{
+	return (uint64_t) p[0]
+		| (uint64_t) p[1] << 8
+		| (uint64_t) p[2] << 16
+		| (uint64_t) p[3] << 24
+		| (uint64_t) p[4] << 32
+		| (uint64_t) p[5] << 40
+		| (uint64_t) p[6] << 48
+		| (uint64_t) p[7] << 56;
+}
+
+static void
+siphash_compress(siphash_state_t *state, uint64_t m)
+{
+	state->v[3] ^= m;
+	SIPROUND(state->v);
+	SIPROUND(state->v);
+	state->v[0] ^= m;
+}
+
+void
+siphash_init(siphash_state_t *state, const uint8_t key[SIPHASH_KEY_SIZE])
+{
+	uint64_t k0 = get_le64(key);
+	uint64_t k1 = get_le64(key + 8);
+
+	state->v[0] = k0 ^ 0x736f6d6570736575ULL;
+	state->v[1] = k1 ^ 0x646f72616e646f6dULL;
+	state->v[2] = k0 ^ 0x6c7967656e657261ULL;
+	state->v[3] = k1 ^ 0x7465646279746573ULL;
+	state->length = 0;
+}
+
+void
+siphash_append(siphash_state_t *state, const uint8_t *buffer, unsigned length)
+{
+	unsigned offset, fill;
+
+	offset = (unsigned) (state->length & 7);
+	state->length += length;
+
+	/* Complete a partial word left by the previous append. */
+	if (0 < offset) {
+		fill = 8 - offset;
+		if (length < fill) {
+			(void) memcpy(state->buffer + offset, buffer, length);
+			return;
+		}
+		(void) memcpy(state->buffer + offset, buffer, fill);
+		siphash_compress(state, get_le64(state->buffer));
+		buffer += fill;
+		length -= fill;
+	}
+
+	for ( ; 8 <= length; buffer += 8, length -= 8)
+		siphash_compress(state, get_le64(buffer));
+
+	(void) memcpy(state->buffer, buffer, length);
+}
+
+void
+siphash_finish(siphash_state_t *state, uint8_t digest[SIPHASH_DIGEST_SIZE])
+{
+	int i;
+	uint64_t b;
+	unsigned offset;
+
+	offset = (unsigned) (state->length & 7);
+	memset(state->buffer + offset, 0, 8 - offset);
+	state->buffer[7] = (uint8_t) state->length;
+	siphash_compress(state, get_le64(state->buffer));
+
+	state->v[2] ^= 0xff;
+	SIPROUND(state->v);
+	SIPROUND(state->v);
+	SIPROUND(state->v);
+	SIPROUND(state->v);
+	b = state->v[0] ^ state->v[1] ^ state->v[2] ^ state->v[3];
+
+	for (i = 0; i < SIPHASH_DIGEST_SIZE; i++, b >>= 8)
+		digest[i] = (uint8_t) b;
+}
+
+#ifdef TEST
+
+#include <stdio.h>
+
+/* From the reference implementation: key 00..0f, message 00..len-1 */
+static struct {
+	unsigned length;
+	uint8_t digest[SIPHASH_DIGEST_SIZE];
+} tests[] = {
+	{  0, { 0x31, 0x0e, 0x0e, 0xdd, 0x47, 0xdb, 0x6f, 0x72 } },
+	{  1, { 0xfd, 0x67, 0xdc, 0x93, 0xc5, 0x39, 0xf8, 0x74 } },
+	{  7, { 0x37, 0xd1, 0x01, 0x8b, 0xf5, 0x00, 0x02, 0xab } },
+	{  8, { 0x62, 0x24, 0x93, 0x9a, 0x79, 0xf5, 0xf5, 0x93 } },
+	{ 15, { 0xe5, 0x45, 0xbe, 0x49, 0x61, 0xca, 0x29, 0xa1 } },
+	{ 63, { 0x72, 0x45, 0x06, 0xeb, 0x4c, 0x32, 0x8a, 0x95 } },
+	{ 0, { 0 } }
+};
+
+static void
+print_digest(uint8_t digest[SIPHASH_DIGEST_SIZE])
+{
+	int i;
+
+	for (i = 0; i < SIPHASH_DIGEST_SIZE; i++, digest++)
+		printf("%02x", *digest);
+}
+
+int
+main(int argc, char **argv)
+{
+	int exit_code = 0;
+	unsigned i, split;
+	siphash_state_t sip;
+	uint8_t key[SIPHASH_KEY_SIZE], message[64], digest[SIPHASH_DIGEST_SIZE];
+
+	for (i = 0; i < sizeof (key); i++)
+		key[i] = i;
+	for (i = 0; i < sizeof (message); i++)
+		message[i] = i;
+
+	for (i = 0; i == 0 || 0 < tests[i].length; i++) {
+		/* Every split point, to exercise the partial word handling. */
+		for (split = 0; split <= tests[i].length; split++) {
+			siphash_init(&sip, key);
+			siphash_append(&sip, message, split);
+			siphash_append(&sip, message + split, tests[i].length - split);
+			siphash_finish(&sip, digest);
+
+			if (memcmp(tests[i].digest, digest, sizeof (digest)) != 0) {
+				printf("siphash(%u, split=%u) got=", tests[i].length, split);
+				print_digest(digest);
+				printf(" expected=");
+				print_digest(tests[i].digest);
+				printf("\n");
+				exit_code = 1;
+			}
+		}
+	}
+
+	return exit_code;
+}
+
+#endif /* TEST */
@@ -266,6 +266,30 @@ timerFree(void *_timer)
 	}
 }
 
+/***********************************************************************
+ *** Monotonic Clock
+ ***********************************************************************/
+
+unsigned long
+timerMonotonicMs(void)
+{
+#if defined(HAVE_CLOCK_GETTIME) && defined(CLOCK_MONOTONIC)
+	struct timespec ts;
+
+	if (clock_gettime(CLOCK_MONOTONIC, &ts) == 0)
+		return (unsigned long) ts.tv_sec * UNIT_MILLI + ts.tv_nsec / 1000000L;
+#endif
+#if defined(HAVE_GETTIMEOFDAY)
+{
+	struct timeval tv;
+
+	if (gettimeofday(&tv, NULL) == 0)
+		return (unsigned long) tv.tv_sec * UNIT_MILLI + tv.tv_usec / 1000L;
+}
+#endif
+	return (unsigned long) time(NULL) * UNIT_MILLI;
+}
+
 #ifdef TEST
 /***********************************************************************
  *** Timer Test
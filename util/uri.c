@@ -1146,45 +1146,66 @@ uri_mime_free(Mime *m, void *_data)
 	}
 }
 
-static void
-uri_mime_body_start(Mime *m, void *_data)
-{
-	UriMime *hold = _data;
+/*
+ * Octet classes for the decoded content scan. An octet without
+ * a class is a delimiter.
+ */
+#define URI_OCTET_CHAR		0x01	/* URI octet, accumulate as is. */
+#define URI_OCTET_SPECIAL	0x02	/* URI octet, HTML entity or Big5 dot. */
+#define URI_OCTET_HINT		0x04	/* Colon, at-sign, dot, or percent. */
+#define URI_OCTET_CR		0x08	/* Ignored. */
+
+/* The same octets as isCharURI() for the RFC 3986 uri_excluded set,
+ * with a carriage return ignored. uriParse2() needs a scheme colon,
+ * an at-sign, or a dot to find anything; a percent-encoding might
+ * decode to one.
+ */
+#define C			URI_OCTET_CHAR
+#define H			(URI_OCTET_CHAR|URI_OCTET_HINT)
+#define S			URI_OCTET_SPECIAL
+#define R			URI_OCTET_CR
+
+static const unsigned char uri_octet_class[256] = {
+	0, C, C, C, C, C, C, C, C, 0, 0, 0, 0, R, C, C,	/* 0x00 */
+	C, C, C, C, C, C, C, C, C, C, C, C, C, C, C, C,	/* 0x10 */
+	0, C, 0, C, C, H, C, C, C, C, C, C, C, C, H, C,	/* 0x20 */
+	C, C, C, C, C, C, C, C, C, C, H, S, 0, C, 0, C,	/* 0x30 */
+	H, C, C, C, C, C, C, C, C, C, C, C, C, C, C, C,	/* 0x40 */
+	C, C, C, C, C, C, C, C, C, C, C, C, 0, C, 0, C,	/* 0x50 */
+	0, C, C, C, C, C, C, C, C, C, C, C, C, C, C, C,	/* 0x60 */
+	C, C, C, C, C, C, C, C, C, C, C, 0, C, 0, C, C,	/* 0x70 */
+	C, C, C, C, C, C, C, C, C, C, C, C, C, C, C, C,	/* 0x80 */
+	C, C, C, C, C, C, C, C, C, C, C, C, C, C, C, C,	/* 0x90 */
+	C, S, C, C, C, C, C, C, C, C, C, C, C, C, C, C,	/* 0xA0 */
+	C, C, C, C, C, C, C, C, C, C, C, C, C, C, C, C,	/* 0xB0 */
+	C, C, C, C, C, C, C, C, C, C, C, C, C, C, C, C,	/* 0xC0 */
+	C, C, C, C, C, C, C, C, C, C, C, C, C, C, C, C,	/* 0xD0 */
+	C, C, C, C, C, C, C, C, C, C, C, C, C, C, C, C,	/* 0xE0 */
+	C, C, C, C, C, C, C, C, C, C, C, C, C, C, C, C,	/* 0xF0 */
+};
 
-	/* When a message or mime part has no Content-Type header
-	 * then the message / mime part defaults to text/plain
-	 * RFC 2045 section 5.2.
-	 */
-	if (!m->state.has_content_type) {
-		hold->is_text_part = 1;
-	}
-	hold->is_body = 1;
-	hold->length = 0;
-}
+#undef C
+#undef H
+#undef S
+#undef R
 
-static void
-uri_mime_body_finish(Mime *m, void *_data)
+static int
+uri_mime_has_hint(const char *s, int length)
 {
-	UriMime *hold = _data;
+	for ( ; 0 < length; s++, length--) {
+		if (uri_octet_class[(unsigned char) *s] & URI_OCTET_HINT) {
+			return 1;
+		}
+	}
 
-	hold->is_text_part = 0;
-	hold->is_body = 0;
-	hold->length = 0;
+	return 0;
 }
 
 static void
-uri_mime_decoded_octet(Mime *m, int ch, void *_data)
+uri_mime_octet(UriMime *hold, int ch)
 {
 	URI *uri;
-	UriMime *hold = _data;
 
-	/* Only process text only parts. Otherwise with simplified
-	 * implicit URI rules, decoding binary attachments like
-	 * images can result in false positives.
-	 */
-	if (!hold->headers_and_body && hold->is_body && !hold->is_text_part) {
-		return;
-	}
         /* Ignore CR as it does not help us with parsing.
          * Assume LF will follow.
          */
@@ -1199,7 +1220,7 @@ uri_mime_decoded_octet(Mime *m, int ch, void *_data)
 		hold->length = 0;
 	}
 	/* Accumulate URI characters in the hold buffer. */
-	if (isCharURI(ch)) {
+	if (ch != EOF && (uri_octet_class[ch] & (URI_OCTET_CHAR|URI_OCTET_SPECIAL))) {
 		/* Look for HTML numerical entities &#NNN; or &#xHHHH; */
 		if (0 < hold->length && ch == ';') {
 			int offset;
@@ -1281,13 +1302,20 @@ delimiter:
 		 * nor in a domain/host name. This relaxed by 2181; used by
 		 * 4408 (SPF) and 6376 (DKIM).
 		 */
-		while (hold->buffer[hold->length-1] == '_') {
+		while (0 < hold->length && hold->buffer[hold->length-1] == '_') {
 			hold->length--;
 			hold->buffer[hold->length] = '\0';
 		}
 		while (hold->buffer[value] == '_') {
 			value++;
 		}
+		/* Most words in a message cannot be a URI, so avoid the
+		 * cost of trying to parse them.
+		 */
+		if ((size_t) value <= hold->length && !uri_mime_has_hint(hold->buffer+value, hold->length-value)) {
+			hold->length = 0;
+			return;
+		}
 		uri = uriParse2(hold->buffer+value, hold->length-value, IMPLICIT_DOMAIN_MIN_DOTS);
 
 		if (uri != NULL) {
@@ -1304,18 +1332,111 @@ delimiter:
 	}
 }
 
+static void
+uri_mime_block(UriMime *hold, const unsigned char *s, size_t length)
+{
+	unsigned classes;
+	const unsigned char *stop, *t;
+
+	for (stop = s + length; s < stop; ) {
+		/* Skip a word without a hint, and its delimiter, without
+		 * copying it into the hold buffer, since it would never
+		 * parse as a URI.
+		 */
+		if (hold->length == 0) {
+			for (classes = 0, t = s; t < stop && (uri_octet_class[*t] & URI_OCTET_CHAR); t++) {
+				classes |= uri_octet_class[*t];
+			}
+			if (t < stop && uri_octet_class[*t] == 0 && !(classes & URI_OCTET_HINT)) {
+				s = t + 1;
+				continue;
+			}
+		}
+
+		/* A Big5 dot is 0xA1 followed by C, D, or O. */
+		if (0 < hold->length && hold->buffer[hold->length-1] == (char) 0xA1) {
+			uri_mime_octet(hold, *s++);
+			continue;
+		}
+
+		/* Accumulate a run of plain URI octets. */
+		for ( ; s < stop && (uri_octet_class[*s] & URI_OCTET_CHAR); s++) {
+			if (sizeof (hold->buffer) <= hold->length) {
+				hold->length = 0;
+			}
+			hold->buffer[hold->length++] = *s;
+		}
+
+		/* Delimiters, CR, HTML entities, and Big5 dots. */
+		if (s < stop) {
+			uri_mime_octet(hold, *s++);
+		}
+	}
+}
+
+static int
+uri_mime_is_skipped(UriMime *hold)
+{
+	/* Only process text only parts. Otherwise with simplified
+	 * implicit URI rules, decoding binary attachments like
+	 * images can result in false positives.
+	 */
+	return !hold->headers_and_body && hold->is_body && !hold->is_text_part;
+}
+
+static void
+uri_mime_decode_flush(Mime *m, void *_data)
+{
+	UriMime *hold = _data;
+
+	if (uri_mime_is_skipped(hold)) {
+		return;
+	}
+	uri_mime_block(hold, m->decode.buffer, m->decode.length);
+	if (m->state.decode_eof) {
+		uri_mime_octet(hold, EOF);
+	}
+}
+
+static void
+uri_mime_body_start(Mime *m, void *_data)
+{
+	UriMime *hold = _data;
+
+	/* When a message or mime part has no Content-Type header
+	 * then the message / mime part defaults to text/plain
+	 * RFC 2045 section 5.2.
+	 */
+	if (!m->state.has_content_type) {
+		hold->is_text_part = 1;
+	}
+	hold->is_body = 1;
+	hold->length = 0;
+}
+
+static void
+uri_mime_body_finish(Mime *m, void *_data)
+{
+	UriMime *hold = _data;
+
+	/* The decode buffer might have been empty when decoding ended. */
+	if (m->state.decode_eof && !uri_mime_is_skipped(hold)) {
+		uri_mime_octet(hold, EOF);
+	}
+
+	hold->is_text_part = 0;
+	hold->is_body = 0;
+	hold->length = 0;
+}
+
 static void
 uri_mime_header(Mime *m, void *_data)
 {
 	UriMime *hold = _data;
 
 	if (hold->headers_and_body) {
-		unsigned char *s;
-		for (s = m->source.buffer; *s != '\0'; s++) {
-			uri_mime_decoded_octet(m, *s, _data);
-		}
-		uri_mime_decoded_octet(m, '\r', _data);
-		uri_mime_decoded_octet(m, '\n', _data);
+		uri_mime_block(hold, m->source.buffer, strlen((char *) m->source.buffer));
+		uri_mime_block(hold, (unsigned char *) "\r\n", 2);
 	}
 
 	if (2 < uriDebug) {
@@ -1360,7 +1481,7 @@ uriMimeInit(UriMimeHook uri_found_cb, int all, void *data)
 		hold->hook.header = uri_mime_header;
 		hold->hook.body_start = uri_mime_body_start;
 		hold->hook.body_finish = uri_mime_body_finish;
-		hold->hook.decoded_octet = uri_mime_decoded_octet;
+		hold->hook.decode_flush = uri_mime_decode_flush;
 	}
 
 	return hold;